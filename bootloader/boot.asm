@@ -5,8 +5,19 @@
 [BITS 16]
 [ORG 0x7C00]
 
-KERNEL_OFFSET equ 0x1000    ; Memory location to load kernel
-KERNEL_SECTORS equ 20       ; Number of sectors to load (10KB)
+KERNEL_OFFSET equ 0x10000   ; Memory location to load kernel (above this sector)
+KERNEL_LIMIT equ 0x70000    ; Kernel must end below the SMP trampoline
+LOAD_CHUNK equ 64           ; Sectors per read: 32KB never crosses a 64KB boundary
+
+; Sectors to load; the Makefile passes the kernel's size in sectors
+%ifndef KERNEL_SECTORS
+%assign KERNEL_SECTORS 20
+%endif
+%if KERNEL_SECTORS > (KERNEL_LIMIT - KERNEL_OFFSET) / 512
+%error "Kernel image does not fit between KERNEL_OFFSET and KERNEL_LIMIT"
+%endif
+E820_MAP equ 0x500          ; Memory map: entry count (dword) + 24-byte entries
+E820_MAX_ENTRIES equ 100    ; Keep in sync with include/e820.h
 
 start:
     ; Initialize segment registers
@@ -26,6 +37,9 @@ start:
     ; Load kernel from disk
     call load_kernel
 
+    ; Collect the BIOS memory map for the kernel
+    call detect_memory
+
     ; Print loaded message
     mov si, msg_loaded
     call print_string
@@ -48,22 +62,43 @@ start:
 ; ============ 16-bit Functions ============
 
 ; Function: load_kernel
+; Reads the sectors after this one to KERNEL_OFFSET, LOAD_CHUNK at a time,
+; with extended (LBA) reads
 load_kernel:
     pusha
     
-    mov ah, 0x02
-    mov al, KERNEL_SECTORS
-    mov ch, 0
-    mov cl, 2
-    mov dh, 0
+    mov ah, 0x41                ; Check for the extensions
+    mov bx, 0x55AA
     mov dl, [boot_drive]
-    mov bx, KERNEL_OFFSET
+    int 0x13
+    jc disk_error
+    cmp bx, 0xAA55
+    jne disk_error
     
+    mov bx, KERNEL_SECTORS      ; Sectors left
+    
+.next:
+    mov ax, LOAD_CHUNK
+    cmp bx, ax
+    jae .read
+    mov ax, bx
+    
+.read:
+    mov [dap_count], ax
+    pusha
+    mov ah, 0x42
+    mov dl, [boot_drive]
+    mov si, dap
     int 0x13
+    popa                        ; Keeps the carry flag
     jc disk_error
     
-    cmp al, KERNEL_SECTORS
-    jne disk_error
+    sub bx, ax
+    add [dap_lba], ax
+    shl ax, 5                   ; Sectors to 16-byte paragraphs
+    add [dap_segment], ax
+    test bx, bx
+    jnz .next
     
     popa
     ret
@@ -74,6 +109,43 @@ disk_error:
     cli
     hlt
 
+; Function: detect_memory
+; Stores the E820 memory map at E820_MAP (count 0 if unsupported)
+detect_memory:
+    pushad
+    xor ebx, ebx                ; Continuation value (0 = first entry)
+    xor bp, bp                  ; Entries stored
+    mov di, E820_MAP + 4
+
+.next:
+    mov eax, 0xE820
+    mov edx, 0x534D4150         ; 'SMAP' signature
+    mov ecx, 24
+    mov dword [di + 20], 1      ; Valid ACPI attribute if BIOS returns 20 bytes
+    int 0x15
+    jc .done                    ; Unsupported, or past the last entry
+    cmp eax, 0x534D4150
+    jne .done
+
+    mov ecx, [di + 8]           ; Skip zero-length entries
+    or ecx, [di + 12]
+    jz .skip
+
+    inc bp
+    add di, 24
+    cmp bp, E820_MAX_ENTRIES
+    jae .done
+
+.skip:
+    test ebx, ebx               ; EBX = 0 after the last entry
+    jnz .next
+
+.done:
+    mov [E820_MAP], bp
+    mov word [E820_MAP + 2], 0
+    popad
+    ret
+
 ; Function: print_string
 print_string:
     pusha
@@ -194,7 +266,8 @@ protected_mode_start:
     mov byte [ebx+2], 'M'
     mov byte [ebx+3], 0x0F
 
-    ; Jump to kernel
+    ; Jump to kernel (EBX = memory map, like a multiboot info pointer)
+    mov ebx, E820_MAP
     jmp KERNEL_OFFSET
 
 ; ============ Data Section ============
@@ -202,6 +275,13 @@ protected_mode_start:
 [BITS 16]
 
 boot_drive      db 0
+
+; Disk address packet for the extended reads
+dap             db 0x10, 0
+dap_count       dw 0
+dap_offset      dw 0
+dap_segment     dw KERNEL_OFFSET >> 4
+dap_lba         dd 1, 0
 msg_boot        db 'CoreX Bootloader v2.0', 0x0D, 0x0A, 'Loading kernel...', 0x0D, 0x0A, 0
 msg_loaded      db 'Kernel loaded! Switching to protected mode...', 0x0D, 0x0A, 0
 msg_error       db 'Disk read error!', 0x0D, 0x0A, 0
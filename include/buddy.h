@@ -0,0 +1,42 @@
+// Buddy Allocator Header
+// Power-of-two physically contiguous page blocks with coalescing
+
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <stdint.h>
+
+// Largest block is 2^BUDDY_MAX_ORDER pages (4MB)
+#define BUDDY_MAX_ORDER 10
+
+// Pages managed by the buddy zone (must be a multiple of the largest block)
+#define BUDDY_ZONE_PAGES 1024
+
+// Returned when no block is available
+#define BUDDY_NO_BLOCK 0xFFFFFFFF
+
+// The zone has no lock of its own: callers hold the PMM lock
+
+// Initialize the zone starting at base_page (aligned to the largest block)
+void buddy_init(uint32_t base_page, uint32_t page_count);
+
+// Allocate a block of 2^order pages (returns first page number)
+uint32_t buddy_alloc(uint32_t order);
+
+// Free a block previously returned by buddy_alloc (returns 0 on success)
+int buddy_free(uint32_t page, uint32_t order);
+
+// Check whether a page number belongs to the buddy zone
+int buddy_contains(uint32_t page);
+
+// Get zone statistics
+uint32_t buddy_get_free_pages();
+uint32_t buddy_get_total_pages();
+
+// Print free block counts per order and fragmentation
+void buddy_dump();
+
+// Benchmark throughput and fragmentation under a mixed-size workload
+void buddy_benchmark();
+
+#endif // BUDDY_H
@@ -0,0 +1,64 @@
+// Clocksource Header
+// 64-bit nanosecond time from the calibrated TSC, or the PIT without one
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+// Time the TSC is calibrated over against PIT channel 2, per attempt (the
+// shortest of CLOCK_CALIBRATE_RUNS wins, which is the least disturbed)
+#define CLOCK_CALIBRATE_CLOCKS  11932   // 10ms of PIT input clocks
+#define CLOCK_CALIBRATE_RUNS    3
+
+// Where clock_monotonic_ns comes from
+#define CLOCK_SOURCE_PIT        0
+#define CLOCK_SOURCE_TSC        1
+
+// Calibrate the TSC and pick the clocksource (after timer_init). The TSC is
+// used when CPUID reports it invariant (constant rate in every P/C-state).
+void clock_init();
+
+// Nanoseconds since clock_init, never going backwards. With the TSC this
+// is a few instructions; the PIT fallback does port I/O under a lock and
+// has 838ns resolution.
+uint64_t clock_monotonic_ns();
+
+// Raw timestamp for measuring short intervals (the TSC, whichever source
+// clock_monotonic_ns uses); convert with clock_cycles_to_ns
+static inline uint64_t clock_cycles() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// 64-by-32-bit division for cycle averages and rates, in one divl (there
+// is no libgcc to provide __udivdi3). A quotient too large for 32 bits
+// saturates; dividing by 0 gives 0.
+static inline uint32_t div_u64_u32(uint64_t n, uint32_t d) {
+    if (d == 0) {
+        return 0;
+    }
+    if ((uint32_t)(n >> 32) >= d) {
+        return 0xFFFFFFFF;
+    }
+    uint32_t quotient, remainder;
+    __asm__("divl %4"
+            : "=a"(quotient), "=d"(remainder)
+            : "a"((uint32_t)n), "d"((uint32_t)(n >> 32)), "rm"(d));
+    return quotient;
+}
+
+// Convert a clock_cycles interval to nanoseconds
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+
+// Calibrated TSC rate
+uint32_t clock_tsc_khz();
+
+// Get the source clock_monotonic_ns uses
+int clock_source();
+
+// Measure the cost and resolution of each clocksource
+void clock_benchmark();
+
+#endif // CLOCK_H
@@ -0,0 +1,28 @@
+// E820 Memory Map Header
+// BIOS memory map collected by the bootloader (INT 0x15, EAX=0xE820)
+
+#ifndef E820_H
+#define E820_H
+
+#include <stdint.h>
+
+// Where the bootloader stores the map: entry count (uint32) then entries
+#define E820_MAP_ADDR       0x500
+#define E820_MAX_ENTRIES    100
+
+// Region types
+#define E820_USABLE         1   // Free RAM
+#define E820_RESERVED       2   // Firmware or device memory
+#define E820_ACPI_RECLAIM   3   // ACPI tables (reusable once parsed)
+#define E820_ACPI_NVS       4   // ACPI non-volatile storage
+#define E820_BAD            5   // Defective RAM
+
+// Memory map entry (ACPI 3.x layout, 24 bytes)
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi_attrs;
+} __attribute__((packed)) e820_entry_t;
+
+#endif // E820_H
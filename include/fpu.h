@@ -0,0 +1,55 @@
+// FPU/SSE Header
+// SSE enablement and lazy per-task FXSAVE context switching
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+struct task;
+
+// FXSAVE image: x87, MMX and XMM registers plus MXCSR
+#define FPU_STATE_SIZE  512
+
+typedef struct fpu_state {
+    uint8_t data[FPU_STATE_SIZE];
+} __attribute__((aligned(16))) fpu_state_t;
+
+// fpu_cpu of a task whose registers are live on no CPU
+#define FPU_NO_CPU      0xFFFFFFFF
+
+// Lazy switching counters, summed over all CPUs
+typedef struct {
+    uint32_t traps;         // #NM exceptions taken
+    uint32_t restores;      // FXRSTORs (the rest found their state still loaded)
+    uint32_t saves;         // FXSAVEs at switch-out
+    uint32_t allocs;        // Save areas created on first use
+} fpu_stats_t;
+
+// Enable the FPU and SSE on the bootstrap processor
+// Prints a message and leaves SIMD off if the CPU has no FXSR/SSE
+void fpu_init();
+
+// Same for an application processor (after fpu_init)
+void fpu_init_cpu();
+
+// Check whether SSE is enabled
+int fpu_has_sse();
+
+// Called by the scheduler before switching away from prev (interrupts
+// off): saves prev's registers if it used them during this slice and
+// arms CR0.TS so the next task traps on its first SIMD instruction
+void fpu_switch(struct task* prev);
+
+// #NM handler: give the current task the FPU (returns -1 if it cannot)
+int fpu_handle_trap();
+
+// Free a task's save area (when the task is reaped)
+void fpu_release(struct task* task);
+
+const fpu_stats_t* fpu_get_stats();
+
+// Compare context switches between tasks that do and do not use SSE
+void fpu_benchmark();
+
+#endif // FPU_H
@@ -7,16 +7,16 @@
 #include <stdint.h>
 
 // File system constants
-#define MAX_FILES 16
+// The number of files is limited only by available memory
 #define MAX_FILENAME 32
 #define MAX_FILE_SIZE 1024
 
 // File structure
-typedef struct {
+typedef struct file {
     char name[MAX_FILENAME];
     uint32_t size;
     uint8_t data[MAX_FILE_SIZE];
-    int used;
+    struct file* next;
 } file_t;
 
 // Initialize file system
@@ -0,0 +1,64 @@
+// GDT (Global Descriptor Table) Header
+// Flat kernel and user segments, the per-CPU data segment and the TSS
+
+#ifndef GDT_H
+#define GDT_H
+
+#include <stdint.h>
+
+// GDT entry structure
+struct gdt_entry {
+    uint16_t limit_low;     // Limit bits 0-15
+    uint16_t base_low;      // Base bits 0-15
+    uint8_t  base_middle;   // Base bits 16-23
+    uint8_t  access;        // Present, ring, type
+    uint8_t  granularity;   // Limit bits 16-19 and flags
+    uint8_t  base_high;     // Base bits 24-31
+} __attribute__((packed));
+
+// GDT pointer structure
+struct gdt_ptr {
+    uint16_t limit;         // Size of GDT - 1
+    uint32_t base;          // Address of GDT
+} __attribute__((packed));
+
+// Task state segment: only the ring-0 stack fields are used, for the
+// switch to the kernel stack on an interrupt or trap from ring 3
+struct tss_entry {
+    uint32_t prev_tss;
+    uint32_t esp0;          // Kernel stack top of the task running here
+    uint32_t ss0;
+    uint32_t esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base;    // Past the limit: no I/O permission bitmap
+} __attribute__((packed));
+
+// Selectors (the same on every CPU; each CPU has its own table, so the
+// per-CPU selector resolves to that CPU's block wherever it is loaded)
+// SYSENTER/SYSEXIT fix the order: kernel code, kernel data, user code,
+// user data must be consecutive. User selectors include RPL 3.
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE   0x1B
+#define GDT_USER_DATA   0x23
+#define GDT_PERCPU      0x28
+#define GDT_TSS         0x30
+
+#define GDT_ENTRIES     7
+
+// Build and load this CPU's GDT and TSS; GS ends up covering
+// [percpu, percpu + size)
+void gdt_init_cpu(uint32_t cpu, uint32_t percpu, uint32_t size);
+
+// Set the stack this CPU enters the kernel on from ring 3 (the scheduler
+// calls it for every task it switches to)
+void gdt_set_kernel_stack(uint32_t esp0);
+
+// Address of this CPU's TSS esp0 field (SYSENTER_ESP points there)
+uint32_t gdt_kernel_stack_slot();
+
+#endif // GDT_H
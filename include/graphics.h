@@ -43,8 +43,14 @@ void graphics_fill_rect(int x, int y, int width, int height, uint8_t color);
 void graphics_draw_char(int x, int y, char c, uint8_t color);
 void graphics_draw_string(int x, int y, const char* str, uint8_t color);
 
+// Copy a full GRAPHICS_WIDTH x GRAPHICS_HEIGHT frame to the screen
+void graphics_blit(const uint8_t* frame);
+
 // Mode switching
 void graphics_set_mode_13h();
 void graphics_set_text_mode();
 
+// Compare frame blits through uncached and write-combining mappings
+void graphics_benchmark();
+
 #endif // GRAPHICS_H
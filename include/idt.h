@@ -24,13 +24,28 @@ struct idt_ptr {
 // Number of IDT entries
 #define IDT_ENTRIES 256
 
+// Register state pushed by the ISR stubs (isr.asm), lowest address first
+typedef struct {
+    uint32_t gs, fs, es, ds;                            // Segment registers
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;    // pusha
+    uint32_t int_no, err_code;                          // Pushed by the stub
+    uint32_t eip, cs, eflags;                           // Pushed by the CPU
+    uint32_t useresp, ss;                               // Only on privilege change
+} registers_t;
+
 // Initialize IDT
 void idt_init();
 
+// Load the shared IDT on an application processor
+void idt_init_cpu();
+
 // Set an IDT gate
 void idt_set_gate(uint8_t num, uint32_t handler, uint16_t selector, uint8_t flags);
 
 // Exception handler (called from assembly)
-void exception_handler(uint32_t int_no, uint32_t err_code);
+void exception_handler(registers_t* regs);
+
+// Hardware IRQ handler (called from assembly)
+void irq_handler(registers_t* regs);
 
 #endif // IDT_H
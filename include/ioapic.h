@@ -0,0 +1,33 @@
+// IOAPIC Header
+// ACPI MADT discovery and redirection of the legacy IRQ lines through the IOAPIC
+
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <stdint.h>
+
+// Most IOAPICs the kernel drives (mapped one page apart from IOAPIC_VIRT)
+#define IOAPIC_MAX          4
+
+// Find the IOAPICs and the ISA interrupt overrides in the ACPI MADT, map
+// them and mask every pin (after lapic_init; returns -1 if there are none,
+// and the 8259s keep the interrupts)
+int ioapic_init();
+
+// Check whether ioapic_init found an IOAPIC
+int ioapic_present();
+
+// Route a legacy IRQ to vector 32 + irq on its destination CPU and unmask
+// it, or mask it again. Edge/level and polarity come from the MADT.
+void ioapic_unmask(uint8_t irq);
+void ioapic_mask(uint8_t irq);
+
+// Deliver a legacy IRQ to another CPU (CPU 0 by default). The timer has to
+// stay on CPU 0, which owns the timer wheel. Returns -1 if the CPU is not
+// online.
+int ioapic_set_destination(uint8_t irq, uint32_t cpu);
+
+// Compare EOI cost and timer interrupt latency, 8259 against the APICs
+void apic_benchmark();
+
+#endif // IOAPIC_H
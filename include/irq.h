@@ -0,0 +1,61 @@
+// IRQ Dispatch Header
+// Table-driven dispatch of the 16 legacy interrupt lines to registered handlers
+
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+
+// Legacy lines behind the PICs (vectors 32-47)
+#define IRQ_LINES           16
+#define IRQ_VECTOR_BASE     32
+
+// Handlers registered over all lines (the table is static)
+#define IRQ_MAX_ACTIONS     32
+
+// Handler run time histogram: bucket n counts runs shorter than
+// 2^(IRQ_HIST_SHIFT + n) cycles, the last bucket everything longer
+#define IRQ_HIST_BUCKETS    8
+#define IRQ_HIST_SHIFT      9
+
+// Handler return values
+// Every handler on a shared line is called; each says whether its device
+// was the one interrupting.
+#define IRQ_NONE            0
+#define IRQ_HANDLED         1
+
+// Runs in interrupt context with interrupts disabled; the EOI (to the 8259
+// or the local APIC) is sent after the whole chain has run
+typedef int (*irq_handler_t)(void* ctx);
+
+// Per-line accounting
+typedef struct {
+    uint32_t count;                     // Interrupts dispatched to handlers
+    uint32_t spurious;                  // IRQ 7/15 not in service (no EOI)
+    uint32_t unhandled;                 // No handler claimed it
+    uint32_t max_cycles;
+    uint64_t total_cycles;              // Whole chain, per interrupt
+    uint32_t hist[IRQ_HIST_BUCKETS];
+} irq_stats_t;
+
+// Add a handler to a line and unmask it (returns -1 if the line is out of
+// range or the table is full). Handlers are called in registration order.
+int irq_register(uint8_t irq, irq_handler_t handler, void* ctx);
+
+// Run the handlers for a line and acknowledge it (irq_handler)
+void irq_dispatch(uint8_t irq);
+
+// Move every line with a handler to the IOAPIC (enabled) or back to the
+// 8259s; the vectors stay the same. Returns -1 if there is no IOAPIC.
+int irq_use_ioapic(int enabled);
+
+// Check which controller delivers the lines
+int irq_using_ioapic();
+
+// Get a line's statistics
+const irq_stats_t* irq_get_stats(uint8_t irq);
+
+// Print per-line counts and handler cost
+void irq_dump();
+
+#endif // IRQ_H
@@ -35,13 +35,16 @@
 // Initialize keyboard driver
 void keyboard_init();
 
-// Keyboard interrupt handler (called from IRQ1)
-void keyboard_handler();
-
 // Get last pressed key (ASCII)
 char keyboard_getchar();
 
+// Get a key, blocking the calling task until one is typed
+char keyboard_wait_char();
+
 // Check if a key is available
 int keyboard_available();
 
+// TSC timestamp of the interrupt that delivered the last character read
+uint64_t keyboard_last_stamp();
+
 #endif // KEYBOARD_H
@@ -0,0 +1,62 @@
+// Kernel Heap Header
+// Slab allocator with power-of-two size classes and object caches
+
+#ifndef KMALLOC_H
+#define KMALLOC_H
+
+#include <stdint.h>
+#include "spinlock.h"
+
+// kmalloc size classes: 8 bytes up to 2KB in single-page slabs, larger
+// requests get whole pages (up to one largest buddy block, else 0)
+#define KMALLOC_MIN_SHIFT   3
+#define KMALLOC_MAX_SHIFT   11
+#define KMALLOC_CLASSES     (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// Most caches that can exist at once (size classes + dedicated caches)
+#define KMEM_MAX_CACHES     32
+
+// Largest slab is 2^KMEM_MAX_SLAB_ORDER pages
+#define KMEM_MAX_SLAB_ORDER 3
+
+typedef struct kmem_slab kmem_slab_t;
+
+// Object cache: slabs of equally sized objects
+typedef struct kmem_cache {
+    spinlock_t lock;                // Slab lists and statistics
+    const char* name;
+    uint32_t object_size;
+    uint32_t slab_order;            // Each slab is 2^slab_order pages
+    uint32_t objects_per_slab;
+    kmem_slab_t* partial;           // Slabs with free objects
+    kmem_slab_t* full;              // Slabs with no free objects
+    kmem_slab_t* spare;             // One empty slab kept to avoid thrashing
+    
+    // Statistics
+    uint32_t active_objects;
+    uint32_t slab_count;
+    uint32_t alloc_count;
+    uint32_t free_count;
+} kmem_cache_t;
+
+// Initialize the kernel heap (after pmm_init)
+void kmalloc_init();
+
+// Create a cache for objects of a fixed size
+kmem_cache_t* kmem_cache_create(const char* name, uint32_t size);
+
+// Allocate and free objects from a cache (O(1))
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+
+// General-purpose allocation
+void* kmalloc(uint32_t size);
+void kfree(void* ptr);
+
+// Print per-cache usage statistics
+void kmalloc_dump();
+
+// Benchmark against a naive first-fit allocator
+void kmalloc_benchmark();
+
+#endif // KMALLOC_H
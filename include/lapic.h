@@ -0,0 +1,47 @@
+// Local APIC Header
+// Per-CPU interrupt controller: IPIs, AP startup and the local timer
+
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+// Interrupt vectors delivered by the local APIC
+#define LAPIC_TIMER_VECTOR      0xF0    // Local timer (time slices on APs)
+#define LAPIC_RESCHED_VECTOR    0xF1    // Another CPU queued work for us
+#define LAPIC_SPURIOUS_VECTOR   0xFF    // Spurious interrupts (no EOI)
+
+// Time the local timer is calibrated over against PIT channel 2
+#define LAPIC_CALIBRATE_US      10000
+
+// Detect, map and enable the bootstrap processor's local APIC, and
+// calibrate its timer (returns -1 if the CPU has no APIC)
+int lapic_init();
+
+// Enable the local APIC of the CPU we are running on
+void lapic_init_cpu();
+
+// Start this CPU's local timer at TIMER_HZ
+void lapic_timer_start();
+
+// Get this CPU's local APIC ID
+uint32_t lapic_id();
+
+// Check whether lapic_init mapped the local APIC
+int lapic_available();
+
+// Signal end of interrupt for a local APIC vector
+void lapic_eoi();
+
+// Check whether this CPU's local APIC has a vector in service (delivered
+// and not yet EOI'd)
+int lapic_in_service(uint8_t vector);
+
+// Send a fixed interrupt to one CPU
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// INIT every other CPU, then send the STARTUP IPIs pointing them at the
+// page-aligned real-mode code at trampoline (below 1MB)
+void lapic_start_aps(uint32_t trampoline);
+
+#endif // LAPIC_H
@@ -1,5 +1,5 @@
 // Paging Header
-// 4KB paging implementation with identity mapping
+// 4KB and 4MB (PSE) paging with an identity-mapped kernel
 
 #ifndef PAGING_H
 #define PAGING_H
@@ -10,6 +10,40 @@
 #define PAGE_PRESENT    0x1     // Page is present in memory
 #define PAGE_WRITE      0x2     // Page is writable
 #define PAGE_USER       0x4     // Page is accessible from user mode
+#define PAGE_PWT        0x8     // Write-through caching
+#define PAGE_PCD        0x10    // Cache disable
+#define PAGE_LARGE      0x80    // 4MB page (page directory entries only)
+#define PAGE_GLOBAL     0x100   // Survives CR3 reloads (needs CR4.PGE)
+#define PAGE_COW        0x200   // Available bit: shared copy-on-write page
+
+// Memory types for map_page/map_range flags
+// paging_init programs the PAT so that PWT alone selects write-combining
+// (on CPUs without PAT it falls back to write-through)
+#define PAGE_WC         PAGE_PWT                // Write-combining
+#define PAGE_UC         (PAGE_PCD | PAGE_PWT)   // Strong uncacheable
+
+#define LARGE_PAGE_SIZE 0x400000    // 4MB
+
+// Virtual memory layout
+// RAM below PAGING_IDENTITY_END is identity-mapped with global 4MB pages
+// (4KB page tables when the CPU lacks PSE). The user window is private to
+// each address space; everything else is shared kernel space.
+#define PAGING_IDENTITY_END 0xC0000000
+#define USER_SPACE_BASE     0xC0000000  // Per-task pages
+#define USER_SPACE_END      0xF0000000
+#define KERNEL_VMAP_BASE    0xF0000000  // Demand-paged kernel regions (vmm.c)
+#define KERNEL_VMAP_END     0xF8000000
+#define KERNEL_STACK_BASE   0xF8000000  // Task kernel stacks with guard pages (vmm.c)
+#define KERNEL_STACK_END    0xFC000000
+#define PAGING_SCRATCH_BASE 0xFC000000  // 4MB window for temporary mappings
+#define FRAMEBUFFER_VIRT    0xFC400000  // 4MB window for the framebuffer
+#define LAPIC_VIRT          0xFE000000  // Local APIC registers (lapic.c)
+#define IOAPIC_VIRT         0xFE001000  // IOAPIC registers, a page each (ioapic.c)
+#define ACPI_VIRT           0xFE010000  // Window for ACPI tables outside the identity map
+
+// Range operations touching more pages than this reload CR3 instead of
+// issuing one invlpg per page
+#define PAGING_FLUSH_THRESHOLD 32
 
 // Page table/directory entry structure
 typedef uint32_t page_entry_t;
@@ -23,15 +57,71 @@ typedef struct {
     page_entry_t entries[1024];
 } __attribute__((aligned(4096))) page_table_t;
 
-// Initialize paging with identity mapping of first 4MB
+// Address space: a page directory sharing the kernel entries
+typedef struct address_space {
+    page_directory_t* directory;    // Physical address (identity-mapped)
+    uint32_t heap_end;              // Demand-zero user heap is [USER_SPACE_BASE, heap_end)
+    struct address_space* next;
+} address_space_t;
+
+// Initialize paging with an identity mapping of usable RAM (after pmm_init)
 void paging_init();
 
+// Per-CPU paging setup for an application processor (CR3 and CR4 are
+// already loaded by the startup trampoline)
+void paging_init_cpu();
+
+// Kernel mappings are shared, but invlpg only reaches the local TLB.
+// Removing or redirecting one bumps a generation and every other CPU
+// flushes when it next calls this (the scheduler does, before each switch),
+// which is before it can be handed the recycled address
+void paging_sync_tlb();
+
 // Map a virtual address to a physical address
 void map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
 
 // Unmap a virtual address
 void unmap_page(uint32_t virtual_addr);
 
+// Map size bytes starting at virtual_addr to physical_addr
+// Uses 4MB pages wherever both addresses and the remaining size allow it
+void map_range(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size, uint32_t flags);
+
+// Unmap size bytes starting at virtual_addr
+void unmap_range(uint32_t virtual_addr, uint32_t size);
+
+// Get the physical address a virtual address maps to (0 if unmapped)
+uint32_t virt_to_phys(uint32_t virtual_addr);
+
+// Address spaces
+// User-window addresses passed to the mapping functions refer to the
+// current space; all other addresses are shared by every space
+address_space_t* paging_kernel_space();
+address_space_t* paging_current_space();
+address_space_t* paging_create_space();
+address_space_t* paging_clone_space(address_space_t* source);
+void paging_destroy_space(address_space_t* space);
+
+// Make a space current without loading CR3 (the context switch does that)
+void paging_set_current(address_space_t* space);
+
+// Make a space current and load its directory
+void paging_switch(address_space_t* space);
+
+// Resolve a write fault on a copy-on-write page (returns 0 if handled)
+int paging_handle_cow(uint32_t virtual_addr);
+
+// Flush the whole TLB, including global entries
+void flush_tlb_all();
+
+// Check CPU paging features detected by paging_init
+int paging_has_pse();
+int paging_has_pge();
+int paging_has_pat();
+
+// Benchmark per-page mapping against map_range
+void paging_benchmark();
+
 // Enable paging
 void enable_paging();
 
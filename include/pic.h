@@ -14,6 +14,7 @@
 
 // PIC commands
 #define PIC_EOI         0x20    // End of Interrupt
+#define PIC_READ_ISR    0x0B    // OCW3: next command-port read returns the ISR
 
 // Initialize and remap PIC
 void pic_init();
@@ -21,4 +22,11 @@ void pic_init();
 // Send End of Interrupt signal
 void pic_send_eoi(uint8_t irq);
 
+// Mask or unmask one line (unmasking a slave line also opens the cascade)
+void pic_mask(uint8_t irq);
+void pic_unmask(uint8_t irq);
+
+// Read the in-service registers (slave in the high byte)
+uint16_t pic_read_isr();
+
 #endif // PIC_H
@@ -1,19 +1,44 @@
 // Physical Memory Manager (PMM) Header
-// Bitmap-based physical memory allocator
+// Two-level bitmap page allocator plus a buddy zone for contiguous blocks
 
 #ifndef PMM_H
 #define PMM_H
 
 #include <stdint.h>
+#include "e820.h"
+#include "smp.h"
 
 // Memory constants
 #define PAGE_SIZE 4096              // 4KB pages
-#define MEMORY_SIZE (16 * 1024 * 1024)  // 16MB total memory
-#define TOTAL_PAGES (MEMORY_SIZE / PAGE_SIZE)
-#define BITMAP_SIZE (TOTAL_PAGES / 8)   // 1 bit per page
+#define PMM_MAX_ADDRESS 0xC0000000ULL   // Manage RAM the kernel identity-maps (PAGING_IDENTITY_END)
+#define PMM_METADATA_MIN 0x100000   // Page bitmaps go at or above 1MB
 
-// Initialize physical memory manager
-void pmm_init();
+// Per-CPU page magazines
+#define PMM_MAX_CPUS    SMP_MAX_CPUS
+#define PMM_CACHE_SIZE  32      // Pages a magazine can hold
+#define PMM_CACHE_BATCH 16      // Pages moved per refill or drain
+
+typedef struct {
+    uint32_t count;                     // Pages currently cached
+    uint32_t pages[PMM_CACHE_SIZE];     // Physical addresses (LIFO)
+    uint32_t alloc_hits;                // Allocations served from the magazine
+    uint32_t alloc_misses;              // Allocations that needed a refill
+    uint32_t free_hits;                 // Frees absorbed by the magazine
+    uint32_t free_misses;               // Frees that needed a drain
+} pmm_cache_t;
+
+// Pool of pages zeroed in the background (by the idle task)
+#define PMM_ZERO_POOL_SIZE 256
+
+typedef struct {
+    uint32_t hits;                      // pmm_alloc_zeroed() served from the pool
+    uint32_t misses;                    // Pool empty, page zeroed synchronously
+    uint32_t miss_cycles;               // Time spent zeroing on misses
+    uint32_t background_zeroed;         // Pages zeroed by the idle task
+} pmm_zero_stats_t;
+
+// Initialize physical memory manager from the BIOS memory map
+void pmm_init(const e820_entry_t* map, uint32_t entries);
 
 // Allocate a physical page (returns physical address)
 uint32_t pmm_alloc();
@@ -21,9 +46,54 @@ uint32_t pmm_alloc();
 // Free a physical page
 void pmm_free(uint32_t addr);
 
+// Allocate a zero-filled page (pre-zeroed pool first)
+uint32_t pmm_alloc_zeroed();
+
+// Zero up to count pages into the pool (returns pages added, 0 when full
+// or out of free pages)
+uint32_t pmm_zero_pool_refill(uint32_t count);
+
+// Zeroed-pool state and statistics
+uint32_t pmm_get_zero_pool_pages();
+const pmm_zero_stats_t* pmm_get_zero_stats();
+
+// Allocate up to count pages from the global bitmap in one pass
+// (writes physical addresses to pages, returns how many were allocated)
+uint32_t pmm_alloc_batch(uint32_t count, uint32_t* pages);
+
+// Free count pages to the global bitmap in one pass
+void pmm_free_batch(uint32_t count, const uint32_t* pages);
+
+// Allocate 2^order physically contiguous pages from the buddy zone
+// (returns physical address aligned to the block size, 0 on failure)
+uint32_t pmm_alloc_order(uint32_t order);
+
+// Free a block returned by pmm_alloc_order
+void pmm_free_order(uint32_t addr, uint32_t order);
+
+// Hold the allocator lock (which also guards the buddy zone) across
+// direct buddy_* calls, with interrupts off
+uint32_t pmm_lock_irqsave();
+void pmm_unlock_irqrestore(uint32_t flags);
+
+// Reference counting for shared pages
+// A page starts with one reference from pmm_alloc(); pmm_unref() frees it
+// once the last reference is dropped
+void pmm_ref(uint32_t addr);
+void pmm_unref(uint32_t addr);
+uint32_t pmm_get_refs(uint32_t addr);
+
 // Get memory statistics
 uint32_t pmm_get_free_pages();
 uint32_t pmm_get_used_pages();
 uint32_t pmm_get_total_pages();
+uint32_t pmm_get_reserved_pages();
+
+// Per-CPU magazine statistics
+uint32_t pmm_get_cache_cpus();
+const pmm_cache_t* pmm_get_cache(uint32_t cpu);
+
+// Benchmark alloc/free rate at several occupancy levels
+void pmm_benchmark();
 
 #endif // PMM_H
@@ -0,0 +1,68 @@
+// Profiler Header
+// Timer-driven sampling of the interrupted EIP into per-CPU histograms
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "idt.h"
+
+// Per-CPU histogram: open-addressed table of sampled addresses, one buddy
+// block of 2^PROFILE_SLOTS_ORDER pages
+#define PROFILE_SLOTS_BITS      10
+#define PROFILE_SLOTS           (1 << PROFILE_SLOTS_BITS)
+#define PROFILE_SLOTS_ORDER     1
+#define PROFILE_PROBES          16      // Slots tried before a sample is dropped
+
+// Call chains (profile_start with callchains set): a per-CPU log of the
+// sampled EIP and the return addresses found by following saved EBPs,
+// which needs a kernel built with FRAME_POINTERS=1
+#define PROFILE_MAX_DEPTH       15
+#define PROFILE_CHAIN_ORDER     4
+#define PROFILE_CHAINS          ((4096 << PROFILE_CHAIN_ORDER) / sizeof(profile_chain_t))
+
+// Functions in the report
+#define PROFILE_TOP_LINES       20
+
+// A sampled address and its hit count (count 0: free slot)
+typedef struct {
+    uint32_t addr;
+    uint32_t count;
+} profile_slot_t;
+
+// One sample's call chain, innermost first
+typedef struct {
+    uint32_t depth;
+    uint32_t pc[PROFILE_MAX_DEPTH];
+} profile_chain_t;
+
+// Set while sampling
+extern volatile int profile_running;
+
+// Record one sample from a timer interrupt (use profile_tick)
+void profile_sample(registers_t* regs);
+
+// Sampling hook for the timer interrupts: the PIT on CPU 0 and the local
+// APIC timer on the others, each at TIMER_HZ
+static inline void profile_tick(registers_t* regs) {
+    if (__builtin_expect(profile_running, 0)) {
+        profile_sample(regs);
+    }
+}
+
+// Empty the histograms and start sampling, keeping the periodic tick on
+// while it runs (returns -1 if the buffers cannot be allocated)
+int profile_start(int callchains);
+
+// Stop sampling; the histograms keep their contents
+void profile_stop();
+
+// Print the functions with the most samples, symbolized from the kernel's
+// link-time symbol table
+void profile_report(uint32_t lines);
+
+// Stop sampling and send the raw samples over the serial port, for
+// tools/prof2folded.py (returns -1 without a UART)
+int profile_export();
+
+#endif // PROFILE_H
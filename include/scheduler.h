@@ -1,10 +1,13 @@
 // Task Scheduler Header
-// Cooperative multitasking with round-robin scheduling
+// Preemptive priority scheduling with per-CPU O(1) bitmap run queues
 
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
 #include <stdint.h>
+#include "paging.h"
+#include "timer.h"
+#include "fpu.h"
 
 // Task states
 #define TASK_READY      0
@@ -12,39 +15,152 @@
 #define TASK_BLOCKED    2
 #define TASK_TERMINATED 3
 
-// Maximum number of tasks
-#define MAX_TASKS 8
+// Pages the idle task zeroes between halts
+#define IDLE_ZERO_BATCH 8
 
-// Task stack size (4KB)
+// Priority levels (0 is the highest); equal priorities share the CPU
+// round-robin, lower ones only run when no higher level is ready
+#define SCHED_PRIORITIES        32
+#define SCHED_PRIORITY_HIGH     0
+#define SCHED_PRIORITY_DEFAULT  16
+#define SCHED_PRIORITY_LOW      30
+#define SCHED_PRIORITY_IDLE     31      // Only the idle task
+
+// Default time slice in timer ticks
+#define SCHED_QUANTUM_TICKS 5
+
+// EFLAGS a new task starts with (reserved bit 1; task_entry sets IF once
+// it has finished the switch)
+#define TASK_INITIAL_EFLAGS 0x002
+
+// Default task stack size (4KB); each stack sits above an unmapped guard page
 #define TASK_STACK_SIZE 4096
 
 // Task structure
+// TCBs and stacks are allocated per task and freed when it is reaped
 typedef struct task {
     uint32_t id;
     uint32_t esp;           // Stack pointer
     uint32_t ebp;           // Base pointer
     uint32_t eip;           // Instruction pointer
     uint32_t state;
-    uint32_t stack[TASK_STACK_SIZE / 4];  // Task stack
-    struct task* next;
+    uint32_t priority;
+    uint32_t stack_base;                // Lowest stack address (0: boot stack)
+    uint32_t stack_size;
+    address_space_t* space;             // Page directory (kernel half shared)
+    struct task* run_next;              // Run queue or zombie list link
+    uint32_t cpu;                       // CPU whose run queue owns the task
+    volatile uint32_t on_cpu;           // Running, or its stack still in use by a switch
+    volatile uint32_t wake_pending;     // Woken before it got to block
+    struct task* wait_next;             // Wait queue link (sync.c)
+    volatile uint32_t wait_queued;      // On a wait queue
+    timer_event_t sleep_timer;          // Wakeup for task_sleep_ticks
+    uint32_t wake_tick;                 // Tick the last sleep should end on
+    uint64_t wake_stamp;                // TSC when the sleep timer fired
+    uint64_t cpu_cycles;                // Time spent running
+    struct fpu_state* fpu;              // FXSAVE area, allocated on first SIMD use
+    uint32_t fpu_cpu;                   // CPU that last loaded it (FPU_NO_CPU if none)
 } task_t;
 
 // Task function pointer
 typedef void (*task_func_t)(void);
 
+// Scheduler statistics, summed over all CPUs
+// Updated without a shared lock, so on SMP a concurrent event may
+// occasionally go uncounted
+typedef struct {
+    uint32_t switches;          // Context switches
+    uint32_t preemptions;       // Switches forced by an expired time slice
+    uint32_t yields;            // Voluntary task_yield calls
+    uint32_t tasks;             // Live tasks, including not yet reaped zombies
+    uint32_t reaped;            // Terminated tasks whose memory was freed
+    uint32_t wakeups;           // Sleeps that ended
+    uint32_t late_wakeups;      // Sleepers that ran after their wake tick
+    uint32_t wake_cycles;       // Timer expiry to task running, summed
+    uint32_t wake_cycles_max;
+    uint32_t steals;            // Tasks an idle CPU took from a busier one
+    uint64_t idle_halted;       // Cycles idle tasks spent in hlt (all CPUs)
+} sched_stats_t;
+
 // Initialize scheduler
 void scheduler_init();
 
-// Create a new task
-int task_create(task_func_t func);
+// Create the idle task for an application processor before it starts
+// (returns the initial stack pointer for it, 0 if out of memory)
+uint32_t scheduler_cpu_prepare(uint32_t cpu);
+
+// Free the idle task of a CPU that never came up
+void scheduler_cpu_cancel(uint32_t cpu);
+
+// Start scheduling on an application processor, as its idle task
+// (never returns)
+void scheduler_start_cpu();
+
+// Create a new task at a priority (SCHED_PRIORITY_*)
+int task_create(task_func_t func, uint32_t priority);
+
+// Create a new task with a stack of stack_size bytes (up to VMM_STACK_MAX)
+int task_create_sized(task_func_t func, uint32_t priority, uint32_t stack_size);
+
+// Create a task with a copy-on-write clone of the current task's user pages
+// (runs at the current task's priority)
+int task_clone(task_func_t func);
 
 // Yield CPU to next task
 void task_yield();
 
-// Schedule next task (called from timer)
+// End the current task (never returns; what a task function returning does)
+void task_exit();
+
+// Schedule next task (interrupts must be disabled)
 void schedule();
 
+// Account one timer tick against the current slice (called from the timer IRQ)
+void scheduler_tick();
+
+// Switch tasks on the way out of an IRQ if a slice ended or a higher
+// priority task woke up (called last in irq_handler)
+void scheduler_irq_exit();
+
+// Handle a reschedule IPI from another CPU
+void scheduler_ipi();
+
+// Get the running task
+task_t* task_current();
+
+// Block the current task until task_wake (interrupts must be disabled)
+// Returns at once if a wakeup already arrived after the task made itself
+// findable (e.g. registered as a waiter) but before it got here
+void task_block();
+
+// Make a blocked task runnable (any context, including IRQ handlers)
+void task_wake(task_t* task);
+
+// Sleep for at least the given time; other tasks (or the idle task's
+// hlt) use the CPU meanwhile
+void task_sleep_ticks(uint32_t ticks);
+void task_sleep_ms(uint32_t ms);
+
+// Set/get the time slice in timer ticks
+void scheduler_set_quantum(uint32_t ticks);
+uint32_t scheduler_get_quantum();
+
+// Get scheduler statistics
+const sched_stats_t* scheduler_get_stats();
+
+// Free the TCBs, stacks and address spaces of terminated tasks
+void scheduler_reap();
+
 // Get current task ID
 uint32_t get_current_task_id();
 
+// Measure context switch cost with 2, 64 and 1024 tasks
+void scheduler_benchmark();
+
+// Measure sleep wakeup jitter and idle CPU time
+void scheduler_sleep_benchmark();
+
+// Get cycles the idle tasks of all CPUs have spent on them (halted or not)
+uint64_t scheduler_idle_cycles();
+
 #endif // SCHEDULER_H
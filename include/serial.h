@@ -0,0 +1,40 @@
+// Serial Port Header
+// Polled output on COM1 for getting data off the machine
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+
+// COM1 registers (offsets from the base port)
+#define SERIAL_COM1         0x3F8
+#define SERIAL_DATA         0       // THR on write; divisor low with DLAB
+#define SERIAL_IER          1       // Interrupt enable; divisor high with DLAB
+#define SERIAL_FCR          2       // FIFO control
+#define SERIAL_LCR          3       // Line control
+#define SERIAL_MCR          4       // Modem control
+#define SERIAL_LSR          5       // Line status
+#define SERIAL_SCRATCH      7
+
+#define SERIAL_LCR_DLAB     0x80
+#define SERIAL_LCR_8N1      0x03
+#define SERIAL_LSR_THRE     0x20    // Transmit holding register empty
+
+// Divisor of the 115200 baud UART clock
+#define SERIAL_DIVISOR      1
+
+// Set COM1 to 115200 8N1 with its interrupts off (returns -1 if no UART
+// answers, and serial_write drops everything)
+int serial_init();
+
+// Check whether serial_init found a UART
+int serial_present();
+
+// Send bytes, waiting for the transmitter between them. Callers serialize
+// their own output; bytes from two CPUs at once interleave.
+void serial_write(const void* data, uint32_t size);
+
+// Send a NUL-terminated string
+void serial_print(const char* str);
+
+#endif // SERIAL_H
@@ -0,0 +1,58 @@
+// SMP Header
+// Application processor startup and per-CPU data
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+// Most CPUs the kernel brings up; extra processors stay parked
+#define SMP_MAX_CPUS        8
+
+// Physical page the AP startup code is copied to (below 1MB, so the
+// STARTUP IPI can point at it; reserved by the PMM)
+#define SMP_TRAMPOLINE      0x70000
+
+// How long to wait for APs to answer the STARTUP IPIs
+#define SMP_BOOT_TIMEOUT_MS 100
+
+// Per-CPU block; GS points at the running CPU's copy
+typedef struct {
+    uint32_t id;                // Must stay first: smp_cpu_id() reads %gs:0
+    uint32_t apic_id;           // Local APIC ID, the target for IPIs
+    volatile uint32_t online;   // Set once the CPU runs its idle task
+} cpu_t;
+
+// Index of the CPU we are running on (0 is the bootstrap processor)
+// One instruction, so it cannot be split by a migration; the answer is
+// only stable while the task cannot be preempted
+static inline uint32_t smp_cpu_id() {
+    uint32_t id;
+    __asm__ __volatile__("movl %%gs:0, %0" : "=r"(id));
+    return id;
+}
+
+// Set up the bootstrap processor's GDT and per-CPU block
+// (first thing in kmain: everything after it may call smp_cpu_id)
+void smp_early_init();
+
+// Start the application processors (after the scheduler and timer are
+// running, with interrupts enabled)
+void smp_init();
+
+// Number of CPUs running the scheduler
+uint32_t smp_cpu_count();
+
+// Check whether a CPU index is online
+int smp_cpu_online(uint32_t cpu);
+
+// Local APIC ID of a CPU index (the destination for its interrupts)
+uint32_t smp_cpu_apic_id(uint32_t cpu);
+
+// Interrupt another CPU so it re-runs its scheduler
+void smp_send_resched(uint32_t cpu);
+
+// Measure how a fixed amount of CPU-bound work scales across the CPUs
+void smp_benchmark();
+
+#endif // SMP_H
@@ -0,0 +1,67 @@
+// Spinlock Header
+// Busy-waiting locks for state shared between CPUs
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+// A lock word: 0 when free, 1 when held
+// Zero-initialized statics start out unlocked
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+// Acquisitions that found the lock held, over all locks (sync.c, lockstat)
+extern volatile uint32_t spin_contentions;
+
+// Initialize a lock that is not a zeroed static
+static inline void spin_init(spinlock_t* lock) {
+    lock->locked = 0;
+}
+
+// Acquire a lock
+// Spins on a plain read so waiting CPUs do not bounce the cache line with
+// locked writes; pause tells the CPU (and a hypervisor) we are spinning
+static inline void spin_lock(spinlock_t* lock) {
+    if (!__sync_lock_test_and_set(&lock->locked, 1)) {
+        return;
+    }
+    
+    __sync_fetch_and_add(&spin_contentions, 1);
+    do {
+        while (lock->locked) {
+            __asm__ __volatile__("pause" : : : "memory");
+        }
+    } while (__sync_lock_test_and_set(&lock->locked, 1));
+}
+
+// Try to acquire a lock once (returns 1 if it was taken)
+static inline int spin_trylock(spinlock_t* lock) {
+    return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+// Release a lock
+static inline void spin_unlock(spinlock_t* lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+// Acquire a lock with interrupts disabled, returning the previous EFLAGS
+// Any lock an interrupt handler also takes must be held this way, or the
+// handler can spin forever on its own CPU
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    spin_lock(lock);
+    return flags;
+}
+
+// Release a lock and restore EFLAGS saved by spin_lock_irqsave
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+#endif // SPINLOCK_H
@@ -0,0 +1,32 @@
+// Kernel Symbols Header
+// Address-to-function lookup in the symbol table built at link time
+
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stdint.h>
+
+// A code symbol; name is an offset into ksym_names
+typedef struct {
+    uint32_t addr;
+    uint32_t name;
+} ksym_t;
+
+// Generated into kernel/symtab.c by tools/ksyms.py from `nm -n` of the
+// kernel, sorted by address. The first link uses an empty table; the
+// second links the real one, which only grows .rodata, so no code moves.
+extern const uint32_t ksym_count;
+extern const ksym_t ksyms[];
+extern const char ksym_names[];
+
+// Check whether an address is inside the kernel's code
+int symbol_in_text(uint32_t addr);
+
+// Find the function containing a code address, and the offset into it
+// (returns 0 outside the kernel's code or without a table)
+const char* symbol_lookup(uint32_t addr, uint32_t* offset);
+
+// Index of that function in ksyms, or ksym_count if there is none
+uint32_t symbol_index(uint32_t addr);
+
+#endif // SYMBOLS_H
@@ -0,0 +1,94 @@
+// Synchronization Header
+// Wait queues, sleeping mutexes, counting semaphores and condition variables
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+#include "spinlock.h"
+
+struct task;
+
+// Tasks blocked until some condition changes
+// The condition is checked and the task queued under one lock, so a wakeup
+// cannot slip in between; callers re-check it after waking.
+typedef struct {
+    spinlock_t lock;
+    struct task* head;
+    struct task* tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, 0, 0 }
+
+// Contention counters kept by every mutex and semaphore (see lockstat)
+typedef struct lock_stats {
+    const char* name;
+    const char* kind;
+    uint32_t acquires;
+    uint32_t contended;                 // Acquires that had to block
+    uint64_t wait_cycles;               // Total time spent blocked
+    struct lock_stats* next;            // All registered locks
+} lock_stats_t;
+
+// Sleeping lock: contenders block instead of spinning
+// Only for task context; interrupt handlers must use spinlocks.
+typedef struct {
+    volatile uint32_t locked;
+    struct task* owner;
+    wait_queue_t waiters;
+    lock_stats_t stats;
+} mutex_t;
+
+// Counting semaphore
+typedef struct {
+    volatile int32_t count;
+    wait_queue_t waiters;               // Its lock also guards count
+    lock_stats_t stats;
+} semaphore_t;
+
+// Condition variable used with a mutex
+typedef struct {
+    wait_queue_t waiters;
+} condvar_t;
+
+// Initialize a wait queue that is not a zeroed static
+void wait_queue_init(wait_queue_t* wq);
+
+// Block the current task on wq
+// lock is held (taken with spin_lock_irqsave) and protects the condition;
+// it may be wq's own lock. It is released while blocked and held again on
+// return. Wakeups can be spurious: wait in a loop on the condition.
+void wait_queue_wait(wait_queue_t* wq, spinlock_t* lock);
+
+// Wake the longest waiting task (returns 0 if the queue was empty)
+struct task* wait_queue_wake_one(wait_queue_t* wq);
+
+// Wake every waiting task, returning how many there were
+uint32_t wait_queue_wake_all(wait_queue_t* wq);
+
+// Mutex operations
+void mutex_init(mutex_t* mutex, const char* name);
+void mutex_lock(mutex_t* mutex);
+int mutex_trylock(mutex_t* mutex);     // Returns 1 if it was taken
+void mutex_unlock(mutex_t* mutex);
+
+// Semaphore operations
+void sem_init(semaphore_t* sem, const char* name, int32_t count);
+void sem_wait(semaphore_t* sem);
+int sem_trywait(semaphore_t* sem);    // Returns 1 if the count was taken
+void sem_post(semaphore_t* sem);
+
+// Condition variable operations
+// cond_wait releases the mutex while blocked and re-acquires it
+void cond_init(condvar_t* cond);
+void cond_wait(condvar_t* cond, mutex_t* mutex);
+void cond_signal(condvar_t* cond);
+void cond_broadcast(condvar_t* cond);
+
+// Print contention statistics for every mutex and semaphore
+void sync_dump();
+
+// Measure mutex contention and semaphore handoff latency
+void sync_benchmark();
+
+#endif // SYNC_H
@@ -0,0 +1,55 @@
+// System Call Header
+// Ring-3 entry into the kernel through SYSENTER or int 0x80
+
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <stdint.h>
+#include "idt.h"
+
+#define SYSCALL_VECTOR  0x80
+
+// Calling convention (both paths): eax = number, ebx/esi/edi = arguments,
+// result in eax. SYSENTER also takes the return EIP in edx and the user
+// ESP in ecx; both, and EFLAGS, are clobbered by it.
+#define SYS_NULL            0   // Does nothing (for measuring entry cost)
+#define SYS_EXIT            1
+#define SYS_YIELD           2
+#define SYS_GETPID          3
+#define SYS_WRITE           4   // ebx = string, esi = length
+#define SYS_BENCH_RESULT    5   // syscallbench's user program reports back
+#define SYSCALL_COUNT       6
+
+// Returned for an unknown number or a bad argument
+#define SYSCALL_ERROR       0xFFFFFFFF
+
+// User program layout inside the per-task user window (above the heap)
+#define USER_CODE_VIRT      0xE0000000
+#define USER_CODE_MAX       (16 * 1024)
+#define USER_STACK_TOP      0xEF000000
+#define USER_STACK_SIZE     4096
+
+// Install the int 0x80 gate and SYSENTER on the bootstrap processor
+void syscall_init();
+
+// Program SYSENTER on an application processor (after gdt_init_cpu)
+void syscall_init_cpu();
+
+// Check whether the fast path is available
+int syscall_has_sysenter();
+
+// Run a system call (both entry paths end up here)
+uint32_t syscall_dispatch(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+
+// int 0x80 handler (called from assembly)
+void syscall_interrupt(registers_t* regs);
+
+// Load a position-independent program into the current task's user
+// window and run it in ring 3. Does not return unless loading fails (-1).
+// The task must have a private address space (task_create gives it one).
+int user_exec(const void* code, uint32_t size);
+
+// Compare a null system call through a direct call, int 0x80 and SYSENTER
+void syscall_benchmark();
+
+#endif // SYSCALL_H
@@ -15,13 +15,96 @@
 // PIT frequency
 #define PIT_FREQUENCY   1193182
 
+// PIT channel 0 modes (command byte: channel 0, lo/hi byte access)
+#define PIT_MODE_ONESHOT    0x30    // Mode 0: interrupt on terminal count
+#define PIT_MODE_PERIODIC   0x34    // Mode 2: rate generator
+
+// PIT channel 2 (delays): gate and status in the system control port
+#define PIT_CONTROL     0x61
+#define PIT2_GATE       0x01    // Channel 2 counts while set
+#define PIT2_SPEAKER    0x02    // Routes channel 2 to the speaker
+#define PIT2_OUT        0x20    // Channel 2 output (set at terminal count)
+#define PIT2_MODE_ONESHOT   0xB0    // Channel 2, lo/hi byte, mode 0
+
+// System tick rate
+#define TIMER_HZ        100
+
+// Timer wheel geometry: a 256-slot root wheel for the next 256 ticks and
+// four 64-slot levels above it, each covering 64 times the span below
+#define TIMER_ROOT_BITS     8
+#define TIMER_LEVEL_BITS    6
+#define TIMER_LEVELS        4
+
+// Timeout callback (runs in interrupt context)
+typedef void (*timer_callback_t)(void* data);
+
+// Pending timeout; embedded in its owner, so adding one never allocates
+typedef struct timer_event {
+    struct timer_event* next;
+    struct timer_event** pprev;     // Link pointing at us (0 when idle)
+    uint32_t expires;               // Tick at which callback runs
+    timer_callback_t callback;
+    void* data;
+} timer_event_t;
+
+// Timer interrupt statistics
+typedef struct {
+    uint32_t irqs;              // Timer interrupts taken
+    uint32_t oneshots;          // Times the periodic tick was stopped
+    uint32_t ticks_skipped;     // Ticks covered without an interrupt
+} timer_stats_t;
+
 // Initialize PIT timer
 void timer_init(uint32_t frequency);
 
+// Run callback(data) delay_ticks ticks from now (at least one); O(1)
+void timer_add(timer_event_t* event, uint32_t delay_ticks, timer_callback_t callback, void* data);
+
+// Cancel a pending timeout (returns 1 if it was still pending); O(1)
+int timer_cancel(timer_event_t* event);
+
+// Busy-wait for at least us microseconds on PIT channel 2, which keeps
+// counting whatever channel 0 and tickless mode are doing (boot-time
+// delays on the bootstrap processor, e.g. AP startup)
+void timer_udelay(uint32_t us);
+
+// Busy-wait for a number of PIT input clocks (at most 0xFFFF) on channel 2
+void timer_pit_wait(uint32_t clocks);
+
+// Convert milliseconds to ticks, rounding up
+uint32_t timer_ms_to_ticks(uint32_t ms);
+
 // Get current tick count
+// (while the tick is stopped it catches up when the next interrupt arrives)
 uint32_t timer_get_ticks();
 
-// Timer interrupt handler (called from IRQ0)
-void timer_handler();
+// PIT input clocks (PIT_FREQUENCY per second) since timer_init, with the
+// position inside the current tick; several port reads, and may step back
+// by up to a tick around an interrupt (clock.c is the public clock)
+uint64_t timer_get_clocks();
+
+// Tickless operation: with at most one runnable task there is nothing to
+// time-slice, so the periodic tick is replaced by a one-shot interrupt at
+// the earliest pending timeout (the PIT's 16-bit counter caps one shot at
+// about 55ms). Both run with interrupts disabled, and only act on the
+// bootstrap processor, which owns the PIT.
+void timer_tick_stop();
+void timer_tick_restart();
+
+// Enable or disable tickless operation (on by default), and check it
+void timer_set_tickless(int enabled);
+int timer_get_tickless();
+
+// Get timer interrupt statistics
+const timer_stats_t* timer_get_stats();
+
+// Measure how long timer interrupts take to reach their handler over a
+// number of periodic ticks, from the PIT count at handler entry (in ns,
+// at the PIT's 838ns resolution). Tickless mode is off while it runs.
+// Returns -1 if no tick arrived.
+int timer_measure_latency(uint32_t ticks, uint32_t* min_ns, uint32_t* avg_ns);
+
+// Compare timer interrupt rates with the periodic tick and tickless mode
+void timer_benchmark();
 
 #endif // TIMER_H
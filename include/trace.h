@@ -0,0 +1,95 @@
+// Event Trace Header
+// Static tracepoints recording into per-CPU ring buffers, dumped over serial
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Event types (bit n of the trace mask enables type n)
+#define TRACE_IRQ_ENTRY     0       // arg0: vector
+#define TRACE_IRQ_EXIT      1       // arg0: vector
+#define TRACE_SWITCH        2       // arg0: outgoing task id, arg1: incoming
+#define TRACE_PMM_ALLOC     3       // arg0: physical address, arg1: order
+#define TRACE_PMM_FREE      4       // arg0: physical address, arg1: order
+#define TRACE_FAULT_ENTRY   5       // arg0: faulting address, arg1: error code
+#define TRACE_FAULT_EXIT    6       // arg0: faulting address, arg1: 0 or -1
+#define TRACE_FS_BEGIN      7       // arg0: TRACE_FS_* operation
+#define TRACE_FS_END        8       // arg0: operation, arg1: result
+#define TRACE_MARK          9       // arg0..arg2: caller's values
+#define TRACE_EVENT_TYPES   10
+
+#define TRACE_ALL           ((1u << TRACE_EVENT_TYPES) - 1)
+
+// File system operations in TRACE_FS_BEGIN/END
+#define TRACE_FS_CREATE     0
+#define TRACE_FS_READ       1
+#define TRACE_FS_DELETE     2
+
+// Per-CPU ring: one buddy block of 2^TRACE_RING_ORDER pages, overwriting
+// the oldest records once full
+#define TRACE_RING_ORDER    4
+#define TRACE_RING_RECORDS  ((4096 << TRACE_RING_ORDER) / sizeof(trace_record_t))
+
+// One event, two to a cache line
+typedef struct {
+    uint64_t tsc;           // clock_cycles() when it was recorded
+    uint16_t type;
+    uint16_t cpu;
+    uint32_t seq;           // Per-CPU record number: gaps mean overwritten records
+    uint32_t task;          // Current task id (0 before the scheduler runs)
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+} trace_record_t;
+
+// Serial dump: the header, then per CPU a trace_dump_cpu_t followed by its
+// records oldest first, then TRACE_DUMP_END. All fields little-endian;
+// tools/trace2chrome.py turns it into a Chrome trace.
+#define TRACE_DUMP_MAGIC    "CXTRACE1"
+#define TRACE_DUMP_END      "CXTREND1"
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;   // sizeof(trace_record_t)
+    uint32_t tsc_khz;       // For converting timestamps to time
+    uint32_t cpus;          // trace_dump_cpu_t blocks that follow
+} trace_dump_header_t;
+
+typedef struct {
+    uint32_t cpu;
+    uint32_t count;         // Records that follow
+    uint32_t lost;          // Older records overwritten before the dump
+} trace_dump_cpu_t;
+
+// Event types being recorded
+extern volatile uint32_t trace_mask;
+
+// Append a record to this CPU's ring (use trace_event)
+void trace_record(uint32_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+// Tracepoint: a load and a not-taken branch while the type is disabled
+static inline void trace_event(uint32_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+    if (__builtin_expect(trace_mask & (1u << type), 0)) {
+        trace_record(type, arg0, arg1, arg2);
+    }
+}
+
+// Allocate the rings of the online CPUs on first use, empty them and
+// record the event types in mask (returns -1 if a ring cannot be allocated)
+int trace_start(uint32_t mask);
+
+// Stop recording; the rings keep their contents for trace_dump
+void trace_stop();
+
+// Stop recording and send the rings over the serial port
+// (returns -1 without a UART)
+int trace_dump();
+
+// Print whether tracing is on and the per-CPU record counts
+void trace_status();
+
+// Measure the cost of a tracepoint, disabled and enabled (empties the rings)
+void trace_benchmark();
+
+#endif // TRACE_H
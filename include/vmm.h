@@ -0,0 +1,90 @@
+// Virtual Memory Manager Header
+// Demand-paged kernel regions backed lazily by the page-fault handler
+
+#ifndef VMM_H
+#define VMM_H
+
+#include <stdint.h>
+#include "idt.h"
+
+// Most regions that can exist at once
+#define VMM_MAX_REGIONS 64
+
+// Largest kernel stack vmm_stack_alloc hands out
+#define VMM_STACK_MAX   (64 * 1024)
+
+// Region flags
+#define VMM_WRITE   0x1     // Region is writable
+#define VMM_GUARD   0x2     // Leave an unmapped guard page below the region
+
+// Page-fault error code bits
+#define PF_PRESENT  0x1     // Fault on a present page (protection violation)
+#define PF_WRITE    0x2     // Faulting access was a write
+#define PF_USER     0x4     // Fault happened in user mode
+
+// Virtual region; pages are mapped on first touch
+typedef struct {
+    uint32_t start;             // First byte (page aligned)
+    uint32_t end;               // One past the last byte (page aligned)
+    uint32_t flags;
+    const char* name;
+    const uint8_t* source;      // Initial contents (file mappings), 0 for zero-fill
+    uint32_t source_size;
+    uint32_t resident_pages;    // Pages currently backed by a frame
+} vmm_region_t;
+
+// Page-fault statistics
+typedef struct {
+    uint32_t faults;            // All page faults taken
+    uint32_t resolved;          // Faults fixed up (demand or copy-on-write)
+    uint32_t invalid;           // Faults outside any region or not permitted
+    uint32_t cow_faults;        // Writes to shared copy-on-write pages
+    uint64_t total_cycles;      // Handler time for resolved faults
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+} vmm_stats_t;
+
+// Initialize the region table (after paging_init)
+void vmm_init();
+
+// Reserve a zero-filled region of size bytes in kernel virtual space
+void* vmm_alloc(const char* name, uint32_t size, uint32_t flags);
+
+// Reserve a region whose pages start out as a copy of data (e.g. a file)
+void* vmm_map_data(const char* name, const void* data, uint32_t size, uint32_t flags);
+
+// Release a region and the frames backing it
+void vmm_free(void* addr);
+
+// Find the region containing an address (0 if none)
+const vmm_region_t* vmm_find_region(uint32_t addr);
+
+// Grow or shrink the current address space's demand-zero user heap
+// (returns the previous end, 0 if it does not fit)
+void* vmm_user_sbrk(int32_t increment);
+
+// Resolve a page fault (returns 0 if handled, -1 if the access is invalid)
+int vmm_handle_fault(registers_t* regs);
+
+// Allocate a kernel stack of size bytes (rounded up to pages) below an
+// unmapped guard page; pages are backed up front, since a kernel stack
+// fault cannot be handled on the stack that faulted
+// Returns the lowest address of the stack, 0 if out of memory or space
+void* vmm_stack_alloc(uint32_t size);
+
+// Free a stack from vmm_stack_alloc
+void vmm_stack_free(void* base, uint32_t size);
+
+// Get page-fault statistics
+const vmm_stats_t* vmm_get_stats();
+
+// Print regions and fault statistics
+void vmm_dump();
+
+// Measure demand-fault latency over a fresh region
+void vmm_benchmark();
+
+// Compare a copy-on-write clone of the user heap against an eager copy
+void vmm_cow_benchmark();
+
+#endif // VMM_H
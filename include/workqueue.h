@@ -0,0 +1,88 @@
+// Deferred Work Header
+// Softirq work run on interrupt exit and kernel worker thread queues
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include "spinlock.h"
+#include "sync.h"
+
+struct task;
+
+typedef void (*work_func_t)(void* arg);
+
+// A unit of deferred work
+// An item is queued at most once at a time; queueing a pending item is a
+// no-op, so a handler can queue the same item on every interrupt and the
+// function drains whatever accumulated. pending is cleared just before
+// func runs, so func may queue the item again or free it.
+typedef struct work {
+    work_func_t func;
+    void* arg;
+    struct work* next;
+    uint64_t queued_stamp;              // TSC when queued, for latency
+    volatile uint32_t pending;
+} work_t;
+
+// Per-queue accounting (latency is queue to start, in cycles)
+typedef struct {
+    uint32_t queued;
+    uint32_t completed;
+    uint32_t max_latency;
+    uint64_t total_latency;
+    uint64_t run_cycles;
+} work_stats_t;
+
+// A queue served by its own kernel worker thread
+// Work items here run in task context and may block.
+typedef struct {
+    const char* name;
+    spinlock_t lock;
+    work_t* head;
+    work_t* tail;
+    wait_queue_t idle;                  // The worker, when out of work
+    struct task* volatile worker;
+    work_stats_t stats;
+} workqueue_t;
+
+// Most queues a kernel can create (workers are never torn down)
+#define WORKQUEUE_MAX       8
+
+// Softirq items run per interrupt exit; the rest go to the system queue
+#define SOFTIRQ_BUDGET      32
+
+// Prepare a work item
+void work_init(work_t* work, work_func_t func, void* arg);
+
+// Queue work to run on this CPU on the way out of the current interrupt,
+// with interrupts enabled. Returns 0 if it was already pending.
+// Softirq work must not block or take a lock that task code holds without
+// disabling interrupts. Queued from task context it runs at the next
+// interrupt on this CPU.
+int softirq_queue(work_t* work);
+
+// Run pending softirq work (irq_handler, interrupts disabled)
+void softirq_run();
+
+// Check whether this CPU is running softirq work (a nested interrupt must
+// then return without running it again or switching tasks)
+int softirq_active();
+
+// Create the system worker queue (after scheduler_init)
+void workqueue_init();
+
+// Create a queue and start its worker thread (0 if none are left)
+workqueue_t* workqueue_create(const char* name, uint32_t priority);
+
+// Queue work on a worker thread; returns 0 if it was already pending
+// Safe from interrupt handlers.
+int workqueue_queue(workqueue_t* wq, work_t* work);
+
+// The shared "events" queue
+workqueue_t* workqueue_system();
+
+// Print per-queue counts and latency
+void workqueue_dump();
+
+#endif // WORKQUEUE_H
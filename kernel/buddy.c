@@ -0,0 +1,293 @@
+// Buddy Allocator Implementation
+// Hands out 2^order contiguous pages and coalesces buddies on free
+
+#include "buddy.h"
+#include "clock.h"
+#include "pmm.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_dec(unsigned int num);
+
+// Per-page metadata (indexed relative to the zone base)
+// Only the first page of a block carries meaningful state
+#define BLOCK_FREE      0x80    // Block is on a free list
+#define BLOCK_ALLOCATED 0x40    // Block was handed out by buddy_alloc
+#define BLOCK_ORDER     0x0F    // Order of the block
+#define NO_PAGE         0xFFFF
+
+static uint8_t block_state[BUDDY_ZONE_PAGES];
+static uint16_t free_next[BUDDY_ZONE_PAGES];
+static uint16_t free_prev[BUDDY_ZONE_PAGES];
+
+// Free list heads, one per order
+static uint16_t free_head[BUDDY_MAX_ORDER + 1];
+static uint32_t free_count[BUDDY_MAX_ORDER + 1];
+
+// Zone layout and statistics
+static uint32_t zone_base = 0;
+static uint32_t zone_pages = 0;
+static uint32_t zone_free = 0;
+
+// Helper: Read the CPU timestamp counter
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: Push a block onto the free list for its order
+static void list_push(uint32_t index, uint32_t order) {
+    free_prev[index] = NO_PAGE;
+    free_next[index] = free_head[order];
+    if (free_head[order] != NO_PAGE) {
+        free_prev[free_head[order]] = index;
+    }
+    free_head[order] = index;
+    free_count[order]++;
+    block_state[index] = BLOCK_FREE | order;
+}
+
+// Helper: Unlink a block from the free list for its order
+static void list_remove(uint32_t index, uint32_t order) {
+    if (free_prev[index] != NO_PAGE) {
+        free_next[free_prev[index]] = free_next[index];
+    } else {
+        free_head[order] = free_next[index];
+    }
+    if (free_next[index] != NO_PAGE) {
+        free_prev[free_next[index]] = free_prev[index];
+    }
+    free_count[order]--;
+    block_state[index] = 0;
+}
+
+// Initialize the zone
+void buddy_init(uint32_t base_page, uint32_t page_count) {
+    if (page_count > BUDDY_ZONE_PAGES) {
+        page_count = BUDDY_ZONE_PAGES;
+    }
+    
+    zone_base = base_page;
+    zone_pages = page_count;
+    zone_free = 0;
+    
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        free_head[order] = NO_PAGE;
+        free_count[order] = 0;
+    }
+    
+    for (uint32_t i = 0; i < BUDDY_ZONE_PAGES; i++) {
+        block_state[i] = 0;
+    }
+    
+    // Carve the zone into the largest naturally aligned blocks that fit
+    uint32_t index = 0;
+    while (index < zone_pages) {
+        uint32_t order = BUDDY_MAX_ORDER;
+        while ((index & ((1u << order) - 1)) != 0 || index + (1u << order) > zone_pages) {
+            order--;
+        }
+        list_push(index, order);
+        zone_free += 1u << order;
+        index += 1u << order;
+    }
+}
+
+// Allocate a block of 2^order pages
+uint32_t buddy_alloc(uint32_t order) {
+    if (order > BUDDY_MAX_ORDER) {
+        return BUDDY_NO_BLOCK;
+    }
+    
+    // Find the smallest free block that is large enough
+    uint32_t current = order;
+    while (current <= BUDDY_MAX_ORDER && free_head[current] == NO_PAGE) {
+        current++;
+    }
+    if (current > BUDDY_MAX_ORDER) {
+        return BUDDY_NO_BLOCK;
+    }
+    
+    uint32_t index = free_head[current];
+    list_remove(index, current);
+    
+    // Split it, returning the upper halves to the free lists
+    while (current > order) {
+        current--;
+        list_push(index + (1u << current), current);
+    }
+    
+    block_state[index] = BLOCK_ALLOCATED | order;
+    zone_free -= 1u << order;
+    
+    return zone_base + index;
+}
+
+// Free a block and merge it with its buddy while possible
+int buddy_free(uint32_t page, uint32_t order) {
+    if (!buddy_contains(page) || order > BUDDY_MAX_ORDER) {
+        return -1;
+    }
+    
+    uint32_t index = page - zone_base;
+    if (block_state[index] != (BLOCK_ALLOCATED | order)) {
+        return -1;  // Not the head of an allocated block of this order
+    }
+    
+    zone_free += 1u << order;
+    
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = index ^ (1u << order);
+        if (buddy >= zone_pages || block_state[buddy] != (BLOCK_FREE | order)) {
+            break;
+        }
+        list_remove(buddy, order);
+        if (buddy < index) {
+            index = buddy;
+        }
+        order++;
+    }
+    
+    list_push(index, order);
+    return 0;
+}
+
+// Check whether a page belongs to the zone
+int buddy_contains(uint32_t page) {
+    return page >= zone_base && page < zone_base + zone_pages;
+}
+
+// Get number of free pages in the zone
+uint32_t buddy_get_free_pages() {
+    return zone_free;
+}
+
+// Get number of pages in the zone
+uint32_t buddy_get_total_pages() {
+    return zone_pages;
+}
+
+// Helper: Size in pages of the largest free block
+static uint32_t largest_free_block() {
+    for (int order = BUDDY_MAX_ORDER; order >= 0; order--) {
+        if (free_head[order] != NO_PAGE) {
+            return 1u << order;
+        }
+    }
+    return 0;
+}
+
+// Print free block counts per order and fragmentation
+// Fragmentation is the share of free memory outside the largest free block
+void buddy_dump() {
+    print("  Order:  ");
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        print_dec(order);
+        print(order < 10 ? "    " : "   ");
+    }
+    print("\n  Free:   ");
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        uint32_t count = free_count[order];
+        print_dec(count);
+        print(count < 10 ? "    " : count < 100 ? "   " : "  ");
+    }
+    
+    uint32_t largest = largest_free_block();
+    print("\n  Free pages: ");
+    print_dec(zone_free);
+    print(", largest block: ");
+    print_dec(largest);
+    print(" pages, fragmentation: ");
+    print_dec(zone_free ? 100 - largest * 100 / zone_free : 0);
+    print("%\n");
+}
+
+// ============ Benchmark ============
+
+#define BENCH_SLOTS 256     // Live allocations tracked by the workload
+#define BENCH_OPS   8192    // Alloc/free operations per run
+
+// Helper: Small LCG for the workload
+static uint32_t bench_random(uint32_t* state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+// Helper: Pick an order skewed towards small blocks
+// 50% order 0, 25% order 1, 12.5% order 2, 6.25% order 3, rest order 4
+static uint32_t bench_order(uint32_t* state) {
+    uint32_t r = bench_random(state) % 16;
+    if (r < 8) return 0;
+    if (r < 12) return 1;
+    if (r < 14) return 2;
+    if (r < 15) return 3;
+    return 4;
+}
+
+// Mixed-size workload: randomly allocate or free blocks of order 0-4
+void buddy_benchmark() {
+    static uint32_t slot_page[BENCH_SLOTS];
+    static uint8_t slot_order[BENCH_SLOTS];
+    uint32_t seed = 0x9E3779B9;
+    uint32_t allocs = 0, frees = 0, failures = 0;
+    
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        slot_page[i] = BUDDY_NO_BLOCK;
+    }
+    
+    print("\nBuddy benchmark (");
+    print_dec(BENCH_OPS);
+    print(" mixed ops, orders 0-4)\n");
+    
+    // The whole run holds the PMM lock, so it times the zone alone
+    uint32_t flags = pmm_lock_irqsave();
+    uint64_t start = rdtsc();
+    
+    for (int op = 0; op < BENCH_OPS; op++) {
+        uint32_t slot = bench_random(&seed) % BENCH_SLOTS;
+        
+        if (slot_page[slot] == BUDDY_NO_BLOCK) {
+            uint32_t order = bench_order(&seed);
+            uint32_t page = buddy_alloc(order);
+            if (page == BUDDY_NO_BLOCK) {
+                failures++;
+                continue;
+            }
+            slot_page[slot] = page;
+            slot_order[slot] = order;
+            allocs++;
+        } else {
+            buddy_free(slot_page[slot], slot_order[slot]);
+            slot_page[slot] = BUDDY_NO_BLOCK;
+            frees++;
+        }
+    }
+    
+    uint64_t cycles = rdtsc() - start;
+    pmm_unlock_irqrestore(flags);
+    
+    print("  Allocs: ");
+    print_dec(allocs);
+    print(", frees: ");
+    print_dec(frees);
+    print(", failed allocs: ");
+    print_dec(failures);
+    print("\n  Cycles per op: ");
+    print_dec(div_u64_u32(cycles, allocs + frees));
+    print("\n\n  Under load:\n");
+    buddy_dump();
+    
+    // Release everything still held; coalescing should restore the zone
+    flags = pmm_lock_irqsave();
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        if (slot_page[i] != BUDDY_NO_BLOCK) {
+            buddy_free(slot_page[i], slot_order[i]);
+        }
+    }
+    pmm_unlock_irqrestore(flags);
+    
+    print("\n  After freeing all blocks:\n");
+    buddy_dump();
+    print("\n");
+}
@@ -0,0 +1,199 @@
+// Clocksource Implementation
+// TSC calibration against PIT channel 2 and count-to-nanosecond scaling
+
+#include "clock.h"
+#include "spinlock.h"
+#include "timer.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// CPUID 0x80000007 EDX: the TSC ticks at a constant rate in every state
+#define CPUID_INVARIANT_TSC     (1 << 8)
+
+// ns = count * mult >> shift, with mult kept to 32 bits
+// For the PIT: 10^9 * 2^22 / PIT_FREQUENCY
+#define PIT_NS_MULT             3515225673u
+#define PIT_NS_SHIFT            22
+
+static int source = CLOCK_SOURCE_PIT;
+static uint32_t tsc_khz = 0;
+static uint32_t tsc_mult = 0;
+static uint32_t tsc_shift = 0;
+static uint64_t tsc_base = 0;
+static uint64_t pit_base = 0;
+
+// The PIT count can read a tick behind around an interrupt; the last value
+// handed out keeps readers from seeing time go backwards
+static spinlock_t pit_clock_lock = SPINLOCK_INIT;
+static uint64_t pit_last_ns = 0;
+
+// Helper: count * mult >> shift without overflowing 64 bits (shift <= 32)
+static uint64_t scale(uint64_t count, uint32_t mult, uint32_t shift) {
+    uint64_t high = (count >> 32) * mult;
+    uint64_t low = (count & 0xFFFFFFFF) * mult;
+    return (high << (32 - shift)) + (low >> shift);
+}
+
+// Helper: Check CPUID for an invariant TSC
+static int tsc_invariant() {
+    uint32_t eax = 0x80000000, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (eax < 0x80000007) {
+        return 0;
+    }
+    eax = 0x80000007;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx & CPUID_INVARIANT_TSC) != 0;
+}
+
+// Helper: TSC rate in kHz from the shortest of a few PIT intervals
+// (0 if the result would not fit)
+static uint32_t calibrate_khz() {
+    uint64_t best = ~0ull;
+    for (uint32_t run = 0; run < CLOCK_CALIBRATE_RUNS; run++) {
+        uint64_t start = clock_cycles();
+        timer_pit_wait(CLOCK_CALIBRATE_CLOCKS);
+        uint64_t cycles = clock_cycles() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    
+    // kHz = cycles * PIT_FREQUENCY / (clocks * 1000)
+    uint64_t scaled = best * PIT_FREQUENCY;
+    uint32_t divisor = CLOCK_CALIBRATE_CLOCKS * 1000;
+    if (best >> 32 || (scaled >> 32) >= divisor) {
+        return 0;
+    }
+    return div_u64_u32(scaled, divisor);
+}
+
+// Helper: Nanoseconds from the TSC
+static uint64_t tsc_ns() {
+    return scale(clock_cycles() - tsc_base, tsc_mult, tsc_shift);
+}
+
+// Helper: Nanoseconds from the PIT, clamped to never go backwards
+static uint64_t pit_ns() {
+    uint32_t flags = spin_lock_irqsave(&pit_clock_lock);
+    uint64_t clocks = timer_get_clocks();
+    uint64_t ns = clocks > pit_base ? scale(clocks - pit_base, PIT_NS_MULT, PIT_NS_SHIFT) : 0;
+    if (ns < pit_last_ns) {
+        ns = pit_last_ns;
+    } else {
+        pit_last_ns = ns;
+    }
+    spin_unlock_irqrestore(&pit_clock_lock, flags);
+    return ns;
+}
+
+// Calibrate the TSC and pick the clocksource
+void clock_init() {
+    tsc_khz = calibrate_khz();
+    if (tsc_khz) {
+        // Largest shift that keeps mult = 10^6 * 2^shift / kHz in 32 bits
+        tsc_shift = 32;
+        while (tsc_shift > 0 && ((uint64_t)1000000 << tsc_shift) >= ((uint64_t)tsc_khz << 32)) {
+            tsc_shift--;
+        }
+        tsc_mult = div_u64_u32((uint64_t)1000000 << tsc_shift, tsc_khz);
+    }
+    tsc_base = clock_cycles();
+    pit_base = timer_get_clocks();
+    
+    int invariant = tsc_invariant();
+    source = (tsc_khz && invariant) ? CLOCK_SOURCE_TSC : CLOCK_SOURCE_PIT;
+    
+    print("Clock: TSC at ");
+    print_dec(tsc_khz / 1000);
+    print(" MHz");
+    print(invariant ? " (invariant)" : " (not invariant)");
+    print(source == CLOCK_SOURCE_TSC ? ", time from the TSC\n" : ", time from the PIT\n");
+}
+
+// Nanoseconds since clock_init, never going backwards
+uint64_t clock_monotonic_ns() {
+    if (source == CLOCK_SOURCE_TSC) {
+        return tsc_ns();
+    }
+    return pit_ns();
+}
+
+// Convert a clock_cycles interval to nanoseconds
+uint64_t clock_cycles_to_ns(uint64_t cycles) {
+    return scale(cycles, tsc_mult, tsc_shift);
+}
+
+// Calibrated TSC rate
+uint32_t clock_tsc_khz() {
+    return tsc_khz;
+}
+
+// Get the source clock_monotonic_ns uses
+int clock_source() {
+    return source;
+}
+
+// ============ Benchmark ============
+
+#define CLOCK_BENCH_ROUNDS      1000
+#define CLOCK_BENCH_STEPS       100
+
+typedef uint64_t (*clock_read_t)();
+
+// Helper: Cycles per call of a clock read
+static uint32_t read_cost(clock_read_t read) {
+    uint64_t start = clock_cycles();
+    for (uint32_t i = 0; i < CLOCK_BENCH_ROUNDS; i++) {
+        read();
+    }
+    return (uint32_t)(clock_cycles() - start) / CLOCK_BENCH_ROUNDS;
+}
+
+// Helper: Smallest step a clock is seen to move by
+static uint32_t resolution(clock_read_t read) {
+    uint32_t best = 0xFFFFFFFF;
+    uint64_t last = read();
+    for (uint32_t steps = 0; steps < CLOCK_BENCH_STEPS; ) {
+        uint64_t now = read();
+        if (now != last) {
+            uint64_t step = now - last;
+            if (step < best) {
+                best = step >> 32 ? 0xFFFFFFFF : (uint32_t)step;
+            }
+            last = now;
+            steps++;
+        }
+    }
+    return best;
+}
+
+// Helper: One result line
+static void print_clock(const char* name, clock_read_t read) {
+    print(name);
+    print_dec(read_cost(read));
+    print(" cycles/read, resolution ");
+    print_dec(resolution(read));
+    print(" ns\n");
+}
+
+// Measure the cost and resolution of each clocksource
+void clock_benchmark() {
+    print("\nClocksources (");
+    print(source == CLOCK_SOURCE_TSC ? "TSC" : "PIT");
+    print(" in use, TSC at ");
+    print_dec(tsc_khz);
+    print(" kHz):\n");
+    
+    print("  clock_cycles:   ");
+    print_dec(read_cost(clock_cycles));
+    print(" cycles/read\n");
+    if (tsc_khz) {
+        print_clock("  TSC ns:         ", tsc_ns);
+    }
+    print_clock("  PIT ns:         ", pit_ns);
+    print("\n");
+}
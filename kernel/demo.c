@@ -2,10 +2,14 @@
 // This demonstrates that the shell command parsing works
 
 #include "shell.h"
+#include "scheduler.h"
 
 extern void shell_execute(const char* command);
 extern void print(const char* str);
 
+// Pause between commands
+#define DEMO_PAUSE_MS 500
+
 void run_demo() {
     print("\n=== DEMO MODE: Showcasing Shell Commands ===\n\n");
     
@@ -14,19 +18,19 @@ void run_demo() {
     shell_execute("help");
     
     // Wait a bit (simulate user reading)
-    for(volatile int i = 0; i < 10000000; i++);
+    task_sleep_ms(DEMO_PAUSE_MS);
     
     // Simulate typing "version"
     print("CoreX> version\n");
     shell_execute("version");
     
-    for(volatile int i = 0; i < 10000000; i++);
+    task_sleep_ms(DEMO_PAUSE_MS);
     
     // Simulate typing "meminfo"
     print("CoreX> meminfo\n");
     shell_execute("meminfo");
     
-    for(volatile int i = 0; i < 10000000; i++);
+    task_sleep_ms(DEMO_PAUSE_MS);
     
     // Simulate typing "echo"
     print("CoreX> echo Hello from CoreX OS!\n");
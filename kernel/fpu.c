@@ -0,0 +1,327 @@
+// FPU/SSE Implementation
+// CR0.TS-based lazy save/restore of the x87 and SSE registers
+
+#include "fpu.h"
+#include "kmalloc.h"
+#include "scheduler.h"
+#include "smp.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+#define CPUID_FXSR      (1 << 24)
+#define CPUID_SSE       (1 << 25)
+
+#define CR0_MP          (1 << 1)    // WAIT/FWAIT honour TS
+#define CR0_EM          (1 << 2)    // Emulate x87 (must be clear for SSE)
+#define CR0_TS          (1 << 3)    // Task switched: next FPU/SSE use traps
+#define CR0_NE          (1 << 5)    // Native x87 error reporting
+#define CR4_OSFXSR      (1 << 9)    // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT  (1 << 10)   // Unmasked SIMD exceptions raise #XM
+
+// Per-CPU lazy switching state
+// owner is the task whose registers this CPU holds; they may also be
+// saved already (see fpu_switch). ts_set mirrors CR0.TS so switching
+// between tasks that never use SIMD does not touch CR0 at all.
+typedef struct {
+    struct task* owner;
+    int ts_set;
+} fpu_cpu_t;
+
+static fpu_cpu_t fpu_cpus[SMP_MAX_CPUS];
+static kmem_cache_t* fpu_cache = 0;
+static fpu_state_t initial_state;       // Registers right after fninit
+static int sse_enabled = 0;
+static fpu_stats_t stats;
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint32_t read_cr0() {
+    uint32_t cr0;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline uint32_t read_cr4() {
+    uint32_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+// Helper: Clear CR0.TS (clts is cheaper than a CR0 write)
+static inline void clts() {
+    __asm__ __volatile__("clts" : : : "memory");
+}
+
+// Helper: Set CR0.TS
+static inline void stts() {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void fxsave(fpu_state_t* state) {
+    __asm__ __volatile__("fxsave %0" : "=m"(*state));
+}
+
+static inline void fxrstor(const fpu_state_t* state) {
+    __asm__ __volatile__("fxrstor %0" : : "m"(*state));
+}
+
+// Helper: Enable the FPU and SSE on the CPU we are running on, with a
+// clean register set and TS armed
+static void enable_cpu() {
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    clts();
+    __asm__ __volatile__("fninit");
+}
+
+// Enable the FPU and SSE on the bootstrap processor
+void fpu_init() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & CPUID_FXSR) || !(edx & CPUID_SSE)) {
+        print("FPU: No FXSR/SSE support, SIMD disabled\n");
+        return;
+    }
+    
+    fpu_cache = kmem_cache_create("fpu_state", sizeof(fpu_state_t));
+    if (!fpu_cache) {
+        print("FPU: Cannot create save area cache\n");
+        return;
+    }
+    
+    // Every task starts from the state fninit leaves (MXCSR is at its
+    // reset value, all exceptions masked)
+    enable_cpu();
+    fxsave(&initial_state);
+    stts();
+    fpu_cpus[0].owner = 0;
+    fpu_cpus[0].ts_set = 1;
+    sse_enabled = 1;
+    
+    print("SSE enabled (lazy FXSAVE switching)\n");
+}
+
+// Enable the FPU and SSE on an application processor
+void fpu_init_cpu() {
+    if (!sse_enabled) {
+        return;
+    }
+    
+    uint32_t cpu = smp_cpu_id();
+    enable_cpu();
+    stts();
+    fpu_cpus[cpu].owner = 0;
+    fpu_cpus[cpu].ts_set = 1;
+}
+
+// Check whether SSE is enabled
+int fpu_has_sse() {
+    return sse_enabled;
+}
+
+// Save the outgoing task's registers if it used them, and re-arm TS
+// A task can be stolen by another CPU as soon as it is off this one, so
+// its state is written back now rather than on the next task's first use.
+void fpu_switch(struct task* prev) {
+    if (!sse_enabled) {
+        return;
+    }
+    
+    fpu_cpu_t* cpu = &fpu_cpus[smp_cpu_id()];
+    if (cpu->ts_set) {
+        return;     // No SIMD since the last switch: nothing to do
+    }
+    
+    // The registers stay loaded, so if prev comes back here before anyone
+    // else uses them the trap only has to clear TS
+    if (prev->fpu && cpu->owner == prev) {
+        fxsave(prev->fpu);
+        stats.saves++;
+    }
+    stts();
+    cpu->ts_set = 1;
+}
+
+// #NM: the current task used the FPU or SSE with TS set
+int fpu_handle_trap() {
+    if (!sse_enabled) {
+        return -1;
+    }
+    
+    uint32_t flags = irq_save();
+    uint32_t id = smp_cpu_id();
+    fpu_cpu_t* cpu = &fpu_cpus[id];
+    task_t* task = task_current();
+    stats.traps++;
+    
+    clts();
+    cpu->ts_set = 0;
+    
+    // Boot code before the scheduler runs owns the registers outright
+    if (!task) {
+        irq_restore(flags);
+        return 0;
+    }
+    
+    if (!task->fpu) {
+        // First use: start from a clean register set
+        task->fpu = (fpu_state_t*)kmem_cache_alloc(fpu_cache);
+        if (!task->fpu) {
+            stts();
+            cpu->ts_set = 1;
+            irq_restore(flags);
+            print("FPU: Out of memory for save area\n");
+            return -1;
+        }
+        *task->fpu = initial_state;
+        stats.allocs++;
+    } else if (cpu->owner == task && task->fpu_cpu == id) {
+        // Nobody used the registers since this task was last here
+        irq_restore(flags);
+        return 0;
+    }
+    
+    fxrstor(task->fpu);
+    cpu->owner = task;
+    task->fpu_cpu = id;
+    stats.restores++;
+    
+    irq_restore(flags);
+    return 0;
+}
+
+// Free a task's save area
+void fpu_release(struct task* task) {
+    if (!task->fpu) {
+        return;
+    }
+    
+    // A CPU still naming it as owner would skip a restore for a new task
+    // allocated at the same address
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        __sync_bool_compare_and_swap(&fpu_cpus[cpu].owner, task, 0);
+    }
+    kmem_cache_free(fpu_cache, task->fpu);
+    task->fpu = 0;
+}
+
+const fpu_stats_t* fpu_get_stats() {
+    return &stats;
+}
+
+// ============ Benchmark ============
+
+#define FPU_BENCH_TASKS     2
+#define FPU_BENCH_YIELDS    8192        // Per task
+
+static volatile uint32_t bench_done = 0;
+static volatile int bench_sse = 0;
+static task_t* bench_waiter = 0;
+
+// Helper: Yield in a loop, touching an XMM register every round if asked
+static void bench_task() {
+    for (uint32_t i = 0; i < FPU_BENCH_YIELDS; i++) {
+        if (bench_sse) {
+            __asm__ __volatile__("addps %%xmm0, %%xmm1" : : : "memory");
+        }
+        task_yield();
+    }
+    
+    // The last one out wakes the shell
+    if (__sync_add_and_fetch(&bench_done, 1) == FPU_BENCH_TASKS) {
+        task_wake(bench_waiter);
+    }
+}
+
+// Helper: Cycles per yield with the tasks using SSE or not
+static uint32_t bench_run(int sse, fpu_stats_t* delta) {
+    fpu_stats_t before = stats;
+    bench_sse = sse;
+    bench_done = 0;
+    bench_waiter = task_current();
+    
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < FPU_BENCH_TASKS; i++) {
+        if (task_create(bench_task, bench_waiter->priority) < 0) {
+            while (bench_done < i) {
+                task_sleep_ms(10);
+            }
+            return 0;
+        }
+    }
+    
+    // Exactly one wakeup comes; one that lands first is not lost
+    __asm__ __volatile__("cli");
+    task_block();
+    __asm__ __volatile__("sti");
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    
+    delta->traps = stats.traps - before.traps;
+    delta->restores = stats.restores - before.restores;
+    delta->saves = stats.saves - before.saves;
+    delta->allocs = stats.allocs - before.allocs;
+    return cycles / (FPU_BENCH_TASKS * FPU_BENCH_YIELDS);
+}
+
+// Compare yields between tasks that never touch SSE against tasks that
+// use it every time slice
+void fpu_benchmark() {
+    if (!sse_enabled) {
+        print("SSE not enabled\n");
+        return;
+    }
+    
+    print("\nLazy FPU/SSE switching (");
+    print_dec(FPU_BENCH_TASKS);
+    print(" tasks x ");
+    print_dec(FPU_BENCH_YIELDS);
+    print(" yields)\n");
+    print("  Tasks        Cycles/yield   #NM     FXRSTOR  FXSAVE\n");
+    
+    for (int sse = 0; sse <= 1; sse++) {
+        fpu_stats_t delta;
+        uint32_t cycles = bench_run(sse, &delta);
+        print(sse ? "  Using SSE    " : "  Integer only ");
+        if (cycles == 0) {
+            print("out of memory\n");
+            continue;
+        }
+        print_dec(cycles);
+        print(cycles < 10 ? "              " : cycles < 100 ? "             " :
+              cycles < 1000 ? "            " : "           ");
+        print_dec(delta.traps);
+        print(delta.traps < 10 ? "       " : delta.traps < 100000 ? "   " : "  ");
+        print_dec(delta.restores);
+        print(delta.restores < 10 ? "        " : delta.restores < 100000 ? "    " : "   ");
+        print_dec(delta.saves);
+        print("\n");
+    }
+    print("\n");
+}
@@ -2,17 +2,25 @@
 // Flat file system stored in memory
 
 #include "fs.h"
+#include "kmalloc.h"
+#include "sync.h"
+#include "trace.h"
 
 // External print functions
 extern void print(const char* str);
 extern void print_hex(unsigned int num);
 
 // File system storage
-// Store at fixed memory location 0x20000 (128KB) to avoid increasing kernel binary size
-#define FS_MEMORY_START 0x20000
-static file_t* files = (file_t*)FS_MEMORY_START;
+// Files are allocated from a slab cache and kept in creation order
+static kmem_cache_t* file_cache = 0;
+static file_t* files_head = 0;
+static file_t* files_tail = 0;
 static int fs_initialized = 0;
 
+// File list (tasks on any CPU may call in; file copies can be long, so
+// waiters sleep rather than spin)
+static mutex_t fs_lock;
+
 // String utility functions
 static int strlen(const char* str) {
     int len = 0;
@@ -45,48 +53,35 @@ static void memcpy(void* dest, const void* src, uint32_t n) {
 
 // Initialize file system
 void fs_init() {
-    for (int i = 0; i < MAX_FILES; i++) {
-        files[i].used = 0;
-        files[i].name[0] = '\0';
-        files[i].size = 0;
+    file_cache = kmem_cache_create("file_t", sizeof(file_t));
+    if (!file_cache) {
+        print("FS: Cannot create file cache\n");
+        return;
     }
+    files_head = 0;
+    files_tail = 0;
+    mutex_init(&fs_lock, "fs");
     fs_initialized = 1;
     print("File system initialized\n");
 }
 
-// Find file by name
-static int find_file(const char* filename) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, filename) == 0) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-// Find free file slot
-static int find_free_slot() {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!files[i].used) {
-            return i;
+// Find file by name (fs_lock held)
+static file_t* find_file(const char* filename) {
+    for (file_t* file = files_head; file; file = file->next) {
+        if (strcmp(file->name, filename) == 0) {
+            return file;
         }
     }
-    return -1;
+    return 0;
 }
 
-// Create a file with content
-int fs_create(const char* filename, const char* content) {
+// Helper: Create a file with content (fs_create without the tracepoints)
+static int create_file(const char* filename, const char* content) {
     if (!fs_initialized) {
         print("FS: Not initialized\n");
         return -1;
     }
     
-    // Check if file already exists
-    if (find_file(filename) >= 0) {
-        print("FS: File already exists\n");
-        return -1;
-    }
-    
     // Check filename length
     if (strlen(filename) >= MAX_FILENAME) {
         print("FS: Filename too long\n");
@@ -100,45 +95,81 @@ int fs_create(const char* filename, const char* content) {
         return -1;
     }
     
-    // Find free slot
-    int slot = find_free_slot();
-    if (slot < 0) {
-        print("FS: No free slots\n");
+    mutex_lock(&fs_lock);
+    
+    // Check if file already exists
+    if (find_file(filename)) {
+        mutex_unlock(&fs_lock);
+        print("FS: File already exists\n");
+        return -1;
+    }
+    
+    // Allocate file
+    file_t* file = (file_t*)kmem_cache_alloc(file_cache);
+    if (!file) {
+        mutex_unlock(&fs_lock);
+        print("FS: Out of memory\n");
         return -1;
     }
     
     // Create file
-    file_t* file = &files[slot];
     strcpy(file->name, filename);
     file->size = content_size;
     memcpy(file->data, content, content_size);
-    file->used = 1;
+    file->next = 0;
     
+    // Append to the file list
+    if (files_tail) {
+        files_tail->next = file;
+    } else {
+        files_head = file;
+    }
+    files_tail = file;
+    
+    mutex_unlock(&fs_lock);
     return 0;
 }
 
-// Read a file
-int fs_read(const char* filename, char* buffer, uint32_t size) {
+// Create a file with content
+int fs_create(const char* filename, const char* content) {
+    trace_event(TRACE_FS_BEGIN, TRACE_FS_CREATE, 0, 0);
+    int result = create_file(filename, content);
+    trace_event(TRACE_FS_END, TRACE_FS_CREATE, result, 0);
+    return result;
+}
+
+// Helper: Read a file (fs_read without the tracepoints)
+static int read_file(const char* filename, char* buffer, uint32_t size) {
     if (!fs_initialized) {
         print("FS: Not initialized\n");
         return -1;
     }
     
-    int slot = find_file(filename);
-    if (slot < 0) {
+    mutex_lock(&fs_lock);
+    file_t* file = find_file(filename);
+    if (!file) {
+        mutex_unlock(&fs_lock);
         print("FS: File not found\n");
         return -1;
     }
     
-    file_t* file = &files[slot];
     uint32_t read_size = (size < file->size) ? size : file->size;
     
     memcpy(buffer, file->data, read_size);
     buffer[read_size] = '\0';
     
+    mutex_unlock(&fs_lock);
     return read_size;
 }
 
+// Read a file
+int fs_read(const char* filename, char* buffer, uint32_t size) {
+    trace_event(TRACE_FS_BEGIN, TRACE_FS_READ, 0, 0);
+    int result = read_file(filename, buffer, size);
+    trace_event(TRACE_FS_END, TRACE_FS_READ, result, 0);
+    return result;
+}
+
 // List all files
 void fs_list() {
     if (!fs_initialized) {
@@ -151,22 +182,22 @@ void fs_list() {
     print("  Name                Size (bytes)\n");
     print("  --------------------------------\n");
     
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            print("  ");
-            print(files[i].name);
-            
-            // Pad to 20 characters
-            int name_len = strlen(files[i].name);
-            for (int j = name_len; j < 20; j++) {
-                print(" ");
-            }
-            
-            print_hex(files[i].size);
-            print("\n");
-            count++;
+    mutex_lock(&fs_lock);
+    for (file_t* file = files_head; file; file = file->next) {
+        print("  ");
+        print(file->name);
+        
+        // Pad to 20 characters
+        int name_len = strlen(file->name);
+        for (int j = name_len; j < 20; j++) {
+            print(" ");
         }
+        
+        print_hex(file->size);
+        print("\n");
+        count++;
     }
+    mutex_unlock(&fs_lock);
     
     if (count == 0) {
         print("  (no files)\n");
@@ -177,36 +208,61 @@ void fs_list() {
     print("\n");
 }
 
-// Delete a file
-int fs_delete(const char* filename) {
+// Helper: Delete a file (fs_delete without the tracepoints)
+static int delete_file(const char* filename) {
     if (!fs_initialized) {
         print("FS: Not initialized\n");
         return -1;
     }
     
-    int slot = find_file(filename);
-    if (slot < 0) {
+    // Unlink from the file list
+    mutex_lock(&fs_lock);
+    file_t* prev = 0;
+    file_t* file = files_head;
+    while (file && strcmp(file->name, filename) != 0) {
+        prev = file;
+        file = file->next;
+    }
+    
+    if (!file) {
+        mutex_unlock(&fs_lock);
         print("FS: File not found\n");
         return -1;
     }
     
-    files[slot].used = 0;
-    files[slot].name[0] = '\0';
-    files[slot].size = 0;
+    if (prev) {
+        prev->next = file->next;
+    } else {
+        files_head = file->next;
+    }
+    if (files_tail == file) {
+        files_tail = prev;
+    }
+    mutex_unlock(&fs_lock);
+    
+    kmem_cache_free(file_cache, file);
     
     return 0;
 }
 
+// Delete a file
+int fs_delete(const char* filename) {
+    trace_event(TRACE_FS_BEGIN, TRACE_FS_DELETE, 0, 0);
+    int result = delete_file(filename);
+    trace_event(TRACE_FS_END, TRACE_FS_DELETE, result, 0);
+    return result;
+}
+
 // Get file size
 int fs_size(const char* filename) {
     if (!fs_initialized) {
         return -1;
     }
     
-    int slot = find_file(filename);
-    if (slot < 0) {
-        return -1;
-    }
+    mutex_lock(&fs_lock);
+    file_t* file = find_file(filename);
+    int size = file ? (int)file->size : -1;
+    mutex_unlock(&fs_lock);
     
-    return files[slot].size;
+    return size;
 }
@@ -0,0 +1,76 @@
+// GDT Implementation
+// Replaces the bootloader's GDT with one table (and TSS) per CPU
+
+#include "gdt.h"
+#include "smp.h"
+
+// One table per CPU; they differ only in the per-CPU segment base
+static struct gdt_entry gdt_tables[SMP_MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr gdt_ptrs[SMP_MAX_CPUS];
+static struct tss_entry tss_table[SMP_MAX_CPUS];
+
+// Helper: Fill in one descriptor
+static void gdt_set_gate(struct gdt_entry* entry, uint32_t base, uint32_t limit,
+                         uint8_t access, uint8_t granularity) {
+    entry->base_low = base & 0xFFFF;
+    entry->base_middle = (base >> 16) & 0xFF;
+    entry->base_high = (base >> 24) & 0xFF;
+    entry->limit_low = limit & 0xFFFF;
+    entry->granularity = ((limit >> 16) & 0x0F) | (granularity & 0xF0);
+    entry->access = access;
+}
+
+// Build and load a CPU's GDT
+void gdt_init_cpu(uint32_t cpu, uint32_t percpu, uint32_t size) {
+    struct gdt_entry* gdt = gdt_tables[cpu];
+    
+    struct tss_entry* tss = &tss_table[cpu];
+    
+    // Access 0x9A/0x92: present, ring 0, code (exec/read) or data (read/write)
+    // 0xFA/0xF2: the same for ring 3; 0x89: present, 32-bit TSS (available)
+    // Granularity 0xCF: 4KB units, 32-bit; 0x40: byte units, 32-bit
+    gdt_set_gate(&gdt[0], 0, 0, 0, 0);
+    gdt_set_gate(&gdt[1], 0, 0xFFFFF, 0x9A, 0xCF);
+    gdt_set_gate(&gdt[2], 0, 0xFFFFF, 0x92, 0xCF);
+    gdt_set_gate(&gdt[3], 0, 0xFFFFF, 0xFA, 0xCF);
+    gdt_set_gate(&gdt[4], 0, 0xFFFFF, 0xF2, 0xCF);
+    gdt_set_gate(&gdt[5], percpu, size - 1, 0x92, 0x40);
+    gdt_set_gate(&gdt[6], (uint32_t)tss, sizeof(*tss) - 1, 0x89, 0x00);
+    
+    uint8_t* bytes = (uint8_t*)tss;
+    for (uint32_t i = 0; i < sizeof(*tss); i++) {
+        bytes[i] = 0;
+    }
+    tss->ss0 = GDT_KERNEL_DATA;
+    tss->iomap_base = sizeof(*tss);
+    
+    gdt_ptrs[cpu].limit = sizeof(gdt_tables[cpu]) - 1;
+    gdt_ptrs[cpu].base = (uint32_t)gdt;
+    
+    // Reload every segment register so none caches a bootloader descriptor
+    __asm__ __volatile__(
+        "lgdt %0\n"
+        "ljmp %1, $1f\n"
+        "1:\n"
+        "mov %2, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%ss\n"
+        "mov %3, %%ax\n"
+        "mov %%ax, %%gs\n"
+        : : "m"(gdt_ptrs[cpu]), "i"(GDT_KERNEL_CODE), "i"(GDT_KERNEL_DATA), "i"(GDT_PERCPU)
+        : "eax", "memory");
+    
+    __asm__ __volatile__("ltr %w0" : : "r"(GDT_TSS));
+}
+
+// Set the stack this CPU enters the kernel on from ring 3
+void gdt_set_kernel_stack(uint32_t esp0) {
+    tss_table[smp_cpu_id()].esp0 = esp0;
+}
+
+// Address of this CPU's TSS esp0 field
+uint32_t gdt_kernel_stack_slot() {
+    return (uint32_t)&tss_table[smp_cpu_id()].esp0;
+}
@@ -2,8 +2,23 @@
 // VGA Mode 13h (320x200, 256 colors)
 
 #include "graphics.h"
+#include "paging.h"
+#include "kmalloc.h"
 
-// Framebuffer pointer
+extern void print(const char* str);
+extern void print_dec(uint32_t num);
+extern void clear_screen();
+
+// Bytes in one Mode 13h frame
+#define FRAMEBUFFER_SIZE (GRAPHICS_WIDTH * GRAPHICS_HEIGHT)
+
+// Text-mode font saved from VGA plane 2 (256 glyphs, 32 bytes each)
+#define VGA_FONT_SIZE 8192
+
+// Frames blitted per memory type by graphics_benchmark
+#define FB_BENCH_FRAMES 64
+
+// Framebuffer pointer (identity mapping until graphics_init remaps it)
 static uint8_t* framebuffer = (uint8_t*)FRAMEBUFFER;
 
 // Minimal 8x8 font (only essential characters: 0-9, A-Z, space)
@@ -48,9 +63,13 @@ static const uint8_t font_8x8[37][8] = {
     {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00}, // Z (36)
 };
 
-// Initialize graphics mode
+// Initialize graphics mode (after paging_init)
 void graphics_init() {
-    // Graphics mode will be set on demand
+    // Graphics mode will be set on demand; only the mapping is set up here.
+    // Write-combining lets the CPU merge pixel stores into burst writes
+    // instead of sending each one to the card as an uncached transaction.
+    map_range(FRAMEBUFFER_VIRT, FRAMEBUFFER, FRAMEBUFFER_SIZE, PAGE_WRITE | PAGE_WC | PAGE_GLOBAL);
+    framebuffer = (uint8_t*)FRAMEBUFFER_VIRT;
 }
 
 // Port I/O functions
@@ -188,8 +207,19 @@ void graphics_set_text_mode() {
 
 // Clear screen with color
 void graphics_clear(uint8_t color) {
-    for (int i = 0; i < GRAPHICS_WIDTH * GRAPHICS_HEIGHT; i++) {
-        framebuffer[i] = color;
+    uint32_t* dst = (uint32_t*)framebuffer;
+    uint32_t pattern = color * 0x01010101u;
+    for (int i = 0; i < FRAMEBUFFER_SIZE / 4; i++) {
+        dst[i] = pattern;
+    }
+}
+
+// Copy a full frame to the screen with dword stores
+void graphics_blit(const uint8_t* frame) {
+    const uint32_t* src = (const uint32_t*)frame;
+    volatile uint32_t* dst = (volatile uint32_t*)framebuffer;
+    for (int i = 0; i < FRAMEBUFFER_SIZE / 4; i++) {
+        dst[i] = src[i];
     }
 }
 
@@ -297,3 +327,135 @@ void graphics_draw_string(int x, int y, const char* str, uint8_t color) {
         str++;
     }
 }
+
+// ============ Write-Combining Benchmark ============
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: drain the write-combining buffers (a locked instruction is a
+// full fence and does not need SSE like sfence does)
+static inline void wc_flush() {
+    __asm__ __volatile__("lock; addl $0, (%%esp)" : : : "memory", "cc");
+}
+
+// Helper: point the plane registers at font plane 2 (sequential access)
+static void font_plane_enter() {
+    outb(VGA_SEQ_INDEX, 0x02); outb(VGA_SEQ_DATA, 0x04);
+    outb(VGA_SEQ_INDEX, 0x04); outb(VGA_SEQ_DATA, 0x07);
+    outb(VGA_GC_INDEX, 0x04); outb(VGA_GC_DATA, 0x02);
+    outb(VGA_GC_INDEX, 0x05); outb(VGA_GC_DATA, 0x00);
+    outb(VGA_GC_INDEX, 0x06); outb(VGA_GC_DATA, 0x04);
+}
+
+// Helper: back to odd/even text-mode access
+static void font_plane_leave() {
+    outb(VGA_SEQ_INDEX, 0x02); outb(VGA_SEQ_DATA, 0x03);
+    outb(VGA_SEQ_INDEX, 0x04); outb(VGA_SEQ_DATA, 0x03);
+    outb(VGA_GC_INDEX, 0x04); outb(VGA_GC_DATA, 0x00);
+    outb(VGA_GC_INDEX, 0x05); outb(VGA_GC_DATA, 0x10);
+    outb(VGA_GC_INDEX, 0x06); outb(VGA_GC_DATA, 0x0E);
+}
+
+// Helper: copy the text-mode font out of (or back into) plane 2;
+// mode 13h overwrites it. Goes through the framebuffer window, which
+// must be mapped uncached so no store is still buffered when the plane
+// registers are switched back
+static void font_copy(uint8_t* font, int save) {
+    volatile uint8_t* plane = (volatile uint8_t*)framebuffer;
+    font_plane_enter();
+    for (int i = 0; i < VGA_FONT_SIZE; i++) {
+        if (save) {
+            font[i] = plane[i];
+        } else {
+            plane[i] = font[i];
+        }
+    }
+    font_plane_leave();
+}
+
+// Helper: remap the framebuffer window with a memory type
+// The first 4MB identity page also covers these frames (uncached under
+// the MTRRs), so the framebuffer is only ever accessed through this
+// window, never the identity alias. The old mapping is torn down and
+// caches and write-combining buffers written back first, so no store
+// made under the old type reaches the card after the switch
+static void map_framebuffer(uint32_t type) {
+    unmap_range(FRAMEBUFFER_VIRT, FRAMEBUFFER_SIZE);
+    __asm__ __volatile__("wbinvd" : : : "memory");
+    map_range(FRAMEBUFFER_VIRT, FRAMEBUFFER, FRAMEBUFFER_SIZE, PAGE_WRITE | type | PAGE_GLOBAL);
+}
+
+// Helper: average cycles to blit one frame
+static uint32_t time_blits(const uint8_t* frame) {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < FB_BENCH_FRAMES; i++) {
+        graphics_blit(frame);
+    }
+    wc_flush();
+    return (uint32_t)(rdtsc() - start) / FB_BENCH_FRAMES;
+}
+
+// Blit frames through an uncached and a write-combining mapping
+void graphics_benchmark() {
+    uint8_t* frame = (uint8_t*)kmalloc(FRAMEBUFFER_SIZE);
+    uint8_t* font = (uint8_t*)kmalloc(VGA_FONT_SIZE);
+    if (!frame || !font) {
+        print("fbbench: out of memory\n");
+        kfree(frame);
+        kfree(font);
+        return;
+    }
+    
+    // Diagonal colour bands
+    for (int y = 0; y < GRAPHICS_HEIGHT; y++) {
+        for (int x = 0; x < GRAPHICS_WIDTH; x++) {
+            frame[y * GRAPHICS_WIDTH + x] = (uint8_t)(x + y);
+        }
+    }
+    
+    map_framebuffer(PAGE_UC);
+    font_copy(font, 1);
+    graphics_set_mode_13h();
+    
+    uint32_t uc_cycles = time_blits(frame);
+    
+    map_framebuffer(PAGE_WC);
+    uint32_t wc_cycles = time_blits(frame);
+    
+    graphics_set_text_mode();
+    map_framebuffer(PAGE_UC);
+    font_copy(font, 0);
+    map_framebuffer(PAGE_WC);
+    kfree(font);
+    kfree(frame);
+    
+    // Text memory was overwritten while in mode 13h
+    clear_screen();
+    print("Framebuffer blit, ");
+    print_dec(FB_BENCH_FRAMES);
+    print(" frames of ");
+    print_dec(FRAMEBUFFER_SIZE);
+    print(" bytes");
+    if (!paging_has_pat()) {
+        print(" (no PAT: WC falls back to write-through)");
+    }
+    print("\n");
+    print("  Uncached:        ");
+    print_dec(uc_cycles);
+    print(" cycles/frame\n");
+    print("  Write-combining: ");
+    print_dec(wc_cycles);
+    print(" cycles/frame\n");
+    if (wc_cycles) {
+        uint32_t tenths = uc_cycles * 10 / wc_cycles;
+        print("  Speedup: ");
+        print_dec(tenths / 10);
+        print(".");
+        print_dec(tenths % 10);
+        print("x\n");
+    }
+}
@@ -2,10 +2,19 @@
 // Sets up interrupt descriptor table and exception handlers
 
 #include "idt.h"
+#include "vmm.h"
+#include "irq.h"
+#include "scheduler.h"
+#include "lapic.h"
+#include "fpu.h"
+#include "workqueue.h"
+#include "trace.h"
+#include "profile.h"
 
 // External print function from kernel.c
 extern void print(const char* str);
 extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
 extern void putchar(char c);
 
 // IDT entries array
@@ -64,6 +73,11 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 
+// External assembly local APIC vector handlers
+extern void apic_vector240();
+extern void apic_vector241();
+extern void apic_vector255();
+
 // External function to load IDT
 extern void idt_load(uint32_t);
 
@@ -117,12 +131,12 @@ void idt_init() {
     // Set up IDT pointer
     idtp.limit = (sizeof(struct idt_entry) * IDT_ENTRIES) - 1;
     idtp.base = (uint32_t)&idt;
-
+    
     // Clear IDT
     for (int i = 0; i < IDT_ENTRIES; i++) {
         idt_set_gate(i, 0, 0, 0);
     }
-
+    
     // Install ISRs for CPU exceptions (0-31)
     // Flags: 0x8E = Present, Ring 0, 32-bit Interrupt Gate
     idt_set_gate(0, (uint32_t)isr0, 0x08, 0x8E);
@@ -157,7 +171,7 @@ void idt_init() {
     idt_set_gate(29, (uint32_t)isr29, 0x08, 0x8E);
     idt_set_gate(30, (uint32_t)isr30, 0x08, 0x8E);
     idt_set_gate(31, (uint32_t)isr31, 0x08, 0x8E);
-
+    
     // Install IRQ handlers (32-47)
     idt_set_gate(32, (uint32_t)irq0, 0x08, 0x8E);
     idt_set_gate(33, (uint32_t)irq1, 0x08, 0x8E);
@@ -175,15 +189,50 @@ void idt_init() {
     idt_set_gate(45, (uint32_t)irq13, 0x08, 0x8E);
     idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
-
+    
+    // Local APIC vectors (SMP)
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint32_t)apic_vector240, 0x08, 0x8E);
+    idt_set_gate(LAPIC_RESCHED_VECTOR, (uint32_t)apic_vector241, 0x08, 0x8E);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint32_t)apic_vector255, 0x08, 0x8E);
+    
     // Load IDT
     idt_load((uint32_t)&idtp);
     
     print("IDT initialized with 32 exception handlers and 16 IRQ handlers\n");
 }
 
+// Load the IDT on an application processor (every CPU shares one table)
+void idt_init_cpu() {
+    idt_load((uint32_t)&idtp);
+}
+
 // Exception handler called from assembly
-void exception_handler(uint32_t int_no, uint32_t err_code) {
+void exception_handler(registers_t* regs) {
+    uint32_t int_no = regs->int_no;
+    
+    // Page faults on demand-paged regions are resolved and retried
+    if (int_no == 14 && vmm_handle_fault(regs) == 0) {
+        return;
+    }
+    
+    // Device-not-available: first FPU/SSE use since a switch (CR0.TS)
+    if (int_no == 7 && fpu_handle_trap() == 0) {
+        return;
+    }
+    
+    // A fault in ring 3 ends that task, not the system
+    if ((regs->cs & 3) == 3) {
+        print("\nUser task ");
+        print_dec(get_current_task_id());
+        print(" killed: ");
+        print(int_no < 32 ? exception_messages[int_no] : "Unknown Exception");
+        print(" at EIP ");
+        print_hex(regs->eip);
+        print("\n");
+        __asm__ __volatile__("sti");
+        task_exit();
+    }
+    
     print("\n!!! EXCEPTION !!!\n");
     print("Exception: ");
     
@@ -197,7 +246,17 @@ void exception_handler(uint32_t int_no, uint32_t err_code) {
     print_hex(int_no);
     
     print("\nError Code: ");
-    print_hex(err_code);
+    print_hex(regs->err_code);
+    
+    print("\nEIP: ");
+    print_hex(regs->eip);
+    
+    if (int_no == 14) {
+        uint32_t cr2;
+        __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+        print("\nFaulting Address: ");
+        print_hex(cr2);
+    }
     
     print("\n\nSystem Halted.\n");
     
@@ -208,12 +267,38 @@ void exception_handler(uint32_t int_no, uint32_t err_code) {
 }
 
 // IRQ handler called from assembly
-// External timer handler
-extern void timer_handler();
-extern void keyboard_handler();
-
-void irq_handler() {
-    // Just call keyboard handler directly
-    // (We only have keyboard IRQ enabled anyway)
-    keyboard_handler();
+// Legacy lines go through the registered handler chains (irq.c); the
+// local APIC vectors are the kernel's own
+void irq_handler(registers_t* regs) {
+    uint32_t int_no = regs->int_no;
+    trace_event(TRACE_IRQ_ENTRY, int_no, 0, 0);
+    
+    // The timer interrupts double as the profiler's sampling clock
+    if (int_no == IRQ_VECTOR_BASE || int_no == LAPIC_TIMER_VECTOR) {
+        profile_tick(regs);
+    }
+    
+    if (int_no >= IRQ_VECTOR_BASE && int_no < IRQ_VECTOR_BASE + IRQ_LINES) {
+        irq_dispatch(int_no - IRQ_VECTOR_BASE);
+    } else if (int_no == LAPIC_TIMER_VECTOR) {
+        // Application processors slice time on their local timer
+        lapic_eoi();
+        scheduler_tick();
+    } else if (int_no == LAPIC_RESCHED_VECTOR) {
+        lapic_eoi();
+        scheduler_ipi();
+    }
+    // LAPIC_SPURIOUS_VECTOR: not a real interrupt, no EOI
+    trace_event(TRACE_IRQ_EXIT, int_no, 0, 0);
+    
+    // Interrupted deferred work finishes before anything else runs here
+    if (softirq_active()) {
+        return;
+    }
+    
+    // Deferred work queued by the handler, with interrupts enabled
+    softirq_run();
+    
+    // A slice ran out or a higher-priority task woke: switch now
+    scheduler_irq_exit();
 }
@@ -0,0 +1,442 @@
+// IOAPIC Implementation
+// MADT parsing and redirection table programming for the legacy IRQ lines
+
+#include "ioapic.h"
+#include "irq.h"
+#include "lapic.h"
+#include "paging.h"
+#include "pic.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// Register window: write a register index to REGSEL, then use WIN
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WIN          0x10
+
+#define IOAPIC_REG_VER      0x01    // Bits 16-23: highest redirection entry
+#define IOAPIC_REG_REDTBL   0x10    // Two registers per pin, low dword first
+
+// Redirection entry, low dword (fixed delivery, physical destination)
+#define REDIR_ACTIVE_LOW    (1 << 13)
+#define REDIR_LEVEL         (1 << 15)
+#define REDIR_MASKED        (1 << 16)
+
+// MADT entry types
+#define MADT_IOAPIC         1
+#define MADT_OVERRIDE       2
+
+// Interrupt source override flags (polarity and trigger, 0 = bus default)
+#define INTI_POLARITY       0x3
+#define INTI_ACTIVE_LOW     0x3
+#define INTI_TRIGGER        0xC
+#define INTI_LEVEL          0xC
+
+// BIOS areas searched for the RSDP
+#define BDA_EBDA_SEGMENT    0x40E
+#define BIOS_ROM_START      0xE0000
+#define BIOS_ROM_END        0x100000
+
+// Tables outside the identity map are read through a window this big
+#define ACPI_WINDOW_SIZE    0x10000
+
+// ACPI table header (shared by the RSDT and MADT)
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// Root system description pointer (ACPI 1.0 part)
+typedef struct {
+    char signature[8];              // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    acpi_header_t header;
+    uint32_t lapic_base;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed)) madt_ioapic_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t bus;                    // 0: ISA
+    uint8_t source;                 // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed)) madt_override_t;
+
+typedef struct {
+    volatile uint32_t* regs;
+    uint32_t gsi_base;
+    uint32_t pins;
+} ioapic_t;
+
+// Where a legacy IRQ arrives and where it is delivered
+typedef struct {
+    uint32_t gsi;
+    uint32_t mode;                  // REDIR_LEVEL and REDIR_ACTIVE_LOW
+    uint32_t dest;                  // Local APIC ID
+    int enabled;
+} isa_route_t;
+
+static ioapic_t ioapics[IOAPIC_MAX];
+static uint32_t ioapic_count = 0;
+static isa_route_t isa_routes[IRQ_LINES];
+
+// REGSEL and WIN are a pair; every access holds this
+static spinlock_t ioapic_lock = SPINLOCK_INIT;
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint32_t ioapic_read(ioapic_t* io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WIN / 4];
+}
+
+static inline void ioapic_write(ioapic_t* io, uint32_t reg, uint32_t value) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WIN / 4] = value;
+}
+
+// ============ MADT discovery ============
+
+// Helper: Compare a table signature
+static int signature_is(const char* signature, const char* expected, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        if (signature[i] != expected[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Helper: ACPI checksums make the bytes of a table sum to zero
+static int checksum_ok(const void* table, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)table;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+// Helper: Make size bytes of physical memory readable
+// Tables in RAM are normally inside the identity map; anything else is
+// mapped into one window, so a pointer is only good until the next call
+static const void* acpi_map(uint32_t phys, uint32_t size) {
+    if (virt_to_phys(phys) == phys && virt_to_phys(phys + size - 1) == phys + size - 1) {
+        return (const void*)phys;
+    }
+    uint32_t offset = phys & 0xFFF;
+    if (size > ACPI_WINDOW_SIZE - offset) {
+        return 0;
+    }
+    map_range(ACPI_VIRT, phys - offset, offset + size, 0);
+    return (const void*)(ACPI_VIRT + offset);
+}
+
+// Helper: Search a BIOS area for the RSDP (on 16-byte boundaries)
+static const acpi_rsdp_t* find_rsdp(uint32_t start, uint32_t end) {
+    for (uint32_t addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+        const acpi_rsdp_t* rsdp = (const acpi_rsdp_t*)addr;
+        if (signature_is(rsdp->signature, "RSD PTR ", 8) &&
+            checksum_ok(rsdp, sizeof(acpi_rsdp_t))) {
+            return rsdp;
+        }
+    }
+    return 0;
+}
+
+// Helper: Physical address of the MADT (0 if there is none)
+// The 32-bit RSDT is enough here; ACPI 2.0 keeps it next to the XSDT
+static uint32_t find_madt() {
+    // The BDA sits in the first page, which the compiler takes for a null
+    // dereference when the address is a constant
+    uint32_t bda = BDA_EBDA_SEGMENT;
+    __asm__ __volatile__("" : "+r"(bda));
+    uint32_t ebda = (uint32_t)*(const volatile uint16_t*)bda << 4;
+    
+    const acpi_rsdp_t* rsdp = 0;
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        rsdp = find_rsdp(ebda, ebda + 1024);
+    }
+    if (!rsdp) {
+        rsdp = find_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+    }
+    if (!rsdp) {
+        return 0;
+    }
+    
+    uint32_t rsdt = rsdp->rsdt;
+    const acpi_header_t* header = acpi_map(rsdt, sizeof(acpi_header_t));
+    if (!header || !signature_is(header->signature, "RSDT", 4)) {
+        return 0;
+    }
+    uint32_t length = header->length;
+    header = length >= sizeof(acpi_header_t) ? acpi_map(rsdt, length) : 0;
+    if (!header || !checksum_ok(header, length)) {
+        return 0;
+    }
+    
+    // Each lookup reuses the window, so the RSDT is mapped again per entry
+    uint32_t entries = (length - sizeof(acpi_header_t)) / 4;
+    for (uint32_t i = 0; i < entries; i++) {
+        const uint32_t* entry = acpi_map(rsdt + sizeof(acpi_header_t) + i * 4, 4);
+        uint32_t table = entry ? *entry : 0;
+        header = table ? acpi_map(table, sizeof(acpi_header_t)) : 0;
+        if (header && signature_is(header->signature, "APIC", 4)) {
+            return table;
+        }
+    }
+    return 0;
+}
+
+// Helper: Record the IOAPICs and ISA overrides the MADT lists
+static void parse_madt(uint32_t madt_addr) {
+    const acpi_header_t* header = acpi_map(madt_addr, sizeof(acpi_header_t));
+    uint32_t length = header ? header->length : 0;
+    const acpi_madt_t* madt = length >= sizeof(acpi_madt_t) ? acpi_map(madt_addr, length) : 0;
+    if (!madt || !checksum_ok(madt, length)) {
+        print("IOAPIC: Bad MADT\n");
+        return;
+    }
+    
+    const uint8_t* entry = (const uint8_t*)(madt + 1);
+    const uint8_t* end = (const uint8_t*)madt + length;
+    while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end) {
+        if (entry[0] == MADT_IOAPIC && ioapic_count < IOAPIC_MAX) {
+            const madt_ioapic_t* info = (const madt_ioapic_t*)entry;
+            uint32_t virt = IOAPIC_VIRT + ioapic_count * 0x1000;
+            map_page(virt, info->address, PAGE_WRITE | PAGE_UC | PAGE_GLOBAL);
+            
+            ioapic_t* io = &ioapics[ioapic_count++];
+            io->regs = (volatile uint32_t*)virt;
+            io->gsi_base = info->gsi_base;
+            io->pins = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+            
+            print("IOAPIC at ");
+            print_hex(info->address);
+            print(": GSI ");
+            print_dec(io->gsi_base);
+            print("-");
+            print_dec(io->gsi_base + io->pins - 1);
+            print("\n");
+        } else if (entry[0] == MADT_OVERRIDE) {
+            const madt_override_t* override = (const madt_override_t*)entry;
+            if (override->bus == 0 && override->source < IRQ_LINES) {
+                isa_route_t* route = &isa_routes[override->source];
+                route->gsi = override->gsi;
+                route->mode = 0;
+                if ((override->flags & INTI_POLARITY) == INTI_ACTIVE_LOW) {
+                    route->mode |= REDIR_ACTIVE_LOW;
+                }
+                if ((override->flags & INTI_TRIGGER) == INTI_LEVEL) {
+                    route->mode |= REDIR_LEVEL;
+                }
+            }
+        }
+        entry += entry[1];
+    }
+}
+
+// ============ Redirection ============
+
+// Helper: The IOAPIC and pin serving a GSI
+static ioapic_t* ioapic_for(uint32_t gsi, uint32_t* pin) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        ioapic_t* io = &ioapics[i];
+        if (gsi >= io->gsi_base && gsi < io->gsi_base + io->pins) {
+            *pin = gsi - io->gsi_base;
+            return io;
+        }
+    }
+    return 0;
+}
+
+// Helper: Write a line's redirection entry from its route
+// The destination goes first, so an unmasked entry never points elsewhere
+static void ioapic_program(uint8_t irq) {
+    isa_route_t* route = &isa_routes[irq];
+    uint32_t pin;
+    ioapic_t* io = ioapic_for(route->gsi, &pin);
+    if (!io) {
+        return;
+    }
+    
+    uint32_t low = route->mode | (IRQ_VECTOR_BASE + irq);
+    if (!route->enabled) {
+        low |= REDIR_MASKED;
+    }
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(io, IOAPIC_REG_REDTBL + pin * 2 + 1, route->dest << 24);
+    ioapic_write(io, IOAPIC_REG_REDTBL + pin * 2, low);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+// Find the IOAPICs and mask every pin
+int ioapic_init() {
+    // ISA lines are edge-triggered and active high unless overridden
+    for (uint32_t irq = 0; irq < IRQ_LINES; irq++) {
+        isa_routes[irq].gsi = irq;
+        isa_routes[irq].mode = 0;
+        isa_routes[irq].dest = lapic_id();
+        isa_routes[irq].enabled = 0;
+    }
+    
+    uint32_t madt = find_madt();
+    if (!madt) {
+        print("IOAPIC: No ACPI MADT, interrupts stay on the 8259 PIC\n");
+        return -1;
+    }
+    parse_madt(madt);
+    if (ioapic_count == 0) {
+        print("IOAPIC: None listed, interrupts stay on the 8259 PIC\n");
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        for (uint32_t pin = 0; pin < ioapics[i].pins; pin++) {
+            ioapic_write(&ioapics[i], IOAPIC_REG_REDTBL + pin * 2, REDIR_MASKED);
+        }
+    }
+    return 0;
+}
+
+// Check whether ioapic_init found an IOAPIC
+int ioapic_present() {
+    return ioapic_count != 0;
+}
+
+// Route a legacy IRQ and unmask it
+void ioapic_unmask(uint8_t irq) {
+    isa_routes[irq].enabled = 1;
+    ioapic_program(irq);
+}
+
+// Mask a legacy IRQ
+void ioapic_mask(uint8_t irq) {
+    isa_routes[irq].enabled = 0;
+    ioapic_program(irq);
+}
+
+// Deliver a legacy IRQ to another CPU
+int ioapic_set_destination(uint8_t irq, uint32_t cpu) {
+    if (irq >= IRQ_LINES || !smp_cpu_online(cpu)) {
+        return -1;
+    }
+    isa_routes[irq].dest = smp_cpu_apic_id(cpu);
+    ioapic_program(irq);
+    return 0;
+}
+
+// ============ Benchmark ============
+
+#define EOI_BENCH_ROUNDS        1000
+#define LATENCY_BENCH_TICKS     100
+
+// Helper: Cycles per EOI write
+// Interrupts are off and nothing is in service, so the writes only cost
+// their bus cycle (port I/O against a memory-mapped register)
+static uint32_t eoi_cycles(int lapic) {
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < EOI_BENCH_ROUNDS; i++) {
+        if (lapic) {
+            lapic_eoi();
+        } else {
+            pic_send_eoi(0);
+        }
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start) / EOI_BENCH_ROUNDS;
+    irq_restore(flags);
+    return cycles;
+}
+
+// Helper: Timer interrupt latency on the controller in use
+static void print_latency(const char* name) {
+    uint32_t min_ns, avg_ns;
+    print(name);
+    if (timer_measure_latency(LATENCY_BENCH_TICKS, &min_ns, &avg_ns) != 0) {
+        print("no timer interrupts\n");
+        return;
+    }
+    print_dec(min_ns);
+    print(" ns min, ");
+    print_dec(avg_ns);
+    print(" ns avg\n");
+}
+
+// Compare EOI cost and timer interrupt latency, 8259 against the APICs
+void apic_benchmark() {
+    print("\nInterrupt controllers (");
+    print(irq_using_ioapic() ? "IOAPIC" : "8259 PIC");
+    print(" in use)\n");
+    
+    print("  EOI write:       8259 ");
+    print_dec(eoi_cycles(0));
+    print(" cycles");
+    if (lapic_available()) {
+        print(", local APIC ");
+        print_dec(eoi_cycles(1));
+        print(" cycles");
+    }
+    print("\n");
+    
+    // The PIT counts at 838ns, which is the resolution here
+    print("  Timer IRQ latency (PIT reload to handler, ");
+    print_dec(LATENCY_BENCH_TICKS);
+    print(" ticks):\n");
+    int was_ioapic = irq_using_ioapic();
+    irq_use_ioapic(0);
+    print_latency("    8259:    ");
+    if (ioapic_present()) {
+        irq_use_ioapic(1);
+        print_latency("    IOAPIC:  ");
+    } else {
+        print("    IOAPIC:  not present\n");
+    }
+    irq_use_ioapic(was_ioapic);
+    print("\n");
+}
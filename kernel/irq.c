@@ -0,0 +1,255 @@
+// IRQ Dispatch Implementation
+// Shared-line handler chains, spurious interrupt filtering and per-line cost
+
+#include "irq.h"
+#include "clock.h"
+#include "ioapic.h"
+#include "lapic.h"
+#include "pic.h"
+#include "spinlock.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// A registered handler
+typedef struct irq_action {
+    irq_handler_t handler;
+    void* ctx;
+    struct irq_action* next;
+} irq_action_t;
+
+// Chains only grow, and a node is complete before it is linked, so the
+// dispatcher walks them without a lock
+static irq_action_t irq_actions[IRQ_MAX_ACTIONS];
+static uint32_t irq_action_count = 0;
+static irq_action_t* volatile irq_chains[IRQ_LINES];
+static spinlock_t irq_lock = SPINLOCK_INIT;
+
+// Set once irq_use_ioapic moves the lines off the 8259s
+static volatile int irq_ioapic = 0;
+
+// A line stays in service until its EOI, which follows the whole chain,
+// so the same line never runs twice at once and the counters need no lock
+static irq_stats_t irq_stats[IRQ_LINES];
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: Unmask a line on the controller in use (irq_lock held)
+static void line_unmask(uint8_t irq) {
+    if (irq_ioapic) {
+        ioapic_unmask(irq);
+    } else {
+        pic_unmask(irq);
+    }
+}
+
+// Helper: Mask a line on the controller in use (irq_lock held)
+static void line_mask(uint8_t irq) {
+    if (irq_ioapic) {
+        ioapic_mask(irq);
+    } else {
+        pic_mask(irq);
+    }
+}
+
+// Helper: Check whether the local APIC delivered this interrupt
+// Always with the IOAPIC; with the 8259s only for one the IOAPIC latched
+// just before irq_use_ioapic switched back
+static int from_lapic(uint8_t irq) {
+    return irq_ioapic || (ioapic_present() && lapic_in_service(IRQ_VECTOR_BASE + irq));
+}
+
+// Add a handler to a line and unmask it
+int irq_register(uint8_t irq, irq_handler_t handler, void* ctx) {
+    if (irq >= IRQ_LINES || !handler) {
+        return -1;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&irq_lock);
+    if (irq_action_count >= IRQ_MAX_ACTIONS) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        print("IRQ: Handler table full\n");
+        return -1;
+    }
+    irq_action_t* action = &irq_actions[irq_action_count++];
+    action->handler = handler;
+    action->ctx = ctx;
+    action->next = 0;
+    __sync_synchronize();
+    
+    irq_action_t* volatile* link = &irq_chains[irq];
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = action;
+    
+    line_unmask(irq);
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return 0;
+}
+
+// Move every line with a handler between the 8259s and the IOAPIC
+int irq_use_ioapic(int enabled) {
+    enabled = enabled != 0;
+    if (enabled && !ioapic_present()) {
+        return -1;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&irq_lock);
+    if (enabled != irq_ioapic) {
+        for (uint8_t irq = 0; irq < IRQ_LINES; irq++) {
+            if (irq_chains[irq]) {
+                line_mask(irq);
+            }
+        }
+        
+        // An interrupt the 8259 raised just before the move to the IOAPIC
+        // was acknowledged to the local APIC; clear what it left in service
+        if (!enabled) {
+            for (uint32_t i = 0; i < IRQ_LINES && pic_read_isr(); i++) {
+                pic_send_eoi(8);
+            }
+        }
+        
+        irq_ioapic = enabled;
+        for (uint8_t irq = 0; irq < IRQ_LINES; irq++) {
+            if (irq_chains[irq]) {
+                line_unmask(irq);
+            }
+        }
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return 0;
+}
+
+// Check which controller delivers the lines
+int irq_using_ioapic() {
+    return irq_ioapic;
+}
+
+// Helper: Check whether IRQ 7 or 15 is real
+// The PIC raises its lowest-priority line when a request goes away before
+// the CPU acknowledges it; the in-service bit is then clear. A spurious
+// IRQ 15 still came through the master's cascade line, which did go into
+// service there and needs its EOI. (The local APIC has its own spurious
+// vector.)
+static int irq_spurious(uint8_t irq) {
+    if (irq != 7 && irq != 15) {
+        return 0;
+    }
+    if (from_lapic(irq) || (pic_read_isr() & (1 << irq))) {
+        return 0;
+    }
+    if (irq == 15) {
+        pic_send_eoi(2);
+    }
+    return 1;
+}
+
+// Helper: Histogram bucket for a handler run time
+static uint32_t irq_bucket(uint32_t cycles) {
+    uint32_t scaled = cycles >> IRQ_HIST_SHIFT;
+    uint32_t bucket = 0;
+    while (scaled && bucket < IRQ_HIST_BUCKETS - 1) {
+        scaled >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Run the handlers for a line and acknowledge it
+void irq_dispatch(uint8_t irq) {
+    irq_stats_t* stats = &irq_stats[irq];
+    if (irq_spurious(irq)) {
+        stats->spurious++;
+        return;
+    }
+    
+    uint64_t start = rdtsc();
+    int handled = 0;
+    for (irq_action_t* action = irq_chains[irq]; action; action = action->next) {
+        handled |= action->handler(action->ctx);
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    
+    if (from_lapic(irq)) {
+        lapic_eoi();
+    } else {
+        pic_send_eoi(irq);
+    }
+    
+    stats->count++;
+    if (!handled) {
+        stats->unhandled++;
+    }
+    stats->total_cycles += cycles;
+    if (cycles > stats->max_cycles) {
+        stats->max_cycles = cycles;
+    }
+    stats->hist[irq_bucket(cycles)]++;
+}
+
+// Get a line's statistics
+const irq_stats_t* irq_get_stats(uint8_t irq) {
+    return irq < IRQ_LINES ? &irq_stats[irq] : 0;
+}
+
+// Print per-line counts and handler cost
+void irq_dump() {
+    print("\nIRQ lines via the ");
+    print(irq_ioapic ? "IOAPIC" : "8259 PIC");
+    print(" (handler cost in cycles):\n");
+    print("  IRQ  Handlers  Count\tSpurious  Unhandled  Avg\tMax\n");
+    
+    for (uint32_t irq = 0; irq < IRQ_LINES; irq++) {
+        const irq_stats_t* stats = &irq_stats[irq];
+        uint32_t handlers = 0;
+        for (irq_action_t* action = irq_chains[irq]; action; action = action->next) {
+            handlers++;
+        }
+        if (!handlers && !stats->count && !stats->spurious) {
+            continue;
+        }
+        
+        print(irq < 10 ? "   " : "  ");
+        print_dec(irq);
+        print("   ");
+        print_dec(handlers);
+        print("         ");
+        print_dec(stats->count);
+        print("\t");
+        print_dec(stats->spurious);
+        print("\t    ");
+        print_dec(stats->unhandled);
+        print("\t       ");
+        print_dec(div_u64_u32(stats->total_cycles, stats->count));
+        print("\t");
+        print_dec(stats->max_cycles);
+        print("\n");
+    }
+    
+    // Bucket n: under 2^(9 + n) cycles, so the columns are 512 .. 32K
+    print("\n  Run time    <512  <1K   <2K   <4K   <8K   <16K  <32K  more\n");
+    for (uint32_t irq = 0; irq < IRQ_LINES; irq++) {
+        const irq_stats_t* stats = &irq_stats[irq];
+        if (!stats->count) {
+            continue;
+        }
+        print("  IRQ ");
+        print_dec(irq);
+        print(irq < 10 ? "       " : "      ");
+        for (uint32_t b = 0; b < IRQ_HIST_BUCKETS; b++) {
+            uint32_t n = stats->hist[b];
+            print_dec(n);
+            print(n < 10 ? "     " : n < 100 ? "    " : n < 1000 ? "   " : n < 10000 ? "  " : " ");
+        }
+        print("\n");
+    }
+    print("\n");
+}
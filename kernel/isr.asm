@@ -89,6 +89,21 @@ IRQ 13, 45      ; FPU / Coprocessor
 IRQ 14, 46      ; Primary ATA
 IRQ 15, 47      ; Secondary ATA
 
+; Local APIC vectors (SMP)
+; Same path as the IRQs; the handler EOIs the local APIC instead of the PIC
+%macro APIC_VECTOR 1
+    global _apic_vector%1
+    _apic_vector%1:
+        cli
+        push dword 0            ; Dummy error code
+        push dword %1           ; Interrupt number
+        jmp irq_common_stub
+%endmacro
+
+APIC_VECTOR 240     ; Local timer
+APIC_VECTOR 241     ; Reschedule IPI
+APIC_VECTOR 255     ; Spurious
+
 ; Common ISR stub
 ; Saves processor state, calls C handler, restores state
 isr_common_stub:
@@ -101,19 +116,23 @@ isr_common_stub:
     push fs
     push gs
     
-    ; Load kernel data segment
+    ; Load kernel data segments and the per-CPU GS (smp.h): a user task
+    ; may have left anything in them. The pops below restore what was
+    ; interrupted; a kernel task's GS is reloaded from the GDT of whichever
+    ; CPU irets, so a migrated task gets the right base
     mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, 0x28
     mov gs, ax
     
-    ; Push stack pointer (contains register state)
+    ; Push stack pointer (points at the saved registers_t)
     mov eax, esp
     push eax
     
     ; Call C exception handler
-    ; Arguments: interrupt number, error code (already on stack)
+    ; Argument: registers_t* with interrupt number and error code
     call _exception_handler
     
     ; Clean up pushed arguments
@@ -136,6 +155,9 @@ isr_common_stub:
 
 ; Common IRQ stub
 ; Similar to ISR stub but calls IRQ handler
+; The saved frame stays on the interrupted task's stack; if the timer
+; handler switches tasks, this stub finishes (and irets) only when the
+; task is scheduled again
 extern _irq_handler
 
 irq_common_stub:
@@ -148,16 +170,28 @@ irq_common_stub:
     push fs
     push gs
     
-    ; Load kernel data segment
+    ; Load kernel data segments and the per-CPU GS (smp.h): a user task
+    ; may have left anything in them. The pops below restore what was
+    ; interrupted; a kernel task's GS is reloaded from the GDT of whichever
+    ; CPU irets, so a migrated task gets the right base
     mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, 0x28
     mov gs, ax
     
+    ; Push stack pointer (points at the saved registers_t)
+    mov eax, esp
+    push eax
+    
     ; Call C IRQ handler (cdecl calling convention)
+    ; Argument: registers_t* with the interrupt number
     call _irq_handler
     
+    ; Clean up pushed arguments
+    pop eax
+    
     ; Restore segment registers
     pop gs
     pop fs
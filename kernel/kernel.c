@@ -4,12 +4,25 @@
 #include "idt.h"
 #include "pic.h"
 #include "timer.h"
+#include "clock.h"
+#include "serial.h"
 #include "pmm.h"
+#include "kmalloc.h"
 #include "paging.h"
+#include "vmm.h"
 #include "keyboard.h"
 #include "shell.h"
 #include "scheduler.h"
 #include "fs.h"
+#include "graphics.h"
+#include "smp.h"
+#include "fpu.h"
+#include "workqueue.h"
+#include "syscall.h"
+#include "lapic.h"
+#include "ioapic.h"
+#include "irq.h"
+#include "spinlock.h"
 
 // VGA text mode constants
 #define VGA_MEMORY 0xB8000
@@ -22,6 +35,9 @@ static unsigned short* vga_buffer = (unsigned short*)VGA_MEMORY;
 static unsigned int cursor_x = 0;
 static unsigned int cursor_y = 0;
 
+// Console output from several CPUs (one character at a time)
+static spinlock_t console_lock = SPINLOCK_INIT;
+
 // Port I/O functions
 static inline void outb(unsigned short port, unsigned char value) {
     __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
@@ -60,6 +76,8 @@ void clear_screen() {
 // Function: putchar
 // Prints a single character to the screen
 void putchar(char c) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    
     if (c == '\n') {
         cursor_x = 0;
         cursor_y++;
@@ -96,6 +114,8 @@ void putchar(char c) {
     
     // Update hardware cursor - DISABLED FOR TESTING
     // update_cursor();
+    
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 // Function: print
@@ -117,26 +137,94 @@ void print_hex(unsigned int num) {
     }
 }
 
+// Function: print_dec
+// Prints an unsigned decimal number
+void print_dec(unsigned int num) {
+    char digits[10];
+    int count = 0;
+    
+    do {
+        digits[count++] = '0' + (num % 10);
+        num /= 10;
+    } while (num != 0);
+    
+    while (count > 0) {
+        putchar(digits[--count]);
+    }
+}
+
 // Kernel main entry point
-void kmain() {
+// boot_map: E820 map from the bootloader (entry count, then entries)
+void kmain(uint32_t* boot_map) {
     // Clear the screen
     clear_screen();
     
     // Print welcome message
     print("CoreX OS v3.0\n\n");
     
+    // Per-CPU GDT for the bootstrap processor (GS points at its cpu_t)
+    smp_early_init();
+    
     // Initialize IDT
     idt_init();
     
     // Initialize PIC
     pic_init();
     
+    // Initialize physical memory manager from the bootloader's E820 map
+    pmm_init((const e820_entry_t*)(boot_map + 1), boot_map[0]);
+    
+    // Enable paging (identity map of RAM with 4MB global pages)
+    paging_init();
+    
+    // Initialize demand-paged kernel regions
+    vmm_init();
+    
+    // Map the VGA framebuffer write-combining
+    graphics_init();
+    
+    // Initialize kernel heap (slab caches on top of the PMM)
+    kmalloc_init();
+    
+    // Enable SSE; save areas come from the heap (before SMP: APs copy CR4)
+    fpu_init();
+    
+    // User segments are in the GDT; add the int 0x80 gate and SYSENTER
+    syscall_init();
+    
+    // Initialize scheduler (the boot thread becomes task 0, the shell)
+    scheduler_init();
+    
+    // In-memory file system (slab-allocated files behind a mutex)
+    fs_init();
+    
+    // Start the system worker thread for deferred work
+    workqueue_init();
+    
+    // Start the system tick that drives preemption
+    timer_init(TIMER_HZ);
+    
+    // Calibrate the TSC against the PIT for nanosecond timestamps
+    clock_init();
+    
+    // COM1 carries trace dumps off the machine
+    serial_init();
+    
     // Initialize keyboard
     keyboard_init();
     
+    // Move the interrupt lines from the 8259s to the IOAPIC when the ACPI
+    // MADT lists one (the 8259s keep them otherwise)
+    if (lapic_init() == 0 && ioapic_init() == 0) {
+        irq_use_ioapic(1);
+    }
+    
     // Enable interrupts
     __asm__ __volatile__("sti");
     
+    // Start the other CPUs, each with its own idle task and run queue
+    smp_init();
+    
     // Initialize and run shell
     shell_init();
     shell_run();
@@ -1,9 +1,9 @@
 ; CoreX Kernel Entry Point (32-bit Protected Mode)
-; Loaded at 0x1000 by the bootloader
+; Loaded at 0x10000 by the bootloader
 ; Runs in 32-bit protected mode
 
 [BITS 32]
-[ORG 0x1000]
+[ORG 0x10000]
 
 ; VGA text mode constants
 VIDEO_MEMORY equ 0xB8000
@@ -21,6 +21,8 @@ _start:
     mov esp, ebp
     
     ; Call C kernel main function
+    ; EBX = E820 memory map left by the bootloader
+    push ebx
     call _kmain
     
     ; If kmain returns (it shouldn't), halt
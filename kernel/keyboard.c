@@ -2,7 +2,11 @@
 // Scancode to ASCII conversion with shift support
 
 #include "keyboard.h"
-#include "pic.h"
+#include "irq.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "sync.h"
+#include "workqueue.h"
 
 // External print functions
 extern void print(const char* str);
@@ -20,6 +24,28 @@ static char keyboard_buffer[KEYBOARD_BUFFER_SIZE];
 static int buffer_read = 0;
 static int buffer_write = 0;
 
+// Arrival time (TSC) of each buffered character, for echo latency
+static uint64_t buffer_stamps[KEYBOARD_BUFFER_SIZE];
+static uint64_t last_stamp = 0;
+
+// Raw scancodes from the interrupt handler, translated in softirq context
+// One interrupt handler at a time produces; keyboard_lock serializes the
+// softirq consumers
+#define SCANCODE_RING_SIZE 64
+static uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static uint64_t scancode_stamps[SCANCODE_RING_SIZE];
+static volatile uint32_t scancode_head = 0;
+static volatile uint32_t scancode_tail = 0;
+static work_t keyboard_work;
+static void keyboard_process(void* arg);
+static int keyboard_handler(void* ctx);
+
+// Tasks blocked in keyboard_wait_char
+static wait_queue_t readers = WAIT_QUEUE_INIT;
+
+// Buffer (the IRQ arrives on one CPU, the reader may be on another)
+static spinlock_t keyboard_lock = SPINLOCK_INIT;
+
 // I/O port operations
 static inline uint8_t inb(uint16_t port) {
     uint8_t ret;
@@ -27,6 +53,12 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 // US QWERTY scancode to ASCII table (without shift)
 static const char scancode_to_ascii[] = {
     0,   0,   '1', '2', '3', '4', '5', '6',     // 0x00-0x07
@@ -65,51 +97,118 @@ void keyboard_init() {
     caps_lock = 0;
     ctrl_pressed = 0;
     alt_pressed = 0;
+    work_init(&keyboard_work, keyboard_process, 0);
+    irq_register(1, keyboard_handler, 0);
     
     print("Keyboard driver initialized\n");
 }
 
-// Add character to buffer
-static void keyboard_buffer_add(char c) {
+// Add character to buffer (keyboard_lock held)
+// stamp is when its interrupt arrived
+static int keyboard_buffer_add(char c, uint64_t stamp) {
     int next = (buffer_write + 1) % KEYBOARD_BUFFER_SIZE;
-    if (next != buffer_read) {
-        keyboard_buffer[buffer_write] = c;
-        buffer_write = next;
+    if (next == buffer_read) {
+        return 0;
     }
+    keyboard_buffer[buffer_write] = c;
+    buffer_stamps[buffer_write] = stamp;
+    buffer_write = next;
+    return 1;
 }
 
-// Keyboard interrupt handler - USE BUFFER
-void keyboard_handler() {
-    uint8_t scancode = inb(KEYBOARD_DATA_PORT);
+// Helper: Softirq work: translate queued scancodes into the buffer
+static void keyboard_process(void* arg) {
+    (void)arg;
+    int added = 0;
     
-    // Only handle key presses (not releases)
-    if (!(scancode & 0x80)) {
-        // Convert scancode to ASCII (simple version)
-        if (scancode < sizeof(scancode_to_ascii)) {
+    uint32_t flags = spin_lock_irqsave(&keyboard_lock);
+    while (scancode_tail != scancode_head) {
+        uint8_t scancode = scancode_ring[scancode_tail];
+        uint64_t stamp = scancode_stamps[scancode_tail];
+        scancode_tail = (scancode_tail + 1) % SCANCODE_RING_SIZE;
+        
+        // Only handle key presses (not releases)
+        if (!(scancode & 0x80) && scancode < sizeof(scancode_to_ascii)) {
             char ascii = scancode_to_ascii[scancode];
             if (ascii != 0) {
-                // Add to buffer (NOT direct putchar!)
-                keyboard_buffer_add(ascii);
+                added |= keyboard_buffer_add(ascii, stamp);
             }
         }
     }
+    spin_unlock_irqrestore(&keyboard_lock, flags);
     
-    // Send EOI to PIC
-    pic_send_eoi(1);
+    // A reader queues itself before dropping keyboard_lock, so it is
+    // either on the queue by now or will find the character
+    if (added) {
+        wait_queue_wake_one(&readers);
+    }
 }
 
-// Get character from buffer (non-blocking)
-char keyboard_getchar() {
+// Keyboard interrupt handler (IRQ 1)
+// Only reads the scancode; translation runs on the way out of the
+// interrupt with interrupts enabled
+static int keyboard_handler(void* ctx) {
+    (void)ctx;
+    uint8_t scancode = inb(KEYBOARD_DATA_PORT);
+    
+    uint32_t next = (scancode_head + 1) % SCANCODE_RING_SIZE;
+    if (next != scancode_tail) {
+        scancode_ring[scancode_head] = scancode;
+        scancode_stamps[scancode_head] = rdtsc();
+        scancode_head = next;
+    }
+    softirq_queue(&keyboard_work);
+    return IRQ_HANDLED;
+}
+
+// Helper: Take the next character from the buffer (keyboard_lock held)
+static char buffer_take() {
     if (buffer_read == buffer_write) {
         return 0;  // No character available
     }
     
     char c = keyboard_buffer[buffer_read];
+    last_stamp = buffer_stamps[buffer_read];
     buffer_read = (buffer_read + 1) % KEYBOARD_BUFFER_SIZE;
     return c;
 }
 
+// Get character from buffer (non-blocking)
+char keyboard_getchar() {
+    uint32_t flags = spin_lock_irqsave(&keyboard_lock);
+    char c = buffer_take();
+    spin_unlock_irqrestore(&keyboard_lock, flags);
+    return c;
+}
+
+// Get character from buffer, blocking until one arrives
+char keyboard_wait_char() {
+    while (1) {
+        uint32_t flags = spin_lock_irqsave(&keyboard_lock);
+        if (buffer_read != buffer_write) {
+            char c = buffer_take();
+            spin_unlock_irqrestore(&keyboard_lock, flags);
+            return c;
+        }
+        
+        // Queued under the lock, so the interrupt's wakeup cannot be missed
+        if (task_current()) {
+            wait_queue_wait(&readers, &keyboard_lock);
+            spin_unlock_irqrestore(&keyboard_lock, flags);
+        } else {
+            // No scheduler: wait for the next interrupt instead
+            spin_unlock_irqrestore(&keyboard_lock, flags);
+            __asm__ __volatile__("hlt");
+        }
+    }
+}
+
 // Check if character is available
 int keyboard_available() {
     return buffer_read != buffer_write;
 }
+
+// Get the TSC value at which the last character returned arrived
+uint64_t keyboard_last_stamp() {
+    return last_stamp;
+}
@@ -0,0 +1,518 @@
+// Kernel Heap Implementation
+// Slab caches built on pmm_alloc() / pmm_alloc_order()
+
+#include "kmalloc.h"
+#include "buddy.h"
+#include "clock.h"
+#include "pmm.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_dec(unsigned int num);
+
+#define SLAB_MAGIC  0x51AB51AB      // Slab header
+#define LARGE_MAGIC 0x1A26E000      // Page-sized kmalloc block header
+
+// Slab header, stored at the start of the slab
+// Slabs are naturally aligned (buddy blocks), so an object's slab is
+// found by masking its address with the slab size
+struct kmem_slab {
+    uint32_t magic;
+    kmem_cache_t* cache;
+    kmem_slab_t* next;
+    kmem_slab_t* prev;
+    void* free_list;                // Free objects, linked through their first word
+    uint32_t in_use;
+};
+
+// Header of a kmalloc block too large for the size classes
+typedef struct {
+    uint32_t magic;
+    uint32_t order;                 // Block is 2^order pages
+    uint32_t size;                  // Bytes requested
+    uint32_t reserved;              // Keeps the payload 16-byte aligned
+} large_header_t;
+
+// Objects start at this offset into the slab (keeps them 16-byte aligned)
+#define SLAB_OBJECTS_OFFSET 32
+
+// Cache storage and the kmalloc size classes
+static kmem_cache_t caches[KMEM_MAX_CACHES];
+static uint32_t cache_count = 0;
+static spinlock_t caches_lock = SPINLOCK_INIT;     // Cache creation
+static kmem_cache_t* size_classes[KMALLOC_CLASSES];
+
+// Large allocation statistics
+static uint32_t large_active = 0;
+static uint32_t large_pages = 0;
+
+static const char* class_names[KMALLOC_CLASSES] = {
+    "kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+// Helper: Read the CPU timestamp counter
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: Unlink a slab from a doubly linked list
+static void slab_unlink(kmem_slab_t** head, kmem_slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = 0;
+    slab->prev = 0;
+}
+
+// Helper: Push a slab onto the front of a list
+static void slab_push(kmem_slab_t** head, kmem_slab_t* slab) {
+    slab->prev = 0;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+// Helper: Get 2^order pages for a slab or large block
+static uint32_t alloc_pages(uint32_t order) {
+    return order == 0 ? pmm_alloc() : pmm_alloc_order(order);
+}
+
+// Helper: Return pages obtained with alloc_pages
+static void free_pages(uint32_t addr, uint32_t order) {
+    if (order == 0) {
+        pmm_free(addr);
+    } else {
+        pmm_free_order(addr, order);
+    }
+}
+
+// Helper: Allocate and format a new slab for a cache
+static kmem_slab_t* slab_create(kmem_cache_t* cache) {
+    uint32_t addr = alloc_pages(cache->slab_order);
+    if (addr == 0) {
+        return 0;
+    }
+    
+    kmem_slab_t* slab = (kmem_slab_t*)addr;
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->next = 0;
+    slab->prev = 0;
+    slab->in_use = 0;
+    
+    // Thread every object onto the free list
+    uint8_t* object = (uint8_t*)addr + SLAB_OBJECTS_OFFSET;
+    slab->free_list = object;
+    for (uint32_t i = 0; i + 1 < cache->objects_per_slab; i++) {
+        *(void**)object = object + cache->object_size;
+        object += cache->object_size;
+    }
+    *(void**)object = 0;
+    
+    cache->slab_count++;
+    return slab;
+}
+
+// Helper: Give an empty slab back to the PMM
+static void slab_destroy(kmem_cache_t* cache, kmem_slab_t* slab) {
+    slab->magic = 0;
+    cache->slab_count--;
+    free_pages((uint32_t)slab, cache->slab_order);
+}
+
+// Helper: Create a cache with slabs of at most 2^max_order pages
+// Picks the smallest slab order that wastes at most 1/8 of the slab
+static kmem_cache_t* cache_create(const char* name, uint32_t size, uint32_t max_order) {
+    // Room for the free-list link, rounded to keep objects 16-byte aligned
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    if (size >= 16) {
+        size = (size + 15) & ~15u;
+    }
+    
+    uint32_t order = 0;
+    while (order < max_order) {
+        uint32_t slab_bytes = PAGE_SIZE << order;
+        uint32_t usable = slab_bytes - SLAB_OBJECTS_OFFSET;
+        if (usable >= size && usable % size <= slab_bytes / 8) {
+            break;
+        }
+        order++;
+    }
+    
+    uint32_t objects = ((PAGE_SIZE << order) - SLAB_OBJECTS_OFFSET) / size;
+    if (objects == 0) {
+        print("Heap: Object too large for a cache\n");
+        return 0;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&caches_lock);
+    if (cache_count >= KMEM_MAX_CACHES) {
+        spin_unlock_irqrestore(&caches_lock, flags);
+        print("Heap: Too many caches\n");
+        return 0;
+    }
+    kmem_cache_t* cache = &caches[cache_count++];
+    spin_unlock_irqrestore(&caches_lock, flags);
+    
+    spin_init(&cache->lock);
+    cache->name = name;
+    cache->object_size = size;
+    cache->slab_order = order;
+    cache->objects_per_slab = objects;
+    cache->partial = 0;
+    cache->full = 0;
+    cache->spare = 0;
+    cache->active_objects = 0;
+    cache->slab_count = 0;
+    cache->alloc_count = 0;
+    cache->free_count = 0;
+    
+    return cache;
+}
+
+// Create a cache for objects of a fixed size
+kmem_cache_t* kmem_cache_create(const char* name, uint32_t size) {
+    return cache_create(name, size, KMEM_MAX_SLAB_ORDER);
+}
+
+// Initialize the kernel heap
+void kmalloc_init() {
+    // Single-page slabs, so kfree finds any object's slab from its page
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        size_classes[i] = cache_create(class_names[i], 1u << (i + KMALLOC_MIN_SHIFT), 0);
+    }
+    
+    print("Kernel heap initialized (");
+    print_dec(KMALLOC_CLASSES);
+    print(" size classes)\n");
+}
+
+// Allocate an object from a cache
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    
+    kmem_slab_t* slab = cache->partial;
+    if (!slab) {
+        // No partial slab - use the spare or grow the cache
+        slab = cache->spare ? cache->spare : slab_create(cache);
+        cache->spare = 0;
+        if (!slab) {
+            spin_unlock_irqrestore(&cache->lock, flags);
+            print("Heap: Out of memory\n");
+            return 0;
+        }
+        slab_push(&cache->partial, slab);
+    }
+    
+    void* object = slab->free_list;
+    slab->free_list = *(void**)object;
+    slab->in_use++;
+    
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_unlink(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+    
+    cache->active_objects++;
+    cache->alloc_count++;
+    
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return object;
+}
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    uint32_t slab_bytes = PAGE_SIZE << cache->slab_order;
+    kmem_slab_t* slab = (kmem_slab_t*)((uint32_t)object & ~(slab_bytes - 1));
+    
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        print("Heap: Invalid free\n");
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_unlink(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+    
+    *(void**)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    cache->active_objects--;
+    cache->free_count++;
+    
+    // Keep one empty slab around, return any others to the PMM
+    if (slab->in_use == 0) {
+        slab_unlink(&cache->partial, slab);
+        if (cache->spare) {
+            slab_destroy(cache, slab);
+        } else {
+            cache->spare = slab;
+        }
+    }
+    
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+// General-purpose allocation
+void* kmalloc(uint32_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    
+    // Round up to the next size class
+    if (size <= (1u << KMALLOC_MAX_SHIFT)) {
+        uint32_t index = 0;
+        while ((1u << (index + KMALLOC_MIN_SHIFT)) < size) {
+            index++;
+        }
+        return kmem_cache_alloc(size_classes[index]);
+    }
+    
+    // Too large for a slab: whole pages with a header in front, up to the
+    // largest buddy block (checked first so the sums below cannot wrap)
+    if (size > (PAGE_SIZE << BUDDY_MAX_ORDER) - sizeof(large_header_t)) {
+        return 0;
+    }
+    uint32_t order = 0;
+    while ((uint32_t)(PAGE_SIZE << order) < size + sizeof(large_header_t)) {
+        order++;
+    }
+    
+    uint32_t addr = alloc_pages(order);
+    if (addr == 0) {
+        return 0;
+    }
+    
+    large_header_t* header = (large_header_t*)addr;
+    header->magic = LARGE_MAGIC;
+    header->order = order;
+    header->size = size;
+    
+    __sync_fetch_and_add(&large_active, 1);
+    __sync_fetch_and_add(&large_pages, 1u << order);
+    
+    return header + 1;
+}
+
+// Free memory returned by kmalloc
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    
+    // kmalloc_init caps the size-class slabs at one page, and large blocks
+    // keep their header in the first page, so the page start identifies
+    // either kind
+    uint32_t page = (uint32_t)ptr & ~(PAGE_SIZE - 1);
+    
+    if (((kmem_slab_t*)page)->magic == SLAB_MAGIC) {
+        kmem_cache_free(((kmem_slab_t*)page)->cache, ptr);
+    } else if (((large_header_t*)page)->magic == LARGE_MAGIC &&
+               ptr == (large_header_t*)page + 1) {
+        large_header_t* header = (large_header_t*)page;
+        uint32_t order = header->order;
+        header->magic = 0;
+        __sync_fetch_and_sub(&large_active, 1);
+        __sync_fetch_and_sub(&large_pages, 1u << order);
+        free_pages(page, order);
+    } else {
+        print("Heap: Invalid kfree\n");
+    }
+}
+
+// Print per-cache usage statistics
+void kmalloc_dump() {
+    print("\nSlab caches:\n");
+    print("  Name            Size   Active/Total  Slabs  Allocs  Frees\n");
+    
+    for (uint32_t i = 0; i < cache_count; i++) {
+        kmem_cache_t* cache = &caches[i];
+        int len = 0;
+        while (cache->name[len]) len++;
+        
+        print("  ");
+        print(cache->name);
+        for (int j = len; j < 16; j++) print(" ");
+        print_dec(cache->object_size);
+        print("\t ");
+        print_dec(cache->active_objects);
+        print("/");
+        print_dec(cache->slab_count * cache->objects_per_slab);
+        print("\t");
+        print_dec(cache->slab_count);
+        print("\t");
+        print_dec(cache->alloc_count);
+        print("\t");
+        print_dec(cache->free_count);
+        print("\n");
+    }
+    
+    print("  Large blocks: ");
+    print_dec(large_active);
+    print(" (");
+    print_dec(large_pages);
+    print(" pages)\n\n");
+}
+
+// ============ Benchmark ============
+
+#define BENCH_SLOTS     256     // Live allocations tracked by the workload
+#define BENCH_OPS       8192    // Alloc/free operations per run
+#define ARENA_SIZE      (512 * 1024)   // Room for every slot at 2KB
+
+// Naive first-fit allocator over a fixed arena, for comparison
+// Every block has a header; allocation walks the list from the start
+typedef struct ff_block {
+    uint32_t size;                  // Payload bytes
+    uint32_t free;
+    struct ff_block* next;
+    uint32_t reserved;
+} ff_block_t;
+
+static ff_block_t* ff_head = 0;
+
+// Helper: Reset the first-fit arena to one free block
+static void ff_init(void* arena, uint32_t size) {
+    ff_head = (ff_block_t*)arena;
+    ff_head->size = size - sizeof(ff_block_t);
+    ff_head->free = 1;
+    ff_head->next = 0;
+}
+
+// Helper: First-fit allocation, splitting the block it lands on
+static void* ff_alloc(uint32_t size) {
+    size = (size + 15) & ~15u;
+    for (ff_block_t* block = ff_head; block; block = block->next) {
+        if (!block->free || block->size < size) {
+            continue;
+        }
+        if (block->size >= size + sizeof(ff_block_t) + 16) {
+            ff_block_t* rest = (ff_block_t*)((uint8_t*)(block + 1) + size);
+            rest->size = block->size - size - sizeof(ff_block_t);
+            rest->free = 1;
+            rest->next = block->next;
+            block->next = rest;
+            block->size = size;
+        }
+        block->free = 0;
+        return block + 1;
+    }
+    return 0;
+}
+
+// Helper: First-fit free, merging with the following block if free
+static void ff_free(void* ptr) {
+    ff_block_t* block = (ff_block_t*)ptr - 1;
+    block->free = 1;
+    while (block->next && block->next->free) {
+        block->size += block->next->size + sizeof(ff_block_t);
+        block->next = block->next->next;
+    }
+}
+
+// Helper: Small LCG for the workload
+static uint32_t bench_random(uint32_t* state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+// Helper: Run the workload against one allocator, returning cycles per op
+static uint32_t bench_run(int first_fit, uint32_t* failures) {
+    static void* slots[BENCH_SLOTS];
+    uint32_t seed = 0xC0FFEE11;
+    uint32_t ops = 0;
+    *failures = 0;
+    
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        slots[i] = 0;
+    }
+    
+    uint64_t start = rdtsc();
+    
+    for (int op = 0; op < BENCH_OPS; op++) {
+        uint32_t slot = bench_random(&seed) % BENCH_SLOTS;
+        if (slots[slot]) {
+            if (first_fit) {
+                ff_free(slots[slot]);
+            } else {
+                kfree(slots[slot]);
+            }
+            slots[slot] = 0;
+        } else {
+            // Sizes 8-2048 bytes (every size class), skewed towards
+            // small objects
+            uint32_t size = 8u << (bench_random(&seed) % KMALLOC_CLASSES);
+            size -= bench_random(&seed) % (size / 2);
+            slots[slot] = first_fit ? ff_alloc(size) : kmalloc(size);
+            if (!slots[slot]) {
+                (*failures)++;
+                continue;
+            }
+        }
+        ops++;
+    }
+    
+    uint64_t cycles = rdtsc() - start;
+    
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        if (slots[i]) {
+            if (first_fit) {
+                ff_free(slots[i]);
+            } else {
+                kfree(slots[i]);
+            }
+        }
+    }
+    
+    return div_u64_u32(cycles, ops);
+}
+
+// Compare kmalloc/kfree against a first-fit allocator on the same workload
+void kmalloc_benchmark() {
+    uint32_t ff_failures, slab_failures;
+    
+    // Borrow a contiguous arena for the first-fit allocator
+    uint32_t order = 0;
+    while ((PAGE_SIZE << order) < ARENA_SIZE) {
+        order++;
+    }
+    uint32_t arena = pmm_alloc_order(order);
+    if (arena == 0) {
+        return;
+    }
+    
+    print("\nHeap benchmark (");
+    print_dec(BENCH_OPS);
+    print(" random ops, 8-2048 bytes, cycles per op)\n");
+    
+    ff_init((void*)arena, ARENA_SIZE);
+    uint32_t ff_cycles = bench_run(1, &ff_failures);
+    uint32_t slab_cycles = bench_run(0, &slab_failures);
+    
+    pmm_free_order(arena, order);
+    
+    print("  First-fit: ");
+    print_dec(ff_cycles);
+    print(" (");
+    print_dec(ff_failures);
+    print(" failed)\n  Slab:      ");
+    print_dec(slab_cycles);
+    print(" (");
+    print_dec(slab_failures);
+    print(" failed)\n\n");
+}
@@ -0,0 +1,170 @@
+// Local APIC Implementation
+// Register access through an uncached mapping at LAPIC_VIRT
+
+#include "lapic.h"
+#include "paging.h"
+#include "timer.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+#define CPUID_APIC          (1 << 9)
+#define MSR_APIC_BASE       0x1B
+#define APIC_BASE_ENABLE    (1 << 11)
+
+// Register offsets
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080   // Task priority
+#define LAPIC_EOI           0x0B0
+#define LAPIC_ISR           0x100   // In service, 32 vectors per register
+#define LAPIC_SVR           0x0F0   // Spurious vector, software enable
+#define LAPIC_ICR_LOW       0x300   // Interrupt command
+#define LAPIC_ICR_HIGH      0x310   // Destination APIC ID in bits 24-31
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define SVR_ENABLE          0x100
+#define LVT_MASKED          (1 << 16)
+#define LVT_PERIODIC        (1 << 17)
+#define TIMER_DIVIDE_16     0x3
+
+// Interrupt command fields
+#define ICR_FIXED           0x000
+#define ICR_INIT            0x500
+#define ICR_STARTUP         0x600
+#define ICR_PENDING         (1 << 12)   // Delivery status: not yet accepted
+#define ICR_ASSERT          (1 << 14)
+#define ICR_ALL_BUT_SELF    (3 << 18)
+
+static volatile uint32_t* lapic = 0;
+static uint32_t timer_initial = 0;      // Timer count per tick at TIMER_HZ
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+// Helper: Wait until the last IPI has been accepted
+static void icr_wait() {
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+// Initialize the bootstrap processor's local APIC
+int lapic_init() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & CPUID_APIC)) {
+        return -1;
+    }
+    
+    uint32_t low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(MSR_APIC_BASE));
+    if (!(low & APIC_BASE_ENABLE)) {
+        low |= APIC_BASE_ENABLE;
+        __asm__ __volatile__("wrmsr" : : "c"(MSR_APIC_BASE), "a"(low), "d"(high));
+    }
+    
+    // Registers must not be cached; every CPU sees its own APIC at the
+    // same physical address, so one shared mapping serves them all
+    uint32_t base = low & 0xFFFFF000;
+    map_page(LAPIC_VIRT, base, PAGE_WRITE | PAGE_UC | PAGE_GLOBAL);
+    lapic = (volatile uint32_t*)LAPIC_VIRT;
+    
+    lapic_init_cpu();
+    
+    // Count down from the top for a known time to get the bus rate
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    timer_udelay(LAPIC_CALIBRATE_US);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    timer_initial = elapsed * (1000000 / LAPIC_CALIBRATE_US) / TIMER_HZ;
+    
+    print("Local APIC at ");
+    print_hex(base);
+    print(", timer ");
+    print_dec(elapsed / (LAPIC_CALIBRATE_US / 1000));
+    print(" kHz\n");
+    return 0;
+}
+
+// Enable this CPU's local APIC and accept every priority
+void lapic_init_cpu() {
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+// Start the periodic local timer
+void lapic_timer_start() {
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, timer_initial);
+}
+
+// Get this CPU's local APIC ID
+uint32_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Check whether lapic_init mapped the local APIC
+int lapic_available() {
+    return lapic != 0;
+}
+
+// Signal end of interrupt
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Check whether a vector is in service on this CPU
+int lapic_in_service(uint8_t vector) {
+    return (lapic_read(LAPIC_ISR + (vector / 32) * 0x10) >> (vector % 32)) & 1;
+}
+
+// Send a fixed interrupt to one CPU
+// The two ICR writes must not be split by an interrupt that sends its own
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    uint32_t flags = irq_save();
+    icr_wait();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, ICR_FIXED | ICR_ASSERT | vector);
+    irq_restore(flags);
+}
+
+// INIT-SIPI-SIPI to every other CPU
+// The second STARTUP is for CPUs that miss the first (MP spec B.4);
+// one that already started ignores it
+void lapic_start_aps(uint32_t trampoline) {
+    lapic_write(LAPIC_ICR_HIGH, 0);
+    lapic_write(LAPIC_ICR_LOW, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_INIT);
+    icr_wait();
+    timer_udelay(10000);
+    
+    for (int i = 0; i < 2; i++) {
+        lapic_write(LAPIC_ICR_LOW, ICR_ALL_BUT_SELF | ICR_STARTUP | (trampoline >> 12));
+        icr_wait();
+        timer_udelay(200);
+    }
+}
@@ -1,18 +1,59 @@
 // Paging Implementation
-// 4KB paging with identity mapping
+// Identity-mapped kernel using 4MB global pages, 4KB pages elsewhere
 
 #include "paging.h"
+#include "clock.h"
 #include "pmm.h"
+#include "kmalloc.h"
+#include "smp.h"
+#include "spinlock.h"
 
 // External print functions
 extern void print(const char* str);
 extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
 
 // Page directory (aligned to 4KB)
 static page_directory_t kernel_directory __attribute__((aligned(4096)));
 
-// Page table for first 4MB (aligned to 4KB)
-static page_table_t first_page_table __attribute__((aligned(4096)));
+// Address spaces: the kernel's own plus one per task
+// All of them share the kernel entries (everything outside the user window)
+static address_space_t kernel_space;
+static address_space_t* current_spaces[SMP_MAX_CPUS];
+static address_space_t* space_list = &kernel_space;
+
+// Page tables and the space list; taken with interrupts off, before the
+// PMM lock when both are needed
+static spinlock_t paging_lock = SPINLOCK_INIT;
+
+// Lazy cross-CPU invalidation (see paging_sync_tlb)
+static volatile uint32_t tlb_generation = 0;
+static uint32_t tlb_seen[SMP_MAX_CPUS];
+
+// CPU features in use
+static int pse_enabled = 0;
+static int pge_enabled = 0;
+static int pat_enabled = 0;
+
+// Flags shared by all identity mappings
+static uint32_t identity_flags = PAGE_PRESENT | PAGE_WRITE;
+
+#define CPUID_PSE   (1 << 3)
+#define CPUID_PGE   (1 << 13)
+#define CPUID_PAT   (1 << 16)
+#define CR4_PSE     (1 << 4)
+#define CR4_PGE     (1 << 7)
+
+// Page Attribute Table
+// PAT entries are selected by the PAT:PCD:PWT bits of an entry. Entry 1
+// (PWT only) is reprogrammed from write-through to write-combining; the
+// rest keep their power-on types (0 WB, 2 UC-, 3 UC).
+#define MSR_PAT         0x277
+#define PAT_LOW         0x00070106  // PA3 UC, PA2 UC-, PA1 WC, PA0 WB
+#define PAT_HIGH        0x00070406  // PA7 UC, PA6 UC-, PA5 WT, PA4 WB (default)
+
+// Flags a 4MB directory entry hands down to the 4KB entries it splits into
+#define SPLIT_FLAGS (PAGE_PRESENT | PAGE_WRITE | PAGE_USER | PAGE_PWT | PAGE_PCD | PAGE_GLOBAL)
 
 // Helper: Get page directory index from virtual address
 static inline uint32_t get_pd_index(uint32_t virtual_addr) {
@@ -29,92 +70,750 @@ static inline uint32_t get_page_frame(page_entry_t entry) {
     return entry & 0xFFFFF000;  // Top 20 bits
 }
 
+// Helper: Check whether an address lies in the per-task user window
+static inline int is_user_address(uint32_t virtual_addr) {
+    return virtual_addr >= USER_SPACE_BASE && virtual_addr < USER_SPACE_END;
+}
+
+// Helper: Address space current on this CPU (interrupts must be off)
+static inline address_space_t* current_space() {
+    return current_spaces[smp_cpu_id()];
+}
+
+// Helper: Directory that holds the entry for an address
+static inline page_directory_t* directory_for(uint32_t virtual_addr) {
+    return is_user_address(virtual_addr) ? current_space()->directory : &kernel_directory;
+}
+
+// Helper: Write a directory entry
+// User entries belong to the current space; kernel entries go to every space
+static void set_pde(uint32_t virtual_addr, page_entry_t entry) {
+    uint32_t pd_index = get_pd_index(virtual_addr);
+    
+    if (is_user_address(virtual_addr)) {
+        current_space()->directory->entries[pd_index] = entry;
+        return;
+    }
+    
+    for (address_space_t* space = space_list; space; space = space->next) {
+        space->directory->entries[pd_index] = entry;
+    }
+}
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+// Helper: Read the CPU timestamp counter
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: Invalidate the TLB entry covering one address
+static inline void invlpg(uint32_t virtual_addr) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+}
+
+// Helper: Read CPUID leaf 1 feature flags (EDX)
+static uint32_t cpuid_features() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return edx;
+}
+
+// Helper: Read and write CR4
+static inline uint32_t read_cr4() {
+    uint32_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+// Helper: Flush the TLB
+// Reloading CR3 keeps global entries; toggling CR4.PGE drops them too
+static void flush_tlb(int global) {
+    if (global && pge_enabled) {
+        uint32_t cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        uint32_t cr3;
+        __asm__ __volatile__("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    }
+}
+
+// Flush the whole TLB, including global entries
+void flush_tlb_all() {
+    flush_tlb(1);
+}
+
+// Helper: Note that an entry other CPUs may have cached changed
+// (paging_lock held; a single CPU has already invalidated its own TLB)
+static inline void tlb_changed(page_entry_t old) {
+    if ((old & PAGE_PRESENT) && smp_cpu_count() > 1) {
+        tlb_generation++;
+    }
+}
+
+// Flush this CPU's TLB if a shared mapping changed since it last looked
+void paging_sync_tlb() {
+    uint32_t cpu = smp_cpu_id();
+    uint32_t generation = tlb_generation;
+    if (tlb_seen[cpu] != generation) {
+        tlb_seen[cpu] = generation;
+        flush_tlb(1);
+    }
+}
+
+// Helper: Program the PAT so that PAGE_WC selects write-combining
+// Caches are flushed around the change as the SDM requires; nothing is
+// mapped with PWT alone yet, so no stale translations can exist
+static void pat_init() {
+    __asm__ __volatile__("wbinvd" : : : "memory");
+    __asm__ __volatile__("wrmsr" : : "c"(MSR_PAT), "a"(PAT_LOW), "d"(PAT_HIGH));
+    __asm__ __volatile__("wbinvd" : : : "memory");
+    pat_enabled = 1;
+}
+
+// Helper: Check whether a directory entry points to a page table
+static inline int is_table(page_entry_t pde) {
+    return (pde & PAGE_PRESENT) && !(pde & PAGE_LARGE);
+}
+
+// Helper: Allocate a zeroed page table
+static page_table_t* alloc_table() {
+    uint32_t new_table = pmm_alloc_zeroed();
+    if (new_table == 0) {
+        print("Paging: Failed to allocate page table\n");
+        return 0;
+    }
+    return (page_table_t*)new_table;
+}
+
+// Helper: Get the page table covering an address, creating it if needed
+// A 4MB page is split into an equivalent page table first
+static page_table_t* get_table(uint32_t virtual_addr, uint32_t flags) {
+    page_entry_t pde = directory_for(virtual_addr)->entries[get_pd_index(virtual_addr)];
+    
+    if (is_table(pde)) {
+        return (page_table_t*)get_page_frame(pde);
+    }
+    
+    page_table_t* table = alloc_table();
+    if (!table) {
+        return 0;
+    }
+    
+    if (pde & PAGE_PRESENT) {
+        // Same translation as the 4MB page, one 4KB entry at a time
+        uint32_t frame = pde & 0xFFC00000;
+        for (uint32_t i = 0; i < 1024; i++) {
+            table->entries[i] = (frame + i * PAGE_SIZE) | (pde & SPLIT_FLAGS);
+        }
+        flags |= pde & PAGE_USER;
+    }
+    
+    // Caching and global bits live in the table entries, not the directory
+    set_pde(virtual_addr, (uint32_t)table | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
+    return table;
+}
+
+// Helper: Write a 4KB entry without flushing the TLB
+// Returns the previous entry, or 0 if no page table could be allocated
+static page_entry_t set_pte(uint32_t virtual_addr, page_entry_t entry) {
+    page_table_t* table = get_table(virtual_addr, entry);
+    if (!table) {
+        return 0;
+    }
+    
+    uint32_t pt_index = get_pt_index(virtual_addr);
+    page_entry_t old = table->entries[pt_index];
+    table->entries[pt_index] = entry;
+    return old;
+}
+
 // Initialize paging
 void paging_init() {
     print("Initializing paging...\n");
     
+    uint32_t features = cpuid_features();
+    
     // Clear page directory
     for (int i = 0; i < 1024; i++) {
         kernel_directory.entries[i] = 0;
     }
     
-    // Identity map first 4MB (0x00000000 - 0x003FFFFF)
-    // This covers kernel code, VGA memory, and initial data
-    for (int i = 0; i < 1024; i++) {
-        uint32_t physical_addr = i * 4096;  // Each page is 4KB
-        first_page_table.entries[i] = physical_addr | PAGE_PRESENT | PAGE_WRITE;
+    kernel_space.directory = &kernel_directory;
+    kernel_space.heap_end = USER_SPACE_BASE;
+    kernel_space.next = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        current_spaces[cpu] = &kernel_space;
     }
     
-    // Install first page table into page directory
-    kernel_directory.entries[0] = ((uint32_t)&first_page_table) | PAGE_PRESENT | PAGE_WRITE;
+    // Identity map usable RAM in whole 4MB units
+    uint32_t ram_end = pmm_get_total_pages() * PAGE_SIZE;
+    uint32_t identity_end = (ram_end + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    if (identity_end == 0 || identity_end > PAGING_IDENTITY_END) {
+        identity_end = PAGING_IDENTITY_END;
+    }
+    
+    // Memory types must be set before any PAGE_WC mapping exists
+    if (features & CPUID_PAT) {
+        pat_init();
+    }
+    
+    // Global bits are ignored until CR4.PGE is set, so they can go in now
+    if (features & CPUID_PGE) {
+        identity_flags |= PAGE_GLOBAL;
+    }
+    
+    if (features & CPUID_PSE) {
+        write_cr4(read_cr4() | CR4_PSE);
+        pse_enabled = 1;
+        
+        for (uint32_t addr = 0; addr < identity_end; addr += LARGE_PAGE_SIZE) {
+            kernel_directory.entries[get_pd_index(addr)] = addr | identity_flags | PAGE_LARGE;
+        }
+    } else {
+        // No PSE: one page table per 4MB
+        for (uint32_t addr = 0; addr < identity_end; addr += PAGE_SIZE) {
+            set_pte(addr, addr | identity_flags);
+        }
+    }
     
-    print("Identity mapped first 4MB (1024 pages)\n");
+    print("Identity mapped ");
+    print_dec(identity_end / (1024 * 1024));
+    print("MB using ");
+    print(pse_enabled ? "4MB" : "4KB");
+    print(" pages\n");
     print("Page directory at: ");
     print_hex((uint32_t)&kernel_directory);
     print("\n");
     
-    print("Page table at: ");
-    print_hex((uint32_t)&first_page_table);
-    print("\n");
-    
     // Enable paging
     enable_paging();
     
-    print("Paging enabled!\n");
+    // Kernel mappings survive CR3 reloads from here on
+    if (features & CPUID_PGE) {
+        write_cr4(read_cr4() | CR4_PGE);
+        pge_enabled = 1;
+    }
+    
+    print("Paging enabled!");
+    if (pge_enabled) {
+        print(" (global pages)");
+    }
+    if (pat_enabled) {
+        print(" (PAT write-combining)");
+    }
+    print("\n");
+}
+
+// Per-CPU paging setup for an application processor
+void paging_init_cpu() {
+    uint32_t cpu = smp_cpu_id();
+    current_spaces[cpu] = &kernel_space;
+    tlb_seen[cpu] = tlb_generation;
+    
+    // Every CPU has its own PAT, and all must agree on memory types
+    if (pat_enabled) {
+        pat_init();
+    }
 }
 
 // Map a virtual address to a physical address
 void map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
-    uint32_t pd_index = get_pd_index(virtual_addr);
-    uint32_t pt_index = get_pt_index(virtual_addr);
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    page_entry_t old = set_pte(virtual_addr, (physical_addr & 0xFFFFF000) | PAGE_PRESENT | flags);
+    
+    // Flush TLB for this address
+    invlpg(virtual_addr);
+    tlb_changed(old);
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+}
+
+// Unmap a virtual address
+void unmap_page(uint32_t virtual_addr) {
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
     
     // Check if page directory entry exists
-    if (!(kernel_directory.entries[pd_index] & PAGE_PRESENT)) {
-        // Need to create a new page table
-        uint32_t new_table = pmm_alloc();
-        if (new_table == 0) {
-            print("Paging: Failed to allocate page table\n");
-            return;
+    if (!(directory_for(virtual_addr)->entries[get_pd_index(virtual_addr)] & PAGE_PRESENT)) {
+        spin_unlock_irqrestore(&paging_lock, flags);
+        return;  // Already unmapped
+    }
+    
+    // Unmap the page (splitting a 4MB page if needed)
+    page_entry_t old = set_pte(virtual_addr, 0);
+    
+    // Flush TLB for this address
+    invlpg(virtual_addr);
+    tlb_changed(old);
+    spin_unlock_irqrestore(&paging_lock, flags);
+}
+
+// Get the physical address a virtual address maps to (0 if unmapped)
+uint32_t virt_to_phys(uint32_t virtual_addr) {
+    uint32_t flags = irq_save();
+    page_entry_t pde = directory_for(virtual_addr)->entries[get_pd_index(virtual_addr)];
+    irq_restore(flags);
+    
+    if (!(pde & PAGE_PRESENT)) {
+        return 0;
+    }
+    if (pde & PAGE_LARGE) {
+        return (pde & 0xFFC00000) | (virtual_addr & (LARGE_PAGE_SIZE - 1));
+    }
+    
+    page_table_t* table = (page_table_t*)get_page_frame(pde);
+    page_entry_t pte = table->entries[get_pt_index(virtual_addr)];
+    if (!(pte & PAGE_PRESENT)) {
+        return 0;
+    }
+    return get_page_frame(pte) | (virtual_addr & 0xFFF);
+}
+
+// ============ Range Operations ============
+
+// Deferred TLB invalidation for a range operation
+// Addresses are queued until the threshold, after which one full flush
+// replaces them all
+typedef struct {
+    uint32_t count;
+    int global;
+    int stale;          // A present entry changed (other CPUs may cache it)
+    uint32_t addrs[PAGING_FLUSH_THRESHOLD];
+} flush_batch_t;
+
+// Helper: Record an address whose translation changed
+static void batch_add(flush_batch_t* batch, uint32_t virtual_addr, page_entry_t old, page_entry_t new) {
+    if (batch->count < PAGING_FLUSH_THRESHOLD) {
+        batch->addrs[batch->count] = virtual_addr;
+    }
+    batch->count++;
+    batch->global |= ((old | new) & PAGE_GLOBAL) != 0;
+    batch->stale |= (old & PAGE_PRESENT) != 0;
+}
+
+// Helper: Apply the queued invalidations
+static void batch_flush(flush_batch_t* batch) {
+    if (batch->count > PAGING_FLUSH_THRESHOLD) {
+        flush_tlb(batch->global);
+    } else {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            invlpg(batch->addrs[i]);
         }
+    }
+    tlb_changed(batch->stale ? PAGE_PRESENT : 0);
+}
+
+// Map size bytes starting at virtual_addr to physical_addr
+void map_range(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size, uint32_t flags) {
+    flush_batch_t batch;
+    batch.count = 0;
+    batch.global = 0;
+    batch.stale = 0;
+    
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    virtual_addr &= 0xFFFFF000;
+    physical_addr &= 0xFFFFF000;
+    
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    uint32_t offset = 0;
+    while (offset < size) {
+        uint32_t virt = virtual_addr + offset;
+        uint32_t phys = physical_addr + offset;
+        page_entry_t old = directory_for(virt)->entries[get_pd_index(virt)];
         
-        // Clear the new page table
-        page_table_t* table = (page_table_t*)new_table;
-        for (int i = 0; i < 1024; i++) {
-            table->entries[i] = 0;
+        // A whole aligned 4MB that is not already split into a page table
+        // (user pages stay 4KB so they can be shared copy-on-write)
+        if (pse_enabled && ((virt | phys) & (LARGE_PAGE_SIZE - 1)) == 0 &&
+            size - offset >= LARGE_PAGE_SIZE && !is_table(old) && !is_user_address(virt)) {
+            page_entry_t entry = phys | PAGE_PRESENT | PAGE_LARGE | flags;
+            set_pde(virt, entry);
+            batch_add(&batch, virt, old, entry);
+            offset += LARGE_PAGE_SIZE;
+            continue;
         }
         
-        // Install page table into directory
-        kernel_directory.entries[pd_index] = new_table | PAGE_PRESENT | PAGE_WRITE | flags;
+        page_entry_t entry = phys | PAGE_PRESENT | flags;
+        old = set_pte(virt, entry);
+        batch_add(&batch, virt, old, entry);
+        offset += PAGE_SIZE;
     }
     
-    // Get page table
-    page_table_t* table = (page_table_t*)get_page_frame(kernel_directory.entries[pd_index]);
+    batch_flush(&batch);
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+}
+
+// Unmap size bytes starting at virtual_addr
+// Page tables whose whole 4MB is unmapped are returned to the PMM
+void unmap_range(uint32_t virtual_addr, uint32_t size) {
+    flush_batch_t batch;
+    batch.count = 0;
+    batch.global = 0;
+    batch.stale = 0;
+    
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    virtual_addr &= 0xFFFFF000;
     
-    // Map the page
-    table->entries[pt_index] = (physical_addr & 0xFFFFF000) | PAGE_PRESENT | flags;
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+    uint32_t offset = 0;
+    while (offset < size) {
+        uint32_t virt = virtual_addr + offset;
+        page_entry_t pde = directory_for(virt)->entries[get_pd_index(virt)];
+        uint32_t to_boundary = LARGE_PAGE_SIZE - (virt & (LARGE_PAGE_SIZE - 1));
+        
+        if (!(pde & PAGE_PRESENT)) {
+            // Nothing mapped up to the next 4MB boundary
+            offset += to_boundary;
+            continue;
+        }
+        
+        // Whole 4MB covered: drop the directory entry
+        if (to_boundary == LARGE_PAGE_SIZE && size - offset >= LARGE_PAGE_SIZE) {
+            set_pde(virt, 0);
+            if (pde & PAGE_LARGE) {
+                batch_add(&batch, virt, pde, 0);
+            } else {
+                page_table_t* table = (page_table_t*)get_page_frame(pde);
+                for (uint32_t i = 0; i < 1024; i++) {
+                    if (table->entries[i] & PAGE_PRESENT) {
+                        batch_add(&batch, virt + i * PAGE_SIZE, table->entries[i], 0);
+                    }
+                }
+                pmm_free((uint32_t)table);
+            }
+            offset += LARGE_PAGE_SIZE;
+            continue;
+        }
+        
+        page_entry_t old = set_pte(virt, 0);
+        if (old & PAGE_PRESENT) {
+            batch_add(&batch, virt, old, 0);
+        }
+        offset += PAGE_SIZE;
+    }
     
-    // Flush TLB for this address
-    __asm__ __volatile__("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+    batch_flush(&batch);
+    spin_unlock_irqrestore(&paging_lock, flags);
 }
 
-// Unmap a virtual address
-void unmap_page(uint32_t virtual_addr) {
-    uint32_t pd_index = get_pd_index(virtual_addr);
+// ============ Address Spaces ============
+
+// Get the kernel's address space
+address_space_t* paging_kernel_space() {
+    return &kernel_space;
+}
+
+// Get the address space user-window operations apply to
+address_space_t* paging_current_space() {
+    uint32_t flags = irq_save();
+    address_space_t* space = current_space();
+    irq_restore(flags);
+    return space;
+}
+
+// Make a space current on this CPU (CR3 is loaded by the caller, e.g.
+// switch_task; interrupts must be off)
+void paging_set_current(address_space_t* space) {
+    current_spaces[smp_cpu_id()] = space;
+}
+
+// Switch to an address space immediately
+void paging_switch(address_space_t* space) {
+    uint32_t flags = irq_save();
+    current_spaces[smp_cpu_id()] = space;
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(space->directory) : "memory");
+    irq_restore(flags);
+}
+
+// Create an address space with an empty user window
+address_space_t* paging_create_space() {
+    address_space_t* space = (address_space_t*)kmalloc(sizeof(address_space_t));
+    if (!space) {
+        return 0;
+    }
+    
+    uint32_t directory = pmm_alloc_zeroed();
+    if (directory == 0) {
+        kfree(space);
+        return 0;
+    }
+    space->directory = (page_directory_t*)directory;
+    space->heap_end = USER_SPACE_BASE;
+    
+    // Copy the kernel entries and link in under the same lock, so a
+    // concurrent set_pde() cannot be missed
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+    for (uint32_t i = 0; i < 1024; i++) {
+        space->directory->entries[i] = is_user_address(i << 22) ? 0 : kernel_directory.entries[i];
+    }
+    space->next = space_list;
+    space_list = space;
+    spin_unlock_irqrestore(&paging_lock, flags);
+    
+    return space;
+}
+
+// Create a copy-on-write clone of an address space's user window
+// Writable pages become read-only in both spaces and share a frame until
+// one side writes to them
+address_space_t* paging_clone_space(address_space_t* source) {
+    address_space_t* space = paging_create_space();
+    if (!space) {
+        return 0;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+    int protected = 0;
+    
+    for (uint32_t pd = get_pd_index(USER_SPACE_BASE); pd < get_pd_index(USER_SPACE_END); pd++) {
+        page_entry_t pde = source->directory->entries[pd];
+        if (!is_table(pde)) {
+            continue;
+        }
+        
+        page_table_t* table = alloc_table();
+        if (!table) {
+            spin_unlock_irqrestore(&paging_lock, flags);
+            paging_destroy_space(space);
+            return 0;
+        }
+        
+        page_table_t* parent = (page_table_t*)get_page_frame(pde);
+        for (uint32_t i = 0; i < 1024; i++) {
+            page_entry_t pte = parent->entries[i];
+            if (!(pte & PAGE_PRESENT)) {
+                continue;
+            }
+            if (pte & PAGE_WRITE) {
+                pte = (pte & ~PAGE_WRITE) | PAGE_COW;
+                parent->entries[i] = pte;
+                protected = 1;
+            }
+            table->entries[i] = pte;
+            pmm_ref(get_page_frame(pte));
+        }
+        
+        space->directory->entries[pd] = (uint32_t)table | (pde & 0xFFF);
+    }
+    space->heap_end = source->heap_end;
+    
+    // The source lost write access to its pages (user entries are not global)
+    if (source == current_space()) {
+        flush_tlb(0);
+    }
+    tlb_changed(protected ? PAGE_PRESENT : 0);
+    
+    spin_unlock_irqrestore(&paging_lock, flags);
+    return space;
+}
+
+// Release an address space and drop its references to user pages
+void paging_destroy_space(address_space_t* space) {
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+    if (space == &kernel_space || space == current_space()) {
+        spin_unlock_irqrestore(&paging_lock, flags);
+        print("Paging: Cannot destroy an active address space\n");
+        return;
+    }
+    
+    address_space_t** link = &space_list;
+    while (*link && *link != space) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = space->next;
+    }
+    
+    spin_unlock_irqrestore(&paging_lock, flags);
+    
+    for (uint32_t pd = get_pd_index(USER_SPACE_BASE); pd < get_pd_index(USER_SPACE_END); pd++) {
+        page_entry_t pde = space->directory->entries[pd];
+        if (!is_table(pde)) {
+            continue;
+        }
+        page_table_t* table = (page_table_t*)get_page_frame(pde);
+        for (uint32_t i = 0; i < 1024; i++) {
+            if (table->entries[i] & PAGE_PRESENT) {
+                pmm_unref(get_page_frame(table->entries[i]));
+            }
+        }
+        pmm_free((uint32_t)table);
+    }
+    
+    pmm_free((uint32_t)space->directory);
+    kfree(space);
+}
+
+// Resolve a write fault on a copy-on-write page of the current space
+int paging_handle_cow(uint32_t virtual_addr) {
+    if (!is_user_address(virtual_addr)) {
+        return -1;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+    page_entry_t pde = current_space()->directory->entries[get_pd_index(virtual_addr)];
+    if (!is_table(pde)) {
+        spin_unlock_irqrestore(&paging_lock, flags);
+        return -1;
+    }
+    
+    page_table_t* table = (page_table_t*)get_page_frame(pde);
     uint32_t pt_index = get_pt_index(virtual_addr);
+    page_entry_t pte = table->entries[pt_index];
     
-    // Check if page directory entry exists
-    if (!(kernel_directory.entries[pd_index] & PAGE_PRESENT)) {
-        return;  // Already unmapped
+    // Another CPU sharing the space got here first
+    if ((pte & PAGE_PRESENT) && (pte & PAGE_WRITE)) {
+        spin_unlock_irqrestore(&paging_lock, flags);
+        invlpg(virtual_addr);
+        return 0;
+    }
+    if (!(pte & PAGE_PRESENT) || !(pte & PAGE_COW)) {
+        spin_unlock_irqrestore(&paging_lock, flags);
+        return -1;
     }
     
-    // Get page table
-    page_table_t* table = (page_table_t*)get_page_frame(kernel_directory.entries[pd_index]);
+    uint32_t frame = get_page_frame(pte);
+    uint32_t pte_flags = (pte & 0xFFF & ~PAGE_COW) | PAGE_WRITE;
     
-    // Unmap the page
-    table->entries[pt_index] = 0;
+    if (pmm_get_refs(frame) == 1) {
+        // Last sharer: take the frame over without copying
+        table->entries[pt_index] = frame | pte_flags;
+    } else {
+        uint32_t copy = pmm_alloc();
+        if (copy == 0) {
+            spin_unlock_irqrestore(&paging_lock, flags);
+            return -1;
+        }
+        
+        // Frames are identity-mapped, so copy physical to physical
+        uint32_t* dest = (uint32_t*)copy;
+        const uint32_t* src = (const uint32_t*)frame;
+        for (int i = 0; i < PAGE_SIZE / 4; i++) {
+            dest[i] = src[i];
+        }
+        
+        table->entries[pt_index] = copy | pte_flags;
+        pmm_unref(frame);
+    }
     
-    // Flush TLB for this address
-    __asm__ __volatile__("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+    invlpg(virtual_addr);
+    tlb_changed(pte);
+    spin_unlock_irqrestore(&paging_lock, flags);
+    return 0;
+}
+
+// Check CPU paging features detected by paging_init
+int paging_has_pse() {
+    return pse_enabled;
+}
+
+int paging_has_pge() {
+    return pge_enabled;
+}
+
+int paging_has_pat() {
+    return pat_enabled;
+}
+
+// ============ Benchmark ============
+
+#define BENCH_PAGES 1024                    // One 4MB region
+#define BENCH_PHYS  0x00400000              // Identity-mapped RAM to alias
+#define BENCH_BYTES (BENCH_PAGES * PAGE_SIZE)
+
+// Helper: Read one word from every page of the benchmark window
+static uint32_t bench_touch() {
+    volatile uint32_t* window = (volatile uint32_t*)PAGING_SCRATCH_BASE;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < BENCH_PAGES; i++) {
+        sum += window[i * (PAGE_SIZE / 4)];
+    }
+    return sum;
+}
+
+// Helper: Print one benchmark row, per page of the window
+static void bench_report(const char* name, uint64_t map_cycles, uint64_t touch_cycles, uint64_t unmap_cycles) {
+    print(name);
+    print_dec(div_u64_u32(map_cycles, BENCH_PAGES));
+    print("\t");
+    print_dec(div_u64_u32(touch_cycles, BENCH_PAGES));
+    print("\t");
+    print_dec(div_u64_u32(unmap_cycles, BENCH_PAGES));
+    print("\n");
+}
+
+// Map, touch and unmap a 4MB window three ways
+void paging_benchmark() {
+    uint64_t start;
+    uint64_t map_cycles, touch_cycles, unmap_cycles;
+    
+    print("\nPaging benchmark (4MB window, cycles per page)\n");
+    print("  Method              Map     Touch   Unmap\n");
+    
+    // Per-page map_page/unmap_page: one invlpg each
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_PAGES; i++) {
+        map_page(PAGING_SCRATCH_BASE + i * PAGE_SIZE, BENCH_PHYS + i * PAGE_SIZE, PAGE_WRITE);
+    }
+    map_cycles = rdtsc() - start;
+    start = rdtsc();
+    bench_touch();
+    touch_cycles = rdtsc() - start;
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_PAGES; i++) {
+        unmap_page(PAGING_SCRATCH_BASE + i * PAGE_SIZE);
+    }
+    unmap_cycles = rdtsc() - start;
+    bench_report("  map_page (4KB)      ", map_cycles, touch_cycles, unmap_cycles);
+    
+    // Drop the page table left behind so the 4MB case starts clean
+    unmap_range(PAGING_SCRATCH_BASE, BENCH_BYTES);
+    
+    // map_range over 4KB pages: one CR3 reload instead of 1024 invlpg
+    // (an unaligned physical address keeps it from using a 4MB page)
+    start = rdtsc();
+    map_range(PAGING_SCRATCH_BASE, BENCH_PHYS + PAGE_SIZE, BENCH_BYTES, PAGE_WRITE);
+    map_cycles = rdtsc() - start;
+    start = rdtsc();
+    bench_touch();
+    touch_cycles = rdtsc() - start;
+    start = rdtsc();
+    unmap_range(PAGING_SCRATCH_BASE, BENCH_BYTES);
+    unmap_cycles = rdtsc() - start;
+    bench_report("  map_range (4KB)     ", map_cycles, touch_cycles, unmap_cycles);
+    
+    if (!pse_enabled) {
+        print("  map_range (4MB)     PSE not supported\n\n");
+        return;
+    }
+    
+    // map_range with a single 4MB entry: one TLB entry covers the window
+    start = rdtsc();
+    map_range(PAGING_SCRATCH_BASE, BENCH_PHYS, BENCH_BYTES, PAGE_WRITE);
+    map_cycles = rdtsc() - start;
+    start = rdtsc();
+    bench_touch();
+    touch_cycles = rdtsc() - start;
+    start = rdtsc();
+    unmap_range(PAGING_SCRATCH_BASE, BENCH_BYTES);
+    unmap_cycles = rdtsc() - start;
+    bench_report("  map_range (4MB)     ", map_cycles, touch_cycles, unmap_cycles);
+    print("\n");
 }
 
 // Enable paging
@@ -126,10 +825,12 @@ void enable_paging() {
     );
     
     // Enable paging by setting bit 31 of CR0
+    // WP (bit 16) makes read-only pages apply to the kernel too, which
+    // copy-on-write relies on
     uint32_t cr0;
     __asm__ __volatile__(
         "mov %%cr0, %0\n"
-        "or $0x80000000, %0\n"  // Set PG bit (bit 31)
+        "or $0x80010000, %0\n"  // Set PG (bit 31) and WP (bit 16)
         "mov %0, %%cr0\n"
         : "=r"(cr0)
     );
@@ -39,9 +39,9 @@ void pic_init() {
     outb(PIC1_DATA, 0x01);      // 8086 mode
     outb(PIC2_DATA, 0x01);      // 8086 mode
     
-    // Mask all IRQs except keyboard (IRQ1)
-    outb(PIC1_DATA, 0xFD);      // 11111101 - only IRQ1 unmasked
-    outb(PIC2_DATA, 0xFF);      // 11111111 - all slave IRQs masked
+    // Mask all IRQs; irq_register unmasks the lines that get a handler
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
 }
 
 // Send End of Interrupt signal
@@ -51,3 +51,25 @@ void pic_send_eoi(uint8_t irq) {
     }
     outb(PIC1_COMMAND, PIC_EOI);
 }
+
+// Mask one line
+void pic_mask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+// Unmask one line
+void pic_unmask(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << 2));
+    }
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+// Read the in-service registers
+uint16_t pic_read_isr() {
+    outb(PIC1_COMMAND, PIC_READ_ISR);
+    outb(PIC2_COMMAND, PIC_READ_ISR);
+    return ((uint16_t)inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
+}
@@ -1,43 +1,167 @@
 // Physical Memory Manager (PMM) Implementation
-// Bitmap-based allocator for 4KB pages
+// Two-level bitmap allocator for 4KB pages, sized from the E820 map
 
 #include "pmm.h"
+#include "buddy.h"
+#include "clock.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "trace.h"
 
 // External print functions
 extern void print(const char* str);
 extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// Linker-provided bounds of the kernel image
+extern uint8_t kernel_start[];
+extern uint8_t kernel_end[];
+
+// Memory layout, sized from the E820 map at boot
+static uint32_t total_pages = 0;
+static uint32_t bitmap_words = 0;
+static uint32_t summary_words = 0;
 
 // Bitmap to track page allocation (1 = used, 0 = free)
-static uint8_t memory_bitmap[BITMAP_SIZE];
+// Scanned one 32-bit word (32 pages) at a time
+static uint32_t* memory_bitmap;
+
+// Summary bitmap: one bit per word of memory_bitmap (1 = word is full)
+// Lets the allocator skip 1024 used pages with a single compare
+static uint32_t* summary_bitmap;
+
+// Pages that can never be freed (holes, firmware, kernel, PMM metadata)
+static uint32_t* reserved_bitmap;
+
+// Pages taken by the benchmark to reach its target occupancy
+static uint32_t* bench_filler;
+
+// Extra references per page beyond the owner's (shared copy-on-write frames)
+static uint16_t* ref_counts;
+
+// Fixed low-memory areas in use before the PMM comes up
+static const struct {
+    uint32_t start;
+    uint32_t end;
+} boot_reserved[] = {
+    { 0x00000000, 0x00001000 },     // Real-mode IVT, BIOS data, E820 map
+    { SMP_TRAMPOLINE, SMP_TRAMPOLINE + 0x1000 },    // AP startup trampoline
+    { 0x00080000, 0x00090000 },     // Boot stack (grows down from 0x90000)
+};
+
+// Bitmaps, counters, reference counts, the buddy zone and the zeroed
+// pool; magazines are per-CPU and only need interrupts off
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+// Next-fit hint: bitmap word where the last allocation was made
+static uint32_t next_fit_word = 0;
 
-// Statistics
+// Statistics (bitmap-managed pages only; the buddy zone keeps its own)
+// Reserved pages are counted as used
 static uint32_t free_pages = 0;
 static uint32_t used_pages = 0;
+static uint32_t reserved_pages = 0;
+
+// Per-CPU page magazines
+// pmm_alloc()/pmm_free() are served from the local magazine, which is
+// refilled from and drained to the global bitmap PMM_CACHE_BATCH pages
+// at a time. Cached pages stay set in the bitmap.
+static pmm_cache_t page_cache[PMM_MAX_CPUS];
+
+// Pre-zeroed pages, filled in the background by the idle task
+// Pool pages are allocated in the bitmap but counted as free
+static uint32_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t zero_count = 0;
+static pmm_zero_stats_t zero_stats;
+
+// Helper: Bit scan forward (index of lowest set bit, value must be non-zero)
+static inline uint32_t bsf(uint32_t value) {
+    uint32_t index;
+    __asm__ __volatile__("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+// Helper: Index of the CPU we are running on
+static inline uint32_t this_cpu() {
+    return smp_cpu_id();
+}
+
+// Helper: Read the CPU timestamp counter
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
 
 // Helper: Set a bit in the bitmap
 static void bitmap_set(uint32_t bit) {
-    uint32_t byte = bit / 8;
-    uint32_t offset = bit % 8;
-    memory_bitmap[byte] |= (1 << offset);
+    uint32_t word = bit / 32;
+    memory_bitmap[word] |= (1 << (bit % 32));
+    
+    // Word just became full - mark it in the summary
+    if (memory_bitmap[word] == 0xFFFFFFFF) {
+        summary_bitmap[word / 32] |= (1 << (word % 32));
+    }
 }
 
 // Helper: Clear a bit in the bitmap
 static void bitmap_clear(uint32_t bit) {
-    uint32_t byte = bit / 8;
-    uint32_t offset = bit % 8;
-    memory_bitmap[byte] &= ~(1 << offset);
+    uint32_t word = bit / 32;
+    memory_bitmap[word] &= ~(1 << (bit % 32));
+    summary_bitmap[word / 32] &= ~(1 << (word % 32));
 }
 
 // Helper: Test if a bit is set
 static int bitmap_test(uint32_t bit) {
-    uint32_t byte = bit / 8;
-    uint32_t offset = bit % 8;
-    return (memory_bitmap[byte] & (1 << offset)) != 0;
+    return (memory_bitmap[bit / 32] & (1 << (bit % 32))) != 0;
 }
 
 // Helper: Find first free page
+// Starts at the next-fit hint and walks the summary bitmap, so full
+// regions of memory are skipped 1024 pages at a time
 static uint32_t find_free_page() {
-    for (uint32_t i = 0; i < TOTAL_PAGES; i++) {
+    uint32_t start_word = next_fit_word;
+    uint32_t start_summary = start_word / 32;
+    
+    // Visit every summary word once, then revisit the first one to
+    // pick up the words below the hint (wrap-around)
+    for (uint32_t n = 0; n <= summary_words; n++) {
+        uint32_t s = (start_summary + n) % summary_words;
+        uint32_t candidates = ~summary_bitmap[s];
+        
+        if (n == 0) {
+            // Only words at or above the hint on the first pass
+            candidates &= ~((1u << (start_word % 32)) - 1);
+        } else if (n == summary_words) {
+            // Only words below the hint on the wrap-around pass
+            candidates &= (1u << (start_word % 32)) - 1;
+        }
+        
+        if (candidates != 0) {
+            uint32_t word = s * 32 + bsf(candidates);
+            return word * 32 + bsf(~memory_bitmap[word]);
+        }
+    }
+    
+    return 0xFFFFFFFF;  // No free pages
+}
+
+// Helper: Find first free page by testing one bit at a time
+// This is the original allocator, kept as the benchmark baseline
+static uint32_t find_free_page_linear() {
+    for (uint32_t i = 0; i < total_pages; i++) {
         if (!bitmap_test(i)) {
             return i;
         }
@@ -45,37 +169,326 @@ static uint32_t find_free_page() {
     return 0xFFFFFFFF;  // No free pages
 }
 
-// Initialize physical memory manager
-void pmm_init() {
-    // Clear bitmap (all pages free initially)
-    for (uint32_t i = 0; i < BITMAP_SIZE; i++) {
-        memory_bitmap[i] = 0;
+// Helper: Mark a free page as used and update statistics
+static void claim_page(uint32_t page) {
+    bitmap_set(page);
+    free_pages--;
+    used_pages++;
+    next_fit_word = page / 32;
+}
+
+// Helper: Mark a used page as free and update statistics
+static void release_page(uint32_t page) {
+    bitmap_clear(page);
+    free_pages++;
+    used_pages--;
+}
+
+// Helper: Take up to count free pages from the bitmap
+// Grabs every free page in a bitmap word at once, so the summary and the
+// counters are updated once per word instead of once per page
+static uint32_t bitmap_alloc_batch(uint32_t count, uint32_t* pages) {
+    uint32_t taken = 0;
+    
+    while (taken < count) {
+        uint32_t page = find_free_page();
+        if (page == 0xFFFFFFFF) {
+            break;
+        }
+        
+        uint32_t word = page / 32;
+        uint32_t available = ~memory_bitmap[word];
+        uint32_t grabbed = 0;
+        
+        while (available != 0 && taken < count) {
+            uint32_t bit = bsf(available);
+            available &= available - 1;
+            grabbed |= 1u << bit;
+            pages[taken++] = word * 32 + bit;
+        }
+        
+        memory_bitmap[word] |= grabbed;
+        if (memory_bitmap[word] == 0xFFFFFFFF) {
+            summary_bitmap[word / 32] |= (1 << (word % 32));
+        }
+        next_fit_word = word;
+    }
+    
+    free_pages -= taken;
+    used_pages += taken;
+    return taken;
+}
+
+// Helper: Validate a page before it is released
+// Buddy zone pages are handed straight back to the buddy allocator
+// Returns 1 if the page belongs to the bitmap and can be freed
+static int check_free(uint32_t addr) {
+    // Check alignment
+    if (addr % PAGE_SIZE != 0) {
+        print("PMM: Invalid address (not page-aligned)\n");
+        return 0;
     }
     
-    // Reserve first 1MB for kernel and BIOS
-    // This includes: IVT, BIOS data, VGA memory, kernel code
-    uint32_t reserved_pages = (1024 * 1024) / PAGE_SIZE;  // 256 pages
+    uint32_t page = addr / PAGE_SIZE;
+    
+    // Check bounds
+    if (page >= total_pages) {
+        print("PMM: Invalid address (out of bounds)\n");
+        return 0;
+    }
     
-    for (uint32_t i = 0; i < reserved_pages; i++) {
-        bitmap_set(i);
-        used_pages++;
+    // Pages from the buddy zone go back to their free lists
+    if (buddy_contains(page)) {
+        spin_lock(&pmm_lock);
+        int result = buddy_free(page, 0);
+        spin_unlock(&pmm_lock);
+        if (result != 0) {
+            print("PMM: Invalid free in buddy zone\n");
+        }
+        return 0;
     }
     
-    free_pages = TOTAL_PAGES - reserved_pages;
+    // Check if page is actually allocated
+    if (!bitmap_test(page)) {
+        print("PMM: Warning - freeing already free page\n");
+        return 0;
+    }
+    
+    // Don't allow freeing reserved pages (firmware, kernel, holes)
+    if (reserved_bitmap[page / 32] & (1 << (page % 32))) {
+        print("PMM: Cannot free reserved page\n");
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Helper: Set or clear the bitmap bits for pages [first, last)
+static void mark_pages(uint32_t* bitmap, uint32_t first, uint32_t last, int used) {
+    if (last > total_pages) {
+        last = total_pages;
+    }
+    for (uint32_t page = first; page < last; page++) {
+        if (used) {
+            bitmap[page / 32] |= (1 << (page % 32));
+        } else {
+            bitmap[page / 32] &= ~(1 << (page % 32));
+        }
+    }
+}
+
+// Helper: Reserve every page touching [start, end)
+static void reserve_range(uint64_t start, uint64_t end) {
+    if (start >= PMM_MAX_ADDRESS) {
+        return;
+    }
+    if (end > PMM_MAX_ADDRESS) {
+        end = PMM_MAX_ADDRESS;
+    }
+    uint32_t first = (uint32_t)(start / PAGE_SIZE);
+    uint32_t last = (uint32_t)((end + PAGE_SIZE - 1) / PAGE_SIZE);
+    mark_pages(memory_bitmap, first, last, 1);
+    mark_pages(reserved_bitmap, first, last, 1);
+}
+
+// Helper: Count set bits in a word (no libgcc __popcountsi2)
+static uint32_t popcount(uint32_t value) {
+    value = value - ((value >> 1) & 0x55555555);
+    value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+    value = (value + (value >> 4)) & 0x0F0F0F0F;
+    return (value * 0x01010101) >> 24;
+}
+
+// Helper: End of a map entry, clipped to the managed address space
+static uint64_t entry_end(const e820_entry_t* entry) {
+    uint64_t end = entry->base + entry->length;
+    return end > PMM_MAX_ADDRESS ? PMM_MAX_ADDRESS : end;
+}
+
+// Helper: Name of an E820 region type
+static const char* region_name(uint32_t type) {
+    switch (type) {
+        case E820_USABLE:       return "usable";
+        case E820_RESERVED:     return "reserved";
+        case E820_ACPI_RECLAIM: return "ACPI reclaimable";
+        case E820_ACPI_NVS:     return "ACPI NVS";
+        case E820_BAD:          return "bad memory";
+        default:                return "unknown";
+    }
+}
+
+// Initialize physical memory manager from the BIOS memory map
+void pmm_init(const e820_entry_t* map, uint32_t entries) {
+    // Without a map (e.g. BIOS lacks E820) assume 640KB + 15MB above 1MB
+    static const e820_entry_t default_map[] = {
+        { 0x00000000, 0x0009F000, E820_USABLE, 1 },
+        { 0x00100000, 0x00F00000, E820_USABLE, 1 },
+    };
+    if (entries == 0 || entries > E820_MAX_ENTRIES) {
+        print("PMM: No E820 map, assuming 16MB\n");
+        map = default_map;
+        entries = sizeof(default_map) / sizeof(default_map[0]);
+    }
+    
+    // Size the bitmap from the end of the highest usable region
+    uint64_t top = 0;
+    print("Memory map:\n");
+    for (uint32_t i = 0; i < entries; i++) {
+        print("  ");
+        print_hex((uint32_t)(map[i].base >> 32));
+        print_hex((uint32_t)map[i].base);
+        print(" - ");
+        print_hex((uint32_t)((map[i].base + map[i].length) >> 32));
+        print_hex((uint32_t)(map[i].base + map[i].length));
+        print(" ");
+        print(region_name(map[i].type));
+        print("\n");
+        
+        if (map[i].type == E820_USABLE && map[i].base < PMM_MAX_ADDRESS &&
+            entry_end(&map[i]) > top) {
+            top = entry_end(&map[i]);
+        }
+    }
+    
+    total_pages = (uint32_t)(top / PAGE_SIZE);
+    bitmap_words = (total_pages + 31) / 32;
+    summary_words = (bitmap_words + 31) / 32;
+    
+    // Place the metadata in usable RAM after the kernel image, above the
+    // low-memory area that holds the boot stack and BIOS data
+    uint32_t metadata_size = (3 * bitmap_words + summary_words) * 4 + ((total_pages * 2 + 3) & ~3u);
+    uint32_t lowest = (uint32_t)kernel_end > PMM_METADATA_MIN ? (uint32_t)kernel_end : PMM_METADATA_MIN;
+    uint64_t metadata = 0;
+    for (uint32_t i = 0; i < entries && metadata == 0; i++) {
+        if (map[i].type != E820_USABLE) {
+            continue;
+        }
+        uint64_t start = map[i].base > lowest ? map[i].base : lowest;
+        start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (start + metadata_size <= entry_end(&map[i])) {
+            metadata = start;
+        }
+    }
+    if (metadata == 0) {
+        print("PMM: No room for the page bitmap, halting\n");
+        while (1) {
+            __asm__ __volatile__("cli; hlt");
+        }
+    }
+    
+    memory_bitmap = (uint32_t*)(uint32_t)metadata;
+    reserved_bitmap = memory_bitmap + bitmap_words;
+    bench_filler = reserved_bitmap + bitmap_words;
+    summary_bitmap = bench_filler + bitmap_words;
+    ref_counts = (uint16_t*)(summary_bitmap + summary_words);
+    
+    for (uint32_t i = 0; i < total_pages; i++) {
+        ref_counts[i] = 0;
+    }
+    
+    // Everything starts reserved; only usable regions are released
+    for (uint32_t i = 0; i < bitmap_words; i++) {
+        memory_bitmap[i] = 0xFFFFFFFF;
+        reserved_bitmap[i] = 0xFFFFFFFF;
+    }
+    for (uint32_t i = 0; i < entries; i++) {
+        if (map[i].type == E820_USABLE && map[i].base < PMM_MAX_ADDRESS) {
+            uint32_t first = (uint32_t)((map[i].base + PAGE_SIZE - 1) / PAGE_SIZE);
+            uint32_t last = (uint32_t)(entry_end(&map[i]) / PAGE_SIZE);
+            mark_pages(memory_bitmap, first, last, 0);
+            mark_pages(reserved_bitmap, first, last, 0);
+        }
+    }
+    
+    // Overlapping non-usable entries win over usable ones
+    for (uint32_t i = 0; i < entries; i++) {
+        if (map[i].type != E820_USABLE) {
+            reserve_range(map[i].base, map[i].base + map[i].length);
+        }
+    }
+    
+    // Memory the kernel is already using
+    for (uint32_t i = 0; i < sizeof(boot_reserved) / sizeof(boot_reserved[0]); i++) {
+        reserve_range(boot_reserved[i].start, boot_reserved[i].end);
+    }
+    reserve_range((uint32_t)kernel_start, (uint32_t)kernel_end);
+    reserve_range(metadata, metadata + metadata_size);
+    
+    // Hand the highest usable 4MB-aligned window to the buddy allocator
+    // Its pages stay set in the bitmap so the single-page path skips them
+    uint32_t zone_bytes = BUDDY_ZONE_PAGES * PAGE_SIZE;
+    uint64_t zone = 0;
+    for (uint32_t i = 0; i < entries; i++) {
+        if (map[i].type != E820_USABLE) {
+            continue;
+        }
+        uint64_t end = entry_end(&map[i]) & ~(uint64_t)(zone_bytes - 1);
+        if (end >= zone_bytes && end - zone_bytes >= map[i].base &&
+            end - zone_bytes >= metadata + metadata_size && end - zone_bytes > zone) {
+            zone = end - zone_bytes;
+        }
+    }
+    uint32_t zone_base = (uint32_t)(zone / PAGE_SIZE);
+    uint32_t zone_pages = zone ? BUDDY_ZONE_PAGES : 0;
+    
+    // The window must not cover anything reserved by an overlapping entry
+    for (uint32_t w = zone_base / 32; w < (zone_base + zone_pages) / 32; w++) {
+        if (reserved_bitmap[w] != 0) {
+            print("PMM: Buddy zone overlaps reserved memory, disabled\n");
+            zone_base = 0;
+            zone_pages = 0;
+            break;
+        }
+    }
+    mark_pages(memory_bitmap, zone_base, zone_base + zone_pages, 1);
+    buddy_init(zone_base, zone_pages);
+    
+    // Build the summary and the counters from the final bitmap
+    reserved_pages = 0;
+    free_pages = 0;
+    for (uint32_t i = 0; i < summary_words; i++) {
+        summary_bitmap[i] = 0;
+    }
+    for (uint32_t w = 0; w < summary_words * 32; w++) {
+        if (w >= bitmap_words || memory_bitmap[w] == 0xFFFFFFFF) {
+            summary_bitmap[w / 32] |= (1 << (w % 32));
+        }
+        if (w < bitmap_words) {
+            reserved_pages += popcount(reserved_bitmap[w]);
+            free_pages += 32 - popcount(memory_bitmap[w]);
+        }
+    }
+    
+    // Bits past the last page are set in both bitmaps; don't count them
+    reserved_pages -= bitmap_words * 32 - total_pages;
+    used_pages = total_pages - free_pages - zone_pages;
+    next_fit_word = 0;
+    
+    zero_count = 0;
+    zero_stats.hits = 0;
+    zero_stats.misses = 0;
+    zero_stats.miss_cycles = 0;
+    zero_stats.background_zeroed = 0;
+    
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        page_cache[cpu].count = 0;
+        page_cache[cpu].alloc_hits = 0;
+        page_cache[cpu].alloc_misses = 0;
+        page_cache[cpu].free_hits = 0;
+        page_cache[cpu].free_misses = 0;
+    }
     
     print("PMM initialized\n");
-    print("Total memory: ");
-    print_hex(MEMORY_SIZE);
-    print(" bytes (");
-    print_hex(MEMORY_SIZE / (1024 * 1024));
-    print(" MB)\n");
+    print("Managed memory: ");
+    print_dec(total_pages * (PAGE_SIZE / 1024));
+    print(" KB\n");
     
     print("Page size: ");
     print_hex(PAGE_SIZE);
     print(" bytes\n");
     
     print("Total pages: ");
-    print_hex(TOTAL_PAGES);
+    print_hex(total_pages);
     print("\n");
     
     print("Free pages: ");
@@ -84,70 +497,429 @@ void pmm_init() {
     
     print("Reserved pages: ");
     print_hex(reserved_pages);
-    print(" (first 1MB)\n");
+    print(" (holes, firmware, ACPI, kernel)\n");
+    
+    print("Page bitmap at: ");
+    print_hex((uint32_t)metadata);
+    print("\n");
+    
+    print("Buddy zone: ");
+    print_hex(zone_base * PAGE_SIZE);
+    print(" (");
+    print_hex(zone_pages);
+    print(" pages)\n");
 }
 
-// Allocate a physical page
-uint32_t pmm_alloc() {
-    uint32_t page = find_free_page();
+// Helper: Take a page from the magazine, the bitmap or the buddy zone
+// Returns 0 quietly when all three are empty; the zeroed pool is left alone
+static uint32_t take_page() {
+    uint32_t flags = irq_save();
+    pmm_cache_t* cache = &page_cache[this_cpu()];
     
-    if (page == 0xFFFFFFFF) {
-        print("PMM: Out of memory!\n");
-        return 0;
+    if (cache->count > 0) {
+        cache->alloc_hits++;
+    } else {
+        // Magazine empty - refill it from the global bitmap in one go
+        cache->alloc_misses++;
+        spin_lock(&pmm_lock);
+        uint32_t got = bitmap_alloc_batch(PMM_CACHE_BATCH, cache->pages);
+        spin_unlock(&pmm_lock);
+        for (uint32_t i = 0; i < got; i++) {
+            cache->pages[i] *= PAGE_SIZE;
+        }
+        cache->count = got;
     }
     
-    bitmap_set(page);
-    free_pages--;
-    used_pages++;
+    if (cache->count > 0) {
+        uint32_t addr = cache->pages[--cache->count];
+        irq_restore(flags);
+        return addr;
+    }
+    
+    // Bitmap exhausted - fall back to single pages from the buddy zone
+    spin_lock(&pmm_lock);
+    uint32_t page = buddy_alloc(0);
+    spin_unlock(&pmm_lock);
+    irq_restore(flags);
+    
+    if (page == BUDDY_NO_BLOCK) {
+        return 0;
+    }
     
     // Return physical address
     return page * PAGE_SIZE;
 }
 
+// Helper: Allocate a physical page (pmm_alloc without the tracepoint)
+static uint32_t alloc_page() {
+    uint32_t addr = take_page();
+    if (addr != 0) {
+        return addr;
+    }
+    
+    // Last resort: reclaim a page from the zeroed pool
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (zero_count > 0) {
+        addr = zero_pool[--zero_count];
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    if (addr == 0) {
+        print("PMM: Out of memory!\n");
+    }
+    return addr;
+}
+
+// Allocate a physical page
+uint32_t pmm_alloc() {
+    uint32_t addr = alloc_page();
+    trace_event(TRACE_PMM_ALLOC, addr, 0, 0);
+    return addr;
+}
+
 // Free a physical page
+// A page still sitting in a magazine is not detected as a double free
 void pmm_free(uint32_t addr) {
-    // Check alignment
-    if (addr % PAGE_SIZE != 0) {
-        print("PMM: Invalid address (not page-aligned)\n");
+    trace_event(TRACE_PMM_FREE, addr, 0, 0);
+    uint32_t flags = irq_save();
+    
+    if (!check_free(addr)) {
+        irq_restore(flags);
         return;
     }
     
-    uint32_t page = addr / PAGE_SIZE;
+    pmm_cache_t* cache = &page_cache[this_cpu()];
     
-    // Check bounds
-    if (page >= TOTAL_PAGES) {
-        print("PMM: Invalid address (out of bounds)\n");
-        return;
+    if (cache->count < PMM_CACHE_SIZE) {
+        cache->free_hits++;
+    } else {
+        // Magazine full - drain the oldest pages, keep the cache-warm ones
+        cache->free_misses++;
+        pmm_free_batch(PMM_CACHE_BATCH, cache->pages);
+        for (uint32_t i = PMM_CACHE_BATCH; i < PMM_CACHE_SIZE; i++) {
+            cache->pages[i - PMM_CACHE_BATCH] = cache->pages[i];
+        }
+        cache->count -= PMM_CACHE_BATCH;
     }
     
-    // Check if page is actually allocated
-    if (!bitmap_test(page)) {
-        print("PMM: Warning - freeing already free page\n");
+    cache->pages[cache->count++] = addr;
+    irq_restore(flags);
+}
+
+// Helper: Clear one page (identity-mapped)
+static void zero_page(uint32_t addr) {
+    uint32_t* page = (uint32_t*)addr;
+    for (int i = 0; i < PAGE_SIZE / 4; i++) {
+        page[i] = 0;
+    }
+}
+
+// Allocate a zero-filled page, preferring the pre-zeroed pool
+uint32_t pmm_alloc_zeroed() {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (zero_count > 0) {
+        uint32_t addr = zero_pool[--zero_count];
+        zero_stats.hits++;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        trace_event(TRACE_PMM_ALLOC, addr, 0, 0);
+        return addr;
+    }
+    zero_stats.misses++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    // Pool empty - zero synchronously on the caller's time
+    uint64_t start = rdtsc();
+    uint32_t addr = pmm_alloc();
+    if (addr != 0) {
+        zero_page(addr);
+    }
+    zero_stats.miss_cycles += (uint32_t)(rdtsc() - start);
+    return addr;
+}
+
+// Zero up to count pages into the pool (called with interrupts enabled)
+// Returns the number of pages added; 0 means the pool is full or memory
+// has run out (pages are never taken back out of the pool to refill it)
+uint32_t pmm_zero_pool_refill(uint32_t count) {
+    uint32_t added = 0;
+    
+    while (added < count && zero_count < PMM_ZERO_POOL_SIZE) {
+        uint32_t addr = take_page();
+        if (addr == 0) {
+            break;
+        }
+        
+        // The slow part runs with interrupts on, so the idle task stays
+        // preemptible
+        zero_page(addr);
+        
+        uint32_t flags = spin_lock_irqsave(&pmm_lock);
+        if (zero_count < PMM_ZERO_POOL_SIZE) {
+            zero_pool[zero_count++] = addr;
+            zero_stats.background_zeroed++;
+            spin_unlock_irqrestore(&pmm_lock, flags);
+        } else {
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            pmm_free(addr);
+            break;
+        }
+        added++;
+    }
+    return added;
+}
+
+// Get the number of pages waiting in the zeroed pool
+uint32_t pmm_get_zero_pool_pages() {
+    return zero_count;
+}
+
+// Get zeroed-pool statistics
+const pmm_zero_stats_t* pmm_get_zero_stats() {
+    return &zero_stats;
+}
+
+// Allocate up to count pages straight from the global bitmap
+// Returns the number of physical addresses written to pages
+uint32_t pmm_alloc_batch(uint32_t count, uint32_t* pages) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t got = bitmap_alloc_batch(count, pages);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    for (uint32_t i = 0; i < got; i++) {
+        pages[i] *= PAGE_SIZE;
+    }
+    return got;
+}
+
+// Free count pages straight to the global bitmap
+// The checks only read the bitmap, so the lock is taken per page released
+void pmm_free_batch(uint32_t count, const uint32_t* pages) {
+    uint32_t flags = irq_save();
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (check_free(pages[i])) {
+            spin_lock(&pmm_lock);
+            bitmap_clear(pages[i] / PAGE_SIZE);
+            free_pages++;
+            used_pages--;
+            spin_unlock(&pmm_lock);
+        }
+    }
+    
+    irq_restore(flags);
+}
+
+// Allocate 2^order physically contiguous pages (returns physical address)
+uint32_t pmm_alloc_order(uint32_t order) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t page = buddy_alloc(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    if (page == BUDDY_NO_BLOCK) {
+        print("PMM: No contiguous block of order ");
+        print_dec(order);
+        print("\n");
+        trace_event(TRACE_PMM_ALLOC, 0, order, 0);
+        return 0;
+    }
+    
+    trace_event(TRACE_PMM_ALLOC, page * PAGE_SIZE, order, 0);
+    return page * PAGE_SIZE;
+}
+
+// Free a block returned by pmm_alloc_order
+void pmm_free_order(uint32_t addr, uint32_t order) {
+    trace_event(TRACE_PMM_FREE, addr, order, 0);
+    int result = -1;
+    if (addr % (PAGE_SIZE << order) == 0) {
+        uint32_t flags = spin_lock_irqsave(&pmm_lock);
+        result = buddy_free(addr / PAGE_SIZE, order);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+    if (result != 0) {
+        print("PMM: Invalid contiguous block free\n");
+    }
+}
+
+// Take the allocator lock for direct buddy_* calls
+uint32_t pmm_lock_irqsave() {
+    return spin_lock_irqsave(&pmm_lock);
+}
+
+// Drop the allocator lock
+void pmm_unlock_irqrestore(uint32_t flags) {
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// Add a reference to an allocated page (e.g. a frame shared copy-on-write)
+void pmm_ref(uint32_t addr) {
+    uint32_t page = addr / PAGE_SIZE;
+    if (page >= total_pages) {
         return;
     }
     
-    // Don't allow freeing reserved pages (first 1MB)
-    if (page < 256) {
-        print("PMM: Cannot free reserved page\n");
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (ref_counts[page] < 0xFFFF) {
+        ref_counts[page]++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// Drop a reference to a page, freeing it when the last one goes
+void pmm_unref(uint32_t addr) {
+    uint32_t page = addr / PAGE_SIZE;
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    
+    if (page < total_pages && ref_counts[page] > 0) {
+        ref_counts[page]--;
+        spin_unlock_irqrestore(&pmm_lock, flags);
         return;
     }
     
-    bitmap_clear(page);
-    free_pages++;
-    used_pages--;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    pmm_free(addr);
+}
+
+// Get the number of references to an allocated page
+uint32_t pmm_get_refs(uint32_t addr) {
+    uint32_t page = addr / PAGE_SIZE;
+    return page < total_pages ? ref_counts[page] + 1u : 1;
+}
+
+// Helper: Pages currently parked in per-CPU magazines
+static uint32_t cached_pages() {
+    uint32_t total = 0;
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        total += page_cache[cpu].count;
+    }
+    return total;
 }
 
 // Get number of free pages
 uint32_t pmm_get_free_pages() {
-    return free_pages;
+    return free_pages + cached_pages() + zero_count + buddy_get_free_pages();
 }
 
 // Get number of used pages
 uint32_t pmm_get_used_pages() {
-    return used_pages;
+    return used_pages - cached_pages() - zero_count + buddy_get_total_pages() - buddy_get_free_pages();
 }
 
 // Get total number of pages
 uint32_t pmm_get_total_pages() {
-    return TOTAL_PAGES;
+    return total_pages;
+}
+
+// Get number of reserved pages
+uint32_t pmm_get_reserved_pages() {
+    return reserved_pages;
+}
+
+// Get number of CPUs with a page magazine
+uint32_t pmm_get_cache_cpus() {
+    return smp_cpu_count();
+}
+
+// Get the page magazine of a CPU
+const pmm_cache_t* pmm_get_cache(uint32_t cpu) {
+    return &page_cache[cpu];
+}
+
+// ============ Benchmark ============
+
+#define BENCH_BATCH  32     // Pages held at once per round
+#define BENCH_ROUNDS 64     // Rounds per measurement
+
+// Helper: Small LCG so the filler pages are scattered across memory
+static uint32_t bench_random(uint32_t* state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+// Helper: Time BENCH_ROUNDS rounds of BENCH_BATCH allocs followed by frees
+// Each round holds pmm_lock, like pmm_alloc_batch
+static uint32_t bench_run(int linear) {
+    uint32_t held[BENCH_BATCH];
+    uint32_t ops = 0;
+    uint64_t start = rdtsc();
+    
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint32_t flags = spin_lock_irqsave(&pmm_lock);
+        int count = 0;
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            uint32_t page = linear ? find_free_page_linear() : find_free_page();
+            if (page == 0xFFFFFFFF) {
+                break;
+            }
+            claim_page(page);
+            held[count++] = page;
+        }
+        for (int i = 0; i < count; i++) {
+            release_page(held[i]);
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        ops += count;
+    }
+    
+    return div_u64_u32(rdtsc() - start, ops);
+}
+
+// Measure alloc/free cost at 10%, 50% and 95% occupancy, comparing the
+// original bit-at-a-time scan against the summary bitmap search
+void pmm_benchmark() {
+    static const uint32_t occupancy[] = { 10, 50, 95 };
+    uint32_t seed = 0x2545F491;
+    
+    print("\nPMM benchmark (cycles per alloc+free, ");
+    print_dec(BENCH_ROUNDS * BENCH_BATCH);
+    print(" pairs)\n");
+    print("  Occupancy   Linear scan   Summary bitmap\n");
+    
+    for (uint32_t t = 0; t < sizeof(occupancy) / sizeof(occupancy[0]); t++) {
+        for (uint32_t i = 0; i < bitmap_words; i++) {
+            bench_filler[i] = 0;
+        }
+        
+        // Scatter filler pages until the target share of bitmap bits is set
+        // (the buddy zone counts as set, it is never searched)
+        uint32_t target = total_pages / 100 * occupancy[t];
+        uint32_t zone = buddy_get_total_pages();
+        uint32_t flags = spin_lock_irqsave(&pmm_lock);
+        while (used_pages + zone < target && free_pages > BENCH_BATCH) {
+            uint32_t page = bench_random(&seed) % total_pages;
+            if (!bitmap_test(page)) {
+                claim_page(page);
+                bench_filler[page / 32] |= (1 << (page % 32));
+            }
+        }
+        next_fit_word = 0;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        uint32_t linear = bench_run(1);
+        
+        flags = spin_lock_irqsave(&pmm_lock);
+        next_fit_word = 0;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        uint32_t summary = bench_run(0);
+        
+        print("  ");
+        print_dec(occupancy[t]);
+        print("%         ");
+        print_dec(linear);
+        print("          ");
+        print_dec(summary);
+        print("\n");
+        
+        // Give the filler pages back
+        flags = spin_lock_irqsave(&pmm_lock);
+        for (uint32_t w = 0; w < bitmap_words; w++) {
+            while (bench_filler[w]) {
+                uint32_t bit = bsf(bench_filler[w]);
+                bench_filler[w] &= ~(1 << bit);
+                release_page(w * 32 + bit);
+            }
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+    
+    print("\n");
 }
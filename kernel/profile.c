@@ -0,0 +1,374 @@
+// Profiler Implementation
+// Per-CPU sample histograms, call chains, the report and the serial export
+
+#include "profile.h"
+#include "clock.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "smp.h"
+#include "symbols.h"
+#include "timer.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// Only its own CPU writes a CPU's buffers, from the timer interrupt, so
+// sampling takes no lock
+typedef struct {
+    profile_slot_t* slots;      // 0 until profile_start allocates them
+    profile_chain_t* chains;    // Allocated when call chains are first asked for
+    uint32_t chain_count;
+    uint32_t samples;           // Kernel-mode samples
+    uint32_t user;              // Samples that interrupted ring 3
+    uint32_t dropped;           // Kernel samples the histogram had no slot for
+    uint32_t chains_lost;       // Samples after the chain log filled
+} profile_cpu_t;
+
+static profile_cpu_t cpus[SMP_MAX_CPUS];
+
+volatile int profile_running = 0;
+static int recording_chains = 0;
+static int saved_tickless = 1;
+static uint32_t start_tick = 0;
+static uint32_t stop_tick = 0;
+
+// Helper: Count a sample for an address
+static void histogram_add(profile_cpu_t* cpu, uint32_t addr) {
+    uint32_t hash = (addr * 2654435761u) >> (32 - PROFILE_SLOTS_BITS);
+    for (uint32_t i = 0; i < PROFILE_PROBES; i++) {
+        profile_slot_t* slot = &cpu->slots[(hash + i) & (PROFILE_SLOTS - 1)];
+        if (slot->addr == addr && slot->count) {
+            slot->count++;
+            return;
+        }
+        if (slot->count == 0) {
+            slot->addr = addr;
+            slot->count = 1;
+            return;
+        }
+    }
+    cpu->dropped++;
+}
+
+// Helper: Follow the saved EBP chain from the interrupted frame
+// Frames are only read inside the current task's stack, moving up it, and
+// a return address has to point into the kernel's code; without frame
+// pointers the walk stops at the first EBP that fails these checks.
+static uint32_t walk_frames(registers_t* regs, uint32_t* pc) {
+    pc[0] = regs->eip;
+    uint32_t depth = 1;
+    
+    task_t* task = task_current();
+    if (!task || !task->stack_base) {
+        return depth;
+    }
+    uint32_t low = task->stack_base;
+    uint32_t high = task->stack_base + task->stack_size;
+    
+    uint32_t fp = regs->ebp;
+    while (depth < PROFILE_MAX_DEPTH && fp >= low && fp <= high - 8 && !(fp & 3)) {
+        uint32_t* frame = (uint32_t*)fp;
+        if (!symbol_in_text(frame[1])) {
+            break;
+        }
+        pc[depth++] = frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+    return depth;
+}
+
+// Record one sample from a timer interrupt
+void profile_sample(registers_t* regs) {
+    profile_cpu_t* cpu = &cpus[smp_cpu_id()];
+    if (!cpu->slots) {
+        return;
+    }
+    
+    if (regs->cs & 3) {
+        cpu->user++;
+        return;
+    }
+    cpu->samples++;
+    histogram_add(cpu, regs->eip);
+    
+    if (recording_chains && cpu->chains) {
+        if (cpu->chain_count < PROFILE_CHAINS) {
+            profile_chain_t* chain = &cpu->chains[cpu->chain_count++];
+            chain->depth = walk_frames(regs, chain->pc);
+        } else {
+            cpu->chains_lost++;
+        }
+    }
+}
+
+// Empty the histograms and start sampling
+int profile_start(int callchains) {
+    profile_stop();
+    
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!smp_cpu_online(i)) {
+            continue;
+        }
+        profile_cpu_t* cpu = &cpus[i];
+        if (!cpu->slots) {
+            cpu->slots = (profile_slot_t*)pmm_alloc_order(PROFILE_SLOTS_ORDER);
+        }
+        if (callchains && !cpu->chains) {
+            cpu->chains = (profile_chain_t*)pmm_alloc_order(PROFILE_CHAIN_ORDER);
+        }
+        if (!cpu->slots || (callchains && !cpu->chains)) {
+            print("Profile: Cannot allocate sample buffers\n");
+            return -1;
+        }
+    }
+    
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        profile_cpu_t* cpu = &cpus[i];
+        if (cpu->slots) {
+            for (uint32_t s = 0; s < PROFILE_SLOTS; s++) {
+                cpu->slots[s].addr = 0;
+                cpu->slots[s].count = 0;
+            }
+        }
+        cpu->chain_count = 0;
+        cpu->samples = 0;
+        cpu->user = 0;
+        cpu->dropped = 0;
+        cpu->chains_lost = 0;
+    }
+    
+    // A stopped tick would leave a busy CPU 0 unsampled
+    saved_tickless = timer_get_tickless();
+    timer_set_tickless(0);
+    
+    recording_chains = callchains;
+    start_tick = timer_get_ticks();
+    __sync_synchronize();
+    profile_running = 1;
+    return 0;
+}
+
+// Stop sampling
+void profile_stop() {
+    if (!profile_running) {
+        return;
+    }
+    profile_running = 0;
+    __sync_synchronize();
+    stop_tick = timer_get_ticks();
+    timer_set_tickless(saved_tickless);
+    
+    // Another CPU may be inside profile_sample, which runs with interrupts
+    // off for well under this long (100us)
+    uint64_t start = clock_cycles();
+    while (clock_cycles() - start < (uint64_t)clock_tsc_khz() / 10) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+// Helper: Print a number right-aligned in width columns
+static void print_padded(uint32_t value, uint32_t width) {
+    uint32_t digits = 1;
+    for (uint32_t rest = value / 10; rest; rest /= 10) {
+        digits++;
+    }
+    for (; digits < width; digits++) {
+        print(" ");
+    }
+    print_dec(value);
+}
+
+// Print the functions with the most samples
+void profile_report(uint32_t lines) {
+    uint32_t samples = 0, user = 0, dropped = 0, chains = 0, chains_lost = 0, online = 0;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (cpus[i].slots) {
+            online++;
+        }
+        samples += cpus[i].samples;
+        user += cpus[i].user;
+        dropped += cpus[i].dropped;
+        chains += cpus[i].chain_count;
+        chains_lost += cpus[i].chains_lost;
+    }
+    uint32_t total = samples + user;
+    uint32_t ticks = (profile_running ? timer_get_ticks() : stop_tick) - start_tick;
+    
+    print("\nProfile ");
+    print(profile_running ? "running" : "stopped");
+    print(": ");
+    print_dec(total);
+    print(" samples over ");
+    print_dec(ticks / TIMER_HZ);
+    print(".");
+    print_dec(ticks % TIMER_HZ * 10 / TIMER_HZ);
+    print("s on ");
+    print_dec(online);
+    print(" CPU(s) at ");
+    print_dec(TIMER_HZ);
+    print(" Hz\n");
+    if (!total) {
+        print("\n");
+        return;
+    }
+    
+    // Per-function counts; the last entry collects addresses no symbol covers
+    uint32_t* counts = (uint32_t*)kmalloc((ksym_count + 1) * sizeof(uint32_t));
+    if (!counts) {
+        print("Profile: Out of memory\n\n");
+        return;
+    }
+    for (uint32_t i = 0; i <= ksym_count; i++) {
+        counts[i] = 0;
+    }
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!cpus[i].slots) {
+            continue;
+        }
+        for (uint32_t s = 0; s < PROFILE_SLOTS; s++) {
+            const profile_slot_t* slot = &cpus[i].slots[s];
+            if (slot->count) {
+                counts[symbol_index(slot->addr)] += slot->count;
+            }
+        }
+    }
+    
+    print("  Samples  Share   Function\n");
+    for (uint32_t line = 0; line < lines; line++) {
+        uint32_t best = 0;
+        for (uint32_t i = 1; i < ksym_count; i++) {
+            if (counts[i] > counts[best]) {
+                best = i;
+            }
+        }
+        if (ksym_count == 0 || counts[best] == 0) {
+            break;
+        }
+        
+        // Tenths of a percent
+        uint32_t share = counts[best] * 1000 / total;
+        print_padded(counts[best], 9);
+        print_padded(share / 10, 6);
+        print(".");
+        print_dec(share % 10);
+        print("%   ");
+        print(&ksym_names[ksyms[best].name]);
+        print("\n");
+        counts[best] = 0;
+    }
+    
+    uint32_t unknown = counts[ksym_count];
+    kfree(counts);
+    
+    if (user) {
+        print_padded(user, 9);
+        print("          [user mode]\n");
+    }
+    if (unknown) {
+        print_padded(unknown, 9);
+        print(ksym_count ? "          [outside kernel code]\n" :
+                           "          [no symbol table linked]\n");
+    }
+    if (dropped) {
+        print_padded(dropped, 9);
+        print("          [histogram full, not counted]\n");
+    }
+    if (recording_chains) {
+        print("  Call chains: ");
+        print_dec(chains);
+        print(" recorded, ");
+        print_dec(chains_lost);
+        print(" after the log filled\n");
+    }
+    print("\n");
+}
+
+// Helper: Send a number in hex or decimal
+static void send_hex(uint32_t value) {
+    char text[11] = "0x";
+    for (int i = 0; i < 8; i++) {
+        text[2 + i] = "0123456789abcdef"[(value >> (28 - 4 * i)) & 0xF];
+    }
+    text[10] = '\0';
+    serial_print(text);
+}
+
+static void send_dec(uint32_t value) {
+    char text[11];
+    int pos = 10;
+    text[pos] = '\0';
+    do {
+        text[--pos] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    serial_print(&text[pos]);
+}
+
+// Stop sampling and send the raw samples over the serial port
+int profile_export() {
+    if (!serial_present()) {
+        print("\nProfile: No serial port\n\n");
+        return -1;
+    }
+    profile_stop();
+    
+    // Text, one sample group per line:
+    //   pc <cpu> <count> <addr>            histogram entry
+    //   stack <cpu> <addr> <ret> ...       call chain, innermost first
+    //   user <cpu> <count>                 samples in ring 3
+    serial_print("# corex profile ");
+    send_dec(TIMER_HZ);
+    serial_print(" Hz\n");
+    
+    uint32_t lines = 0;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        const profile_cpu_t* cpu = &cpus[i];
+        if (!cpu->slots) {
+            continue;
+        }
+        for (uint32_t s = 0; s < PROFILE_SLOTS; s++) {
+            if (!cpu->slots[s].count) {
+                continue;
+            }
+            serial_print("pc ");
+            send_dec(i);
+            serial_print(" ");
+            send_dec(cpu->slots[s].count);
+            serial_print(" ");
+            send_hex(cpu->slots[s].addr);
+            serial_print("\n");
+            lines++;
+        }
+        for (uint32_t c = 0; c < cpu->chain_count; c++) {
+            const profile_chain_t* chain = &cpu->chains[c];
+            serial_print("stack ");
+            send_dec(i);
+            for (uint32_t d = 0; d < chain->depth; d++) {
+                serial_print(" ");
+                send_hex(chain->pc[d]);
+            }
+            serial_print("\n");
+            lines++;
+        }
+        if (cpu->user) {
+            serial_print("user ");
+            send_dec(i);
+            serial_print(" ");
+            send_dec(cpu->user);
+            serial_print("\n");
+        }
+    }
+    serial_print("# end\n");
+    
+    print("\nProfile: Sent ");
+    print_dec(lines);
+    print(" lines over COM1\n\n");
+    return 0;
+}
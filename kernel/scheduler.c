@@ -1,95 +1,417 @@
 // Task Scheduler Implementation
-// Cooperative round-robin multitasking
+// Preemptive priority scheduling with per-CPU O(1) bitmap run queues
 
 #include "scheduler.h"
 #include "pmm.h"
+#include "kmalloc.h"
+#include "paging.h"
+#include "vmm.h"
+#include "smp.h"
+#include "gdt.h"
+#include "spinlock.h"
+#include "trace.h"
 
 // External print functions
 extern void print(const char* str);
 extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
 
-// Task list
-static task_t tasks[MAX_TASKS];
-static task_t* current_task = 0;
-static task_t* task_list_head = 0;
-static uint32_t next_task_id = 0;
+// Tasks
+// TCBs come from a slab cache and stacks from the vmm stack window.
+// A task that exits is parked on the zombie list until another task
+// frees its memory (it cannot free the stack it is running on).
+static kmem_cache_t* task_cache = 0;
+static spinlock_t zombie_lock = SPINLOCK_INIT;
+static task_t* zombies = 0;
+static volatile uint32_t next_task_id = 0;
 static int scheduler_enabled = 0;
 
+// Run queues: one FIFO of READY tasks per priority, plus a bitmap with
+// bit p set while queue p is non-empty. The running task is never queued.
+typedef struct {
+    task_t* head;
+    task_t* tail;
+} run_queue_t;
+
+// Per-CPU scheduler state
+// Each CPU runs tasks from its own queues, so the common paths only take
+// the local lock. The lock also covers the state of every task queued on
+// or running from this CPU; a task changes CPUs only when an idle CPU
+// steals it from a queue.
+typedef struct {
+    spinlock_t lock;
+    task_t* current;                    // 0 until the CPU starts scheduling
+    task_t* idle;
+    task_t* prev;                       // Task being switched away from
+    run_queue_t queues[SCHED_PRIORITIES];
+    uint32_t ready_bitmap;
+    volatile uint32_t ready_count;      // Queued tasks, the idle task excluded
+    uint32_t slice_left;
+    volatile int need_resched;
+    volatile int kicked;                // Resched IPI sent to the halted idle task
+    uint64_t switch_stamp;              // TSC at the last context switch
+    uint64_t halt_stamp;                // TSC at which the idle task halted
+    uint64_t halted_cycles;             // Total time the idle task spent in hlt
+    volatile int idle_halted;           // Idle task is (or was just) in hlt
+} sched_cpu_t;
+
+static sched_cpu_t sched_cpus[SMP_MAX_CPUS];
+
+#define IDLE_BIT (1u << SCHED_PRIORITY_IDLE)
+
+// Time slicing
+static uint32_t quantum = SCHED_QUANTUM_TICKS;
+static sched_stats_t stats;
+
 // Assembly function to switch tasks
-extern void switch_task(uint32_t* old_esp, uint32_t new_esp);
+extern void switch_task(uint32_t* old_esp, uint32_t new_esp, uint32_t new_cr3);
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+// Helper: Bit scan forward (index of lowest set bit, value must be non-zero)
+static inline uint32_t bsf(uint32_t value) {
+    uint32_t index;
+    __asm__ __volatile__("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: This CPU's scheduler state (interrupts must be off, or the
+// caller could move to another CPU before using it)
+static inline sched_cpu_t* this_rq() {
+    return &sched_cpus[smp_cpu_id()];
+}
+
+// Helper: Append a task to the tail of its priority's run queue (rq locked)
+static void enqueue(sched_cpu_t* rq, task_t* task) {
+    // A second runnable task needs time slices again (only the bootstrap
+    // processor ever stops its tick)
+    if (rq == &sched_cpus[0] && !(rq->ready_bitmap & ~IDLE_BIT) &&
+        task->priority != SCHED_PRIORITY_IDLE) {
+        timer_tick_restart();
+    }
+    
+    run_queue_t* queue = &rq->queues[task->priority];
+    task->state = TASK_READY;
+    task->run_next = 0;
+    if (queue->tail) {
+        queue->tail->run_next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+    rq->ready_bitmap |= 1u << task->priority;
+    if (task->priority != SCHED_PRIORITY_IDLE) {
+        rq->ready_count++;
+    }
+}
+
+// Helper: Unlink a queued task; prev is the task before it in its queue
+// (0 for the head)
+static void queue_remove(sched_cpu_t* rq, task_t* task, task_t* prev) {
+    run_queue_t* queue = &rq->queues[task->priority];
+    if (prev) {
+        prev->run_next = task->run_next;
+    } else {
+        queue->head = task->run_next;
+    }
+    if (queue->tail == task) {
+        queue->tail = prev;
+    }
+    if (!queue->head) {
+        rq->ready_bitmap &= ~(1u << task->priority);
+    }
+    if (task->priority != SCHED_PRIORITY_IDLE) {
+        rq->ready_count--;
+    }
+    task->run_next = 0;
+}
+
+// Helper: Remove the first task of the highest non-empty priority
+// (ready_bitmap must be non-zero)
+static task_t* dequeue(sched_cpu_t* rq) {
+    task_t* task = rq->queues[bsf(rq->ready_bitmap)].head;
+    queue_remove(rq, task, 0);
+    return task;
+}
+
+// Helper: Send a resched IPI to one halted idle CPU so it steals work that
+// is queued behind a busy task on rq
+static void kick_idle_cpu(sched_cpu_t* rq) {
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        sched_cpu_t* other = &sched_cpus[cpu];
+        if (other == rq || !other->current || other->current != other->idle ||
+            !other->idle_halted) {
+            continue;
+        }
+        if (!__sync_lock_test_and_set(&other->kicked, 1)) {
+            smp_send_resched(cpu);
+            return;
+        }
+    }
+}
+
+// Helper: Take a task from the CPU with the most queued work
+// A task whose stack is still in use by a switch on its old CPU is left
+// alone, and so are idle tasks.
+static task_t* steal_task(sched_cpu_t* rq) {
+    sched_cpu_t* victim = 0;
+    uint32_t most = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        sched_cpu_t* other = &sched_cpus[cpu];
+        if (other != rq && other->current && other->current != other->idle &&
+            other->ready_count > most) {
+            most = other->ready_count;
+            victim = other;
+        }
+    }
+    if (!victim) {
+        return 0;
+    }
+    
+    task_t* task = 0;
+    spin_lock(&victim->lock);
+    uint32_t ready = victim->ready_bitmap & ~IDLE_BIT;
+    while (ready && !task) {
+        task_t* prev = 0;
+        for (task_t* t = victim->queues[bsf(ready)].head; t; prev = t, t = t->run_next) {
+            if (!t->on_cpu) {
+                queue_remove(victim, t, prev);
+                task = t;
+                break;
+            }
+        }
+        ready &= ready - 1;
+    }
+    spin_unlock(&victim->lock);
+    return task;
+}
+
+// Helper: Check that this CPU has a task queued, stealing one if its own
+// queues are empty (interrupts off)
+static int idle_pull(sched_cpu_t* rq) {
+    if (rq->ready_bitmap) {
+        return 1;
+    }
+    
+    task_t* task = steal_task(rq);
+    if (!task) {
+        return 0;
+    }
+    
+    // Off every queue until now; a wakeup in between finds it READY and
+    // leaves it alone
+    spin_lock(&rq->lock);
+    task->cpu = rq - sched_cpus;
+    enqueue(rq, task);
+    spin_unlock(&rq->lock);
+    __sync_fetch_and_add(&stats.steals, 1);
+    return 1;
+}
+
+// Helper: Let the task switched away from run elsewhere, now that its
+// stack is no longer in use (interrupts off)
+static void finish_switch(sched_cpu_t* rq) {
+    task_t* prev = rq->prev;
+    rq->prev = 0;
+    if (prev) {
+        prev->on_cpu = 0;
+    }
+}
+
+// Helper: Pick the next task and switch to it
+// Called with rq->lock held and interrupts off; drops the lock.
+static void schedule_locked(sched_cpu_t* rq) {
+    task_t* old_task = rq->current;
+    
+    // Whoever runs next starts a fresh slice
+    rq->slice_left = quantum;
+    
+    // Keep running unless a task of the same or a higher priority is
+    // ready (or the current task blocked or exited)
+    if (old_task->state == TASK_RUNNING) {
+        if (!rq->ready_bitmap || bsf(rq->ready_bitmap) > old_task->priority) {
+            spin_unlock(&rq->lock);
+            return;
+        }
+        enqueue(rq, old_task);
+    } else if (!rq->ready_bitmap) {
+        spin_unlock(&rq->lock);
+        return;
+    } else if (old_task->state == TASK_TERMINATED) {
+        // Reaped by whoever runs scheduler_reap after we are off this stack
+        spin_lock(&zombie_lock);
+        old_task->run_next = zombies;
+        zombies = old_task;
+        spin_unlock(&zombie_lock);
+    }
+    
+    task_t* next_task = dequeue(rq);
+    next_task->state = TASK_RUNNING;
+    if (next_task == old_task) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+    
+    // Charge the outgoing task; an idle task woken from hlt by this
+    // interrupt stops counting as halted now
+    uint64_t now = rdtsc();
+    old_task->cpu_cycles += now - rq->switch_stamp;
+    rq->switch_stamp = now;
+    if (rq->idle_halted && old_task == rq->idle) {
+        rq->halted_cycles += now - rq->halt_stamp;
+        rq->idle_halted = 0;
+    }
+    
+    next_task->on_cpu = 1;
+    rq->current = next_task;
+    rq->prev = old_task;
+    stats.switches++;
+    trace_event(TRACE_SWITCH, old_task->id, next_task->id, 0);
+    spin_unlock(&rq->lock);
+    
+    fpu_switch(old_task);
+    if (next_task->stack_base) {
+        // Where a trap from ring 3 lands (the boot task never runs there)
+        gdt_set_kernel_stack(next_task->stack_base + next_task->stack_size);
+    }
+    paging_set_current(next_task->space);
+    paging_sync_tlb();
+    
+    // Perform context switch (including CR3)
+    switch_task(&old_task->esp, next_task->esp, (uint32_t)next_task->space->directory);
+    
+    // Back on this task's stack, possibly on another CPU than it left
+    finish_switch(this_rq());
+}
 
 // Task entry wrapper
+// (interrupts are off: switch_task popped TASK_INITIAL_EFLAGS)
 static void task_entry() {
-    // Enable interrupts (new tasks start with IF=0 from switch_task)
-    __asm__ __volatile__("sti");
+    sched_cpu_t* rq = this_rq();
+    finish_switch(rq);
     
     // Get the actual task function from the stack
     // Note: We stored the function pointer in the task struct's EIP field
     // purely for storage. It's not used by switch_task (which uses the stack).
-    task_func_t func = (task_func_t)current_task->eip;
+    task_func_t func = (task_func_t)rq->current->eip;
+    __asm__ __volatile__("sti");
     
     // Call the task function
     func();
     
-    // If task returns, mark as terminated
-    current_task->state = TASK_TERMINATED;
+    task_exit();
+}
+
+// End the current task: mark it terminated and leave the CPU for good
+void task_exit() {
+    __asm__ __volatile__("cli");
+    sched_cpu_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->current->state = TASK_TERMINATED;
+    schedule_locked(rq);
     
-    // Yield to next task
-    while(1) {
+    while (1) {
         task_yield();
     }
 }
 
-// Initialize scheduler
-void scheduler_init() {
-    // Clear task array
-    for (int i = 0; i < MAX_TASKS; i++) {
-        tasks[i].state = TASK_TERMINATED;
-        tasks[i].next = 0;
-    }
-    
-    // Create idle task (task 0)
-    tasks[0].id = next_task_id++;
-    tasks[0].state = TASK_RUNNING;
-    tasks[0].next = &tasks[0];  // Points to itself
-    
-    current_task = &tasks[0];
-    task_list_head = &tasks[0];
-    
-    scheduler_enabled = 1;
+// Idle task: free exited tasks, take work from busier CPUs, refill the
+// zeroed-page pool a few pages at a time, and halt until the next
+// interrupt once there is nothing left to do. It has the lowest priority,
+// so any wakeup preempts it. Idle tasks never change CPUs.
+static void idle_loop() {
+    __asm__ __volatile__("cli");
+    sched_cpu_t* rq = this_rq();
+    __asm__ __volatile__("sti");
     
-    print("Scheduler initialized\n");
+    while (1) {
+        scheduler_reap();
+        
+        // Queued or stealable work comes before zeroing pages
+        __asm__ __volatile__("cli");
+        if (idle_pull(rq)) {
+            schedule();
+            __asm__ __volatile__("sti");
+            continue;
+        }
+        __asm__ __volatile__("sti");
+        
+        if (pmm_zero_pool_refill(IDLE_ZERO_BATCH) != 0) {
+            continue;
+        }
+        
+        // sti takes effect after hlt starts, so a wakeup cannot slip in
+        // between the check and the halt
+        __asm__ __volatile__("cli");
+        if (idle_pull(rq)) {
+            schedule();
+        } else {
+            rq->halt_stamp = rdtsc();
+            rq->idle_halted = 1;
+            __asm__ __volatile__("sti; hlt; cli");
+            rq->kicked = 0;
+            if (rq->idle_halted) {
+                rq->halted_cycles += rdtsc() - rq->halt_stamp;
+                rq->idle_halted = 0;
+            }
+        }
+        __asm__ __volatile__("sti");
+    }
 }
 
-// Create a new task
-int task_create(task_func_t func) {
-    if (!scheduler_enabled) {
-        return -1;
-    }
-    
-    // Find free task slot
-    int slot = -1;
-    for (int i = 1; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_TERMINATED) {
-            slot = i;
-            break;
+// Helper: Allocate a task running func in the given address space
+// (the space is destroyed if the task cannot be created)
+static task_t* task_alloc(task_func_t func, address_space_t* space, uint32_t priority,
+                          uint32_t stack_size) {
+    task_t* task = (task_t*)kmem_cache_alloc(task_cache);
+    uint32_t* stack_base = task ? (uint32_t*)vmm_stack_alloc(stack_size) : 0;
+    if (!stack_base) {
+        print("Scheduler: Out of memory for tasks\n");
+        if (task) {
+            kmem_cache_free(task_cache, task);
         }
+        if (space != paging_kernel_space()) {
+            paging_destroy_space(space);
+        }
+        return 0;
     }
-    
-    if (slot == -1) {
-        print("Scheduler: No free task slots\n");
-        return -1;
-    }
-    
-    task_t* task = &tasks[slot];
+    stack_size = (stack_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     
     // Initialize task
-    task->id = next_task_id++;
-    task->state = TASK_READY;
+    task->id = __sync_fetch_and_add(&next_task_id, 1);
+    task->priority = priority;
     task->eip = (uint32_t)func;
+    task->space = space;
+    task->stack_base = (uint32_t)stack_base;
+    task->stack_size = stack_size;
+    task->run_next = 0;
+    task->sleep_timer.pprev = 0;
+    task->cpu_cycles = 0;
+    task->fpu = 0;
+    task->fpu_cpu = FPU_NO_CPU;
+    task->on_cpu = 0;
+    task->wake_pending = 0;
+    task->wait_next = 0;
+    task->wait_queued = 0;
     
     // Set up stack (grows downward)
-    task->esp = (uint32_t)&task->stack[TASK_STACK_SIZE / 4 - 1];
+    task->esp = (uint32_t)stack_base + stack_size - 4;
     task->ebp = task->esp;
     
     // Push initial values on stack for context switch
@@ -97,12 +419,13 @@ int task_create(task_func_t func) {
     
     // Push registers (as they would be saved by switch_task)
     // Stack grows downwards, so we push in reverse order of switch_task pops
-    // switch_task pops: EAX, ECX, EDX, EBX, EDI, ESI, EBP, RET
-    // So we push: EBP, ESI, EDI, EBX, EDX, ECX, EAX
+    // switch_task pops: EAX, ECX, EDX, EBX, EDI, ESI, EBP, EFLAGS, RET
+    // So we push: EFLAGS, EBP, ESI, EDI, EBX, EDX, ECX, EAX
     
     // Return address for switch_task (pops into EIP)
     *(--stack) = (uint32_t)task_entry;
     
+    *(--stack) = TASK_INITIAL_EFLAGS;   // EFLAGS
     *(--stack) = task->ebp;         // EBP
     *(--stack) = 0;                 // ESI
     *(--stack) = 0;                 // EDI
@@ -112,65 +435,625 @@ int task_create(task_func_t func) {
     *(--stack) = 0;                 // EAX
     
     task->esp = (uint32_t)stack;
+    __sync_fetch_and_add(&stats.tasks, 1);
     
-    // Add to task list (circular linked list)
-    task->next = task_list_head->next;
-    task_list_head->next = task;
+    return task;
+}
+
+// Helper: Set up a task running func in the given address space and queue
+// it on this CPU (the space is destroyed if the task cannot be created)
+static int task_start(task_func_t func, address_space_t* space, uint32_t priority,
+                      uint32_t stack_size) {
+    // Recycle the memory of exited tasks first
+    scheduler_reap();
     
-    print("Task created: ID ");
-    print_hex(task->id);
-    print("\n");
+    task_t* task = task_alloc(func, space, priority, stack_size);
+    if (!task) {
+        return -1;
+    }
+    
+    // The timer may call schedule() at any point; queue the task atomically.
+    // Once queued it may run and exit on another CPU, so read the ID first.
+    int id = task->id;
+    uint32_t flags = irq_save();
+    sched_cpu_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    task->cpu = rq - sched_cpus;
+    enqueue(rq, task);
+    spin_unlock(&rq->lock);
+    kick_idle_cpu(rq);
+    irq_restore(flags);
     
-    return task->id;
+    return id;
+}
+
+// Initialize scheduler
+void scheduler_init() {
+    task_cache = kmem_cache_create("task_t", sizeof(task_t));
+    if (!task_cache) {
+        print("Scheduler: Cannot create task cache\n");
+        return;
+    }
+    
+    // The boot thread becomes task 0 (the shell) on the boot stack
+    task_t* boot = (task_t*)kmem_cache_alloc(task_cache);
+    if (!boot) {
+        print("Scheduler: Cannot allocate boot task\n");
+        return;
+    }
+    boot->id = __sync_fetch_and_add(&next_task_id, 1);
+    boot->state = TASK_RUNNING;
+    boot->priority = SCHED_PRIORITY_DEFAULT;
+    boot->stack_base = 0;
+    boot->stack_size = 0;
+    boot->space = paging_kernel_space();
+    boot->run_next = 0;
+    boot->sleep_timer.pprev = 0;
+    boot->cpu_cycles = 0;
+    boot->fpu = 0;
+    boot->fpu_cpu = FPU_NO_CPU;
+    boot->cpu = 0;
+    boot->on_cpu = 1;
+    boot->wake_pending = 0;
+    boot->wait_next = 0;
+    boot->wait_queued = 0;
+    
+    sched_cpu_t* rq = &sched_cpus[0];
+    rq->current = boot;
+    rq->slice_left = quantum;
+    rq->switch_stamp = rdtsc();
+    stats.tasks = 1;
+    
+    scheduler_enabled = 1;
+    
+    // The idle task runs whenever nothing else can, so there is always
+    // something to switch to when a task blocks
+    if (task_start(idle_loop, paging_kernel_space(), SCHED_PRIORITY_IDLE, TASK_STACK_SIZE) < 0) {
+        print("Scheduler: Cannot create idle task\n");
+        scheduler_enabled = 0;
+        return;
+    }
+    rq->idle = rq->queues[SCHED_PRIORITY_IDLE].head;
+    
+    print("Scheduler initialized\n");
+}
+
+// Create the idle task for an application processor
+// Returns the top of its stack, which the AP boots on, or 0
+uint32_t scheduler_cpu_prepare(uint32_t cpu) {
+    if (!scheduler_enabled || cpu == 0 || cpu >= SMP_MAX_CPUS) {
+        return 0;
+    }
+    
+    task_t* idle = task_alloc(idle_loop, paging_kernel_space(), SCHED_PRIORITY_IDLE,
+                              TASK_STACK_SIZE);
+    if (!idle) {
+        return 0;
+    }
+    idle->cpu = cpu;
+    sched_cpus[cpu].idle = idle;
+    
+    // The AP enters scheduler_start_cpu on a fresh stack; the switch frame
+    // task_alloc built is never used
+    return idle->stack_base + idle->stack_size;
+}
+
+// Free the idle task of a CPU that did not come up
+void scheduler_cpu_cancel(uint32_t cpu) {
+    task_t* idle = cpu < SMP_MAX_CPUS ? sched_cpus[cpu].idle : 0;
+    if (!idle || sched_cpus[cpu].current) {
+        return;
+    }
+    sched_cpus[cpu].idle = 0;
+    
+    vmm_stack_free((void*)idle->stack_base, idle->stack_size);
+    kmem_cache_free(task_cache, idle);
+    __sync_fetch_and_sub(&stats.tasks, 1);
+}
+
+// Become this CPU's idle task and start scheduling (never returns)
+void scheduler_start_cpu() {
+    sched_cpu_t* rq = this_rq();
+    task_t* idle = rq->idle;
+    
+    spin_lock(&rq->lock);
+    idle->state = TASK_RUNNING;
+    idle->on_cpu = 1;
+    rq->slice_left = quantum;
+    rq->switch_stamp = rdtsc();
+    rq->current = idle;
+    spin_unlock(&rq->lock);
+    
+    idle_loop();
+}
+
+// Create a new task with its own, empty user address space
+int task_create(task_func_t func, uint32_t priority) {
+    return task_create_sized(func, priority, TASK_STACK_SIZE);
+}
+
+// Create a task with its own user address space and a stack_size stack
+int task_create_sized(task_func_t func, uint32_t priority, uint32_t stack_size) {
+    if (!scheduler_enabled || priority >= SCHED_PRIORITIES) {
+        return -1;
+    }
+    
+    address_space_t* space = paging_create_space();
+    if (!space) {
+        print("Scheduler: Out of memory for address space\n");
+        return -1;
+    }
+    
+    return task_start(func, space, priority, stack_size);
+}
+
+// Create a task sharing a copy-on-write snapshot of the current task's
+// user pages
+int task_clone(task_func_t func) {
+    if (!scheduler_enabled) {
+        return -1;
+    }
+    
+    task_t* self = task_current();
+    address_space_t* space = paging_clone_space(self->space);
+    if (!space) {
+        print("Scheduler: Out of memory for address space\n");
+        return -1;
+    }
+    
+    return task_start(func, space, self->priority, self->stack_size ?
+                      self->stack_size : TASK_STACK_SIZE);
 }
 
 // Yield CPU to next task
 void task_yield() {
-    if (!scheduler_enabled || !current_task) {
+    if (!scheduler_enabled) {
         return;
     }
     
+    uint32_t flags = irq_save();
+    stats.yields++;
     schedule();
+    irq_restore(flags);
 }
 
-// Schedule next task
+// Schedule next task (interrupts must be off)
 void schedule() {
-    if (!scheduler_enabled || !current_task) {
+    if (!scheduler_enabled) {
+        return;
+    }
+    
+    sched_cpu_t* rq = this_rq();
+    if (!rq->current) {
+        return;
+    }
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+}
+
+// Account a timer tick against the running task's slice
+void scheduler_tick() {
+    if (!scheduler_enabled) {
+        return;
+    }
+    
+    sched_cpu_t* rq = this_rq();
+    if (!rq->current) {
         return;
     }
     
-    task_t* old_task = current_task;
-    task_t* next_task = current_task->next;
+    if (rq->slice_left > 1) {
+        rq->slice_left--;
+    } else {
+        rq->need_resched = 1;
+    }
     
-    // Find next ready task
-    int count = 0;
-    while (next_task->state != TASK_READY && 
-           next_task->state != TASK_RUNNING && 
-           count < MAX_TASKS) {
-        next_task = next_task->next;
-        count++;
+    // Only the current task (and at most the idle task) can run: no
+    // slices to enforce, so sleep until the next timeout instead. The
+    // timer wheel lives on the bootstrap processor, so only its tick stops.
+    if (rq == &sched_cpus[0]) {
+        spin_lock(&rq->lock);
+        uint32_t busy = rq->ready_bitmap & ~IDLE_BIT;
+        spin_unlock(&rq->lock);
+        if (!busy) {
+            timer_tick_stop();
+        }
+    }
+}
+
+// Preempt on the way out of an interrupt
+void scheduler_irq_exit() {
+    sched_cpu_t* rq = this_rq();
+    if (!rq->need_resched) {
+        return;
+    }
+    rq->need_resched = 0;
+    
+    spin_lock(&rq->lock);
+    if (rq->ready_bitmap && bsf(rq->ready_bitmap) <= rq->current->priority) {
+        stats.preemptions++;
+    }
+    schedule_locked(rq);
+}
+
+// Handle a resched IPI: another CPU queued a task here, or added a timer
+// the bootstrap processor's stopped tick has to know about
+void scheduler_ipi() {
+    sched_cpu_t* rq = this_rq();
+    if (!scheduler_enabled || !rq->current) {
+        return;
+    }
+    
+    spin_lock(&rq->lock);
+    if (rq->ready_bitmap && bsf(rq->ready_bitmap) < rq->current->priority) {
+        rq->need_resched = 1;
+    }
+    spin_unlock(&rq->lock);
+    
+    if (rq == &sched_cpus[0]) {
+        timer_tick_restart();
+    }
+}
+
+// Get the running task
+task_t* task_current() {
+    uint32_t flags = irq_save();
+    task_t* task = this_rq()->current;
+    irq_restore(flags);
+    return task;
+}
+
+// Block the current task (interrupts must be off)
+void task_block() {
+    if (!scheduler_enabled) {
+        return;
+    }
+    
+    sched_cpu_t* rq = this_rq();
+    if (!rq->current) {
+        return;
+    }
+    
+    spin_lock(&rq->lock);
+    task_t* task = rq->current;
+    if (task->wake_pending) {
+        // Another CPU woke us between deciding to block and getting here
+        task->wake_pending = 0;
+        spin_unlock(&rq->lock);
+        return;
+    }
+    task->state = TASK_BLOCKED;
+    schedule_locked(rq);
+}
+
+// Make a blocked task runnable
+void task_wake(task_t* task) {
+    uint32_t flags = irq_save();
+    
+    // Blocked and running tasks stay put, but a queued one may be stolen:
+    // lock its CPU, then check it is still there
+    sched_cpu_t* rq;
+    while (1) {
+        rq = &sched_cpus[task->cpu];
+        spin_lock(&rq->lock);
+        if (rq == &sched_cpus[task->cpu]) {
+            break;
+        }
+        spin_unlock(&rq->lock);
+    }
+    
+    int target = -1;
+    int spare = 0;
+    if (task->state == TASK_BLOCKED) {
+        enqueue(rq, task);
+        
+        // Preempt at the next IRQ exit or tick if it outranks the task
+        // running there; at equal priority the bootstrap processor's tick
+        // may need restarting, and an idle CPU could take it sooner
+        if (task->priority < rq->current->priority) {
+            if (rq == this_rq()) {
+                rq->need_resched = 1;
+            } else {
+                target = rq - sched_cpus;
+            }
+        } else {
+            if (rq != this_rq() && task->priority == rq->current->priority) {
+                target = rq - sched_cpus;
+            }
+            spare = 1;
+        }
+    } else if (task->state == TASK_RUNNING) {
+        // Still on its way to task_block on another CPU
+        task->wake_pending = 1;
+    }
+    spin_unlock(&rq->lock);
+    
+    if (target >= 0) {
+        smp_send_resched(target);
+    }
+    if (spare) {
+        kick_idle_cpu(rq);
+    }
+    irq_restore(flags);
+}
+
+// Helper: Sleep timer callback (interrupt context)
+static void sleep_expired(void* data) {
+    task_t* task = (task_t*)data;
+    task->wake_stamp = rdtsc();
+    task_wake(task);
+}
+
+// Sleep for a number of ticks
+void task_sleep_ticks(uint32_t ticks) {
+    if (!scheduler_enabled) {
+        return;
     }
     
-    // If no ready task found, stay with current
-    if (count >= MAX_TASKS) {
+    uint32_t flags = irq_save();
+    task_t* task = this_rq()->current;
+    task->wake_tick = timer_get_ticks() + (ticks ? ticks : 1);
+    timer_add(&task->sleep_timer, ticks, sleep_expired, task);
+    
+    // A stray wakeup must not cut the sleep short
+    do {
+        task_block();
+    } while (task->sleep_timer.pprev);
+    
+    // Back on the CPU: how long after the timer fired, and on what tick
+    uint32_t cycles = (uint32_t)(rdtsc() - task->wake_stamp);
+    stats.wakeups++;
+    stats.wake_cycles += cycles;
+    if (cycles > stats.wake_cycles_max) {
+        stats.wake_cycles_max = cycles;
+    }
+    if (timer_get_ticks() != task->wake_tick) {
+        stats.late_wakeups++;
+    }
+    irq_restore(flags);
+}
+
+// Sleep for a number of milliseconds
+void task_sleep_ms(uint32_t ms) {
+    task_sleep_ticks(timer_ms_to_ticks(ms));
+}
+
+void scheduler_set_quantum(uint32_t ticks) {
+    quantum = ticks ? ticks : 1;
+}
+
+uint32_t scheduler_get_quantum() {
+    return quantum;
+}
+
+// Helper: Total time the idle tasks have spent halted
+static uint64_t idle_halted_cycles() {
+    uint64_t cycles = 0;
+    uint32_t flags = irq_save();
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        sched_cpu_t* rq = &sched_cpus[cpu];
+        spin_lock(&rq->lock);
+        cycles += rq->halted_cycles;
+        spin_unlock(&rq->lock);
+    }
+    irq_restore(flags);
+    return cycles;
+}
+
+const sched_stats_t* scheduler_get_stats() {
+    stats.idle_halted = idle_halted_cycles();
+    return &stats;
+}
+
+// Free everything terminated tasks still hold
+void scheduler_reap() {
+    if (!zombies) {
         return;
     }
     
-    // Switch tasks
-    if (old_task != next_task) {
-        old_task->state = (old_task->state == TASK_RUNNING) ? TASK_READY : old_task->state;
-        next_task->state = TASK_RUNNING;
-        current_task = next_task;
+    // Detach the list; the current task is never on it
+    uint32_t flags = spin_lock_irqsave(&zombie_lock);
+    task_t* task = zombies;
+    zombies = 0;
+    spin_unlock_irqrestore(&zombie_lock, flags);
+    
+    while (task) {
+        task_t* next = task->run_next;
+        if (task->on_cpu) {
+            // Its CPU has not finished switching away yet: next time
+            flags = spin_lock_irqsave(&zombie_lock);
+            task->run_next = zombies;
+            zombies = task;
+            spin_unlock_irqrestore(&zombie_lock, flags);
+            task = next;
+            continue;
+        }
+        
+        vmm_stack_free((void*)task->stack_base, task->stack_size);
+        fpu_release(task);
+        if (task->space != paging_kernel_space()) {
+            paging_destroy_space(task->space);
+        }
+        kmem_cache_free(task_cache, task);
         
-        // Perform context switch
-        switch_task(&old_task->esp, next_task->esp);
+        __sync_fetch_and_sub(&stats.tasks, 1);
+        __sync_fetch_and_add(&stats.reaped, 1);
+        task = next;
+    }
+}
+
+// Get cycles the idle tasks of all CPUs have been on their CPU
+uint64_t scheduler_idle_cycles() {
+    uint64_t cycles = 0;
+    uint32_t flags = irq_save();
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        sched_cpu_t* rq = &sched_cpus[cpu];
+        spin_lock(&rq->lock);
+        if (rq->idle) {
+            cycles += rq->idle->cpu_cycles;
+            if (rq->current == rq->idle) {
+                cycles += rdtsc() - rq->switch_stamp;
+            }
+        }
+        spin_unlock(&rq->lock);
     }
+    irq_restore(flags);
+    return cycles;
 }
 
 // Get current task ID
 uint32_t get_current_task_id() {
-    if (current_task) {
-        return current_task->id;
+    task_t* task = task_current();
+    if (task) {
+        return task->id;
     }
     return 0;
 }
+
+// ============ Benchmark ============
+
+#define SCHED_BENCH_SWITCHES 16384     // Yields per run, split across the tasks
+
+static volatile uint32_t bench_rounds = 0;
+static volatile uint32_t bench_done = 0;
+
+// Helper: benchmark task body, yields a fixed number of times
+static void bench_task() {
+    for (uint32_t i = 0; i < bench_rounds; i++) {
+        task_yield();
+    }
+    __sync_fetch_and_add(&bench_done, 1);
+}
+
+// Helper: average cycles per context switch with count yielding tasks
+static uint32_t bench_switches(uint32_t count) {
+    bench_rounds = SCHED_BENCH_SWITCHES / count;
+    bench_done = 0;
+    
+    // Kernel-space tasks: the CR3 reload is not what is being measured
+    for (uint32_t i = 0; i < count; i++) {
+        if (task_start(bench_task, paging_kernel_space(), task_current()->priority,
+                       TASK_STACK_SIZE) < 0) {
+            return 0;
+        }
+    }
+    
+    uint32_t switches = stats.switches;
+    uint64_t start = rdtsc();
+    while (bench_done < count) {
+        task_yield();
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    switches = stats.switches - switches;
+    
+    return switches ? cycles / switches : 0;
+}
+
+// Measure the cost of a yield-driven context switch as tasks are added
+void scheduler_benchmark() {
+    static const uint32_t counts[] = { 2, 64, 1024 };
+    
+    if (!scheduler_enabled) {
+        print("Scheduler not running\n");
+        return;
+    }
+    
+    print("\nContext switch cost (");
+    print_dec(SCHED_BENCH_SWITCHES);
+    print(" yields per run)\n");
+    print("  Tasks   Cycles/switch\n");
+    for (uint32_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        uint32_t cycles = bench_switches(counts[i]);
+        print("  ");
+        print_dec(counts[i]);
+        print(counts[i] < 10 ? "       " : counts[i] < 100 ? "      " : "    ");
+        if (cycles) {
+            print_dec(cycles);
+        } else {
+            print("out of memory");
+        }
+        print("\n");
+    }
+    print("\n");
+}
+
+// ============ Sleep Benchmark ============
+
+#define SLEEP_BENCH_COUNT   50
+#define SLEEP_BENCH_MS      20
+
+// Sleep repeatedly and report wakeup jitter and what the idle task did
+// with the time
+void scheduler_sleep_benchmark() {
+    if (!scheduler_enabled) {
+        print("Scheduler not running\n");
+        return;
+    }
+    
+    uint32_t wakeups = stats.wakeups;
+    uint32_t late = stats.late_wakeups;
+    uint32_t wake_cycles = stats.wake_cycles;
+    uint32_t old_max = stats.wake_cycles_max;
+    stats.wake_cycles_max = 0;
+    uint64_t idle_start = scheduler_idle_cycles();
+    uint64_t halted_start = idle_halted_cycles();
+    uint32_t tick_start = timer_get_ticks();
+    uint64_t start = rdtsc();
+    
+    for (uint32_t i = 0; i < SLEEP_BENCH_COUNT; i++) {
+        task_sleep_ms(SLEEP_BENCH_MS);
+    }
+    
+    // Kcycles keep the 64-bit differences in 32-bit arithmetic
+    // Idle time is summed over every CPU, so compare it to as much wall time
+    uint32_t cpus = smp_cpu_count();
+    uint32_t elapsed_k = (uint32_t)((rdtsc() - start) >> 10) * cpus;
+    uint32_t idle_k = (uint32_t)((scheduler_idle_cycles() - idle_start) >> 10);
+    uint32_t halted_k = (uint32_t)((idle_halted_cycles() - halted_start) >> 10);
+    uint32_t ticks = timer_get_ticks() - tick_start;
+    wakeups = stats.wakeups - wakeups;
+    late = stats.late_wakeups - late;
+    wake_cycles = stats.wake_cycles - wake_cycles;
+    uint32_t max_cycles = stats.wake_cycles_max;
+    if (old_max > stats.wake_cycles_max) {
+        stats.wake_cycles_max = old_max;
+    }
+    
+    print("\nSleep benchmark: ");
+    print_dec(SLEEP_BENCH_COUNT);
+    print(" x ");
+    print_dec(SLEEP_BENCH_MS);
+    print(" ms (");
+    print_dec(timer_ms_to_ticks(SLEEP_BENCH_MS));
+    print(" ticks each)\n");
+    print("  Ticks elapsed: ");
+    print_dec(ticks);
+    print(" (expected ");
+    print_dec(SLEEP_BENCH_COUNT * timer_ms_to_ticks(SLEEP_BENCH_MS));
+    print(")\n  Late wakeups: ");
+    print_dec(late);
+    print("/");
+    print_dec(wakeups);
+    print("\n  Timer to task running: avg ");
+    print_dec(wakeups ? wake_cycles / wakeups : 0);
+    print(", max ");
+    print_dec(max_cycles);
+    print(" cycles\n");
+    print(cpus == 1 ? "  Idle task: " : "  Idle tasks: ");
+    print_dec(idle_k);
+    print(" of ");
+    print_dec(elapsed_k);
+    print(" Kcycles (");
+    print_dec(cpus);
+    print(cpus == 1 ? " CPU), " : " CPUs), ");
+    print_dec(halted_k);
+    print(" halted, ");
+    print_dec(idle_k > halted_k ? idle_k - halted_k : 0);
+    print(" busy\n");
+    if (elapsed_k) {
+        print(cpus == 1 ? "  CPU halted " : "  CPUs halted ");
+        print_dec(halted_k * 100 / elapsed_k);
+        print("% of the time\n");
+    }
+    print("\n");
+}
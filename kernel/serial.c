@@ -0,0 +1,67 @@
+// Serial Port Implementation
+// COM1 setup and polled transmit
+
+#include "serial.h"
+
+static int present = 0;
+
+// I/O port operations
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// Set COM1 to 115200 8N1 with its interrupts off
+int serial_init() {
+    // Nothing decodes the port without a UART: the scratch register does
+    // not hold a value
+    outb(SERIAL_COM1 + SERIAL_SCRATCH, 0x5A);
+    if (inb(SERIAL_COM1 + SERIAL_SCRATCH) != 0x5A) {
+        return -1;
+    }
+    
+    outb(SERIAL_COM1 + SERIAL_IER, 0x00);
+    outb(SERIAL_COM1 + SERIAL_LCR, SERIAL_LCR_DLAB);
+    outb(SERIAL_COM1 + SERIAL_DATA, SERIAL_DIVISOR & 0xFF);
+    outb(SERIAL_COM1 + SERIAL_IER, SERIAL_DIVISOR >> 8);
+    outb(SERIAL_COM1 + SERIAL_LCR, SERIAL_LCR_8N1);
+    outb(SERIAL_COM1 + SERIAL_FCR, 0xC7);   // Enable and clear FIFOs, 14-byte threshold
+    outb(SERIAL_COM1 + SERIAL_MCR, 0x03);   // DTR, RTS
+    
+    present = 1;
+    return 0;
+}
+
+// Check whether serial_init found a UART
+int serial_present() {
+    return present;
+}
+
+// Send bytes, waiting for the transmitter between them
+void serial_write(const void* data, uint32_t size) {
+    if (!present) {
+        return;
+    }
+    
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (uint32_t i = 0; i < size; i++) {
+        while (!(inb(SERIAL_COM1 + SERIAL_LSR) & SERIAL_LSR_THRE)) {
+            __asm__ __volatile__("pause");
+        }
+        outb(SERIAL_COM1 + SERIAL_DATA, bytes[i]);
+    }
+}
+
+// Send a NUL-terminated string
+void serial_print(const char* str) {
+    uint32_t length = 0;
+    while (str[length]) {
+        length++;
+    }
+    serial_write(str, length);
+}
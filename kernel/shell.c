@@ -4,17 +4,52 @@
 #include "shell.h"
 #include "keyboard.h"
 #include "pmm.h"
+#include "buddy.h"
+#include "kmalloc.h"
+#include "paging.h"
+#include "vmm.h"
+#include "scheduler.h"
+#include "fs.h"
+#include "graphics.h"
+#include "timer.h"
+#include "smp.h"
+#include "fpu.h"
+#include "sync.h"
+#include "workqueue.h"
+#include "syscall.h"
+#include "irq.h"
+#include "ioapic.h"
+#include "clock.h"
+#include "trace.h"
+#include "profile.h"
 
 // External functions
 extern void print(const char* str);
 extern void putchar(char c);
 extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
 extern void clear_screen();
 
 // Shell state
 static char input_buffer[SHELL_BUFFER_SIZE];
 static int buffer_pos = 0;
 
+// Echo latency (keyboard IRQ to echo), in units of 1024 cycles
+static uint32_t echo_samples = 0;
+static uint32_t echo_total = 0;
+static uint32_t echo_max = 0;
+
+// CPU-bound tasks started by the hog command
+#define MAX_HOGS 9
+static volatile int hogs_stop = 0;
+static volatile uint32_t hogs_alive = 0;
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 // String utility functions
 static int strcmp(const char* s1, const char* s2) {
     while (*s1 && (*s1 == *s2)) {
@@ -46,7 +81,39 @@ static void cmd_help() {
     print("  clear     - Clear the screen\n");
     print("  meminfo   - Display memory information\n");
     print("  echo      - Echo text to screen\n");
+    print("  ls        - List files\n");
+    print("  cat <file> - Print a file\n");
+    print("  write <file> <text> - Create a file\n");
+    print("  rm <file> - Delete a file\n");
     print("  version   - Show OS version\n");
+    print("  pmmcache  - Show page cache and zeroed pool stats\n");
+    print("  pmmbench  - Benchmark the page allocator\n");
+    print("  buddybench - Benchmark contiguous block allocation\n");
+    print("  slabinfo  - Show kernel heap cache usage\n");
+    print("  heapbench - Benchmark kmalloc against first-fit\n");
+    print("  pagebench - Benchmark page mapping and TLB reach\n");
+    print("  vmstat    - Show virtual regions and page-fault stats\n");
+    print("  faultbench - Measure demand page-fault latency\n");
+    print("  cowbench  - Benchmark copy-on-write address space cloning\n");
+    print("  fbbench   - Benchmark uncached vs write-combining framebuffer\n");
+    print("  hog <n>   - Run n CPU-bound tasks (0 stops them)\n");
+    print("  quantum <n> - Set the time slice in timer ticks\n");
+    print("  latency   - Show echo latency and scheduler stats\n");
+    print("  schedbench - Measure context switch cost with 2/64/1024 tasks\n");
+    print("  sleepbench - Measure sleep wakeup jitter and idle time\n");
+    print("  tickbench - Compare timer IRQ rates, periodic vs tickless\n");
+    print("  smpbench  - Measure parallel speedup across CPUs\n");
+    print("  fpubench  - Compare switches with and without SSE use\n");
+    print("  lockstat  - Show mutex/semaphore contention statistics\n");
+    print("  lockbench - Measure mutex contention and semaphore handoff\n");
+    print("  workstat  - Show deferred work counts and latency\n");
+    print("  syscallbench - Compare null syscalls: int 0x80 vs SYSENTER\n");
+    print("  irqstat   - Show per-IRQ counts and handler cost histograms\n");
+    print("  apicbench - Compare EOI cost and IRQ latency, 8259 vs IOAPIC\n");
+    print("  clockbench - Compare TSC and PIT clock cost and resolution\n");
+    print("  trace [on|off|dump] - Record kernel events, send them over COM1\n");
+    print("  tracebench - Measure tracepoint cost, disabled and enabled\n");
+    print("  prof [start [-g]|stop|top|export] - Sample where the kernel spends time\n");
     print("\n");
 }
 
@@ -70,18 +137,199 @@ static void cmd_meminfo() {
     print_hex(pmm_get_free_pages());
     print("\n");
     
+    print("  Reserved:     ");
+    print_hex(pmm_get_reserved_pages());
+    print("\n");
+    
     print("  Page size:    4096 bytes (4 KB)\n");
     
-    uint32_t total_mem = pmm_get_total_pages() * 4096;
-    uint32_t free_mem = pmm_get_free_pages() * 4096;
+    // In KB so 4GB of RAM still fits in 32 bits
+    uint32_t total_mem = pmm_get_total_pages() * 4;
+    uint32_t free_mem = pmm_get_free_pages() * 4;
     
     print("  Total memory: ");
-    print_hex(total_mem);
-    print(" bytes\n");
+    print_dec(total_mem);
+    print(" KB\n");
     
     print("  Free memory:  ");
-    print_hex(free_mem);
-    print(" bytes\n\n");
+    print_dec(free_mem);
+    print(" KB\n\n");
+}
+
+// Command: pmmcache
+static void cmd_pmmcache() {
+    print("\nPer-CPU page caches:\n");
+    print("  CPU  Cached  Alloc hit/miss     Free hit/miss\n");
+    
+    for (uint32_t cpu = 0; cpu < pmm_get_cache_cpus(); cpu++) {
+        const pmm_cache_t* cache = pmm_get_cache(cpu);
+        print("  ");
+        print_dec(cpu);
+        print("    ");
+        print_dec(cache->count);
+        print("      ");
+        print_dec(cache->alloc_hits);
+        print("/");
+        print_dec(cache->alloc_misses);
+        print("            ");
+        print_dec(cache->free_hits);
+        print("/");
+        print_dec(cache->free_misses);
+        print("\n");
+    }
+    
+    const pmm_zero_stats_t* zero = pmm_get_zero_stats();
+    print("\nZeroed page pool: ");
+    print_dec(pmm_get_zero_pool_pages());
+    print("/");
+    print_dec(PMM_ZERO_POOL_SIZE);
+    print(" pages, ");
+    print_dec(zero->background_zeroed);
+    print(" zeroed in background\n");
+    print("  Pool hits: ");
+    print_dec(zero->hits);
+    print(", synchronous zeroing: ");
+    print_dec(zero->misses);
+    if (zero->misses) {
+        print(" (avg ");
+        print_dec(zero->miss_cycles / zero->misses);
+        print(" cycles each)");
+    }
+    print("\n\n");
+}
+
+// Task body for hog: spin until told to stop
+static void hog_task() {
+    volatile uint32_t spins = 0;
+    while (!hogs_stop) {
+        spins++;
+    }
+    __sync_fetch_and_sub(&hogs_alive, 1);
+}
+
+// Command: hog <n>
+static void cmd_hog(const char* args) {
+    if (args[0] < '0' || args[0] > '0' + MAX_HOGS || args[1] != '\0') {
+        print("\nUsage: hog <0-9>\n\n");
+        return;
+    }
+    uint32_t count = args[0] - '0';
+    
+    // Stop the current hogs and wait for all of them to exit
+    hogs_stop = 1;
+    while (hogs_alive) {
+        task_yield();
+    }
+    hogs_stop = 0;
+    
+    print("\n");
+    for (uint32_t i = 0; i < count; i++) {
+        __sync_fetch_and_add(&hogs_alive, 1);
+        if (task_create(hog_task, SCHED_PRIORITY_DEFAULT) < 0) {
+            __sync_fetch_and_sub(&hogs_alive, 1);
+            break;
+        }
+    }
+    print_dec(hogs_alive);
+    print(" CPU hog task(s) running\n\n");
+}
+
+// Command: trace on|off|dump
+static void cmd_trace(const char* args) {
+    if (strcmp(args, "on") == 0) {
+        if (trace_start(TRACE_ALL) == 0) {
+            print("\nTracing on\n\n");
+        }
+    } else if (strcmp(args, "off") == 0) {
+        trace_stop();
+        trace_status();
+    } else if (strcmp(args, "dump") == 0) {
+        trace_dump();
+    } else {
+        print("\nUsage: trace [on|off|dump]\n\n");
+    }
+}
+
+// Command: prof start [-g]|stop|top|export
+static void cmd_prof(const char* args) {
+    if (strcmp(args, "start") == 0 || strcmp(args, "start -g") == 0) {
+        int callchains = args[5] != '\0';
+        if (profile_start(callchains) == 0) {
+            print(callchains ? "\nProfiling with call chains\n\n" : "\nProfiling\n\n");
+        }
+    } else if (strcmp(args, "stop") == 0) {
+        profile_stop();
+        profile_report(PROFILE_TOP_LINES);
+    } else if (strcmp(args, "top") == 0) {
+        // Refresh every second until a key is pressed
+        while (!keyboard_available()) {
+            clear_screen();
+            profile_report(PROFILE_TOP_LINES);
+            print("Press any key to return\n");
+            for (int i = 0; i < 10 && !keyboard_available(); i++) {
+                task_sleep_ms(100);
+            }
+        }
+        keyboard_getchar();
+        print("\n");
+    } else if (strcmp(args, "export") == 0) {
+        profile_export();
+    } else {
+        print("\nUsage: prof [start [-g]|stop|top|export]\n\n");
+    }
+}
+
+// Command: quantum <n>
+static void cmd_quantum(const char* args) {
+    uint32_t ticks = 0;
+    while (*args >= '0' && *args <= '9') {
+        ticks = ticks * 10 + (*args++ - '0');
+    }
+    if (*args != '\0' || ticks == 0) {
+        print("\nUsage: quantum <ticks>\n\n");
+        return;
+    }
+    scheduler_set_quantum(ticks);
+    print("\nTime slice: ");
+    print_dec(ticks);
+    print(" ticks\n\n");
+}
+
+// Command: latency
+static void cmd_latency() {
+    const sched_stats_t* stats = scheduler_get_stats();
+    print("\nScheduler: quantum ");
+    print_dec(scheduler_get_quantum());
+    print(" ticks, ");
+    print_dec(hogs_alive);
+    print(" hog(s)\n");
+    print("  Switches: ");
+    print_dec(stats->switches);
+    print(", preemptions: ");
+    print_dec(stats->preemptions);
+    print(", yields: ");
+    print_dec(stats->yields);
+    print("\n  Tasks: ");
+    print_dec(stats->tasks);
+    print(" live, ");
+    print_dec(stats->reaped);
+    print(" reaped\n");
+    
+    print("Echo latency (keyboard IRQ to echo): ");
+    if (echo_samples == 0) {
+        print("no samples\n\n");
+        return;
+    }
+    print_dec(echo_samples);
+    print(" keys\n  Avg: ");
+    print_dec(echo_total / echo_samples);
+    print(" Kcycles, max: ");
+    print_dec(echo_max);
+    print(" Kcycles\n\n");
+    
+    echo_samples = 0;
+    echo_total = 0;
+    echo_max = 0;
 }
 
 // Command: echo
@@ -91,6 +339,58 @@ static void cmd_echo(const char* args) {
     print("\n\n");
 }
 
+// Command: cat <file>
+static void cmd_cat(const char* name) {
+    static char contents[MAX_FILE_SIZE + 1];
+    print("\n");
+    if (fs_read(name, contents, MAX_FILE_SIZE) >= 0) {
+        print(contents);
+        print("\n");
+    }
+    print("\n");
+}
+
+// Command: write <file> <text>
+static void cmd_write(const char* args) {
+    char name[MAX_FILENAME];
+    int len = 0;
+    while (args[len] && args[len] != ' ') {
+        if (len == MAX_FILENAME - 1) {
+            print("\nFS: Filename too long\n\n");
+            return;
+        }
+        name[len] = args[len];
+        len++;
+    }
+    name[len] = '\0';
+    if (len == 0) {
+        print("\nUsage: write <file> <text>\n\n");
+        return;
+    }
+    
+    const char* text = args + len;
+    while (*text == ' ') text++;
+    
+    print("\n");
+    if (fs_create(name, text) == 0) {
+        print("Wrote ");
+        print(name);
+        print("\n");
+    }
+    print("\n");
+}
+
+// Command: rm <file>
+static void cmd_rm(const char* name) {
+    print("\n");
+    if (fs_delete(name) == 0) {
+        print("Deleted ");
+        print(name);
+        print("\n");
+    }
+    print("\n");
+}
+
 // Command: version
 static void cmd_version() {
     print("\nCoreX OS v3.2\n");
@@ -170,6 +470,109 @@ void shell_execute(const char* command) {
     } else if (strcmp(command, "version") == 0) {
         cmd_version();
         
+    } else if (strcmp(command, "pmmcache") == 0) {
+        cmd_pmmcache();
+        
+    } else if (strcmp(command, "pmmbench") == 0) {
+        pmm_benchmark();
+        
+    } else if (strcmp(command, "buddybench") == 0) {
+        buddy_benchmark();
+        
+    } else if (strcmp(command, "slabinfo") == 0) {
+        kmalloc_dump();
+        
+    } else if (strcmp(command, "heapbench") == 0) {
+        kmalloc_benchmark();
+        
+    } else if (strcmp(command, "pagebench") == 0) {
+        paging_benchmark();
+        
+    } else if (strcmp(command, "vmstat") == 0) {
+        vmm_dump();
+        
+    } else if (strcmp(command, "faultbench") == 0) {
+        vmm_benchmark();
+        
+    } else if (strcmp(command, "cowbench") == 0) {
+        vmm_cow_benchmark();
+        
+    } else if (strcmp(command, "fbbench") == 0) {
+        graphics_benchmark();
+        
+    } else if (strncmp(command, "hog ", 4) == 0) {
+        cmd_hog(command + 4);
+        
+    } else if (strncmp(command, "quantum ", 8) == 0) {
+        cmd_quantum(command + 8);
+        
+    } else if (strcmp(command, "latency") == 0) {
+        cmd_latency();
+        
+    } else if (strcmp(command, "schedbench") == 0) {
+        scheduler_benchmark();
+        
+    } else if (strcmp(command, "sleepbench") == 0) {
+        scheduler_sleep_benchmark();
+        
+    } else if (strcmp(command, "tickbench") == 0) {
+        timer_benchmark();
+        
+    } else if (strcmp(command, "smpbench") == 0) {
+        smp_benchmark();
+        
+    } else if (strcmp(command, "fpubench") == 0) {
+        fpu_benchmark();
+        
+    } else if (strcmp(command, "lockstat") == 0) {
+        sync_dump();
+        
+    } else if (strcmp(command, "lockbench") == 0) {
+        sync_benchmark();
+        
+    } else if (strcmp(command, "workstat") == 0) {
+        workqueue_dump();
+        
+    } else if (strcmp(command, "irqstat") == 0) {
+        irq_dump();
+        
+    } else if (strcmp(command, "apicbench") == 0) {
+        apic_benchmark();
+        
+    } else if (strcmp(command, "clockbench") == 0) {
+        clock_benchmark();
+        
+    } else if (strcmp(command, "trace") == 0) {
+        trace_status();
+        
+    } else if (strncmp(command, "trace ", 6) == 0) {
+        cmd_trace(command + 6);
+        
+    } else if (strcmp(command, "tracebench") == 0) {
+        trace_benchmark();
+        
+    } else if (strcmp(command, "prof") == 0) {
+        profile_report(PROFILE_TOP_LINES);
+        
+    } else if (strncmp(command, "prof ", 5) == 0) {
+        cmd_prof(command + 5);
+        
+    } else if (strcmp(command, "syscallbench") == 0) {
+        syscall_benchmark();
+        
+    } else if (strcmp(command, "ls") == 0) {
+        fs_list();
+        print("\n");
+        
+    } else if (strncmp(command, "cat ", 4) == 0) {
+        cmd_cat(command + 4);
+        
+    } else if (strncmp(command, "write ", 6) == 0) {
+        cmd_write(command + 6);
+        
+    } else if (strncmp(command, "rm ", 3) == 0) {
+        cmd_rm(command + 3);
+        
     } else if (strncmp(command, "echo ", 5) == 0) {
         // Echo command with arguments
         cmd_echo(command + 5);
@@ -189,14 +592,20 @@ void shell_execute(const char* command) {
 // Run shell (main loop)
 void shell_run() {
     while (1) {
-        // Get character from keyboard buffer
-        char c = keyboard_getchar();
-        if (c != 0) {
-            // Echo and handle the character
-            shell_handle_input(c);
-        }
+        // Sleep until a key arrives (the idle task runs meanwhile)
+        char c = keyboard_wait_char();
+        
+        // Echo and handle the character
+        shell_handle_input(c);
         
-        // Wait for next interrupt
-        __asm__ __volatile__("hlt");
+        // Record how long the key waited for the shell to run
+        if (c != '\n') {
+            uint32_t kcycles = (uint32_t)((rdtsc() - keyboard_last_stamp()) >> 10);
+            echo_samples++;
+            echo_total += kcycles;
+            if (kcycles > echo_max) {
+                echo_max = kcycles;
+            }
+        }
     }
 }
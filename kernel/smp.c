@@ -0,0 +1,245 @@
+// SMP Implementation
+// Brings up the application processors and gives every CPU a per-CPU block
+
+#include "smp.h"
+#include "gdt.h"
+#include "fpu.h"
+#include "idt.h"
+#include "lapic.h"
+#include "paging.h"
+#include "scheduler.h"
+#include "syscall.h"
+#include "timer.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// Startup code (trampoline.asm) and the end of the kernel image
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_params[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t kernel_end[];
+
+// Parameter block at the end of the trampoline (must match trampoline.asm)
+typedef struct {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t entry;                     // smp_ap_main
+    volatile uint32_t next_cpu;         // Next index to hand out
+    uint32_t stacks[SMP_MAX_CPUS];      // Initial ESP per index
+} ap_boot_params_t;
+
+static cpu_t cpus[SMP_MAX_CPUS];
+static volatile uint32_t online_count = 1;
+
+// Helper: Read the CPU timestamp counter
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Set up the bootstrap processor's per-CPU block
+void smp_early_init() {
+    cpus[0].id = 0;
+    cpus[0].online = 1;
+    gdt_init_cpu(0, (uint32_t)&cpus[0], sizeof(cpu_t));
+}
+
+// Helper: First C code on an AP, on its idle task's stack
+static void smp_ap_main(uint32_t cpu) {
+    cpus[cpu].id = cpu;
+    gdt_init_cpu(cpu, (uint32_t)&cpus[cpu], sizeof(cpu_t));
+    idt_init_cpu();
+    paging_init_cpu();
+    fpu_init_cpu();
+    syscall_init_cpu();
+    lapic_init_cpu();
+    cpus[cpu].apic_id = lapic_id();
+    lapic_timer_start();
+    
+    cpus[cpu].online = 1;
+    __sync_fetch_and_add(&online_count, 1);
+    
+    // Becomes this CPU's idle task; never returns
+    scheduler_start_cpu();
+}
+
+// Start the application processors
+void smp_init() {
+    if ((uint32_t)kernel_end > SMP_TRAMPOLINE) {
+        print("SMP: Kernel overlaps the AP trampoline, running on one CPU\n");
+        return;
+    }
+    if (!lapic_available()) {
+        print("SMP: No local APIC, running on one CPU\n");
+        return;
+    }
+    cpus[0].apic_id = lapic_id();
+    
+    // Copy the startup code below 1MB
+    uint32_t size = ap_trampoline_end - ap_trampoline_start;
+    uint8_t* dest = (uint8_t*)SMP_TRAMPOLINE;
+    for (uint32_t i = 0; i < size; i++) {
+        dest[i] = ap_trampoline_start[i];
+    }
+    ap_boot_params_t* params = (ap_boot_params_t*)(SMP_TRAMPOLINE +
+                               (ap_trampoline_params - ap_trampoline_start));
+    
+    // The processor count is not known without ACPI tables, so every index
+    // gets an idle task up front; unclaimed ones are released afterwards
+    for (uint32_t cpu = 1; cpu < SMP_MAX_CPUS; cpu++) {
+        params->stacks[cpu] = scheduler_cpu_prepare(cpu);
+    }
+    params->stacks[0] = 0;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(params->cr0));
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(params->cr3));
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(params->cr4));
+    params->entry = (uint32_t)smp_ap_main;
+    params->next_cpu = 1;
+    
+    lapic_start_aps(SMP_TRAMPOLINE);
+    
+    // Wait for the APs to claim their indices, then close the count so a
+    // straggler parks instead of using a stack that is about to be freed
+    for (uint32_t ms = 0; ms < SMP_BOOT_TIMEOUT_MS && params->next_cpu < SMP_MAX_CPUS; ms++) {
+        timer_udelay(1000);
+    }
+    uint32_t claimed = __sync_lock_test_and_set(&params->next_cpu, SMP_MAX_CPUS);
+    if (claimed > SMP_MAX_CPUS) {
+        claimed = SMP_MAX_CPUS;
+    }
+    
+    for (uint32_t cpu = 1; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu < claimed && params->stacks[cpu]) {
+            while (!cpus[cpu].online) {
+                __asm__ __volatile__("pause");
+            }
+        } else {
+            scheduler_cpu_cancel(cpu);
+        }
+    }
+    
+    print("SMP: ");
+    print_dec(online_count);
+    print(online_count == 1 ? " CPU online\n" : " CPUs online\n");
+}
+
+// Number of CPUs running the scheduler
+uint32_t smp_cpu_count() {
+    return online_count;
+}
+
+// Check whether a CPU index is online
+int smp_cpu_online(uint32_t cpu) {
+    return cpu < SMP_MAX_CPUS && cpus[cpu].online;
+}
+
+// Local APIC ID of a CPU index
+uint32_t smp_cpu_apic_id(uint32_t cpu) {
+    return cpu < SMP_MAX_CPUS ? cpus[cpu].apic_id : 0;
+}
+
+// Interrupt another CPU so it re-runs its scheduler
+void smp_send_resched(uint32_t cpu) {
+    if (smp_cpu_online(cpu) && cpu != smp_cpu_id()) {
+        lapic_send_ipi(cpus[cpu].apic_id, LAPIC_RESCHED_VECTOR);
+    }
+}
+
+// ============ Benchmark ============
+
+#define SMP_BENCH_ITERATIONS (1u << 27)     // Total work, split across the tasks
+
+static volatile uint32_t bench_iterations = 0;
+static volatile uint32_t bench_done = 0;
+static volatile uint32_t bench_sink = 0;
+static uint32_t bench_tasks = 0;
+static task_t* bench_waiter = 0;
+
+// Helper: CPU-bound task: its share of a dependent multiply-add chain
+// (no memory traffic, so CPUs do not slow each other down)
+static void bench_task() {
+    uint32_t x = 1;
+    for (uint32_t i = 0; i < bench_iterations; i++) {
+        x = x * 1664525 + 1013904223;
+    }
+    bench_sink += x;
+    
+    // The last one out wakes the shell
+    if (__sync_add_and_fetch(&bench_done, 1) == bench_tasks) {
+        task_wake(bench_waiter);
+    }
+}
+
+// Helper: Kcycles of wall time for the work split over count tasks
+static uint32_t bench_run(uint32_t count) {
+    bench_iterations = SMP_BENCH_ITERATIONS / count;
+    bench_done = 0;
+    bench_tasks = count;
+    bench_waiter = task_current();
+    
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < count; i++) {
+        if (task_create(bench_task, SCHED_PRIORITY_DEFAULT) < 0) {
+            // The ones already started never reach count; let them finish
+            while (bench_done < i) {
+                task_sleep_ms(10);
+            }
+            return 0;
+        }
+    }
+    
+    // Block rather than spin, so this CPU takes a worker too; exactly one
+    // wakeup comes, and one that lands before we block is not lost
+    __asm__ __volatile__("cli");
+    task_block();
+    __asm__ __volatile__("sti");
+    
+    return (uint32_t)((rdtsc() - start) >> 10);
+}
+
+// Run the same total work with 1..n tasks and report the speedup
+void smp_benchmark() {
+    uint32_t cpus_online = smp_cpu_count();
+    uint32_t steals = scheduler_get_stats()->steals;
+    
+    print("\nParallel CPU-bound work (");
+    print_dec(SMP_BENCH_ITERATIONS >> 20);
+    print("M iterations, ");
+    print_dec(cpus_online);
+    print(cpus_online == 1 ? " CPU)\n" : " CPUs)\n");
+    print("  Tasks   Kcycles   Speedup\n");
+    
+    uint32_t base = 0;
+    for (uint32_t count = 1; count <= cpus_online * 2; count *= 2) {
+        uint32_t kcycles = bench_run(count);
+        if (kcycles == 0) {
+            print("  Out of memory\n");
+            break;
+        }
+        if (count == 1) {
+            base = kcycles;
+        }
+        
+        // Speedup in hundredths
+        uint32_t speedup = base * 100 / kcycles;
+        print("  ");
+        print_dec(count);
+        print(count < 10 ? "       " : "      ");
+        print_dec(kcycles);
+        print(kcycles < 100000 ? "     " : kcycles < 1000000 ? "    " : "   ");
+        print_dec(speedup / 100);
+        print(".");
+        print_dec((speedup / 10) % 10);
+        print_dec(speedup % 10);
+        print("x\n");
+    }
+    
+    print("  Tasks stolen by idle CPUs: ");
+    print_dec(scheduler_get_stats()->steals - steals);
+    print("\n\n");
+}
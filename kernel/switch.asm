@@ -3,10 +3,16 @@
 
 [BITS 32]
 
-; void switch_task(uint32_t* old_esp, uint32_t new_esp)
+; void switch_task(uint32_t* old_esp, uint32_t new_esp, uint32_t new_cr3)
+; EFLAGS is part of the saved context, so each task gets its own
+; interrupt flag back: a task preempted from the timer IRQ resumes with
+; IF=0 and re-enables it with iret, a new task starts with IF=0 and
+; task_entry enables it
 global _switch_task
 _switch_task:
     ; Save old task context
+    pushfd
+    cli                     ; No interrupts while between stacks
     push ebp
     push esi
     push edi
@@ -16,11 +22,20 @@ _switch_task:
     push eax
     
     ; Save old ESP
-    mov eax, [esp + 32]     ; Get old_esp parameter (after 7 pushes + ret addr)
+    mov eax, [esp + 36]     ; Get old_esp parameter (after 8 pushes + ret addr)
     mov [eax], esp          ; Save current ESP
     
+    ; Switch address space (skipped when both tasks share one, which
+    ; keeps the TLB warm; kernel pages are global either way)
+    mov eax, [esp + 44]     ; Get new_cr3 parameter
+    mov edx, cr3
+    cmp eax, edx
+    je .same_space
+    mov cr3, eax
+.same_space:
+    
     ; Load new ESP
-    mov esp, [esp + 36]     ; Get new_esp parameter
+    mov esp, [esp + 40]     ; Get new_esp parameter
     
     ; Restore new task context
     pop eax
@@ -30,5 +45,6 @@ _switch_task:
     pop edi
     pop esi
     pop ebp
+    popfd
     
     ret
@@ -0,0 +1,45 @@
+// Kernel Symbols Implementation
+// Binary search of the link-time symbol table
+
+#include "symbols.h"
+
+// Linker-provided bounds of the kernel's code
+extern uint8_t kernel_start[];
+extern uint8_t kernel_text_end[];
+
+// Check whether an address is inside the kernel's code
+int symbol_in_text(uint32_t addr) {
+    return addr >= (uint32_t)kernel_start && addr < (uint32_t)kernel_text_end;
+}
+
+// Index of the function containing a code address
+uint32_t symbol_index(uint32_t addr) {
+    if (ksym_count == 0 || !symbol_in_text(addr) || addr < ksyms[0].addr) {
+        return ksym_count;
+    }
+    
+    // Last symbol at or below addr
+    uint32_t low = 0;
+    uint32_t high = ksym_count - 1;
+    while (low < high) {
+        uint32_t mid = (low + high + 1) / 2;
+        if (ksyms[mid].addr <= addr) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// Find the function containing a code address
+const char* symbol_lookup(uint32_t addr, uint32_t* offset) {
+    uint32_t index = symbol_index(addr);
+    if (index == ksym_count) {
+        return 0;
+    }
+    if (offset) {
+        *offset = addr - ksyms[index].addr;
+    }
+    return &ksym_names[ksyms[index].name];
+}
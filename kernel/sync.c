@@ -0,0 +1,441 @@
+// Synchronization Implementation
+// Wait queues on top of task_block/task_wake, and the sleeping locks built on them
+
+#include "sync.h"
+#include "scheduler.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+volatile uint32_t spin_contentions = 0;
+
+// Every mutex and semaphore, for lockstat
+static lock_stats_t* lock_list = 0;
+static spinlock_t lock_list_lock = SPINLOCK_INIT;
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: Name a lock and add it to the lockstat list
+static void lock_stats_register(lock_stats_t* stats, const char* name, const char* kind) {
+    stats->name = name;
+    stats->kind = kind;
+    stats->acquires = 0;
+    stats->contended = 0;
+    stats->wait_cycles = 0;
+    
+    uint32_t flags = spin_lock_irqsave(&lock_list_lock);
+    stats->next = lock_list;
+    lock_list = stats;
+    spin_unlock_irqrestore(&lock_list_lock, flags);
+}
+
+// ============ Wait queues ============
+
+void wait_queue_init(wait_queue_t* wq) {
+    spin_init(&wq->lock);
+    wq->head = 0;
+    wq->tail = 0;
+}
+
+// Helper: Append a task (wq->lock held)
+static void wq_enqueue(wait_queue_t* wq, task_t* task) {
+    task->wait_next = 0;
+    task->wait_queued = 1;
+    if (wq->tail) {
+        wq->tail->wait_next = task;
+    } else {
+        wq->head = task;
+    }
+    wq->tail = task;
+}
+
+// Helper: Take the first task off the queue (wq->lock held)
+static task_t* wq_dequeue(wait_queue_t* wq) {
+    task_t* task = wq->head;
+    if (task) {
+        wq->head = task->wait_next;
+        if (!wq->head) {
+            wq->tail = 0;
+        }
+        task->wait_queued = 0;
+    }
+    return task;
+}
+
+// Helper: Unlink a task that is still queued (wq->lock held)
+static void wq_remove(wait_queue_t* wq, task_t* task) {
+    task_t* prev = 0;
+    for (task_t* t = wq->head; t; prev = t, t = t->wait_next) {
+        if (t == task) {
+            if (prev) {
+                prev->wait_next = t->wait_next;
+            } else {
+                wq->head = t->wait_next;
+            }
+            if (wq->tail == t) {
+                wq->tail = prev;
+            }
+            t->wait_queued = 0;
+            return;
+        }
+    }
+}
+
+// Helper: Block after queueing, then make sure we are off the queue
+// task_block returns at once if a wakeup was left pending from earlier, in
+// which case nobody dequeued us. Wakers call task_wake under wq->lock, so
+// once we have held it no waker still refers to this task (which may exit
+// and be freed). Interrupts are disabled.
+static void wq_block(wait_queue_t* wq, task_t* self) {
+    task_block();
+    spin_lock(&wq->lock);
+    if (self->wait_queued) {
+        wq_remove(wq, self);
+    }
+    spin_unlock(&wq->lock);
+}
+
+// Block the current task on wq, releasing lock meanwhile
+void wait_queue_wait(wait_queue_t* wq, spinlock_t* lock) {
+    task_t* self = task_current();
+    if (!self) {
+        // No scheduler yet: nothing else runs, so just let go briefly
+        spin_unlock(lock);
+        __asm__ __volatile__("pause");
+        spin_lock(lock);
+        return;
+    }
+    
+    int own = (lock == &wq->lock);
+    if (!own) {
+        spin_lock(&wq->lock);
+    }
+    wq_enqueue(wq, self);
+    spin_unlock(&wq->lock);
+    if (!own) {
+        spin_unlock(lock);
+    }
+    
+    // A wakeup that lands before we block is kept by task_block
+    wq_block(wq, self);
+    spin_lock(lock);
+}
+
+// Wake the longest waiting task
+struct task* wait_queue_wake_one(wait_queue_t* wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    task_t* task = wq_dequeue(wq);
+    if (task) {
+        task_wake(task);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return task;
+}
+
+// Wake every waiting task
+uint32_t wait_queue_wake_all(wait_queue_t* wq) {
+    uint32_t count = 0;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    task_t* task;
+    while ((task = wq_dequeue(wq))) {
+        task_wake(task);
+        count++;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return count;
+}
+
+// ============ Mutexes ============
+
+void mutex_init(mutex_t* mutex, const char* name) {
+    mutex->locked = 0;
+    mutex->owner = 0;
+    wait_queue_init(&mutex->waiters);
+    lock_stats_register(&mutex->stats, name, "mutex");
+}
+
+// Acquire a mutex, blocking while another task holds it
+// The uncontended case is one locked compare-and-swap.
+void mutex_lock(mutex_t* mutex) {
+    if (__sync_bool_compare_and_swap(&mutex->locked, 0, 1)) {
+        mutex->owner = task_current();
+        mutex->stats.acquires++;
+        return;
+    }
+    
+    uint64_t start = rdtsc();
+    uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+    while (!__sync_bool_compare_and_swap(&mutex->locked, 0, 1)) {
+        wait_queue_wait(&mutex->waiters, &mutex->waiters.lock);
+    }
+    spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+    
+    // Counters are only touched with the mutex held
+    mutex->owner = task_current();
+    mutex->stats.acquires++;
+    mutex->stats.contended++;
+    mutex->stats.wait_cycles += rdtsc() - start;
+}
+
+// Try to acquire a mutex without blocking
+int mutex_trylock(mutex_t* mutex) {
+    if (!__sync_bool_compare_and_swap(&mutex->locked, 0, 1)) {
+        return 0;
+    }
+    mutex->owner = task_current();
+    mutex->stats.acquires++;
+    return 1;
+}
+
+// Release a mutex and wake one waiter
+// The waiter competes for the lock again rather than being handed it, so
+// a running task can take it first instead of waiting for a switch.
+void mutex_unlock(mutex_t* mutex) {
+    mutex->owner = 0;
+    
+    // Clearing locked under the queue lock orders it against a waiter
+    // deciding to sleep
+    uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+    __sync_lock_release(&mutex->locked);
+    task_t* next = wq_dequeue(&mutex->waiters);
+    if (next) {
+        task_wake(next);
+    }
+    spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+}
+
+// ============ Semaphores ============
+
+void sem_init(semaphore_t* sem, const char* name, int32_t count) {
+    sem->count = count;
+    wait_queue_init(&sem->waiters);
+    lock_stats_register(&sem->stats, name, "semaphore");
+}
+
+// Take one from the count, blocking while it is zero
+void sem_wait(semaphore_t* sem) {
+    uint32_t flags = spin_lock_irqsave(&sem->waiters.lock);
+    if (sem->count <= 0) {
+        uint64_t start = rdtsc();
+        do {
+            wait_queue_wait(&sem->waiters, &sem->waiters.lock);
+        } while (sem->count <= 0);
+        sem->stats.contended++;
+        sem->stats.wait_cycles += rdtsc() - start;
+    }
+    sem->count--;
+    sem->stats.acquires++;
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+}
+
+// Take one from the count if it is positive
+int sem_trywait(semaphore_t* sem) {
+    int taken = 0;
+    uint32_t flags = spin_lock_irqsave(&sem->waiters.lock);
+    if (sem->count > 0) {
+        sem->count--;
+        sem->stats.acquires++;
+        taken = 1;
+    }
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+    return taken;
+}
+
+// Add one to the count and wake a waiter (safe from interrupt handlers)
+void sem_post(semaphore_t* sem) {
+    uint32_t flags = spin_lock_irqsave(&sem->waiters.lock);
+    sem->count++;
+    task_t* next = wq_dequeue(&sem->waiters);
+    if (next) {
+        task_wake(next);
+    }
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+}
+
+// ============ Condition variables ============
+
+void cond_init(condvar_t* cond) {
+    wait_queue_init(&cond->waiters);
+}
+
+// Release the mutex, block until signalled, then re-acquire it
+void cond_wait(condvar_t* cond, mutex_t* mutex) {
+    task_t* self = task_current();
+    if (!self) {
+        mutex_unlock(mutex);
+        mutex_lock(mutex);
+        return;
+    }
+    
+    // Queued before the mutex is dropped, so a signal sent by the next
+    // holder finds us
+    uint32_t flags = irq_save();
+    spin_lock(&cond->waiters.lock);
+    wq_enqueue(&cond->waiters, self);
+    spin_unlock(&cond->waiters.lock);
+    mutex_unlock(mutex);
+    
+    wq_block(&cond->waiters, self);
+    irq_restore(flags);
+    mutex_lock(mutex);
+}
+
+void cond_signal(condvar_t* cond) {
+    wait_queue_wake_one(&cond->waiters);
+}
+
+void cond_broadcast(condvar_t* cond) {
+    wait_queue_wake_all(&cond->waiters);
+}
+
+// Print contention statistics for every mutex and semaphore
+void sync_dump() {
+    print("\nSleeping locks:\n");
+    print("  Name            Kind       Acquires  Contended  Wait Kcycles\n");
+    
+    uint32_t flags = spin_lock_irqsave(&lock_list_lock);
+    for (lock_stats_t* stats = lock_list; stats; stats = stats->next) {
+        int len = 0;
+        while (stats->name[len]) len++;
+        
+        print("  ");
+        print(stats->name);
+        for (int j = len; j < 16; j++) print(" ");
+        print(stats->kind);
+        print(stats->kind[0] == 'm' ? "      " : "  ");
+        print_dec(stats->acquires);
+        print("\t    ");
+        print_dec(stats->contended);
+        print("\t       ");
+        print_dec((uint32_t)(stats->wait_cycles >> 10));
+        print("\n");
+    }
+    spin_unlock_irqrestore(&lock_list_lock, flags);
+    
+    print("  Spinlock acquisitions that had to spin: ");
+    print_dec(spin_contentions);
+    print("\n\n");
+}
+
+// ============ Benchmark ============
+
+#define LOCK_BENCH_TASKS    4
+#define LOCK_BENCH_ROUNDS   20000       // Mutex acquisitions per task
+#define SEM_BENCH_ROUNDS    10000       // Semaphore round trips
+
+static int bench_ready = 0;
+static mutex_t bench_mutex;
+static semaphore_t bench_done;
+static semaphore_t bench_ping;
+static semaphore_t bench_pong;
+static volatile uint32_t bench_counter = 0;
+
+// Helper: Increment a shared counter under the mutex, with a critical
+// section long enough to be preempted in now and then
+static void bench_mutex_task() {
+    for (uint32_t i = 0; i < LOCK_BENCH_ROUNDS; i++) {
+        mutex_lock(&bench_mutex);
+        uint32_t value = bench_counter;
+        for (volatile uint32_t spin = 0; spin < 64; spin++) {
+        }
+        bench_counter = value + 1;
+        mutex_unlock(&bench_mutex);
+    }
+    sem_post(&bench_done);
+}
+
+// Helper: Answer every ping with a pong
+static void bench_pong_task() {
+    for (uint32_t i = 0; i < SEM_BENCH_ROUNDS; i++) {
+        sem_wait(&bench_ping);
+        sem_post(&bench_pong);
+    }
+    sem_post(&bench_done);
+}
+
+// Measure mutex contention and semaphore handoff latency
+void sync_benchmark() {
+    if (!bench_ready) {
+        mutex_init(&bench_mutex, "bench_mutex");
+        sem_init(&bench_done, "bench_done", 0);
+        sem_init(&bench_ping, "bench_ping", 0);
+        sem_init(&bench_pong, "bench_pong", 0);
+        bench_ready = 1;
+    }
+    
+    print("\nMutex: ");
+    print_dec(LOCK_BENCH_TASKS);
+    print(" tasks x ");
+    print_dec(LOCK_BENCH_ROUNDS);
+    print(" increments\n");
+    
+    lock_stats_t before = bench_mutex.stats;
+    bench_counter = 0;
+    uint64_t start = rdtsc();
+    uint32_t started = 0;
+    for (; started < LOCK_BENCH_TASKS; started++) {
+        if (task_create(bench_mutex_task, SCHED_PRIORITY_DEFAULT) < 0) {
+            print("  Out of memory\n");
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        sem_wait(&bench_done);
+    }
+    uint32_t kcycles = (uint32_t)((rdtsc() - start) >> 10);
+    
+    // The workers are done, so the counters are stable
+    uint32_t acquires = bench_mutex.stats.acquires - before.acquires;
+    uint32_t contended = bench_mutex.stats.contended - before.contended;
+    uint32_t wait_kcycles = (uint32_t)((bench_mutex.stats.wait_cycles - before.wait_cycles) >> 10);
+    
+    print("  Kcycles: ");
+    print_dec(kcycles);
+    print(", counter ");
+    print_dec(bench_counter);
+    print(bench_counter == started * LOCK_BENCH_ROUNDS ? " (correct)\n" : " (LOST UPDATES)\n");
+    print("  Acquires: ");
+    print_dec(acquires);
+    print(", blocked: ");
+    print_dec(contended);
+    print(", Kcycles blocked: ");
+    print_dec(wait_kcycles);
+    print("\n");
+    
+    print("Semaphore ping-pong: ");
+    print_dec(SEM_BENCH_ROUNDS);
+    print(" round trips\n");
+    if (task_create(bench_pong_task, SCHED_PRIORITY_DEFAULT) < 0) {
+        print("  Out of memory\n\n");
+        return;
+    }
+    start = rdtsc();
+    for (uint32_t i = 0; i < SEM_BENCH_ROUNDS; i++) {
+        sem_post(&bench_ping);
+        sem_wait(&bench_pong);
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    sem_wait(&bench_done);
+    
+    print("  Cycles per round trip: ");
+    print_dec(cycles / SEM_BENCH_ROUNDS);
+    print("\n\n");
+}
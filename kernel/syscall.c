@@ -0,0 +1,255 @@
+// System Call Implementation
+// Dispatch table shared by the int 0x80 and SYSENTER entry paths
+
+#include "syscall.h"
+#include "gdt.h"
+#include "paging.h"
+#include "pmm.h"
+#include "scheduler.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+extern void putchar(char c);
+
+// Entry points (syscall_entry.asm)
+extern void isr128();
+extern void sysenter_entry();
+extern void user_enter(uint32_t eip, uint32_t esp);
+extern uint8_t user_bench_start[];
+extern uint8_t user_bench_end[];
+
+#define CPUID_SEP               (1 << 11)
+
+#define MSR_SYSENTER_CS         0x174
+#define MSR_SYSENTER_ESP        0x175
+#define MSR_SYSENTER_EIP        0x176
+
+// Longest string SYS_WRITE prints
+#define SYSCALL_WRITE_MAX       1024
+
+typedef uint32_t (*syscall_func_t)(uint32_t arg1, uint32_t arg2, uint32_t arg3);
+
+static int sysenter_enabled = 0;
+
+// Filled in by SYS_BENCH_RESULT
+static volatile uint32_t bench_int80 = 0;
+static volatile uint32_t bench_sysenter = 0;
+static volatile uint32_t bench_rounds = 0;
+static volatile int bench_done = 0;
+
+static inline void wrmsr(uint32_t msr, uint32_t value) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"(value), "d"(0));
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Helper: Check that [addr, addr + size) is mapped user memory
+static int user_range_ok(uint32_t addr, uint32_t size) {
+    if (addr < USER_SPACE_BASE || size > USER_SPACE_END - addr) {
+        return 0;
+    }
+    for (uint32_t page = addr & 0xFFFFF000; page < addr + size; page += 4096) {
+        if (!virt_to_phys(page)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ============ System calls ============
+
+static uint32_t sys_null(uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    (void)arg1; (void)arg2; (void)arg3;
+    return 0;
+}
+
+static uint32_t sys_exit(uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    (void)arg1; (void)arg2; (void)arg3;
+    task_exit();
+    return 0;
+}
+
+static uint32_t sys_yield(uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    (void)arg1; (void)arg2; (void)arg3;
+    task_yield();
+    return 0;
+}
+
+static uint32_t sys_getpid(uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    (void)arg1; (void)arg2; (void)arg3;
+    return get_current_task_id();
+}
+
+static uint32_t sys_write(uint32_t str, uint32_t length, uint32_t arg3) {
+    (void)arg3;
+    if (length > SYSCALL_WRITE_MAX || !user_range_ok(str, length)) {
+        return SYSCALL_ERROR;
+    }
+    const char* chars = (const char*)str;
+    for (uint32_t i = 0; i < length; i++) {
+        putchar(chars[i]);
+    }
+    return length;
+}
+
+static uint32_t sys_bench_result(uint32_t int80, uint32_t sysenter, uint32_t rounds) {
+    bench_int80 = int80;
+    bench_sysenter = sysenter;
+    bench_rounds = rounds;
+    bench_done = 1;
+    return 0;
+}
+
+static const syscall_func_t syscall_table[SYSCALL_COUNT] = {
+    sys_null,
+    sys_exit,
+    sys_yield,
+    sys_getpid,
+    sys_write,
+    sys_bench_result,
+};
+
+// Run a system call
+uint32_t syscall_dispatch(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    if (num >= SYSCALL_COUNT) {
+        return SYSCALL_ERROR;
+    }
+    return syscall_table[num](arg1, arg2, arg3);
+}
+
+// int 0x80 handler
+// The gate clears IF; calls run with interrupts enabled like SYSENTER ones
+void syscall_interrupt(registers_t* regs) {
+    __asm__ __volatile__("sti");
+    regs->eax = syscall_dispatch(regs->eax, regs->ebx, regs->esi, regs->edi);
+    __asm__ __volatile__("cli");
+}
+
+// ============ Setup ============
+
+// Program SYSENTER on this CPU
+void syscall_init_cpu() {
+    if (!sysenter_enabled) {
+        return;
+    }
+    
+    // SS is CS + 8 on entry; SYSEXIT uses CS + 16 and CS + 24 (gdt.h)
+    wrmsr(MSR_SYSENTER_CS, GDT_KERNEL_CODE);
+    wrmsr(MSR_SYSENTER_ESP, gdt_kernel_stack_slot());
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+// Install the int 0x80 gate and SYSENTER on the bootstrap processor
+void syscall_init() {
+    // 0xEE: present, DPL 3 (reachable from user mode), 32-bit interrupt gate
+    idt_set_gate(SYSCALL_VECTOR, (uint32_t)isr128, GDT_KERNEL_CODE, 0xEE);
+    
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    sysenter_enabled = (edx & CPUID_SEP) != 0;
+    syscall_init_cpu();
+    
+    print(sysenter_enabled ? "System calls: SYSENTER and int 0x80\n" :
+                             "System calls: int 0x80 (no SYSENTER)\n");
+}
+
+// Check whether the fast path is available
+int syscall_has_sysenter() {
+    return sysenter_enabled;
+}
+
+// Load a program into the user window and run it in ring 3
+int user_exec(const void* code, uint32_t size) {
+    if (paging_current_space() == paging_kernel_space()) {
+        print("Syscall: user_exec needs a private address space\n");
+        return -1;
+    }
+    if (size == 0 || size > USER_CODE_MAX) {
+        print("Syscall: Bad program size\n");
+        return -1;
+    }
+    
+    // Code pages (writable: there is no loader to protect them after the copy)
+    const uint8_t* src = (const uint8_t*)code;
+    for (uint32_t offset = 0; offset < size; offset += 4096) {
+        uint32_t frame = pmm_alloc_zeroed();
+        if (!frame) {
+            print("Syscall: Out of memory for user program\n");
+            return -1;
+        }
+        map_page(USER_CODE_VIRT + offset, frame, PAGE_USER | PAGE_WRITE);
+    }
+    uint8_t* dest = (uint8_t*)USER_CODE_VIRT;
+    for (uint32_t i = 0; i < size; i++) {
+        dest[i] = src[i];
+    }
+    
+    uint32_t stack = pmm_alloc_zeroed();
+    if (!stack) {
+        print("Syscall: Out of memory for user stack\n");
+        return -1;
+    }
+    map_page(USER_STACK_TOP - USER_STACK_SIZE, stack, PAGE_USER | PAGE_WRITE);
+    
+    // Frames belong to the address space now and go with it at reap
+    user_enter(USER_CODE_VIRT, USER_STACK_TOP);
+    return -1;
+}
+
+// ============ Benchmark ============
+
+#define DIRECT_BENCH_ROUNDS     10000
+#define USER_BENCH_TIMEOUT_MS   5000
+
+// Helper: Task that becomes syscallbench's ring-3 program
+static void bench_user_task() {
+    user_exec(user_bench_start, user_bench_end - user_bench_start);
+}
+
+// Helper: One result line
+static void print_result(const char* name, uint32_t cycles) {
+    print(name);
+    print_dec(cycles);
+    print(" cycles\n");
+}
+
+// Compare a null system call through a direct call, int 0x80 and SYSENTER
+void syscall_benchmark() {
+    print("\nNull system call (SYS_NULL):\n");
+    
+    // Kernel-internal baseline: the dispatch alone, through a pointer the
+    // compiler cannot see through
+    uint32_t (*volatile dispatch)(uint32_t, uint32_t, uint32_t, uint32_t) = syscall_dispatch;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < DIRECT_BENCH_ROUNDS; i++) {
+        dispatch(SYS_NULL, 0, 0, 0);
+    }
+    print_result("  Direct call:  ", (uint32_t)(rdtsc() - start) / DIRECT_BENCH_ROUNDS);
+    
+    bench_done = 0;
+    if (task_create(bench_user_task, SCHED_PRIORITY_DEFAULT) < 0) {
+        print("  Cannot start the user task\n\n");
+        return;
+    }
+    for (uint32_t ms = 0; !bench_done && ms < USER_BENCH_TIMEOUT_MS; ms += 10) {
+        task_sleep_ms(10);
+    }
+    if (!bench_done || bench_rounds == 0) {
+        print("  User task did not report\n\n");
+        return;
+    }
+    
+    print_result("  int 0x80:     ", bench_int80 / bench_rounds);
+    if (bench_sysenter) {
+        print_result("  SYSENTER:     ", bench_sysenter / bench_rounds);
+    } else {
+        print("  SYSENTER:     not supported\n");
+    }
+    print("\n");
+}
@@ -0,0 +1,185 @@
+; System Call Entry
+; int 0x80 and SYSENTER paths into the kernel, and the first entry to ring 3
+
+[BITS 32]
+
+%define KERNEL_DATA     0x10        ; gdt.h
+%define USER_CODE       0x1B
+%define USER_DATA       0x23
+%define PERCPU          0x28
+
+extern _syscall_interrupt
+extern _syscall_dispatch
+
+section .text
+
+; int 0x80 (DPL 3 interrupt gate)
+; Builds the same registers_t frame as the ISR stubs; the handler writes
+; the result into the saved eax
+global _isr128
+_isr128:
+    push dword 0                ; Dummy error code
+    push dword 128              ; Interrupt number
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+    
+    mov ax, KERNEL_DATA
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ax, PERCPU
+    mov gs, ax
+    
+    mov eax, esp
+    push eax
+    call _syscall_interrupt
+    pop eax
+    
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+    add esp, 8
+    iret
+
+; SYSENTER fast path
+; The CPU loads CS/SS from the MSRs, EIP = _sysenter_entry and ESP = the
+; address of this CPU's TSS esp0 field, and clears IF. Nothing of the
+; caller is saved for us: the user ESP and return EIP arrive in ecx/edx.
+global _sysenter_entry
+_sysenter_entry:
+    mov esp, [esp]              ; The current task's kernel stack
+    push ecx                    ; User ESP
+    push edx                    ; User EIP
+    push ds
+    push es
+    push fs
+    push gs
+    
+    mov cx, KERNEL_DATA
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov cx, PERCPU
+    mov gs, cx
+    sti
+    
+    ; syscall_dispatch(eax, ebx, esi, edi); ebx/esi/edi/ebp are preserved
+    ; by the call, eax carries the result
+    push edi
+    push esi
+    push ebx
+    push eax
+    call _syscall_dispatch
+    add esp, 16
+    
+    cli
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    pop edx                     ; SYSEXIT returns to EIP = edx ...
+    pop ecx                     ; ... with ESP = ecx
+    sti                         ; Takes effect after the next instruction
+    sysexit
+
+; void user_enter(uint32_t eip, uint32_t esp)
+; Drop to ring 3 for the first time; never returns. The kernel stack is
+; abandoned: the next trap starts again at the TSS esp0
+global _user_enter
+_user_enter:
+    cli
+    mov ecx, [esp + 4]          ; eip
+    mov edx, [esp + 8]          ; esp
+    
+    mov ax, USER_DATA
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    
+    push dword USER_DATA        ; SS
+    push edx                    ; ESP
+    push dword 0x202            ; EFLAGS: IF set
+    push dword USER_CODE        ; CS
+    push ecx                    ; EIP
+    
+    ; No kernel values leak into the program
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor ebp, ebp
+    iret
+
+; ============ Benchmark ============
+
+%define SYS_NULL            0       ; syscall.h
+%define SYS_EXIT            1
+%define SYS_BENCH_RESULT    5
+%define USER_BENCH_ROUNDS   10000
+
+; Ring-3 program for syscallbench, copied to USER_CODE_VIRT (so it must
+; be position-independent). Times USER_BENCH_ROUNDS null calls through
+; int 0x80, then through SYSENTER if CPUID reports it, and reports
+; SYS_BENCH_RESULT(int 0x80 cycles, SYSENTER cycles or 0, rounds)
+global _user_bench_start
+_user_bench_start:
+    mov edi, USER_BENCH_ROUNDS
+    rdtsc
+    mov ebp, eax
+.int80:
+    mov eax, SYS_NULL
+    int 0x80
+    dec edi
+    jnz .int80
+    rdtsc
+    sub eax, ebp
+    push eax                    ; int 0x80 cycles
+    
+    ; SEP: CPUID.1:EDX bit 11
+    xor esi, esi
+    mov eax, 1
+    cpuid
+    test edx, 1 << 11
+    jz .report
+    
+    ; SYSEXIT comes back to .sysret; find it without absolute addresses
+    call .here
+.here:
+    pop ebx
+    add ebx, .sysret - .here
+    
+    mov edi, USER_BENCH_ROUNDS
+    rdtsc
+    mov ebp, eax
+.sysenter:
+    mov eax, SYS_NULL
+    mov ecx, esp
+    mov edx, ebx
+    sysenter
+.sysret:
+    dec edi
+    jnz .sysenter
+    rdtsc
+    sub eax, ebp
+    mov esi, eax                ; SYSENTER cycles
+
+.report:
+    pop ebx
+    mov edi, USER_BENCH_ROUNDS
+    mov eax, SYS_BENCH_RESULT
+    int 0x80
+    mov eax, SYS_EXIT
+    int 0x80
+.hang:
+    jmp .hang
+
+global _user_bench_end
+_user_bench_end:
@@ -1,35 +1,106 @@
 // PIT (Programmable Interval Timer) Implementation
-// Provides system timer at configurable frequency
+// Provides system timer at configurable frequency and a hierarchical
+// timer wheel for timeouts
 
 #include "timer.h"
-#include "pic.h"
+#include "irq.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "spinlock.h"
 
 // External print functions
 extern void print(const char* str);
 extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
 
-// Global tick counter
+// Global tick counter (tick_wraps counts its overflows for timer_get_clocks)
 static volatile uint32_t tick_count = 0;
+static volatile uint32_t tick_wraps = 0;
 static uint32_t timer_frequency = 0;
+static uint32_t pit_divisor = 0;        // PIT input clocks per tick
+
+// Tickless state
+static int tickless_enabled = 1;
+static volatile int oneshot = 0;        // Channel 0 is in one-shot mode
+static uint32_t oneshot_counts = 0;     // Count the one-shot was loaded with
+static uint32_t oneshot_ticks = 0;      // Ticks that pass when it fires
+static timer_stats_t stats;
+
+// Interrupt latency sampling (timer_measure_latency), in PIT clocks
+static volatile uint32_t latency_left = 0;
+static uint32_t latency_samples = 0;
+static uint32_t latency_total = 0;
+static uint32_t latency_min = 0;
+
+// Timer wheel
+#define ROOT_SIZE   (1 << TIMER_ROOT_BITS)
+#define LEVEL_SIZE  (1 << TIMER_LEVEL_BITS)
+#define ROOT_MASK   (ROOT_SIZE - 1)
+#define LEVEL_MASK  (LEVEL_SIZE - 1)
+
+// Timeouts are added from any CPU and expire on the bootstrap processor
+static spinlock_t wheel_lock;
+static timer_event_t* wheel_root[ROOT_SIZE];
+static timer_event_t* wheel_levels[TIMER_LEVELS][LEVEL_SIZE];
+static uint32_t wheel_tick = 1;     // Next tick whose slot has not run yet
+
+// Channel 0 is reprogrammed on the bootstrap processor and read from any
+// CPU by timer_get_clocks; a command and its data bytes must not interleave
+static spinlock_t pit_lock = SPINLOCK_INIT;
 
 // I/O port operations
 static inline void outb(uint16_t port, uint8_t value) {
     __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
 }
 
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// Helper: Load channel 0 with a mode and count
+static void pit_program(uint8_t mode, uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&pit_lock);
+    outb(PIT_COMMAND, mode);
+    outb(PIT_CHANNEL0, count & 0xFF);           // Low byte
+    outb(PIT_CHANNEL0, (count >> 8) & 0xFF);    // High byte
+    spin_unlock_irqrestore(&pit_lock, flags);
+}
+
+// Helper: Read channel 0's status and current count in one latch
+// (read-back command); status bit 7 is the OUT pin, bit 6 "null count"
+static uint16_t pit_read(uint8_t* status) {
+    uint32_t flags = spin_lock_irqsave(&pit_lock);
+    outb(PIT_COMMAND, 0xC2);
+    *status = inb(PIT_CHANNEL0);
+    uint16_t count = inb(PIT_CHANNEL0);
+    count |= (uint16_t)inb(PIT_CHANNEL0) << 8;
+    spin_unlock_irqrestore(&pit_lock, flags);
+    return count;
+}
+
+// Helper: Credit ticks that have passed
+static void ticks_advance(uint32_t ticks) {
+    uint32_t old = tick_count;
+    tick_count = old + ticks;
+    if (tick_count < old) {
+        tick_wraps++;
+    }
+}
+
+static int timer_handler(void* ctx);
+
 // Initialize PIT timer
 void timer_init(uint32_t frequency) {
     timer_frequency = frequency;
     
     // Calculate divisor
-    uint32_t divisor = PIT_FREQUENCY / frequency;
+    pit_divisor = PIT_FREQUENCY / frequency;
     
-    // Send command byte
-    outb(PIT_COMMAND, 0x36);    // Channel 0, lo/hi byte, rate generator
-    
-    // Send divisor
-    outb(PIT_CHANNEL0, divisor & 0xFF);         // Low byte
-    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);  // High byte
+    // Channel 0, lo/hi byte, rate generator
+    pit_program(PIT_MODE_PERIODIC, pit_divisor);
+    irq_register(0, timer_handler, 0);
     
     print("PIT timer initialized at ");
     print_hex(frequency);
@@ -41,9 +112,330 @@ uint32_t timer_get_ticks() {
     return tick_count;
 }
 
-// Timer interrupt handler
-void timer_handler() {
-    tick_count++;
+// PIT input clocks since timer_init, including the current tick
+// A one-shot started part way into a tick and ends on a tick boundary
+// oneshot_ticks later, so its count measures back from that boundary.
+// Retried until no tick or mode change lands in between; a reload whose
+// interrupt is still pending reads as the start of the old tick, so the
+// result can step back by up to one tick (clock.c clamps it)
+uint64_t timer_get_clocks() {
+    uint32_t ticks, wraps, partial;
+    int was_oneshot;
+    do {
+        ticks = tick_count;
+        wraps = tick_wraps;
+        was_oneshot = oneshot;
+        uint32_t span = oneshot_ticks * pit_divisor;
+        uint32_t loaded = oneshot_counts;
+        
+        uint8_t status;
+        uint32_t count = pit_read(&status);
+        if (!was_oneshot) {
+            partial = count <= pit_divisor ? pit_divisor - count : 0;
+        } else if (status & 0x80) {
+            partial = span;                 // Fired, interrupt not taken yet
+        } else if ((status & 0x40) || count > loaded) {
+            partial = span - loaded;        // Count not loaded yet
+        } else {
+            partial = span - count;
+        }
+    } while (ticks != tick_count || was_oneshot != oneshot);
+    
+    uint64_t all_ticks = ((uint64_t)wraps << 32) | ticks;
+    return all_ticks * pit_divisor + partial;
+}
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+// Helper: Link a timer into the slot for its expiry
+// The root wheel holds timers due within 256 ticks; level n holds those
+// due within 2^(8 + 6(n+1)) ticks, indexed by the matching expiry bits
+static void wheel_insert(timer_event_t* event) {
+    uint32_t delta = event->expires - wheel_tick;
+    timer_event_t** slot;
+    
+    if ((int32_t)delta < 0) {
+        // Already due: run on the next tick processed
+        slot = &wheel_root[wheel_tick & ROOT_MASK];
+    } else if (delta < ROOT_SIZE) {
+        slot = &wheel_root[event->expires & ROOT_MASK];
+    } else {
+        uint32_t level = 0;
+        uint32_t shift = TIMER_ROOT_BITS;
+        while (level < TIMER_LEVELS - 1 && delta >= (1u << (shift + TIMER_LEVEL_BITS))) {
+            level++;
+            shift += TIMER_LEVEL_BITS;
+        }
+        slot = &wheel_levels[level][(event->expires >> shift) & LEVEL_MASK];
+    }
+    
+    event->next = *slot;
+    if (event->next) {
+        event->next->pprev = &event->next;
+    }
+    event->pprev = slot;
+    *slot = event;
+}
+
+// Helper: Unlink a pending timer
+static void wheel_remove(timer_event_t* event) {
+    *event->pprev = event->next;
+    if (event->next) {
+        event->next->pprev = event->pprev;
+    }
+    event->next = 0;
+    event->pprev = 0;
+}
+
+// Helper: Move the timers of one upper slot down towards the root wheel
+// Returns the slot index so the caller knows whether to cascade further
+static uint32_t wheel_cascade(uint32_t level) {
+    uint32_t index = (wheel_tick >> (TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS)) & LEVEL_MASK;
+    timer_event_t* event = wheel_levels[level][index];
+    wheel_levels[level][index] = 0;
+    
+    while (event) {
+        timer_event_t* next = event->next;
+        wheel_insert(event);
+        event = next;
+    }
+    return index;
+}
+
+// Helper: Run every timer that expires at or before the current tick
+// Callbacks run without the lock, since they may add timers or take
+// scheduler locks
+static void wheel_run() {
+    spin_lock(&wheel_lock);
+    while ((int32_t)(tick_count - wheel_tick) >= 0) {
+        uint32_t index = wheel_tick & ROOT_MASK;
+        
+        // The root wheel wrapped: refill it from the levels above
+        if (index == 0) {
+            uint32_t level = 0;
+            while (level < TIMER_LEVELS && wheel_cascade(level) == 0) {
+                level++;
+            }
+        }
+        
+        // Callbacks may add timers, so detach one at a time
+        while (wheel_root[index]) {
+            timer_event_t* event = wheel_root[index];
+            wheel_remove(event);
+            spin_unlock(&wheel_lock);
+            event->callback(event->data);
+            spin_lock(&wheel_lock);
+        }
+        wheel_tick++;
+    }
+    spin_unlock(&wheel_lock);
+}
+
+// Schedule a timeout
+void timer_add(timer_event_t* event, uint32_t delay_ticks, timer_callback_t callback, void* data) {
+    uint32_t flags = irq_save();
+    
+    // A stopped tick was programmed for the old earliest timeout; resume
+    // it so tick_count is current and this timeout cannot be overslept
+    // (another CPU has the bootstrap processor do it from its IPI handler)
+    int remote = smp_cpu_id() != 0;
+    if (!remote) {
+        timer_tick_restart();
+    }
+    
+    spin_lock(&wheel_lock);
+    if (event->pprev) {
+        wheel_remove(event);
+    }
+    event->expires = tick_count + (delay_ticks ? delay_ticks : 1);
+    event->callback = callback;
+    event->data = data;
+    wheel_insert(event);
+    spin_unlock(&wheel_lock);
+    
+    if (remote && oneshot) {
+        smp_send_resched(0);
+    }
+    irq_restore(flags);
+}
+
+// Cancel a timeout
+int timer_cancel(timer_event_t* event) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    int pending = (event->pprev != 0);
+    if (pending) {
+        wheel_remove(event);
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return pending;
+}
+
+// Busy-wait on PIT channel 2 for a number of input clocks
+// Mode 0 raises OUT2 at terminal count
+void timer_pit_wait(uint32_t clocks) {
+    if (clocks == 0) {
+        clocks = 1;
+    } else if (clocks > 0xFFFF) {
+        clocks = 0xFFFF;
+    }
+    
+    // Gate on, speaker off; loading the count restarts the countdown
+    outb(PIT_CONTROL, (inb(PIT_CONTROL) & ~PIT2_SPEAKER) | PIT2_GATE);
+    outb(PIT_COMMAND, PIT2_MODE_ONESHOT);
+    outb(PIT_CHANNEL2, clocks & 0xFF);
+    outb(PIT_CHANNEL2, (clocks >> 8) & 0xFF);
+    while (!(inb(PIT_CONTROL) & PIT2_OUT)) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+// Busy-wait on PIT channel 2
+// The 16-bit counter covers about 55ms, so longer delays are done in pieces
+void timer_udelay(uint32_t us) {
+    while (us > 0) {
+        uint32_t chunk = us > 50000 ? 50000 : us;
+        timer_pit_wait((PIT_FREQUENCY / 1000 + 1) * chunk / 1000);
+        us -= chunk;
+    }
+}
+
+// Convert milliseconds to ticks
+uint32_t timer_ms_to_ticks(uint32_t ms) {
+    uint32_t hz = timer_frequency ? timer_frequency : TIMER_HZ;
+    return (ms * hz + 999) / 1000;
+}
+
+// ============ Tickless Operation ============
+
+// Helper: Ticks until the next pending timeout, at most limit
+// Root wheel wraps count as events too, since a cascade may bring
+// timeouts due on that very tick
+static uint32_t wheel_next_delta(uint32_t limit) {
+    for (uint32_t t = 0; t < limit; t++) {
+        uint32_t index = (wheel_tick + t) & ROOT_MASK;
+        if (wheel_root[index] || index == 0) {
+            return t + 1;
+        }
+    }
+    return limit;
+}
+
+// Stop the periodic tick until the earliest pending timeout
+void timer_tick_stop() {
+    if (!tickless_enabled || oneshot || pit_divisor == 0 || smp_cpu_id() != 0) {
+        return;
+    }
+    
+    // Held until oneshot is set, so a CPU adding a timeout either lands
+    // in the wheel before we look or sees the one-shot and kicks us
+    spin_lock(&wheel_lock);
+    uint32_t ticks = wheel_next_delta(0xFFFF / pit_divisor);
+    if (ticks <= 1) {
+        spin_unlock(&wheel_lock);
+        return;
+    }
+    
+    // Finish the tick in progress, then whole ticks: the interrupt lands
+    // on the same boundary the periodic tick would have
+    uint8_t status;
+    uint32_t left = pit_read(&status);
+    if (left == 0 || left > pit_divisor) {
+        left = pit_divisor;
+    }
+    oneshot_counts = left + (ticks - 1) * pit_divisor;
+    oneshot_ticks = ticks;
+    pit_program(PIT_MODE_ONESHOT, oneshot_counts);
+    oneshot = 1;
+    stats.oneshots++;
+    spin_unlock(&wheel_lock);
+}
+
+// Go back to periodic ticks
+// Whole ticks that already passed are credited now; the one-shot is cut
+// short to end on the next tick boundary and the handler resumes the
+// periodic mode from there
+void timer_tick_restart() {
+    if (!oneshot || smp_cpu_id() != 0) {
+        return;
+    }
+    
+    uint8_t status;
+    uint32_t count = pit_read(&status);
+    if (status & 0x80) {
+        return;     // Already fired; the pending interrupt finishes the job
+    }
+    if ((status & 0x40) || count > oneshot_counts) {
+        count = oneshot_counts;     // Count not loaded yet
+    }
+    
+    uint32_t elapsed = oneshot_counts - count;
+    uint32_t whole = elapsed / pit_divisor;
+    ticks_advance(whole);
+    stats.ticks_skipped += whole;
+    
+    oneshot_counts = pit_divisor - elapsed % pit_divisor;
+    oneshot_ticks = 1;
+    pit_program(PIT_MODE_ONESHOT, oneshot_counts);
+}
+
+// Enable or disable tickless operation
+void timer_set_tickless(int enabled) {
+    uint32_t flags = irq_save();
+    tickless_enabled = enabled;
+    if (!enabled) {
+        timer_tick_restart();
+    }
+    irq_restore(flags);
+}
+
+// Check whether tickless operation is enabled
+int timer_get_tickless() {
+    return tickless_enabled;
+}
+
+// Get timer interrupt statistics
+const timer_stats_t* timer_get_stats() {
+    return &stats;
+}
+
+// Timer interrupt handler (IRQ 0)
+static int timer_handler(void* ctx) {
+    (void)ctx;
+    
+    // In rate-generator mode the interrupt is raised as the counter
+    // reloads, so how far it has counted down since is the latency
+    if (latency_left && !oneshot) {
+        uint8_t status;
+        uint32_t late = pit_divisor - pit_read(&status);
+        latency_total += late;
+        if (late < latency_min) {
+            latency_min = late;
+        }
+        latency_samples++;
+        latency_left--;
+    }
+    
+    stats.irqs++;
+    
+    if (oneshot) {
+        // A one-shot covers oneshot_ticks ticks; resume periodic ticks
+        ticks_advance(oneshot_ticks);
+        stats.ticks_skipped += oneshot_ticks - 1;
+        oneshot = 0;
+        pit_program(PIT_MODE_PERIODIC, pit_divisor);
+    } else {
+        ticks_advance(1);
+    }
     
     // Disabled printing to prevent screen updates
     // Uncomment to see uptime every 5 seconds
@@ -55,10 +447,113 @@ void timer_handler() {
     }
     */
     
-    // Call scheduler for task switching
-    // extern void schedule();
-    // schedule();
+    // Expire timeouts (may wake sleeping tasks)
+    wheel_run();
+    
+    // Charge the tick to the current task's time slice; the switch
+    // itself waits for scheduler_irq_exit, after the EOI
+    scheduler_tick();
+    return IRQ_HANDLED;
+}
+
+// ============ Benchmark ============
+
+#define TIMER_BENCH_MS 1000
+#define PIT_NS_PER_CLOCK 838
+
+// Measure timer interrupt latency over a number of periodic ticks
+int timer_measure_latency(uint32_t ticks, uint32_t* min_ns, uint32_t* avg_ns) {
+    int was_enabled = tickless_enabled;
+    timer_set_tickless(0);
+    
+    uint32_t flags = irq_save();
+    latency_samples = 0;
+    latency_total = 0;
+    latency_min = 0xFFFFFFFF;
+    latency_left = ticks;
+    irq_restore(flags);
+    
+    // Twice the expected time, in case ticks are lost
+    uint32_t timeout_ms = ticks * 2000 / (timer_frequency ? timer_frequency : TIMER_HZ) + 100;
+    for (uint32_t ms = 0; latency_left && ms < timeout_ms; ms += 10) {
+        task_sleep_ms(10);
+    }
+    
+    flags = irq_save();
+    latency_left = 0;
+    uint32_t samples = latency_samples;
+    irq_restore(flags);
+    timer_set_tickless(was_enabled);
+    
+    if (samples == 0) {
+        return -1;
+    }
+    *min_ns = latency_min * PIT_NS_PER_CLOCK;
+    *avg_ns = latency_total / samples * PIT_NS_PER_CLOCK;
+    return 0;
+}
+
+static volatile int spin_stop = 0;
+static volatile uint32_t spinners_alive = 0;
+
+// Helper: CPU-bound task for the benchmark
+static void spin_task() {
+    volatile uint32_t spins = 0;
+    while (!spin_stop) {
+        spins++;
+    }
+    __sync_fetch_and_sub(&spinners_alive, 1);
+}
+
+// Helper: Timer interrupts per second with a number of spinning tasks
+// while the caller sleeps
+static uint32_t irq_rate(uint32_t spinners) {
+    spin_stop = 0;
+    for (uint32_t i = 0; i < spinners; i++) {
+        __sync_fetch_and_add(&spinners_alive, 1);
+        if (task_create(spin_task, SCHED_PRIORITY_DEFAULT) < 0) {
+            __sync_fetch_and_sub(&spinners_alive, 1);
+        }
+    }
+    
+    uint32_t irqs = stats.irqs;
+    task_sleep_ms(TIMER_BENCH_MS);
+    irqs = stats.irqs - irqs;
+    
+    spin_stop = 1;
+    while (spinners_alive) {
+        task_yield();
+    }
+    return irqs * 1000 / TIMER_BENCH_MS;
+}
+
+// Measure timer interrupt rates idle and busy, with and without tickless
+void timer_benchmark() {
+    int was_enabled = tickless_enabled;
+    
+    print("\nTimer interrupts per second (");
+    print_dec(timer_frequency);
+    print(" Hz tick)\n");
+    print("  Runnable tasks   Periodic   Tickless\n");
+    for (uint32_t spinners = 0; spinners <= 2; spinners++) {
+        timer_set_tickless(0);
+        uint32_t periodic = irq_rate(spinners);
+        timer_set_tickless(1);
+        uint32_t tickless = irq_rate(spinners);
+        
+        print("  ");
+        print_dec(spinners);
+        print(spinners == 0 ? " (idle)         " : " (busy)         ");
+        print_dec(periodic);
+        print(periodic < 10 ? "          " : periodic < 100 ? "         " : "        ");
+        print_dec(tickless);
+        print("\n");
+    }
+    timer_set_tickless(was_enabled);
     
-    // Send EOI to PIC
-    pic_send_eoi(0);
+    print("  One-shots: ");
+    print_dec(stats.oneshots);
+    print(", ticks without an interrupt: ");
+    print_dec(stats.ticks_skipped);
+    print("\n\n");
 }
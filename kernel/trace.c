@@ -0,0 +1,240 @@
+// Event Trace Implementation
+// Per-CPU record rings, the serial dump and tracepoint cost
+
+#include "trace.h"
+#include "clock.h"
+#include "pmm.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "smp.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// A ring has one writer, its own CPU, which records with interrupts off;
+// so no lock is needed and a record is never torn by a nested one
+typedef struct {
+    trace_record_t* records;    // 0 until trace_start allocates it
+    volatile uint32_t head;     // Records written since trace_start
+} trace_ring_t;
+
+static trace_ring_t rings[SMP_MAX_CPUS];
+
+volatile uint32_t trace_mask = 0;
+
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+// Append a record to this CPU's ring
+void trace_record(uint32_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+    uint32_t flags = irq_save();
+    uint32_t cpu = smp_cpu_id();
+    trace_ring_t* ring = &rings[cpu];
+    
+    if (ring->records) {
+        uint32_t seq = ring->head;
+        trace_record_t* record = &ring->records[seq & (TRACE_RING_RECORDS - 1)];
+        record->tsc = clock_cycles();
+        record->type = type;
+        record->cpu = cpu;
+        record->seq = seq;
+        record->task = get_current_task_id();
+        record->arg0 = arg0;
+        record->arg1 = arg1;
+        record->arg2 = arg2;
+        ring->head = seq + 1;
+    }
+    
+    irq_restore(flags);
+}
+
+// Allocate the rings of the online CPUs, empty them and start recording
+int trace_start(uint32_t mask) {
+    trace_stop();
+    
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!smp_cpu_online(cpu) || rings[cpu].records) {
+            continue;
+        }
+        uint32_t addr = pmm_alloc_order(TRACE_RING_ORDER);
+        if (addr == 0) {
+            print("Trace: Cannot allocate a ring\n");
+            return -1;
+        }
+        rings[cpu].records = (trace_record_t*)addr;
+    }
+    
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        rings[cpu].head = 0;
+    }
+    __sync_synchronize();
+    trace_mask = mask & TRACE_ALL;
+    return 0;
+}
+
+// Stop recording
+void trace_stop() {
+    if (!trace_mask) {
+        return;
+    }
+    trace_mask = 0;
+    __sync_synchronize();
+    
+    // Another CPU may be inside trace_record; it runs with interrupts off
+    // for well under this long (100us)
+    uint64_t start = clock_cycles();
+    while (clock_cycles() - start < (uint64_t)clock_tsc_khz() / 10) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+// Helper: Records a ring holds, and how many it has overwritten
+static uint32_t ring_count(const trace_ring_t* ring, uint32_t* lost) {
+    uint32_t head = ring->head;
+    uint32_t count = head < TRACE_RING_RECORDS ? head : TRACE_RING_RECORDS;
+    if (lost) {
+        *lost = head - count;
+    }
+    return count;
+}
+
+// Stop recording and send the rings over the serial port
+int trace_dump() {
+    if (!serial_present()) {
+        print("\nTrace: No serial port\n\n");
+        return -1;
+    }
+    trace_stop();
+    
+    trace_dump_header_t header;
+    const char* magic = TRACE_DUMP_MAGIC;
+    for (uint32_t i = 0; i < sizeof(header.magic); i++) {
+        header.magic[i] = magic[i];
+    }
+    header.record_size = sizeof(trace_record_t);
+    header.tsc_khz = clock_tsc_khz();
+    header.cpus = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (rings[cpu].records) {
+            header.cpus++;
+        }
+    }
+    serial_write(&header, sizeof(header));
+    
+    uint32_t total = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        trace_ring_t* ring = &rings[cpu];
+        if (!ring->records) {
+            continue;
+        }
+        
+        trace_dump_cpu_t block;
+        block.cpu = cpu;
+        block.count = ring_count(ring, &block.lost);
+        serial_write(&block, sizeof(block));
+        
+        // Oldest first: once the ring has wrapped that is the slot the
+        // next record would overwrite
+        uint32_t first = ring->head - block.count;
+        for (uint32_t i = 0; i < block.count; i++) {
+            const trace_record_t* record = &ring->records[(first + i) & (TRACE_RING_RECORDS - 1)];
+            serial_write(record, sizeof(*record));
+        }
+        total += block.count;
+    }
+    serial_write(TRACE_DUMP_END, 8);
+    
+    print("\nTrace: Sent ");
+    print_dec(total);
+    print(" records over COM1\n\n");
+    return 0;
+}
+
+// Print whether tracing is on and the per-CPU record counts
+void trace_status() {
+    print("\nTracing ");
+    print(trace_mask ? "on" : "off");
+    print(" (mask ");
+    print_hex(trace_mask);
+    print("), ");
+    print_dec(TRACE_RING_RECORDS);
+    print(" records per CPU\n");
+    
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!rings[cpu].records) {
+            continue;
+        }
+        uint32_t lost;
+        uint32_t count = ring_count(&rings[cpu], &lost);
+        print("  CPU ");
+        print_dec(cpu);
+        print(": ");
+        print_dec(count);
+        print(" records, ");
+        print_dec(lost);
+        print(" overwritten\n");
+    }
+    print("\n");
+}
+
+// ============ Benchmark ============
+
+#define TRACE_BENCH_ROUNDS  1000
+
+// Helper: Cycles per tracepoint with the given mask
+static uint32_t tracepoint_cost(uint32_t mask) {
+    uint32_t flags = irq_save();
+    trace_mask = mask;
+    uint64_t start = clock_cycles();
+    for (uint32_t i = 0; i < TRACE_BENCH_ROUNDS; i++) {
+        trace_event(TRACE_MARK, i, 0, 0);
+    }
+    uint32_t cycles = (uint32_t)(clock_cycles() - start);
+    trace_mask = 0;
+    irq_restore(flags);
+    return cycles / TRACE_BENCH_ROUNDS;
+}
+
+// Measure the cost of a tracepoint, disabled and enabled
+void trace_benchmark() {
+    if (trace_start(0) != 0) {
+        return;
+    }
+    
+    // The loop alone, for reference: the same count of empty iterations
+    uint32_t flags = irq_save();
+    uint64_t start = clock_cycles();
+    for (uint32_t i = 0; i < TRACE_BENCH_ROUNDS; i++) {
+        __asm__ __volatile__("" : : "r"(i) : "memory");
+    }
+    uint32_t loop = (uint32_t)(clock_cycles() - start) / TRACE_BENCH_ROUNDS;
+    irq_restore(flags);
+    
+    uint32_t disabled = tracepoint_cost(0);
+    uint32_t enabled = tracepoint_cost(1u << TRACE_MARK);
+    trace_start(0);
+    
+    print("\nTracepoint cost (");
+    print_dec(TRACE_BENCH_ROUNDS);
+    print(" calls, rings emptied):\n");
+    print("  Empty loop:  ");
+    print_dec(loop);
+    print(" cycles/iteration\n");
+    print("  Disabled:    ");
+    print_dec(disabled);
+    print(" cycles/call\n");
+    print("  Enabled:     ");
+    print_dec(enabled);
+    print(" cycles/call (");
+    print_dec(sizeof(trace_record_t));
+    print("-byte record)\n\n");
+}
@@ -0,0 +1,84 @@
+; Application Processor Startup Trampoline
+; Copied to SMP_TRAMPOLINE by smp_init; a STARTUP IPI starts each AP here
+; in real mode at CS = SMP_TRAMPOLINE >> 4, IP = 0
+
+%define SMP_TRAMPOLINE  0x70000         ; smp.h
+%define SMP_MAX_CPUS    8               ; smp.h
+
+; Address of a trampoline label once copied
+%define TRAMP(label)    (SMP_TRAMPOLINE + ((label) - _ap_trampoline_start))
+
+section .text
+
+[BITS 16]
+global _ap_trampoline_start
+_ap_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    
+    ; Temporary flat GDT, then into protected mode
+    lgdt [ap_gdt_ptr - _ap_trampoline_start]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(ap_protected)
+
+[BITS 32]
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    
+    ; Paging exactly as the bootstrap processor runs it: features first,
+    ; then the kernel page directory, then CR0 with PG set
+    mov eax, [TRAMP(ap_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMP(ap_cr3)]
+    mov cr3, eax
+    mov eax, [TRAMP(ap_cr0)]
+    mov cr0, eax
+    
+    ; Claim a CPU index; late or surplus CPUs park (smp_init closes the
+    ; count by raising it to SMP_MAX_CPUS)
+    mov eax, 1
+    lock xadd [TRAMP(ap_next_cpu)], eax
+    cmp eax, SMP_MAX_CPUS
+    jae .park
+    
+    ; Run smp_ap_main(index) on that CPU's idle task stack
+    mov esp, [TRAMP(ap_stacks) + eax * 4]
+    push eax
+    call [TRAMP(ap_entry)]
+    
+.park:
+    cli
+    hlt
+    jmp .park
+
+align 8
+ap_gdt:
+    dq 0x0000000000000000       ; Null
+    dq 0x00CF9A000000FFFF       ; 0x08: flat code
+    dq 0x00CF92000000FFFF       ; 0x10: flat data
+ap_gdt_ptr:
+    dw ap_gdt_ptr - ap_gdt - 1
+    dd TRAMP(ap_gdt)
+
+; Filled in by smp_init (ap_boot_params_t in smp.c)
+align 4
+global _ap_trampoline_params
+_ap_trampoline_params:
+ap_cr0:         dd 0
+ap_cr3:         dd 0
+ap_cr4:         dd 0
+ap_entry:       dd 0
+ap_next_cpu:    dd 0
+ap_stacks:      times SMP_MAX_CPUS dd 0
+
+global _ap_trampoline_end
+_ap_trampoline_end:
@@ -0,0 +1,596 @@
+// Virtual Memory Manager Implementation
+// Region table for kernel virtual space with demand-zero page faults
+
+#include "vmm.h"
+#include "clock.h"
+#include "paging.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "trace.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// Region table, kept sorted by start address
+static vmm_region_t regions[VMM_MAX_REGIONS];
+static uint32_t region_count = 0;
+
+static vmm_stats_t stats;
+
+// Kernel stack window: one bit per page, set for stack and guard pages
+#define STACK_WINDOW_PAGES ((KERNEL_STACK_END - KERNEL_STACK_BASE) / PAGE_SIZE)
+static uint32_t stack_bitmap[STACK_WINDOW_PAGES / 32];
+static uint32_t stack_hint = 0;         // Next-fit start
+static uint32_t stack_count = 0;
+static uint32_t stack_pages = 0;        // Backed pages (guards excluded)
+
+// Region table and stack window; taken before the paging and PMM locks
+static spinlock_t vmm_lock = SPINLOCK_INIT;
+
+// Helper: Read the CPU timestamp counter
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Initialize the region table
+void vmm_init() {
+    region_count = 0;
+    stats.faults = 0;
+    stats.resolved = 0;
+    stats.invalid = 0;
+    stats.cow_faults = 0;
+    stats.total_cycles = 0;
+    stats.min_cycles = 0xFFFFFFFF;
+    stats.max_cycles = 0;
+    
+    print("VMM initialized (");
+    print_dec((KERNEL_VMAP_END - KERNEL_VMAP_BASE) / (1024 * 1024));
+    print("MB demand-paged kernel space)\n");
+}
+
+// Helper: Find the first gap that fits size bytes plus an optional guard page
+// Returns the slot the new region goes into, or -1
+static int find_gap(uint32_t size, uint32_t guard, uint32_t* start) {
+    uint32_t candidate = KERNEL_VMAP_BASE;
+    
+    for (uint32_t i = 0; i <= region_count; i++) {
+        uint32_t limit = (i < region_count) ? regions[i].start : KERNEL_VMAP_END;
+        if (i < region_count && (regions[i].flags & VMM_GUARD)) {
+            limit -= PAGE_SIZE;     // Keep the next region's guard page free
+        }
+        
+        if (limit > candidate && limit - candidate >= guard + size) {
+            *start = candidate + guard;
+            return i;
+        }
+        
+        if (i < region_count) {
+            candidate = regions[i].end;
+        }
+    }
+    return -1;
+}
+
+// Helper: Insert a region, returning its start address (0 on failure)
+static void* add_region(const char* name, uint32_t size, uint32_t flags,
+                        const uint8_t* source, uint32_t source_size) {
+    if (size == 0) {
+        return 0;
+    }
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    
+    uint32_t irq_flags = spin_lock_irqsave(&vmm_lock);
+    
+    uint32_t start = 0;
+    int slot = (region_count < VMM_MAX_REGIONS) ?
+               find_gap(size, (flags & VMM_GUARD) ? PAGE_SIZE : 0, &start) : -1;
+    if (slot < 0) {
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        print("VMM: No room for region ");
+        print(name);
+        print("\n");
+        return 0;
+    }
+    
+    for (int i = region_count; i > slot; i--) {
+        regions[i] = regions[i - 1];
+    }
+    region_count++;
+    
+    vmm_region_t* region = &regions[slot];
+    region->start = start;
+    region->end = start + size;
+    region->flags = flags;
+    region->name = name;
+    region->source = source;
+    region->source_size = source_size;
+    region->resident_pages = 0;
+    
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    return (void*)start;
+}
+
+// Reserve a zero-filled region
+void* vmm_alloc(const char* name, uint32_t size, uint32_t flags) {
+    return add_region(name, size, flags, 0, 0);
+}
+
+// Reserve a region initialized from data
+void* vmm_map_data(const char* name, const void* data, uint32_t size, uint32_t flags) {
+    return add_region(name, size, flags, (const uint8_t*)data, size);
+}
+
+// Helper: Binary search for the region containing an address
+static int find_index(uint32_t addr) {
+    int low = 0, high = (int)region_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (addr < regions[mid].start) {
+            high = mid - 1;
+        } else if (addr >= regions[mid].end) {
+            low = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+    return -1;
+}
+
+// Find the region containing an address
+const vmm_region_t* vmm_find_region(uint32_t addr) {
+    int index = find_index(addr);
+    return index < 0 ? 0 : &regions[index];
+}
+
+// Release a region and the frames backing it
+void vmm_free(void* addr) {
+    uint32_t irq_flags = spin_lock_irqsave(&vmm_lock);
+    
+    int index = find_index((uint32_t)addr);
+    if (index < 0 || regions[index].start != (uint32_t)addr) {
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        print("VMM: Invalid region free\n");
+        return;
+    }
+    
+    vmm_region_t* region = &regions[index];
+    for (uint32_t page = region->start; page < region->end && region->resident_pages; page += PAGE_SIZE) {
+        uint32_t frame = virt_to_phys(page);
+        if (frame) {
+            pmm_free(frame & 0xFFFFF000);
+            region->resident_pages--;
+        }
+    }
+    unmap_range(region->start, region->end - region->start);
+    
+    for (uint32_t i = index; i + 1 < region_count; i++) {
+        regions[i] = regions[i + 1];
+    }
+    region_count--;
+    
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+}
+
+// Helper: Back one page of a region with a fresh frame
+static int populate_page(vmm_region_t* region, uint32_t page) {
+    uint32_t frame = pmm_alloc_zeroed();
+    if (frame == 0) {
+        return -1;
+    }
+    
+    // Frames are identity-mapped, so they can be filled before mapping
+    if (region->source) {
+        uint32_t offset = page - region->start;
+        if (offset < region->source_size) {
+            uint32_t count = region->source_size - offset;
+            if (count > PAGE_SIZE) {
+                count = PAGE_SIZE;
+            }
+            uint8_t* bytes = (uint8_t*)frame;
+            for (uint32_t i = 0; i < count; i++) {
+                bytes[i] = region->source[offset + i];
+            }
+        }
+    }
+    
+    map_page(page, frame, (region->flags & VMM_WRITE) ? PAGE_WRITE : 0);
+    region->resident_pages++;
+    return 0;
+}
+
+// Helper: Resolve a fault in the current address space's user window
+static int user_fault(uint32_t addr, uint32_t err_code) {
+    // Write to a page shared copy-on-write
+    if ((err_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE)) {
+        if (paging_handle_cow(addr) != 0) {
+            return -1;
+        }
+        stats.cow_faults++;
+        return 0;
+    }
+    
+    // First touch of the demand-zero user heap
+    if (!(err_code & PF_PRESENT) && addr < paging_current_space()->heap_end) {
+        uint32_t frame = pmm_alloc_zeroed();
+        if (frame == 0) {
+            print("VMM: Out of memory for demand page\n");
+            return -1;
+        }
+        map_page(addr & 0xFFFFF000, frame, PAGE_USER | PAGE_WRITE);
+        return 0;
+    }
+    
+    return -1;
+}
+
+// Helper: Resolve a fault in a kernel region
+static int kernel_fault(uint32_t addr, uint32_t err_code) {
+    uint32_t irq_flags = spin_lock_irqsave(&vmm_lock);
+    int index = find_index(addr);
+    
+    // Only not-present faults inside a region with matching permissions
+    if (index < 0 || (err_code & (PF_PRESENT | PF_USER)) ||
+        ((err_code & PF_WRITE) && !(regions[index].flags & VMM_WRITE))) {
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        return -1;
+    }
+    
+    // Another CPU may have faulted on the same page first
+    int result = virt_to_phys(addr) ? 0 : populate_page(&regions[index], addr & 0xFFFFF000);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    
+    if (result != 0) {
+        print("VMM: Out of memory for demand page\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Resolve a page fault
+int vmm_handle_fault(registers_t* regs) {
+    uint64_t start = rdtsc();
+    uint32_t addr;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(addr));
+    
+    stats.faults++;
+    trace_event(TRACE_FAULT_ENTRY, addr, regs->err_code, 0);
+    
+    int result = (addr >= USER_SPACE_BASE && addr < USER_SPACE_END) ?
+                 user_fault(addr, regs->err_code) : kernel_fault(addr, regs->err_code);
+    trace_event(TRACE_FAULT_EXIT, addr, result, 0);
+    if (result != 0) {
+        stats.invalid++;
+        return -1;
+    }
+    
+    // One fault's cycles fit in 32 bits
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    stats.resolved++;
+    stats.total_cycles += cycles;
+    if (cycles < stats.min_cycles) stats.min_cycles = cycles;
+    if (cycles > stats.max_cycles) stats.max_cycles = cycles;
+    
+    return 0;
+}
+
+// Grow or shrink the current address space's user heap
+// Returns the previous end of the heap, or 0 if the request does not fit
+void* vmm_user_sbrk(int32_t increment) {
+    address_space_t* space = paging_current_space();
+    uint32_t old_end = space->heap_end;
+    uint32_t new_end;
+    
+    if (increment >= 0) {
+        uint32_t grow = ((uint32_t)increment + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (grow > USER_SPACE_END - old_end) {
+            return 0;
+        }
+        new_end = old_end + grow;
+    } else {
+        uint32_t shrink = ((uint32_t)-increment + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (shrink > old_end - USER_SPACE_BASE) {
+            return 0;
+        }
+        new_end = old_end - shrink;
+        
+        // Drop the frames behind the released pages
+        for (uint32_t page = new_end; page < old_end; page += PAGE_SIZE) {
+            uint32_t frame = virt_to_phys(page);
+            if (frame) {
+                pmm_unref(frame & 0xFFFFF000);
+            }
+        }
+        unmap_range(new_end, old_end - new_end);
+    }
+    
+    space->heap_end = new_end;
+    return (void*)old_end;
+}
+
+// Get page-fault statistics
+const vmm_stats_t* vmm_get_stats() {
+    return &stats;
+}
+
+// Print regions and fault statistics
+void vmm_dump() {
+    print("\nVirtual memory regions:\n");
+    print("  Start       End         Resident  Name\n");
+    
+    for (uint32_t i = 0; i < region_count; i++) {
+        print("  ");
+        print_hex(regions[i].start);
+        print("  ");
+        print_hex(regions[i].end);
+        print("  ");
+        print_dec(regions[i].resident_pages);
+        print("/");
+        print_dec((regions[i].end - regions[i].start) / PAGE_SIZE);
+        print("\t");
+        print(regions[i].name);
+        print("\n");
+    }
+    if (region_count == 0) {
+        print("  (none)\n");
+    }
+    
+    print("\nKernel stacks: ");
+    print_dec(stack_count);
+    print(" (");
+    print_dec(stack_pages * (PAGE_SIZE / 1024));
+    print(" KB backed)\n");
+    
+    print("\nPage faults: ");
+    print_dec(stats.faults);
+    print(" (resolved ");
+    print_dec(stats.resolved);
+    print(", copy-on-write ");
+    print_dec(stats.cow_faults);
+    print(", invalid ");
+    print_dec(stats.invalid);
+    print(")\n");
+    
+    print("User heap: ");
+    print_dec((paging_current_space()->heap_end - USER_SPACE_BASE) / 1024);
+    print(" KB\n");
+    
+    if (stats.resolved) {
+        print("Fault latency (cycles): avg ");
+        print_dec(div_u64_u32(stats.total_cycles, stats.resolved));
+        print(", min ");
+        print_dec(stats.min_cycles);
+        print(", max ");
+        print_dec(stats.max_cycles);
+        print("\n");
+    }
+    print("\n");
+}
+
+// ============ Kernel Stacks ============
+
+// Helper: Test/set/clear pages in the stack window bitmap
+static inline int stack_page_used(uint32_t page) {
+    return stack_bitmap[page / 32] & (1u << (page % 32));
+}
+
+static void stack_mark(uint32_t first, uint32_t count, int used) {
+    for (uint32_t page = first; page < first + count; page++) {
+        if (used) {
+            stack_bitmap[page / 32] |= 1u << (page % 32);
+        } else {
+            stack_bitmap[page / 32] &= ~(1u << (page % 32));
+        }
+    }
+}
+
+// Helper: Find count free pages in a row, next-fit from the hint (-1 if none)
+static int stack_find(uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t scanned = 0; scanned < STACK_WINDOW_PAGES + count; scanned++) {
+        uint32_t page = (stack_hint + scanned) % STACK_WINDOW_PAGES;
+        if (page == 0) {
+            run = 0;    // Runs do not wrap around the end of the window
+        }
+        if (stack_page_used(page)) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            return page + 1 - count;
+        }
+    }
+    return -1;
+}
+
+// Allocate a kernel stack below a guard page
+void* vmm_stack_alloc(uint32_t size) {
+    if (size == 0 || size > VMM_STACK_MAX) {
+        return 0;
+    }
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    uint32_t irq_flags = spin_lock_irqsave(&vmm_lock);
+    
+    // The guard page is reserved with the stack so no neighbour uses it
+    int first = stack_find(pages + 1);
+    if (first < 0) {
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        print("VMM: Kernel stack window full\n");
+        return 0;
+    }
+    stack_mark(first, pages + 1, 1);
+    
+    uint32_t base = KERNEL_STACK_BASE + (first + 1) * PAGE_SIZE;
+    for (uint32_t i = 0; i < pages; i++) {
+        uint32_t frame = pmm_alloc();
+        if (frame == 0) {
+            // Give back what was mapped so far
+            for (uint32_t j = 0; j < i; j++) {
+                pmm_free(virt_to_phys(base + j * PAGE_SIZE) & 0xFFFFF000);
+            }
+            unmap_range(base, i * PAGE_SIZE);
+            stack_mark(first, pages + 1, 0);
+            spin_unlock_irqrestore(&vmm_lock, irq_flags);
+            return 0;
+        }
+        map_page(base + i * PAGE_SIZE, frame, PAGE_WRITE | PAGE_GLOBAL);
+    }
+    
+    stack_hint = first + pages + 1;
+    stack_count++;
+    stack_pages += pages;
+    
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    return (void*)base;
+}
+
+// Free a kernel stack and its guard page
+void vmm_stack_free(void* base, uint32_t size) {
+    uint32_t addr = (uint32_t)base;
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (addr < KERNEL_STACK_BASE + PAGE_SIZE || addr + pages * PAGE_SIZE > KERNEL_STACK_END) {
+        print("VMM: Invalid stack free\n");
+        return;
+    }
+    
+    uint32_t irq_flags = spin_lock_irqsave(&vmm_lock);
+    
+    for (uint32_t i = 0; i < pages; i++) {
+        uint32_t frame = virt_to_phys(addr + i * PAGE_SIZE);
+        if (frame) {
+            pmm_free(frame & 0xFFFFF000);
+        }
+    }
+    unmap_range(addr, pages * PAGE_SIZE);
+    stack_mark((addr - KERNEL_STACK_BASE) / PAGE_SIZE - 1, pages + 1, 0);
+    stack_count--;
+    stack_pages -= pages;
+    
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+}
+
+// ============ Benchmark ============
+
+#define BENCH_PAGES 256
+
+// Touch every page of a fresh region and report the cost per demand fault
+void vmm_benchmark() {
+    volatile uint8_t* region = (volatile uint8_t*)vmm_alloc("faultbench", BENCH_PAGES * PAGE_SIZE, VMM_WRITE);
+    if (!region) {
+        return;
+    }
+    
+    uint32_t resolved_before = stats.resolved;
+    uint64_t handler_before = stats.total_cycles;
+    
+    // First touch of each page takes a fault
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_PAGES; i++) {
+        region[i * PAGE_SIZE] = 1;
+    }
+    uint64_t fault_cycles = rdtsc() - start;
+    
+    // Second touch hits the now-present pages
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_PAGES; i++) {
+        region[i * PAGE_SIZE] = 2;
+    }
+    uint64_t touch_cycles = rdtsc() - start;
+    
+    uint32_t faults = stats.resolved - resolved_before;
+    uint64_t handler_cycles = stats.total_cycles - handler_before;
+    
+    vmm_free((void*)region);
+    
+    print("\nDemand paging benchmark (");
+    print_dec(BENCH_PAGES);
+    print(" pages)\n  Faults taken: ");
+    print_dec(faults);
+    print("\n  Cycles per first touch: ");
+    print_dec(div_u64_u32(fault_cycles, BENCH_PAGES));
+    print(" (handler ");
+    print_dec(div_u64_u32(handler_cycles, faults));
+    print(")\n  Cycles per later touch: ");
+    print_dec(div_u64_u32(touch_cycles, BENCH_PAGES));
+    print("\n\n");
+}
+
+// ============ Copy-on-Write Benchmark ============
+
+#define COW_PAGES 1024
+
+// Clone a 4MB user heap copy-on-write and compare against an eager copy
+void vmm_cow_benchmark() {
+    volatile uint8_t* heap = (volatile uint8_t*)vmm_user_sbrk(COW_PAGES * PAGE_SIZE);
+    if (!heap) {
+        print("VMM: No room in the user window\n");
+        return;
+    }
+    
+    // Populate the parent
+    for (uint32_t i = 0; i < COW_PAGES; i++) {
+        heap[i * PAGE_SIZE] = (uint8_t)i;
+    }
+    
+    // Eager copy: what cloning would cost without sharing
+    static uint32_t copies[COW_PAGES];
+    uint64_t start = rdtsc();
+    uint32_t copied = 0;
+    for (uint32_t i = 0; i < COW_PAGES; i++) {
+        copies[i] = pmm_alloc();
+        if (copies[i] == 0) {
+            break;
+        }
+        uint32_t* dest = (uint32_t*)copies[i];
+        const uint32_t* src = (const uint32_t*)(heap + i * PAGE_SIZE);
+        for (int j = 0; j < PAGE_SIZE / 4; j++) {
+            dest[j] = src[j];
+        }
+        copied++;
+    }
+    uint32_t eager_cycles = (uint32_t)(rdtsc() - start);
+    for (uint32_t i = 0; i < copied; i++) {
+        pmm_free(copies[i]);
+    }
+    
+    // Copy-on-write clone: only page tables are allocated
+    uint32_t free_before = pmm_get_free_pages();
+    start = rdtsc();
+    address_space_t* child = paging_clone_space(paging_current_space());
+    uint32_t clone_cycles = (uint32_t)(rdtsc() - start);
+    if (!child) {
+        vmm_user_sbrk(-(int32_t)(COW_PAGES * PAGE_SIZE));
+        return;
+    }
+    uint32_t clone_pages = free_before - pmm_get_free_pages();
+    
+    // Writes in the parent now copy one page each
+    uint32_t cow_before = stats.cow_faults;
+    start = rdtsc();
+    for (uint32_t i = 0; i < COW_PAGES; i++) {
+        heap[i * PAGE_SIZE] = 0xFF;
+    }
+    uint32_t write_cycles = (uint32_t)(rdtsc() - start);
+    uint32_t cow_faults = stats.cow_faults - cow_before;
+    
+    paging_destroy_space(child);
+    vmm_user_sbrk(-(int32_t)(COW_PAGES * PAGE_SIZE));
+    
+    print("\nCopy-on-write benchmark (");
+    print_dec(COW_PAGES);
+    print(" pages, cycles)\n  Eager copy:          ");
+    print_dec(eager_cycles);
+    print("\n  COW clone:           ");
+    print_dec(clone_cycles);
+    print(" (");
+    print_dec(clone_pages);
+    print(" pages allocated)\n  Writes after clone:  ");
+    print_dec(write_cycles);
+    print(" (");
+    print_dec(cow_faults);
+    print(" copy-on-write faults)\n\n");
+}
@@ -0,0 +1,308 @@
+// Deferred Work Implementation
+// Interrupt handlers queue work here instead of doing it with interrupts off
+
+#include "workqueue.h"
+#include "clock.h"
+#include "scheduler.h"
+#include "smp.h"
+
+// External print functions
+extern void print(const char* str);
+extern void print_hex(unsigned int num);
+extern void print_dec(unsigned int num);
+
+// Per-CPU softirq list
+// Only its own CPU touches it, with interrupts disabled.
+typedef struct {
+    work_t* head;
+    work_t* tail;
+    volatile uint32_t active;           // Running softirq work now
+    uint32_t handed_off;                // Items moved to the system queue
+    work_stats_t stats;
+} softirq_cpu_t;
+
+static softirq_cpu_t softirq_cpus[SMP_MAX_CPUS];
+
+static workqueue_t workqueues[WORKQUEUE_MAX];
+static volatile uint32_t workqueue_count = 0;
+static spinlock_t workqueues_lock = SPINLOCK_INIT;
+static workqueue_t* system_wq = 0;
+
+// Helper: Disable interrupts, returning the previous EFLAGS
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Helper: Restore EFLAGS saved by irq_save
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+void work_init(work_t* work, work_func_t func, void* arg) {
+    work->func = func;
+    work->arg = arg;
+    work->next = 0;
+    work->queued_stamp = 0;
+    work->pending = 0;
+}
+
+// Helper: Run one item and account for it
+// The item may be requeued or freed by its function, so it is not touched
+// after the call.
+static void run_work(work_t* work, work_stats_t* stats) {
+    uint64_t start = rdtsc();
+    uint32_t latency = (uint32_t)(start - work->queued_stamp);
+    work_func_t func = work->func;
+    void* arg = work->arg;
+    
+    __sync_lock_release(&work->pending);
+    func(arg);
+    
+    stats->run_cycles += rdtsc() - start;
+    stats->total_latency += latency;
+    if (latency > stats->max_latency) {
+        stats->max_latency = latency;
+    }
+    stats->completed++;
+}
+
+// Helper: Append an item that is already marked pending (wq->lock held)
+static void wq_append(workqueue_t* wq, work_t* work) {
+    work->next = 0;
+    if (wq->tail) {
+        wq->tail->next = work;
+    } else {
+        wq->head = work;
+    }
+    wq->tail = work;
+    wq->stats.queued++;
+}
+
+// ============ Softirq ============
+
+// Queue work to run on interrupt exit on this CPU
+int softirq_queue(work_t* work) {
+    if (__sync_lock_test_and_set(&work->pending, 1)) {
+        return 0;
+    }
+    
+    uint32_t flags = irq_save();
+    softirq_cpu_t* cpu = &softirq_cpus[smp_cpu_id()];
+    work->queued_stamp = rdtsc();
+    work->next = 0;
+    if (cpu->tail) {
+        cpu->tail->next = work;
+    } else {
+        cpu->head = work;
+    }
+    cpu->tail = work;
+    cpu->stats.queued++;
+    irq_restore(flags);
+    return 1;
+}
+
+// Run pending softirq work with interrupts enabled
+// At most SOFTIRQ_BUDGET items run here, so a flood of interrupts cannot
+// starve tasks; the rest are handed to the system worker.
+void softirq_run() {
+    softirq_cpu_t* cpu = &softirq_cpus[smp_cpu_id()];
+    if (!cpu->head || cpu->active) {
+        return;
+    }
+    cpu->active = 1;
+    
+    uint32_t budget = SOFTIRQ_BUDGET;
+    while (cpu->head && budget) {
+        work_t* list = cpu->head;
+        cpu->head = 0;
+        cpu->tail = 0;
+        
+        __asm__ __volatile__("sti");
+        while (list && budget) {
+            work_t* next = list->next;
+            run_work(list, &cpu->stats);
+            list = next;
+            budget--;
+        }
+        __asm__ __volatile__("cli");
+        
+        // Out of budget: put the unrun items back in front
+        if (list) {
+            work_t* last = list;
+            while (last->next) {
+                last = last->next;
+            }
+            last->next = cpu->head;
+            if (!cpu->head) {
+                cpu->tail = last;
+            }
+            cpu->head = list;
+        }
+    }
+    
+    if (cpu->head && system_wq) {
+        spin_lock(&system_wq->lock);
+        while (cpu->head) {
+            work_t* work = cpu->head;
+            cpu->head = work->next;
+            wq_append(system_wq, work);
+            cpu->handed_off++;
+        }
+        cpu->tail = 0;
+        spin_unlock(&system_wq->lock);
+        wait_queue_wake_one(&system_wq->idle);
+    }
+    
+    cpu->active = 0;
+}
+
+// Check whether this CPU is running softirq work
+int softirq_active() {
+    return softirq_cpus[smp_cpu_id()].active;
+}
+
+// ============ Worker threads ============
+
+// Helper: Worker thread body
+// Tasks take no argument, so each worker claims the first queue that
+// does not have one yet (every queue starts exactly one worker).
+static void worker_main() {
+    task_t* self = task_current();
+    workqueue_t* wq = 0;
+    for (uint32_t i = 0; i < workqueue_count && !wq; i++) {
+        if (__sync_bool_compare_and_swap(&workqueues[i].worker, 0, self)) {
+            wq = &workqueues[i];
+        }
+    }
+    if (!wq) {
+        return;
+    }
+    
+    while (1) {
+        uint32_t flags = spin_lock_irqsave(&wq->lock);
+        while (!wq->head) {
+            wait_queue_wait(&wq->idle, &wq->lock);
+        }
+        work_t* list = wq->head;
+        wq->head = 0;
+        wq->tail = 0;
+        spin_unlock_irqrestore(&wq->lock, flags);
+        
+        while (list) {
+            work_t* next = list->next;
+            run_work(list, &wq->stats);
+            list = next;
+        }
+    }
+}
+
+// Create a queue and start its worker thread
+workqueue_t* workqueue_create(const char* name, uint32_t priority) {
+    uint32_t flags = spin_lock_irqsave(&workqueues_lock);
+    if (workqueue_count >= WORKQUEUE_MAX) {
+        spin_unlock_irqrestore(&workqueues_lock, flags);
+        print("Workqueue: Too many queues\n");
+        return 0;
+    }
+    workqueue_t* wq = &workqueues[workqueue_count];
+    wq->name = name;
+    spin_init(&wq->lock);
+    wq->head = 0;
+    wq->tail = 0;
+    wait_queue_init(&wq->idle);
+    wq->worker = 0;
+    wq->stats = (work_stats_t){0, 0, 0, 0, 0};
+    __sync_synchronize();
+    workqueue_count++;
+    spin_unlock_irqrestore(&workqueues_lock, flags);
+    
+    // Work queued before the worker starts waits for it
+    if (task_create(worker_main, priority) < 0) {
+        print("Workqueue: Cannot start worker for ");
+        print(name);
+        print("\n");
+    }
+    return wq;
+}
+
+// Create the system worker queue
+void workqueue_init() {
+    system_wq = workqueue_create("events", SCHED_PRIORITY_DEFAULT);
+}
+
+// Queue work on a worker thread
+int workqueue_queue(workqueue_t* wq, work_t* work) {
+    if (__sync_lock_test_and_set(&work->pending, 1)) {
+        return 0;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    work->queued_stamp = rdtsc();
+    wq_append(wq, work);
+    spin_unlock_irqrestore(&wq->lock, flags);
+    
+    wait_queue_wake_one(&wq->idle);
+    return 1;
+}
+
+workqueue_t* workqueue_system() {
+    return system_wq;
+}
+
+// Helper: One line of workqueue_dump
+static void print_stats(const char* name, const work_stats_t* stats) {
+    int len = 0;
+    while (name[len]) len++;
+    
+    print("  ");
+    print(name);
+    for (int j = len; j < 12; j++) print(" ");
+    print_dec(stats->queued);
+    print("\t");
+    print_dec(stats->completed);
+    print("\t");
+    print_dec(div_u64_u32(stats->total_latency, stats->completed));
+    print("\t    ");
+    print_dec(stats->max_latency);
+    print("\t ");
+    print_dec(div_u64_u32(stats->run_cycles, stats->completed));
+    print("\n");
+}
+
+// Print per-queue counts and latency
+void workqueue_dump() {
+    print("\nDeferred work (latency and run time in cycles):\n");
+    print("  Queue       Queued\tRun\tAvg lat\tMax lat\tAvg run\n");
+    
+    // Softirq lists are summed over the CPUs
+    work_stats_t total = {0, 0, 0, 0, 0};
+    uint32_t handed_off = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        const softirq_cpu_t* s = &softirq_cpus[cpu];
+        total.queued += s->stats.queued;
+        total.completed += s->stats.completed;
+        total.total_latency += s->stats.total_latency;
+        total.run_cycles += s->stats.run_cycles;
+        if (s->stats.max_latency > total.max_latency) {
+            total.max_latency = s->stats.max_latency;
+        }
+        handed_off += s->handed_off;
+    }
+    print_stats("softirq", &total);
+    
+    for (uint32_t i = 0; i < workqueue_count; i++) {
+        print_stats(workqueues[i].name, &workqueues[i].stats);
+    }
+    
+    print("  Softirq items handed to the system worker: ");
+    print_dec(handed_off);
+    print("\n\n");
+}
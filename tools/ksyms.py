@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+# Kernel Symbol Table Generator
+# Turns `nm -n` output for the linked kernel into kernel/symtab.c
+#
+# Usage: ksyms.py [kernel.nm] > kernel/symtab.c
+# Without an nm listing it writes an empty table, for the first link pass.
+
+import sys
+
+HEADER = """// Kernel Symbol Table
+// Generated by tools/ksyms.py from the kernel link; do not edit
+
+#include "symbols.h"
+"""
+
+
+def read_symbols(path):
+    """Return [(address, name)] for the code symbols in an nm listing."""
+    symbols = {}
+    with open(path) as listing:
+        for line in listing:
+            fields = line.split()
+            if len(fields) != 3 or fields[1] not in "Tt":
+                continue
+            address, kind, name = int(fields[0], 16), fields[1], fields[2]
+            # One name per address, preferring a global one
+            if address not in symbols or (kind == "T" and symbols[address][0] == "t"):
+                symbols[address] = (kind, name)
+
+    # PE toolchains prefix C names with an underscore (kernel_stub.asm
+    # calls _kmain); drop it so the names read as in the source
+    names = set(name for _, name in symbols.values())
+    strip = "_kmain" in names
+    result = []
+    for address in sorted(symbols):
+        name = symbols[address][1]
+        if strip and name.startswith("_"):
+            name = name[1:]
+        result.append((address, name))
+    return result
+
+
+def main():
+    symbols = read_symbols(sys.argv[1]) if len(sys.argv) > 1 else []
+
+    out = [HEADER]
+    out.append("const uint32_t ksym_count = %d;\n" % len(symbols))
+    out.append("const ksym_t ksyms[] = {")
+    offset = 0
+    for address, name in symbols:
+        out.append("    { 0x%08x, %d }," % (address, offset))
+        offset += len(name) + 1
+    if not symbols:
+        out.append("    { 0, 0 },")
+    out.append("};\n")
+    out.append("const char ksym_names[] =")
+    for _, name in symbols:
+        out.append('    "%s\\0"' % name)
+    out.append('    "";')
+    print("\n".join(out))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
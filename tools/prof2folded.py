@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# Profile Decoder
+# Turns a `prof export` captured from COM1 into folded stacks for flame graphs
+#
+# Usage: prof2folded.py serial.bin kernel.nm > kernel.folded
+#        flamegraph.pl kernel.folded > kernel.svg
+# kernel.nm is the `nm -n` listing the build writes next to the kernel
+# (kernel/kernel_c.nm, or kernel/corex.nm for the GRUB build).
+
+import bisect
+import collections
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from ksyms import read_symbols  # noqa: E402
+
+EXPORT_START = "# corex profile"
+EXPORT_END = "# end"
+
+
+def last_export(data):
+    """Return the lines of the last complete export in the capture."""
+    text = data.decode("latin-1")
+    start = text.rfind(EXPORT_START)
+    if start < 0:
+        raise ValueError("no profile export in the capture")
+    end = text.find(EXPORT_END, start)
+    if end < 0:
+        raise ValueError("profile export is truncated")
+    return text[start:end].splitlines()[1:]
+
+
+class Symbolizer:
+    def __init__(self, symbols):
+        self.addresses = [address for address, _ in symbols]
+        self.names = [name for _, name in symbols]
+
+    def name(self, address):
+        index = bisect.bisect_right(self.addresses, address) - 1
+        if index < 0:
+            return "0x%08x" % address
+        return self.names[index]
+
+
+def fold(lines, symbolizer):
+    """Count identical stacks, outermost frame first."""
+    stacks = collections.Counter()
+    flat = collections.Counter()
+    for line in lines:
+        fields = line.split()
+        if not fields:
+            continue
+        if fields[0] == "stack":
+            addresses = [int(field, 16) for field in fields[2:]]
+            # Return addresses point after the call; look up the call itself
+            frames = [symbolizer.name(addresses[0])]
+            frames += [symbolizer.name(address - 1) for address in addresses[1:]]
+            stacks[";".join(reversed(frames))] += 1
+        elif fields[0] == "pc":
+            flat[symbolizer.name(int(fields[3], 16))] += int(fields[2])
+        elif fields[0] == "user":
+            flat["[user mode]"] += int(fields[2])
+
+    # Without call chains every sample is a one-frame stack
+    if not stacks:
+        return flat
+    user = flat.get("[user mode]")
+    if user:
+        stacks["[user mode]"] += user
+    return stacks
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("usage: %s serial.bin kernel.nm" % sys.argv[0], file=sys.stderr)
+        return 2
+    with open(sys.argv[1], "rb") as capture:
+        data = capture.read()
+    try:
+        lines = last_export(data)
+    except ValueError as error:
+        print("%s: %s" % (sys.argv[1], error), file=sys.stderr)
+        return 1
+
+    symbolizer = Symbolizer(read_symbols(sys.argv[2]))
+    for stack, count in sorted(fold(lines, symbolizer).items()):
+        print("%s %d" % (stack, count))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# Trace Decoder
+# Turns a `trace dump` captured from COM1 into Chrome trace JSON
+#
+# Usage: trace2chrome.py serial.bin trace.json
+# Open the result in chrome://tracing or https://ui.perfetto.dev
+
+import json
+import struct
+import sys
+
+# Layouts from include/trace.h
+DUMP_MAGIC = b"CXTRACE1"
+DUMP_END = b"CXTREND1"
+HEADER = struct.Struct("<8sIII")        # magic, record_size, tsc_khz, cpus
+CPU_BLOCK = struct.Struct("<III")       # cpu, count, lost
+RECORD = struct.Struct("<QHHIIIII")     # tsc, type, cpu, seq, task, arg0..arg2
+
+IRQ_ENTRY, IRQ_EXIT, SWITCH, PMM_ALLOC, PMM_FREE, FAULT_ENTRY, FAULT_EXIT, \
+    FS_BEGIN, FS_END, MARK = range(10)
+
+FS_OPS = {0: "fs_create", 1: "fs_read", 2: "fs_delete"}
+
+IRQ_VECTOR_BASE = 32
+TASKS_PID = 1000
+
+
+def parse(data):
+    """Return (tsc_khz, {cpu: (lost, [record tuples])}) for the last dump."""
+    start = data.rfind(DUMP_MAGIC)
+    if start < 0:
+        raise ValueError("no trace dump in the capture")
+    _, record_size, tsc_khz, cpus = HEADER.unpack_from(data, start)
+    if record_size != RECORD.size:
+        raise ValueError("record size %d, expected %d" % (record_size, RECORD.size))
+    if tsc_khz == 0:
+        raise ValueError("the kernel has no TSC rate")
+
+    offset = start + HEADER.size
+    rings = {}
+    for _ in range(cpus):
+        cpu, count, lost = CPU_BLOCK.unpack_from(data, offset)
+        offset += CPU_BLOCK.size
+        records = [RECORD.unpack_from(data, offset + i * RECORD.size) for i in range(count)]
+        offset += count * RECORD.size
+        rings[cpu] = (lost, records)
+    if data[offset:offset + len(DUMP_END)] != DUMP_END:
+        raise ValueError("dump is truncated")
+    return tsc_khz, rings
+
+
+def irq_name(vector):
+    if IRQ_VECTOR_BASE <= vector < IRQ_VECTOR_BASE + 16:
+        return "IRQ %d" % (vector - IRQ_VECTOR_BASE)
+    return "vector %d" % vector
+
+
+def convert(tsc_khz, rings):
+    base = min((r[0] for _, records in rings.values() for r in records), default=0)
+
+    def us(tsc):
+        return (tsc - base) * 1000.0 / tsc_khz
+
+    events = []
+    tasks = set()
+    for cpu, (lost, records) in sorted(rings.items()):
+        events.append({"ph": "M", "name": "process_name", "pid": cpu,
+                       "args": {"name": "CPU %d" % cpu}})
+        events.append({"ph": "M", "name": "thread_name", "pid": cpu, "tid": 0,
+                       "args": {"name": "tasks"}})
+        events.append({"ph": "M", "name": "thread_name", "pid": cpu, "tid": 1,
+                       "args": {"name": "interrupts"}})
+        if lost:
+            print("CPU %d: %d older records were overwritten" % (cpu, lost), file=sys.stderr)
+
+        # A nested interrupt can record ahead of the event it interrupted
+        records = sorted(records, key=lambda r: (r[0], r[3]))
+        running = None
+        since = 0.0
+        for tsc, kind, _, _, task, arg0, arg1, arg2 in records:
+            ts = us(tsc)
+            if running is None:
+                running, since = task, ts
+            track = {"pid": TASKS_PID, "tid": task, "ts": ts}
+            tasks.add(task)
+
+            if kind == IRQ_ENTRY or kind == IRQ_EXIT:
+                events.append({"ph": "B" if kind == IRQ_ENTRY else "E", "name": irq_name(arg0),
+                               "cat": "irq", "pid": cpu, "tid": 1, "ts": ts})
+            elif kind == SWITCH:
+                events.append({"ph": "X", "name": "task %d" % arg0, "cat": "sched",
+                               "pid": cpu, "tid": 0, "ts": since, "dur": ts - since})
+                running, since = arg1, ts
+                tasks.add(arg1)
+            elif kind == PMM_ALLOC or kind == PMM_FREE:
+                events.append(dict(track, ph="i", s="t", cat="pmm",
+                                   name="pmm_alloc" if kind == PMM_ALLOC else "pmm_free",
+                                   args={"addr": "0x%08x" % arg0, "order": arg1}))
+            elif kind == FAULT_ENTRY:
+                events.append(dict(track, ph="B", cat="vmm", name="page fault",
+                                   args={"addr": "0x%08x" % arg0, "error": arg1}))
+            elif kind == FAULT_EXIT:
+                events.append(dict(track, ph="E", args={"resolved": arg1 == 0}))
+            elif kind == FS_BEGIN:
+                events.append(dict(track, ph="B", cat="fs", name=FS_OPS.get(arg0, "fs")))
+            elif kind == FS_END:
+                result = arg1 - (1 << 32) if arg1 & 0x80000000 else arg1
+                events.append(dict(track, ph="E", args={"result": result}))
+            elif kind == MARK:
+                events.append(dict(track, ph="i", s="t", name="mark", args={"args": [arg0, arg1, arg2]}))
+
+        if records and running is not None:
+            end = us(records[-1][0])
+            events.append({"ph": "X", "name": "task %d" % running, "cat": "sched",
+                           "pid": cpu, "tid": 0, "ts": since, "dur": end - since})
+
+    events.append({"ph": "M", "name": "process_name", "pid": TASKS_PID, "args": {"name": "Tasks"}})
+    for task in sorted(tasks):
+        events.append({"ph": "M", "name": "thread_name", "pid": TASKS_PID, "tid": task,
+                       "args": {"name": "task %d" % task}})
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("usage: %s serial.bin trace.json" % sys.argv[0], file=sys.stderr)
+        return 2
+    with open(sys.argv[1], "rb") as capture:
+        data = capture.read()
+    try:
+        tsc_khz, rings = parse(data)
+    except (ValueError, struct.error) as error:
+        print("%s: %s" % (sys.argv[1], error), file=sys.stderr)
+        return 1
+    with open(sys.argv[2], "w") as out:
+        json.dump(convert(tsc_khz, rings), out)
+    count = sum(len(records) for _, records in rings.values())
+    print("%d records from %d CPUs" % (count, len(rings)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())